@@ -0,0 +1,359 @@
+/**
+ * @file
+ *
+ * Contains command aliases. Aliases live in a hash table and are expanded on
+ * the tokens of each input line before it is parsed: a word in command
+ * position that names an alias is replaced by the alias's words, which are
+ * tokenized once when the alias is defined. An alias's first word may itself
+ * be an alias, but never one that is already being expanded.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alias.h"
+#include "logger.h"
+#include "memstat.h"
+#include "util.h"
+
+/* Number of hash table buckets */
+#define ALIAS_BUCKETS 64
+
+/* Most aliases expanded inside one another */
+#define ALIAS_DEPTH 16
+
+/**
+ * Stores a single alias: its value as given and the value's tokens, which
+ * point into a private copy
+ */
+struct alias
+{
+    char *name;
+    char *value;
+    char *buf;
+    char **words;
+    int count;
+    struct alias *next;
+};
+
+/**
+ * Stores the tokens of a line being expanded
+ */
+struct word_list
+{
+    char **items;
+    int count;
+    int size;
+};
+
+static struct alias *table[ALIAS_BUCKETS] = { 0 };
+static int defined = 0;
+
+/**
+ * Hashes an alias name
+ * @param name the name to hash
+ *
+ * @return bucket index for the name
+ */
+static unsigned int alias_hash(const char *name)
+{
+    unsigned int hash = 5381;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    return hash % ALIAS_BUCKETS;
+}
+
+/**
+ * Finds an alias by name
+ * @param name the name to find
+ *
+ * @return pointer to the alias or NULL if it is not defined
+ */
+static struct alias *alias_find(const char *name)
+{
+    for (struct alias *a = table[alias_hash(name)]; a != NULL; a = a->next) {
+        if (strcmp(a->name, name) == 0) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Frees an alias
+ * @param a the alias
+ */
+static void alias_free(struct alias *a)
+{
+    free(a->name);
+    free(a->value);
+    free(a->buf);
+    mem_free(MEM_PARSER, a->words);
+    free(a);
+}
+
+/**
+ * Checks if the token after another one is in command position
+ * @param prev the token before it
+ *
+ * @return true if prev ends a command or opens a list of commands
+ */
+static bool starts_command(const char *prev)
+{
+    const char *openers[] = { ";", "&", ";;", "&&", "if", "then", "elif", "else",
+        "while", "until", "do", "{" };
+    if (prev[0] == '|') {
+        /* "|", "||", and parallel stage operators */
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(openers) / sizeof(openers[0]); i++) {
+        if (strcmp(prev, openers[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Appends a token to the expanded line
+ * @param out the expanded line
+ * @param word the token
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int push(struct word_list *out, char *word)
+{
+    if (out->count + 1 >= out->size) {
+        int size = (out->size == 0) ? ARGS_INIT_SZ : out->size * 2;
+        char **tmp = mem_realloc(MEM_PARSER, out->items, size * sizeof(char *));
+        if (tmp == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        out->items = tmp;
+        out->size = size;
+    }
+    out->items[out->count++] = word;
+    out->items[out->count] = NULL;
+    return 0;
+}
+
+/**
+ * Appends a token to the expanded line, replacing it by its alias if it has
+ * one and is in command position
+ * @param out the expanded line
+ * @param word the token
+ * @param command true if the token is in command position
+ * @param chain aliases being expanded around this token
+ * @param depth number of entries in chain
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int add_word(struct word_list *out, char *word, bool command,
+        const struct alias **chain, int depth)
+{
+    const struct alias *a = (command && depth < ALIAS_DEPTH) ? alias_find(word) : NULL;
+    for (int i = 0; a != NULL && i < depth; i++) {
+        if (chain[i] == a) {
+            a = NULL;
+        }
+    }
+    if (a == NULL) {
+        return push(out, word);
+    }
+    chain[depth] = a;
+    for (int i = 0; i < a->count; i++) {
+        bool next_command = (i == 0) || starts_command(a->words[i - 1]);
+        if (add_word(out, a->words[i], next_command, chain, depth + 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Expands the aliases in a tokenized input line. The line's array is
+ * replaced when anything was expanded; its tokens may then point into the
+ * alias table, so they must be copied (as the parser does) before an alias
+ * can change.
+ * @param args the NULL-terminated tokens, replaced by the expanded tokens
+ * @param tokens the number of tokens, updated to match
+ */
+void alias_expand(char ***args, int *tokens)
+{
+    if (defined == 0) {
+        return;
+    }
+    char **in = *args;
+    int first = 0;
+    while (first < *tokens && ((first > 0 && starts_command(in[first - 1]) == false)
+                || alias_find(in[first]) == NULL)) {
+        first++;
+    }
+    if (first == *tokens) {
+        return;
+    }
+
+    struct word_list out = { NULL, 0, 0 };
+    const struct alias *chain[ALIAS_DEPTH];
+    for (int i = 0; i < *tokens; i++) {
+        bool command = (i == 0) || starts_command(in[i - 1]);
+        if (add_word(&out, in[i], command, chain, 0) == -1) {
+            mem_free(MEM_PARSER, out.items);
+            return;
+        }
+    }
+    mem_free(MEM_PARSER, in);
+    *args = out.items;
+    *tokens = out.count;
+}
+
+/**
+ * Defines an alias, replacing any previous definition
+ * @param name the alias name
+ * @param value the text it expands to
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int alias_define(const char *name, const char *value)
+{
+    struct alias *a = calloc(1, sizeof(struct alias));
+    if (a == NULL || (a->name = strdup(name)) == NULL || (a->value = strdup(value)) == NULL
+            || (a->buf = strdup(value)) == NULL) {
+        perror("malloc");
+        if (a != NULL) {
+            free(a->name);
+            free(a->value);
+            free(a);
+        }
+        return -1;
+    }
+    bool pipes;
+    if ((a->words = tokenize_command(a->buf, &a->count, &pipes)) == NULL) {
+        a->words = NULL;
+        alias_free(a);
+        return -1;
+    }
+
+    struct alias **link = &table[alias_hash(name)];
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        struct alias *old = *link;
+        a->next = old->next;
+        alias_free(old);
+        defined--;
+    } else {
+        a->next = NULL;
+    }
+    *link = a;
+    defined++;
+    return 0;
+}
+
+/**
+ * Handles the "alias" builtin: "alias" lists every alias, "alias NAME"
+ * shows one, and "alias NAME=WORD..." defines NAME to expand to the words.
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 if an alias was not found or a name is invalid
+ */
+int alias_handler(char *args[])
+{
+    if (args[1] == NULL) {
+        for (int i = 0; i < ALIAS_BUCKETS; i++) {
+            for (struct alias *a = table[i]; a != NULL; a = a->next) {
+                printf("alias %s=%s\n", a->name, a->value);
+            }
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    char *eq = strchr(args[1], '=');
+    if (eq == NULL) {
+        struct alias *a = alias_find(args[1]);
+        if (a == NULL) {
+            fprintf(stderr, "alias: %s: not found\n", args[1]);
+            return 1;
+        }
+        printf("alias %s=%s\n", a->name, a->value);
+        fflush(stdout);
+        return 0;
+    }
+    if (eq == args[1] || strcspn(args[1], "/$") < (size_t) (eq - args[1])) {
+        fprintf(stderr, "alias: invalid name '%.*s'\n", (int) (eq - args[1]), args[1]);
+        return 1;
+    }
+
+    size_t len = strlen(eq + 1) + 1;
+    for (int i = 2; args[i] != NULL; i++) {
+        len += strlen(args[i]) + 1;
+    }
+    char *value = malloc(len);
+    if (value == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    strcpy(value, eq + 1);
+    for (int i = 2; args[i] != NULL; i++) {
+        strcat(value, " ");
+        strcat(value, args[i]);
+    }
+    *eq = '\0';
+    int result = alias_define(args[1], value);
+    *eq = '=';
+    free(value);
+    return (result == 0) ? 0 : 1;
+}
+
+/**
+ * Handles the "unalias" builtin: "unalias NAME..." removes aliases and
+ * "unalias -a" removes them all
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 if an alias was not found
+ */
+int unalias_handler(char *args[])
+{
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0) {
+        alias_destroy();
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        struct alias **link = &table[alias_hash(args[i])];
+        while (*link != NULL && strcmp((*link)->name, args[i]) != 0) {
+            link = &(*link)->next;
+        }
+        if (*link == NULL) {
+            fprintf(stderr, "unalias: %s: not found\n", args[i]);
+            status = 1;
+            continue;
+        }
+        struct alias *a = *link;
+        *link = a->next;
+        alias_free(a);
+        defined--;
+    }
+    return status;
+}
+
+/**
+ * Frees every alias
+ */
+void alias_destroy(void)
+{
+    for (int i = 0; i < ALIAS_BUCKETS; i++) {
+        while (table[i] != NULL) {
+            struct alias *a = table[i];
+            table[i] = a->next;
+            alias_free(a);
+        }
+    }
+    defined = 0;
+}
@@ -0,0 +1,15 @@
+/**
+ * @file
+ *
+ * Contains function headers for command aliases.
+ */
+
+#ifndef _ALIAS_H_
+#define _ALIAS_H_
+
+void alias_expand(char ***args, int *tokens);
+int alias_handler(char *args[]);
+int unalias_handler(char *args[]);
+void alias_destroy(void);
+
+#endif
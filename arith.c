@@ -0,0 +1,874 @@
+/**
+ * @file
+ *
+ * Contains arithmetic expansion, "$(( EXPR ))". An expression is compiled
+ * once into a short postfix program that runs on a small stack; compiled
+ * programs are kept in a cache keyed by the expression text, so a loop body
+ * such as "i=$((i + 1))" is parsed on its first iteration only. Arithmetic
+ * is done on 64-bit signed integers and wraps around on overflow. Variables
+ * are named without "$" and read and written in the shell's own table.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arith.h"
+#include "logger.h"
+#include "vars.h"
+
+/* Number of compiled expressions kept for reuse */
+#define ARITH_CACHE 64
+
+/* Deepest nesting of parentheses and operators in one expression */
+#define ARITH_DEPTH 256
+
+/**
+ * Instructions of a compiled expression
+ */
+enum arith_code
+{
+    OP_NONE,
+    OP_NUM,
+    OP_VAR,
+    OP_NEG,
+    OP_NOT,
+    OP_BNOT,
+    OP_POW,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_ADD,
+    OP_SUB,
+    OP_SHL,
+    OP_SHR,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_BAND,
+    OP_BXOR,
+    OP_BOR,
+    OP_BOOL,
+    OP_JZ,
+    OP_JNZ,
+    OP_JMP,
+    OP_POP,
+    OP_ASSIGN,
+    OP_INCR,
+};
+
+/**
+ * Stores a single instruction. Numbers and jump targets use value; OP_VAR,
+ * OP_ASSIGN, and OP_INCR use name. OP_ASSIGN applies binop ("+=") unless it
+ * is OP_NONE ("="); OP_INCR adds value and leaves the old value if post.
+ */
+struct arith_op
+{
+    enum arith_code code;
+    enum arith_code binop;
+    long long value;
+    char *name;
+    bool post;
+};
+
+/**
+ * Stores a compiled expression and the stack it runs on
+ */
+struct arith_expr
+{
+    char *text;
+    struct arith_op *ops;
+    int count;
+    int size;
+    long long *stack;
+};
+
+/**
+ * Stores the state of the compiler while it reads an expression
+ */
+struct compiler
+{
+    const char *pos;
+    const char *end;
+    struct arith_expr *expr;
+    int depth;
+    const char *error;
+};
+
+/**
+ * Describes a binary operator: its text, instruction, and precedence (higher
+ * binds tighter)
+ */
+struct binary
+{
+    const char *text;
+    enum arith_code code;
+    int prec;
+};
+
+static const struct binary binaries[] = {
+    { "||", OP_NONE, 1 }, { "&&", OP_NONE, 2 }, { "|", OP_BOR, 3 },
+    { "^", OP_BXOR, 4 }, { "&", OP_BAND, 5 }, { "==", OP_EQ, 6 },
+    { "!=", OP_NE, 6 }, { "<", OP_LT, 7 }, { "<=", OP_LE, 7 },
+    { ">", OP_GT, 7 }, { ">=", OP_GE, 7 }, { "<<", OP_SHL, 8 },
+    { ">>", OP_SHR, 8 }, { "+", OP_ADD, 9 }, { "-", OP_SUB, 9 },
+    { "*", OP_MUL, 10 }, { "/", OP_DIV, 10 }, { "%", OP_MOD, 10 },
+    { "**", OP_POW, 11 },
+};
+
+/* Operators longest first, so a prefix never hides a longer operator */
+static const char *operators[] = {
+    "<<=", ">>=", "**", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++",
+    "--", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "+", "-", "*", "/",
+    "%", "<", ">", "&", "^", "|", "!", "~", "?", ":", "=", "(", ")", ",",
+};
+
+static struct arith_expr *cache[ARITH_CACHE] = { 0 };
+
+static int compile_comma(struct compiler *c);
+static int compile_assign(struct compiler *c);
+
+/**
+ * Finds the end of an arithmetic expansion
+ * @param expr the text just after "$(("
+ *
+ * @return pointer to the "))" that closes the expansion, or NULL if it is
+ * not closed
+ */
+const char *arith_close(const char *expr)
+{
+    int depth = 0;
+    for (const char *c = expr; *c != '\0'; c++) {
+        if (*c == '(') {
+            depth++;
+        } else if (*c == ')' && depth > 0) {
+            depth--;
+        } else if (*c == ')') {
+            return (c[1] == ')') ? c : NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds an arithmetic expansion that a token leaves open
+ * @param tok the token to check
+ *
+ * @return pointer to the first "$((" in tok that is not closed, or NULL if
+ * there is none
+ */
+const char *arith_unclosed(const char *tok)
+{
+    const char *start = strstr(tok, "$((");
+    while (start != NULL) {
+        const char *close = arith_close(start + 3);
+        if (close == NULL) {
+            return start;
+        }
+        start = strstr(close + 2, "$((");
+    }
+    return NULL;
+}
+
+/**
+ * Reports an error in an expression, which is shown without its surrounding
+ * blanks
+ * @param text the expression text
+ * @param fmt printf-style description of the error
+ */
+static void arith_error(const char *text, const char *fmt, ...)
+{
+    while (isspace((unsigned char) *text)) {
+        text++;
+    }
+    int len = strlen(text);
+    while (len > 0 && isspace((unsigned char) text[len - 1])) {
+        len--;
+    }
+    fprintf(stderr, "arithmetic: %.*s: ", len, text);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/**
+ * Skips blanks in the expression
+ * @param c the compiler
+ */
+static void skip_blanks(struct compiler *c)
+{
+    while (c->pos < c->end && isspace((unsigned char) *c->pos)) {
+        c->pos++;
+    }
+}
+
+/**
+ * Finds the operator at the current position
+ * @param c the compiler
+ *
+ * @return the operator text or NULL if there is no operator here
+ */
+static const char *peek_op(struct compiler *c)
+{
+    skip_blanks(c);
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        size_t len = strlen(operators[i]);
+        if ((size_t) (c->end - c->pos) >= len && strncmp(c->pos, operators[i], len) == 0) {
+            return operators[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Consumes an operator if it is next in the expression
+ * @param c the compiler
+ * @param op the operator text
+ *
+ * @return true if the operator was consumed
+ */
+static bool accept(struct compiler *c, const char *op)
+{
+    const char *next = peek_op(c);
+    if (next == NULL || strcmp(next, op) != 0) {
+        return false;
+    }
+    c->pos += strlen(op);
+    return true;
+}
+
+/**
+ * Appends an instruction to the program
+ * @param c the compiler
+ * @param code the instruction
+ * @param value its number or jump target
+ *
+ * @return index of the instruction or -1 if memory could not be allocated
+ */
+static int emit(struct compiler *c, enum arith_code code, long long value)
+{
+    struct arith_expr *e = c->expr;
+    if (e->count == e->size) {
+        int size = (e->size == 0) ? 16 : e->size * 2;
+        struct arith_op *tmp = realloc(e->ops, size * sizeof(struct arith_op));
+        if (tmp == NULL) {
+            perror("realloc");
+            c->error = "out of memory";
+            return -1;
+        }
+        e->ops = tmp;
+        e->size = size;
+    }
+    e->ops[e->count] = (struct arith_op) { code, OP_NONE, value, NULL, false };
+    return e->count++;
+}
+
+/**
+ * Appends an instruction that works on a variable
+ * @param c the compiler
+ * @param code the instruction
+ * @param name the variable name (not NUL-terminated)
+ * @param len the length of the name
+ *
+ * @return index of the instruction or -1 on failure
+ */
+static int emit_name(struct compiler *c, enum arith_code code, const char *name, size_t len)
+{
+    int at = emit(c, code, 0);
+    if (at == -1) {
+        return -1;
+    }
+    if ((c->expr->ops[at].name = strndup(name, len)) == NULL) {
+        perror("strndup");
+        c->expr->count--;
+        c->error = "out of memory";
+        return -1;
+    }
+    return at;
+}
+
+/**
+ * Reads a variable name if one is next in the expression
+ * @param c the compiler
+ * @param len receives the length of the name
+ *
+ * @return start of the name or NULL if there is none
+ */
+static const char *read_name(struct compiler *c, size_t *len)
+{
+    skip_blanks(c);
+    const char *start = c->pos;
+    if (start == c->end || (isalpha((unsigned char) *start) == 0 && *start != '_')) {
+        return NULL;
+    }
+    const char *p = start;
+    while (p < c->end && (isalnum((unsigned char) *p) || *p == '_')) {
+        p++;
+    }
+    *len = p - start;
+    c->pos = p;
+    return start;
+}
+
+/**
+ * Compiles a number, variable, or parenthesized expression, along with a
+ * "++" or "--" that follows a variable
+ * @param c the compiler
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int compile_primary(struct compiler *c)
+{
+    size_t len;
+    const char *name = read_name(c, &len);
+    if (name != NULL) {
+        bool inc = accept(c, "++");
+        if (inc || accept(c, "--")) {
+            int at = emit_name(c, OP_INCR, name, len);
+            if (at == -1) {
+                return -1;
+            }
+            c->expr->ops[at].value = inc ? 1 : -1;
+            c->expr->ops[at].post = true;
+            return 0;
+        }
+        return (emit_name(c, OP_VAR, name, len) == -1) ? -1 : 0;
+    }
+
+    if (accept(c, "(")) {
+        if (compile_comma(c) == -1) {
+            return -1;
+        }
+        if (accept(c, ")") == false) {
+            c->error = "missing ')'";
+            return -1;
+        }
+        return 0;
+    }
+
+    if (c->pos < c->end && isdigit((unsigned char) *c->pos)) {
+        char digits[64];
+        size_t n = 0;
+        while (c->pos + n < c->end && isalnum((unsigned char) c->pos[n])
+                && n < sizeof(digits) - 1) {
+            digits[n] = c->pos[n];
+            n++;
+        }
+        digits[n] = '\0';
+        char *stop;
+        unsigned long long value = strtoull(digits, &stop, 0);
+        if (*stop != '\0') {
+            c->error = "invalid number";
+            return -1;
+        }
+        c->pos += n;
+        return (emit(c, OP_NUM, (long long) value) == -1) ? -1 : 0;
+    }
+
+    c->error = (c->pos == c->end) ? "operand expected" : "syntax error";
+    return -1;
+}
+
+/**
+ * Compiles a unary operator and its operand
+ * @param c the compiler
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int compile_unary(struct compiler *c)
+{
+    if (++c->depth > ARITH_DEPTH) {
+        c->error = "expression nested too deeply";
+        return -1;
+    }
+
+    int result = 0;
+    bool inc = accept(c, "++");
+    if (inc || accept(c, "--")) {
+        size_t len;
+        const char *name = read_name(c, &len);
+        if (name == NULL) {
+            c->error = "variable expected after ++ or --";
+            result = -1;
+        } else {
+            int at = emit_name(c, OP_INCR, name, len);
+            if (at == -1) {
+                result = -1;
+            } else {
+                c->expr->ops[at].value = inc ? 1 : -1;
+            }
+        }
+    } else if (accept(c, "-")) {
+        result = (compile_unary(c) == -1 || emit(c, OP_NEG, 0) == -1) ? -1 : 0;
+    } else if (accept(c, "+")) {
+        result = compile_unary(c);
+    } else if (accept(c, "!")) {
+        result = (compile_unary(c) == -1 || emit(c, OP_NOT, 0) == -1) ? -1 : 0;
+    } else if (accept(c, "~")) {
+        result = (compile_unary(c) == -1 || emit(c, OP_BNOT, 0) == -1) ? -1 : 0;
+    } else {
+        result = compile_primary(c);
+    }
+    c->depth--;
+    return result;
+}
+
+/**
+ * Finds the binary operator at the current position
+ * @param c the compiler
+ *
+ * @return the operator or NULL if the next token is not a binary operator
+ */
+static const struct binary *peek_binary(struct compiler *c)
+{
+    const char *op = peek_op(c);
+    for (size_t i = 0; op != NULL && i < sizeof(binaries) / sizeof(binaries[0]); i++) {
+        if (strcmp(binaries[i].text, op) == 0) {
+            return &binaries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Compiles a chain of binary operators that bind at least as tightly as a
+ * given precedence. "&&" and "||" jump over their right operand when the
+ * left one decides the result.
+ * @param c the compiler
+ * @param min the lowest precedence to consume
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int compile_binary(struct compiler *c, int min)
+{
+    if (compile_unary(c) == -1) {
+        return -1;
+    }
+    const struct binary *op;
+    while ((op = peek_binary(c)) != NULL && op->prec >= min) {
+        c->pos += strlen(op->text);
+        /* "**" groups right to left, everything else left to right */
+        int next = (op->code == OP_POW) ? op->prec : op->prec + 1;
+        if (op->code != OP_NONE) {
+            if (compile_binary(c, next) == -1 || emit(c, op->code, 0) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        bool and = (strcmp(op->text, "&&") == 0);
+        int skip = emit(c, and ? OP_JZ : OP_JNZ, 0);
+        if (skip == -1 || compile_binary(c, next) == -1 || emit(c, OP_BOOL, 0) == -1) {
+            return -1;
+        }
+        int done = emit(c, OP_JMP, 0);
+        if (done == -1) {
+            return -1;
+        }
+        c->expr->ops[skip].value = c->expr->count;
+        if (emit(c, OP_NUM, and ? 0 : 1) == -1) {
+            return -1;
+        }
+        c->expr->ops[done].value = c->expr->count;
+    }
+    return 0;
+}
+
+/**
+ * Compiles a conditional expression, "COND ? A : B"
+ * @param c the compiler
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int compile_ternary(struct compiler *c)
+{
+    if (compile_binary(c, 1) == -1) {
+        return -1;
+    }
+    if (accept(c, "?") == false) {
+        return 0;
+    }
+    int skip = emit(c, OP_JZ, 0);
+    if (skip == -1 || compile_comma(c) == -1) {
+        return -1;
+    }
+    if (accept(c, ":") == false) {
+        c->error = "missing ':'";
+        return -1;
+    }
+    int done = emit(c, OP_JMP, 0);
+    if (done == -1) {
+        return -1;
+    }
+    c->expr->ops[skip].value = c->expr->count;
+    if (compile_assign(c) == -1) {
+        return -1;
+    }
+    c->expr->ops[done].value = c->expr->count;
+    return 0;
+}
+
+/**
+ * Compiles an assignment, "NAME = EXPR" or "NAME OP= EXPR", or else a
+ * conditional expression
+ * @param c the compiler
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int compile_assign(struct compiler *c)
+{
+    static const struct { const char *text; enum arith_code binop; } assigns[] = {
+        { "=", OP_NONE }, { "+=", OP_ADD }, { "-=", OP_SUB }, { "*=", OP_MUL },
+        { "/=", OP_DIV }, { "%=", OP_MOD }, { "<<=", OP_SHL }, { ">>=", OP_SHR },
+        { "&=", OP_BAND }, { "^=", OP_BXOR }, { "|=", OP_BOR },
+    };
+
+    const char *start = c->pos;
+    size_t len;
+    const char *name = read_name(c, &len);
+    const char *op = (name != NULL) ? peek_op(c) : NULL;
+    for (size_t i = 0; op != NULL && i < sizeof(assigns) / sizeof(assigns[0]); i++) {
+        if (strcmp(op, assigns[i].text) != 0) {
+            continue;
+        }
+        c->pos += strlen(op);
+        if (compile_assign(c) == -1) {
+            return -1;
+        }
+        int at = emit_name(c, OP_ASSIGN, name, len);
+        if (at == -1) {
+            return -1;
+        }
+        c->expr->ops[at].binop = assigns[i].binop;
+        return 0;
+    }
+    c->pos = start;
+    return compile_ternary(c);
+}
+
+/**
+ * Compiles a comma-separated list of expressions, whose value is the last
+ * one's
+ * @param c the compiler
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int compile_comma(struct compiler *c)
+{
+    if (compile_assign(c) == -1) {
+        return -1;
+    }
+    while (accept(c, ",")) {
+        if (emit(c, OP_POP, 0) == -1 || compile_assign(c) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Frees a compiled expression
+ * @param e the expression
+ */
+static void expr_free(struct arith_expr *e)
+{
+    if (e == NULL) {
+        return;
+    }
+    for (int i = 0; i < e->count; i++) {
+        free(e->ops[i].name);
+    }
+    free(e->ops);
+    free(e->stack);
+    free(e->text);
+    free(e);
+}
+
+/**
+ * Compiles an expression
+ * @param expr the expression text (not NUL-terminated)
+ * @param len the length of the text
+ *
+ * @return the compiled expression or NULL on failure, which is reported
+ */
+static struct arith_expr *compile(const char *expr, size_t len)
+{
+    struct arith_expr *e = calloc(1, sizeof(struct arith_expr));
+    if (e == NULL || (e->text = strndup(expr, len)) == NULL) {
+        perror("malloc");
+        free(e);
+        return NULL;
+    }
+
+    struct compiler c = { expr, expr + len, e, 0, NULL };
+    skip_blanks(&c);
+    if (c.pos == c.end) {
+        /* "$(( ))" is zero */
+        if (emit(&c, OP_NUM, 0) == -1) {
+            expr_free(e);
+            return NULL;
+        }
+    } else if (compile_comma(&c) == 0) {
+        skip_blanks(&c);
+        if (c.pos != c.end) {
+            c.error = "syntax error";
+        }
+    }
+    if (c.error == NULL && (e->stack = malloc((e->count + 1) * sizeof(long long))) == NULL) {
+        perror("malloc");
+        c.error = "out of memory";
+    }
+    if (c.error != NULL) {
+        if (c.pos == c.end) {
+            arith_error(e->text, "%s", c.error);
+        } else {
+            arith_error(e->text, "%s (at '%.*s')", c.error, (int) (c.end - c.pos), c.pos);
+        }
+        expr_free(e);
+        return NULL;
+    }
+    LOG("Compiled '%s' to %d instructions\n", e->text, e->count);
+    return e;
+}
+
+/**
+ * Reads a variable as a number. Unset and empty variables are zero.
+ * @param e the expression being run, for error messages
+ * @param name the variable name
+ * @param value receives the number
+ *
+ * @return 0 on success or -1 if the value is not a number
+ */
+static int read_var(const struct arith_expr *e, const char *name, long long *value)
+{
+    const char *text = var_get(name);
+    while (text != NULL && isspace((unsigned char) *text)) {
+        text++;
+    }
+    if (text == NULL || *text == '\0') {
+        *value = 0;
+        return 0;
+    }
+    bool negative = (*text == '-');
+    if (*text == '-' || *text == '+') {
+        text++;
+    }
+    char *end;
+    unsigned long long magnitude = strtoull(text, &end, 0);
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    if (end == text || *end != '\0' || *text == '-' || *text == '+') {
+        arith_error(e->text, "%s: value is not a number", name);
+        return -1;
+    }
+    *value = (long long) (negative ? 0 - magnitude : magnitude);
+    return 0;
+}
+
+/**
+ * Stores a number in a variable
+ * @param name the variable name
+ * @param value the number
+ */
+static void write_var(const char *name, long long value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%lld", value);
+    var_set(name, number);
+}
+
+/**
+ * Applies a binary operator. Addition, subtraction, multiplication, and left
+ * shifts wrap around; shift counts are taken modulo 64.
+ * @param e the expression being run, for error messages
+ * @param code the operator
+ * @param a the left operand
+ * @param b the right operand
+ * @param out receives the result
+ *
+ * @return 0 on success or -1 on division by zero or a negative exponent
+ */
+static int apply(const struct arith_expr *e, enum arith_code code, long long a, long long b,
+        long long *out)
+{
+    unsigned long long ua = (unsigned long long) a;
+    unsigned long long ub = (unsigned long long) b;
+    switch (code) {
+        case OP_ADD: *out = (long long) (ua + ub); break;
+        case OP_SUB: *out = (long long) (ua - ub); break;
+        case OP_MUL: *out = (long long) (ua * ub); break;
+        case OP_DIV:
+        case OP_MOD:
+            if (b == 0) {
+                arith_error(e->text, "division by zero");
+                return -1;
+            }
+            if (a == LLONG_MIN && b == -1) {
+                *out = (code == OP_DIV) ? LLONG_MIN : 0;
+            } else {
+                *out = (code == OP_DIV) ? a / b : a % b;
+            }
+            break;
+        case OP_POW: {
+            if (b < 0) {
+                arith_error(e->text, "exponent less than 0");
+                return -1;
+            }
+            unsigned long long result = 1;
+            while (ub != 0) {
+                if (ub & 1) {
+                    result *= ua;
+                }
+                ua *= ua;
+                ub >>= 1;
+            }
+            *out = (long long) result;
+            break;
+        }
+        case OP_SHL: *out = (long long) (ua << (ub & 63)); break;
+        case OP_SHR: *out = a >> (ub & 63); break;
+        case OP_LT: *out = a < b; break;
+        case OP_LE: *out = a <= b; break;
+        case OP_GT: *out = a > b; break;
+        case OP_GE: *out = a >= b; break;
+        case OP_EQ: *out = a == b; break;
+        case OP_NE: *out = a != b; break;
+        case OP_BAND: *out = a & b; break;
+        case OP_BXOR: *out = a ^ b; break;
+        case OP_BOR: *out = a | b; break;
+        default: *out = 0; break;
+    }
+    return 0;
+}
+
+/**
+ * Runs a compiled expression
+ * @param e the expression
+ * @param result receives its value
+ *
+ * @return 0 on success or -1 on failure, which is reported
+ */
+static int run(const struct arith_expr *e, long long *result)
+{
+    long long *sp = e->stack;
+    for (int pc = 0; pc < e->count; pc++) {
+        const struct arith_op *op = &e->ops[pc];
+        long long value;
+        switch (op->code) {
+            case OP_NUM:
+                *sp++ = op->value;
+                break;
+            case OP_VAR:
+                if (read_var(e, op->name, sp) == -1) {
+                    return -1;
+                }
+                sp++;
+                break;
+            case OP_NEG: sp[-1] = (long long) (0 - (unsigned long long) sp[-1]); break;
+            case OP_NOT: sp[-1] = !sp[-1]; break;
+            case OP_BNOT: sp[-1] = ~sp[-1]; break;
+            case OP_BOOL: sp[-1] = (sp[-1] != 0); break;
+            case OP_POP: sp--; break;
+            case OP_JZ:
+                if (*--sp == 0) {
+                    pc = op->value - 1;
+                }
+                break;
+            case OP_JNZ:
+                if (*--sp != 0) {
+                    pc = op->value - 1;
+                }
+                break;
+            case OP_JMP:
+                pc = op->value - 1;
+                break;
+            case OP_ASSIGN:
+                value = sp[-1];
+                if (op->binop != OP_NONE) {
+                    long long current;
+                    if (read_var(e, op->name, &current) == -1
+                            || apply(e, op->binop, current, sp[-1], &value) == -1) {
+                        return -1;
+                    }
+                }
+                write_var(op->name, value);
+                sp[-1] = value;
+                break;
+            case OP_INCR:
+                if (read_var(e, op->name, &value) == -1) {
+                    return -1;
+                }
+                write_var(op->name, (long long) ((unsigned long long) value + op->value));
+                *sp++ = op->post ? value : (long long) ((unsigned long long) value + op->value);
+                break;
+            default:
+                sp--;
+                if (apply(e, op->code, sp[-1], sp[0], &sp[-1]) == -1) {
+                    return -1;
+                }
+                break;
+        }
+    }
+    *result = sp[-1];
+    return 0;
+}
+
+/**
+ * Hashes an expression's text
+ * @param text the text
+ * @param len the length of the text
+ *
+ * @return cache slot for the expression
+ */
+static unsigned int arith_hash(const char *text, size_t len)
+{
+    unsigned int hash = 5381;
+    for (size_t i = 0; i < len; i++) {
+        hash = hash * 33 + (unsigned char) text[i];
+    }
+    return hash % ARITH_CACHE;
+}
+
+/**
+ * Evaluates an arithmetic expression, compiling it unless the same text was
+ * compiled before. Errors are reported on stderr.
+ * @param expr the expression text (not NUL-terminated)
+ * @param len the length of the text
+ * @param result receives the value
+ *
+ * @return 0 on success or -1 on failure
+ */
+int arith_eval(const char *expr, size_t len, long long *result)
+{
+    unsigned int slot = arith_hash(expr, len);
+    struct arith_expr *e = cache[slot];
+    if (e == NULL || strlen(e->text) != len || strncmp(e->text, expr, len) != 0) {
+        if ((e = compile(expr, len)) == NULL) {
+            return -1;
+        }
+        expr_free(cache[slot]);
+        cache[slot] = e;
+    }
+    return run(e, result);
+}
+
+/**
+ * Frees every compiled expression
+ */
+void arith_destroy(void)
+{
+    for (int i = 0; i < ARITH_CACHE; i++) {
+        expr_free(cache[i]);
+        cache[i] = NULL;
+    }
+}
@@ -0,0 +1,17 @@
+/**
+ * @file
+ *
+ * Contains function headers for arithmetic expansion.
+ */
+
+#ifndef _ARITH_H_
+#define _ARITH_H_
+
+#include <stddef.h>
+
+const char *arith_close(const char *expr);
+const char *arith_unclosed(const char *tok);
+int arith_eval(const char *expr, size_t len, long long *result);
+void arith_destroy(void);
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * @file
+ *
+ * Contains the "batch" builtin, which runs a command whose argument list may
+ * be too large for a single exec. The space argv and envp would take in the
+ * new process image is measured the way the kernel counts it (each string
+ * plus its terminator plus a pointer) and compared against
+ * sysconf(_SC_ARG_MAX). An invocation that does not fit is split into
+ * several execs of the same command, like xargs. The words before a "--"
+ * (or just the command name, without one) are repeated in every batch. The
+ * shell applies redirections before the builtin runs, so a supervisor
+ * process and every batch inherit them.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "guard.h"
+#include "logger.h"
+#include "procsub.h"
+#include "util.h"
+
+/* Space left free below ARG_MAX, as xargs does, for the auxiliary vector */
+#define BATCH_HEADROOM 2048
+
+/* Longest single argument the kernel accepts (MAX_ARG_STRLEN) */
+#define BATCH_MAX_ARG (32 * 4096)
+
+extern char **environ;
+
+/**
+ * Computes the space a string takes in a new process image
+ * @param str the string
+ *
+ * @return its length plus terminator plus the pointer to it
+ */
+static size_t exec_size(const char *str)
+{
+    return strlen(str) + 1 + sizeof(char *);
+}
+
+/**
+ * Converts a batch's status from waitpid into its contribution to the
+ * combined status, following xargs: 127 or 126 if the command could not be
+ * run, 125 if it was killed by a signal, 123 if it failed, 0 if it succeeded
+ * @param status the status reported by waitpid
+ *
+ * @return the batch's status code
+ */
+static int batch_status(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return 125;
+    }
+    int code = WEXITSTATUS(status);
+    if (code == 0 || code == 126 || code == 127) {
+        return code;
+    }
+    return 123;
+}
+
+/**
+ * Waits for one running batch
+ * @param result combined status so far, raised to this batch's status
+ *
+ * @return 0 on success or -1 if there was nothing to wait for
+ */
+static int reap_batch(int *result)
+{
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) == -1 && errno == EINTR);
+    if (pid == -1) {
+        return -1;
+    }
+    int code = batch_status(status);
+    if (code > *result) {
+        *result = code;
+    }
+    return 0;
+}
+
+/**
+ * Runs the command in batches. Called in the supervisor process, after its
+ * redirections were applied.
+ * @param cmd the command: fixed arguments followed by the arguments to split
+ * @param fixed number of arguments repeated in every batch
+ * @param jobs most batches run at the same time
+ * @param max_args most split arguments per batch, or 0 for no limit
+ *
+ * @return the combined status of every batch
+ */
+static int run_batches(char *cmd[], int fixed, long jobs, long max_args)
+{
+    size_t limit = sysconf(_SC_ARG_MAX);
+    size_t env_size = sizeof(char *);
+    for (char **env = environ; *env != NULL; env++) {
+        env_size += exec_size(*env);
+    }
+    size_t fixed_size = sizeof(char *);
+    for (int i = 0; i < fixed; i++) {
+        fixed_size += exec_size(cmd[i]);
+    }
+    if (env_size + fixed_size + BATCH_HEADROOM >= limit) {
+        fprintf(stderr, "batch: environment and command leave no room for arguments\n");
+        return 1;
+    }
+    size_t room = limit - env_size - fixed_size - BATCH_HEADROOM;
+
+    int total = 0;
+    while (cmd[fixed + total] != NULL) {
+        if (strlen(cmd[fixed + total]) >= BATCH_MAX_ARG) {
+            fprintf(stderr, "batch: argument %d is longer than the kernel allows\n", total + 1);
+            return 1;
+        }
+        total++;
+    }
+    char **argv = malloc((fixed + total + 1) * sizeof(char *));
+    if (argv == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(argv, cmd, fixed * sizeof(char *));
+
+    int result = 0;
+    int running = 0;
+    int batches = 0;
+    int next = fixed;
+    do {
+        int count = 0;
+        size_t used = 0;
+        while (cmd[next + count] != NULL && (max_args == 0 || count < max_args)) {
+            size_t size = exec_size(cmd[next + count]);
+            if (count > 0 && used + size > room) {
+                break;
+            }
+            used += size;
+            count++;
+        }
+        memcpy(argv + fixed, cmd + next, count * sizeof(char *));
+        argv[fixed + count] = NULL;
+        next += count;
+
+        if (running == jobs) {
+            reap_batch(&result);
+            running--;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            result = 1;
+            break;
+        } else if (pid == 0) {
+            guard_apply_limits();
+            execvp(argv[0], argv);
+            int error = errno;
+            perror("mash");
+            _exit((error == ENOENT) ? 127 : 126);
+        }
+        running++;
+        batches++;
+    } while (cmd[next] != NULL);
+
+    while (running > 0 && reap_batch(&result) == 0) {
+        running--;
+    }
+    LOG("Ran %d arguments in %d batches\n", total, batches);
+    free(argv);
+    return result;
+}
+
+/**
+ * Parses a non-negative count option
+ * @param str the option value
+ * @param value receives the count
+ *
+ * @return true if the value is valid
+ */
+static bool parse_count(const char *str, long *value)
+{
+    char *end;
+    if (str == NULL) {
+        return false;
+    }
+    *value = strtol(str, &end, 10);
+    return end != str && *end == '\0' && *value >= 0;
+}
+
+/**
+ * Handles the "batch" builtin:
+ * "batch [-P JOBS] [-n MAX] command [fixed...] -- args...". The arguments
+ * after "--" are split into as many execs of the command as ARG_MAX requires
+ * (or MAX arguments each with -n), run one at a time or up to JOBS at once
+ * with -P (0 means one per CPU). The words between the command name and
+ * "--" are repeated in every batch and the "--" itself is dropped. Without a
+ * "--", every argument after the command name is split.
+ * @param args command arguments
+ *
+ * @return 0 if every batch succeeded, otherwise 123 if any failed, 125 if any
+ * was killed, or 126/127 if the command could not be run
+ */
+int batch_handler(char *args[])
+{
+    long jobs = 1;
+    long max_args = 0;
+    bool valid = true;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i += 2) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        long *target = (strcmp(args[i], "-P") == 0) ? &jobs
+            : (strcmp(args[i], "-n") == 0) ? &max_args : NULL;
+        if (target == NULL || parse_count(args[i + 1], target) == false) {
+            valid = false;
+            break;
+        }
+    }
+    if (valid == false || args[i] == NULL) {
+        fprintf(stderr, "usage: batch [-P JOBS] [-n MAX] command [fixed...] [--] [args...]\n");
+        return 1;
+    }
+    if (jobs == 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = (jobs > 0) ? jobs : 1;
+    }
+    char **cmd = args + i;
+    int fixed = 1;
+    while (cmd[fixed] != NULL && strcmp(cmd[fixed], "--") != 0) {
+        fixed++;
+    }
+    if (cmd[fixed] == NULL) {
+        fixed = 1;
+    } else {
+        for (int j = fixed; cmd[j] != NULL; j++) {
+            cmd[j] = cmd[j + 1];
+        }
+    }
+
+    fflush(stdout);
+    pid_t supervisor = fork();
+    if (supervisor == -1) {
+        perror("fork");
+        return 1;
+    } else if (supervisor == 0) {
+        close_inherited_fds();
+        procsub_keep(cmd);
+        _exit(run_batches(cmd, fixed, jobs, max_args));
+    }
+
+    int status;
+    bool timed_out;
+    if (guard_wait(supervisor, &status, &timed_out) == -1) {
+        perror("waitpid");
+        return 1;
+    }
+    if (timed_out) {
+        return 124;
+    }
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
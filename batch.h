@@ -0,0 +1,13 @@
+/**
+ * @file
+ *
+ * Contains function headers for running commands with argument lists split
+ * to fit the kernel's ARG_MAX limit.
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+int batch_handler(char *args[]);
+
+#endif
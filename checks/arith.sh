@@ -0,0 +1,22 @@
+# $(( )) evaluates 64-bit integer expressions with C's operators, **,
+# assignments and ++/--, and reports errors without running the command.
+echo $(( 1 + 2 * 3 )) $(( (1 + 2) * 3 )) $(( 7 / 2 )) $(( -7 % 3 ))
+echo $(( 2 ** 10 )) $(( 1 << 4 )) $(( 0xff & 0x0f )) $(( 5 ^ 3 )) $(( ~0 ))
+echo $(( 3 > 2 )) $(( 3 == 2 )) $(( 1 && 0 )) $(( 0 || 2 )) $(( !5 ))
+echo $(( 1 ? 10 : 20 )) $(( 0 ? 10 : 20 ))
+echo $(( 9223372036854775807 + 1 ))
+i=5
+echo $(( i * 2 )) $((i+1))
+: $(( i += 10 ))
+echo $i
+echo $(( i++ )) $i $(( ++i )) $i $(( i-- )) $i
+echo $(( unset_var + 1 ))
+total=0
+for n in 1 2 3 4; do total=$(( total + n )); done
+echo $total
+echo $(( 1 / 0 )) not printed
+echo status $?
+echo $(( 1 + )) not printed
+echo status $?
+echo $(( 2 + 3 ; echo not run
+echo status $?
@@ -0,0 +1,26 @@
+# batch splits only the arguments after --, repeats the words before it in
+# every run, follows xargs' exit statuses, and splits at ARG_MAX by itself.
+printf pat1\nx\n > a
+printf y\npat2\n > b
+batch -n 1 grep -H -e pat -- a b
+batch -n 1 echo -n -- x y
+echo
+batch -n 1 echo p q
+batch -n 1 grep -q pat1 -- a b
+echo status $?
+batch -P 2 -n 1 true -- 1 2 3 4
+echo status $?
+batch -n 1 echo > out -- r s
+cat out
+batch no-such-command -- x
+echo status $?
+batch
+echo status $?
+mkdir many
+cd many
+seq -f %0200g 15000 | xargs touch
+ls * > /dev/null
+batch ls -- * > ../list
+wc -l < ../list
+batch -P 0 wc -c -- * > ../counts
+grep -vc total ../counts
@@ -0,0 +1,13 @@
+# Tab completes a file name in an interactive session on a terminal made by
+# script(1). The keys are typed by a small sh script, with a pause after the
+# Tab because any other key cancels a listing in progress.
+mkdir big
+seq -f big/f%g 5000 | xargs touch
+touch big/unique-name
+cat > type <<'END'
+printf 'echo big/un\t'
+sleep 1
+printf '\nexit\n'
+END
+sh type | timeout 10 script -qec $MASH /dev/null > typescript
+tr \r \n < typescript | grep -cx big/unique-name
@@ -0,0 +1,42 @@
+# if/elif/else, while, until, for, case, break, continue and variables.
+x=2
+if [ $x -eq 1 ]; then
+    echo one
+elif [ $x -eq 2 ]; then
+    echo two
+else
+    echo other
+fi
+if false; then echo no; else echo else-branch; fi
+i=0
+while [ $i -lt 3 ]; do
+    echo while $i
+    i=$(( i + 1 ))
+done
+until [ $i -eq 0 ]; do i=$(( i - 1 )); done
+echo until $i
+for w in a b c d; do
+    if [ $w = b ]; then continue; fi
+    if [ $w = d ]; then break; fi
+    echo for $w
+done
+for outer in 1 2; do
+    for inner in 1 2; do
+        if [ $inner = 2 ]; then break 2; fi
+        echo nested $outer $inner
+    done
+done
+for f in x.c y.h z; do
+    case $f in
+        *.c) echo $f source ;;
+        *.h) echo $f header ;;
+        *) echo $f other ;;
+    esac
+done
+true; echo true $?
+false; echo false $?
+echo pid-set ${$}-ok | grep -c pid-set
+export EXPORTED=yes
+sh -c env | grep EXPORTED
+unset EXPORTED
+echo unset [$EXPORTED]
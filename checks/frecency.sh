@@ -0,0 +1,27 @@
+# cd records visits, z and cd -j jump to the best match, and the visits are
+# saved when a session exits, including one run with -c. Paths are printed
+# relative to HOME, which is the check's directory.
+mkdir -p projects/mash/src projects/other/src notes
+cd projects/mash/src
+cd ../../other/src
+cd ../../mash/src
+cd ../../..
+z mash src
+pwd | sed s,$HOME,~,
+cd -j other src
+pwd | sed s,$HOME,~,
+z nomatch
+echo status $?
+cd /
+z src
+pwd | sed s,$HOME,~,
+cd $HOME
+cat > args <<'END'
+cd notes; /bin/true
+END
+tr \n \0 < args | xargs -0 $MASH -c
+cat > later <<'END'
+z notes
+pwd | sed s,$HOME,~,
+END
+$MASH later
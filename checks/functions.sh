@@ -0,0 +1,37 @@
+# Functions run in the shell with positional parameters, shift and return,
+# and aliases expand where a command starts.
+greet() { echo hello $1 of $#; }
+greet world a b
+function count {
+    n=0
+    for arg in $@; do n=$(( n + 1 )); done
+    echo $n args, first $1
+    shift 2
+    echo after shift $1
+    return 4
+}
+count p q r s
+echo status $?
+setvar() { inside=yes; }
+setvar
+echo $inside
+greet piped | tr a-z A-Z
+greet redirected > out
+cat out
+args() { echo ${10} $*; }
+args 1 2 3 4 5 6 7 8 9 ten
+functions
+unset -f greet
+greet gone
+echo status $?
+alias say=echo said
+say hi
+alias twice=say say
+twice hi
+alias say
+unalias say
+say hi
+echo status $?
+alias loop=loop
+loop
+echo status $?
@@ -0,0 +1,15 @@
+# Wildcards expand to sorted matches, skip dot files unless the pattern
+# starts with a dot, stay literal when nothing matches, and see files
+# created after the directory was cached.
+mkdir -p d/sub
+touch d/b.txt d/a.txt d/c.log d/.hidden d/sub/x.txt
+echo d/*.txt
+echo d/*
+echo d/.h*
+echo d/?.log
+echo d/[ab].txt
+echo d/*/*.txt
+echo d/*.none
+echo d/a*
+touch d/a.txt2
+echo d/a*
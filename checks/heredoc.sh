@@ -0,0 +1,26 @@
+# Here-documents and here-strings: expansion, quoted delimiters, <<- tab
+# stripping, other descriptors, a body larger than a pipe holds, and the
+# body being an in-memory file.
+name=world
+cat <<END
+hello $name
+  indented
+END
+cat <<'END'
+hello $name
+END
+cat <<-END
+		tabs stripped
+	END
+cat <<< here-string
+wc -l <<< $name
+cat 3<<END <&3
+from three
+END
+cat > big <<'END'
+wc -l <<EOF
+END
+seq 100000 >> big
+echo EOF >> big
+$MASH big
+readlink /proc/self/fd/0 <<< x | cut -c 1-7
@@ -0,0 +1,17 @@
+# latency counts the phases of the commands run so far, latency reset
+# clears them, and --latency-json writes them when the shell exits, also
+# after -c. Times vary, so only names and counts are printed.
+/bin/true
+/bin/true
+latency > table
+cut -c 1-19 table
+latency reset
+latency -j > j
+tr , \n < j | grep -c count.:0
+latency bogus
+echo status $?
+echo /bin/true > s
+$MASH --latency-json=out.json s
+tr { \n < out.json | grep -c count
+$MASH --latency-json=c.json -c /bin/true
+tr , \n < c.json | grep exec.:{.count
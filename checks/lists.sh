@@ -0,0 +1,27 @@
+# ;, && and || lists, continuation lines, and -c with positional parameters.
+# A -c string with spaces is passed through xargs, one argument per line.
+# Its last command replaces the shell, so ps finds itself at the shell's PID.
+echo a; echo b
+true && echo and-ran
+false && echo not-printed
+false || echo or-ran
+true || echo not-printed
+false && echo no || echo fallback
+true &&
+    echo continued
+cat > args <<'END'
+echo $0 $1; false || echo fell back; ps -o comm= -p $$
+name
+first
+END
+tr \n \0 < args | xargs -0 $MASH -c
+echo -c status $?
+$MASH -c false
+echo -c status $?
+cat > inner <<'END'
+echo $0 $1 $2; exit 3
+END
+$MASH inner one two
+echo script status $?
+$MASH -c 2> /dev/null
+echo status $?
@@ -0,0 +1,30 @@
+# memo replays the output and status of a command whose inputs did not
+# change, runs it again when an input file changes, and keeps separate
+# entries for different output targets.
+echo hello > in
+cat > count <<'END'
+echo ran >> runs
+cat in
+exit 3
+END
+memo sh count in
+echo status $?
+memo sh count in
+echo status $?
+wc -l < runs
+echo changed > in
+memo sh count in
+wc -l < runs
+memo sh count in > out
+cat out
+wc -l < runs
+memo sh count in > out
+cat out
+wc -l < runs
+memo -l > list
+grep -c sh.count.in list
+memo -c > /dev/null
+memo -l > list
+grep -c sh.count.in list
+memo sh count in
+wc -l < runs
@@ -0,0 +1,18 @@
+# Pipe sizing policies, globally and for a single pipeline. The system
+# maximum varies between machines, so it is left out of the output.
+pipesize > s
+grep -v maximum s
+pipesize -d on
+pipesize 1M
+seq 3 | cat
+pipesize 64K seq 2 | cat
+pipesize > s
+grep -v maximum s
+pipesize bogus
+echo status $?
+pipesize -d maybe
+echo status $?
+pipesize adaptive
+seq 100000 | cat | wc -l
+pipesize default
+seq 1 | cat
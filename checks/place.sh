@@ -0,0 +1,23 @@
+# place sets CPU affinity, nice and I/O class for a command, and -b sets
+# defaults for background jobs. CPU 0 is the only one every machine has, so
+# affinity is only printed where it was set.
+cat > cpus <<'END'
+taskset -pc $$ | sed 's/.*: //'
+END
+cat > prio <<'END'
+nice
+ionice
+END
+place -c 0 sh cpus
+place -c pack:0 sh cpus | cat
+place -c spread:0 sh cpus | cat
+place -n 5 -i idle sh prio
+place -i be:3 sh prio | cat
+place -c bogus true
+echo status $?
+place -b -n 7
+place
+nice &
+sleep 0.3
+place -b off
+place
@@ -0,0 +1,13 @@
+# <(list) and >(list) become /dev/fd paths to pipes, run at the same time
+# as the command, and only the command that names them keeps them open.
+printf b\na\nc\n > x
+printf c\nb\na\n > y
+diff <(sort x) <(sort y) && echo same
+cat <(echo one; echo two)
+seq 3 | tee >(wc -l > count) > /dev/null
+sleep 0.2
+cat count
+echo <(true) | grep -c ^/dev/fd/
+paste <(seq 2) <(seq 3 4)
+echo <(sleep 0.5) > /dev/null
+ls /proc/self/fd | wc -l
@@ -0,0 +1,15 @@
+# pstat meters the edges of a pipeline without changing the data, and
+# prints a summary on stderr. Rates and times vary, so only the edge names
+# and byte counts are printed.
+seq 100000 | md5sum
+cat > metered <<'END'
+pstat seq 100000 | cat | md5sum
+seq 10 | cat > /dev/null
+pstat on
+seq 10 | cat > /dev/null
+pstat off
+seq 10 | cat > /dev/null
+pstat
+END
+$MASH metered > summary 2>&1
+cut -c 1-40 summary
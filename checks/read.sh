@@ -0,0 +1,38 @@
+# read splits lines on IFS into names, keeps the rest in the last one,
+# handles -r, -d, -n and -u, leaves the offset after the line it read so
+# commands in the loop continue from there, and a loop takes a redirection.
+cat > inventory <<'END'
+web 10.0.0.1 primary
+db 10.0.0.2
+cache
+END
+while read host ip rest; do echo [$host] [$ip] [$rest]; done < inventory
+read line < inventory
+echo $line
+read < inventory
+echo $REPLY
+cat > lines <<'END'
+first
+second
+third
+END
+while read l; do echo got $l; head -n 1; done < lines
+mkfifo fifo
+seq 4 > fifo &
+while read l; do echo pipe $l; head -n 1; done < fifo
+printf a\\b\n > esc
+read x < esc
+echo $x
+read -r x < esc
+echo $x
+read -d : x <<< one:two
+echo $x
+read -n 3 x <<< abcdef
+echo $x
+read -u 3 x 3< inventory
+echo $x
+IFS=,
+read a b <<< p,q
+echo $a $b
+read x < /dev/null
+echo status $?
@@ -0,0 +1,21 @@
+# Output, append, input, stderr, duplication and closing redirections.
+echo one > f
+echo two >> f
+cat < f
+ls /nonexistent 2> err
+cat err | wc -l
+ls /nonexistent > both 2>&1
+wc -l < both
+ls /nonexistent &> amp
+wc -l < amp
+echo three &>> amp
+tail -n 1 amp
+echo to-stderr 1>&2
+echo via-three 3> g 1>&3
+cat g
+echo closed >&- 2> /dev/null
+echo status $?
+cat < missing
+echo status $?
+# Only 0, 1, 2 and the directory ls itself opens are inherited
+ls /proc/self/fd | wc -l
@@ -0,0 +1,17 @@
+# A script run with --script-cache is tokenized once and saved; later runs
+# use the saved tokens until the script changes.
+cat > s <<'END'
+echo first run
+for i in 1 2; do echo loop $i; done
+END
+$MASH --script-cache s
+ls -a
+cp .s.mashc saved
+$MASH --script-cache s
+cmp .s.mashc saved && echo cache kept
+echo echo edited > s
+$MASH --script-cache s
+mkdir c
+$MASH --script-cache-dir=c s
+ls c | wc -l
+$MASH --script-cache-dir=c s
@@ -0,0 +1,22 @@
+# |N> runs N copies of a stage on line-aligned parts of the input and
+# merges whole lines back; o keeps the order, h and hK send equal lines
+# (or equal Kth fields) to the same copy, and z splits on NUL.
+seq 100000 |4> cat | sort -n | md5sum
+seq 100000 | md5sum
+seq 300000 |4o> cat | md5sum
+seq 300000 | md5sum
+cat > words <<'END'
+a 1
+b 2
+a 3
+c 4
+b 5
+a 6
+END
+cat > pidof <<'END'
+while read key rest; do echo $key:$$; done
+END
+cat words |3h1> sh pidof | sort -u | cut -d: -f 1 | uniq -d | wc -l
+printf a\0b\0c\0 |2z> tr \0 \n | sort
+seq 10 |2> wc -l > total
+wc -l < total
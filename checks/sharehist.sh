@@ -0,0 +1,19 @@
+# Sessions started with --shared-history see each other's commands through
+# !prefix, the last session to exit saves the ring to ~/.mash_history, and
+# the next first session loads it again.
+cat > a <<'END'
+printf %s\n from-a
+sleep 1
+END
+cat > b <<'END'
+echo from-b
+!printf
+END
+$MASH --shared-history a &
+sleep 0.3
+$MASH --shared-history b
+sleep 1.5
+cat .mash_history
+echo printf %s\n from-disk > .mash_history
+echo !printf > c
+$MASH --shared-history c
@@ -0,0 +1,6 @@
+# Scripts never load readline, and --startup-profile lists the startup
+# phases (without their times, which vary).
+grep -c readline /proc/$$/maps
+echo true > s
+$MASH --startup-profile s 2>&1 | sed s/[[:blank:]]*[0-9.]*.ms$//
+$MASH --startup-profile -c true 2>&1 | sed s/[[:blank:]]*[0-9.]*.ms$//
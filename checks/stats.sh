@@ -0,0 +1,13 @@
+# stats lists each subsystem, and a background job shows up as memory in
+# "jobs". Byte counts vary, so only names and whether "jobs" is all zero are
+# printed.
+stats > s
+cut -c 1-10 s | tr -d [:blank:]
+grep -c ^jobs[[:blank:]]*0[[:blank:]]*0[[:blank:]]*0[[:blank:]]*0$ s
+sleep 1 &
+stats > s
+grep -c ^jobs[[:blank:]]*0[[:blank:]]*0[[:blank:]]*0[[:blank:]]*0$ s
+stats -j > j
+tr , \n < j | grep -c allocs
+stats -x
+echo status $?
@@ -0,0 +1,20 @@
+# A descriptor redirected to several files writes to all of them, for
+# external commands and builtins alike, and tee is built in.
+echo old > b
+seq 3 > a >> b
+cat a
+cat b
+seq 100000 > big1 > big2
+cmp big1 big2 && echo same
+history > h1 > h2
+cmp h1 h2 && echo same
+ls /nonexistent 2> e1 2> e2
+cat e1 e2 | wc -l
+seq 5 | tee t1 t2 | wc -l
+cat t1 t2 | wc -l
+echo more | tee -a t1 > /dev/null
+tail -n 1 t1
+seq 200000 | tee t3 > t4
+cmp t3 t4 && wc -l < t3
+tee < a copy
+cat copy
@@ -0,0 +1,41 @@
+# timeout stops a command and its children at the deadline with status 124,
+# -s picks the signal, -k escalates to SIGKILL, and limit sets rlimits.
+cat > kids <<'END'
+sleep 5 &
+echo $! > pid
+wait
+echo not reached
+END
+cat > trap <<'END'
+trap '' TERM
+sleep 0.5
+echo survived TERM
+sleep 5
+END
+cat > ulimits <<'END'
+ulimit -n
+ulimit -t
+END
+timeout 0.2 sleep 5
+echo status $?
+timeout 5 true
+echo status $?
+timeout 5 false
+echo status $?
+timeout 0.2 sh kids
+echo status $?
+sleep 0.2
+xargs ps -o stat= -p < pid | grep -c ^[^Z]
+timeout -s INT 0.2 sleep 5
+echo status $?
+timeout -k 0.5 0.2 sh trap
+echo status $?
+timeout 0.2
+sleep 1
+echo default status $?
+timeout off
+sleep 0.3
+echo off status $?
+limit -n 20 -t 3 sh ulimits
+timeout bogus sleep 1
+echo status $?
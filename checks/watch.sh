@@ -0,0 +1,19 @@
+# watch runs a command once, then again after each burst of changes under
+# the paths, ignoring dot directories, until it gets SIGINT.
+mkdir -p src/sub src/.git
+cat > w <<'END'
+echo $$ > pid
+watch --paths src -- ls src/sub
+END
+$MASH w > log 2>&1 &
+sleep 0.5
+touch src/sub/a
+sleep 0.5
+touch src/sub/b src/c src/sub/c
+sleep 0.5
+touch src/.git/index
+sleep 0.5
+xargs kill -INT < pid
+sleep 0.3
+xargs ps -o stat= -p < pid | grep -c ^[^Z]
+sed s/.after.*// log
@@ -0,0 +1,496 @@
+/**
+ * @file
+ *
+ * Contains asynchronous filename completion. Directories are listed on a
+ * background thread in getdents64 batches while the completion waits up to a
+ * deadline; if the listing is not done by then, the matches found so far are
+ * shown with a "more…" marker and the listing carries on in the background.
+ * Listings are cached by directory modification time, and a listing in
+ * progress is cancelled as soon as the user types anything but Tab.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "lineedit.h"
+#include "logger.h"
+#include "memstat.h"
+
+/* Size of the buffer handed to getdents64; each call is one batch */
+#define COMPLETE_BUF_SZ (64 * 1024)
+
+/* Number of directory listings kept in the cache */
+#define COMPLETE_CACHE_SLOTS 4
+
+/* Milliseconds a completion waits for a listing before showing partial results */
+#define COMPLETE_DEADLINE_MS 150
+
+/* Milliseconds between checks for typed input while waiting */
+#define COMPLETE_POLL_MS 10
+
+/**
+ * Record layout returned by the getdents64 system call
+ */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * Stores the entries of a single directory. Entries are appended by the
+ * worker thread while lock is held; complete is set once the whole directory
+ * has been read.
+ */
+struct dir_listing
+{
+    bool used;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t loaded;
+    time_t last_used;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    size_t *offsets;
+    size_t count;
+    size_t entries_cap;
+    bool complete;
+};
+
+static struct dir_listing cache[COMPLETE_CACHE_SLOTS] = { 0 };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static bool worker_running = false;
+static atomic_bool cancelled = false;
+static struct dir_listing *building = NULL;
+static int building_fd = -1;
+
+/* Matches handed to readline through complete_generator() */
+static char **found = NULL;
+static size_t found_len = 0;
+static size_t found_next = 0;
+
+/**
+ * Frees the memory held by a cached directory listing
+ * @param listing the listing to free
+ */
+static void listing_free(struct dir_listing *listing)
+{
+    mem_free(MEM_COMPLETION, listing->names);
+    mem_free(MEM_COMPLETION, listing->offsets);
+    memset(listing, 0, sizeof(struct dir_listing));
+}
+
+/**
+ * Appends one batch of directory entries to a listing. Called with lock held.
+ * @param listing the listing to append to
+ * @param buf records returned by getdents64
+ * @param nread number of bytes in buf
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int listing_append(struct dir_listing *listing, const char *buf, long nread)
+{
+    for (long pos = 0; pos < nread; ) {
+        const struct linux_dirent64 *d = (const struct linux_dirent64 *) (buf + pos);
+        pos += d->d_reclen;
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+            continue;
+        }
+        size_t name_sz = strlen(d->d_name) + 1;
+        if (listing->names_len + name_sz > listing->names_cap) {
+            size_t cap = (listing->names_cap == 0) ? 4096 : listing->names_cap;
+            while (listing->names_len + name_sz > cap) {
+                cap *= 2;
+            }
+            char *tmp = mem_realloc(MEM_COMPLETION, listing->names, cap);
+            if (tmp == NULL) {
+                return -1;
+            }
+            listing->names = tmp;
+            listing->names_cap = cap;
+        }
+        if (listing->count == listing->entries_cap) {
+            size_t cap = (listing->entries_cap == 0) ? 64 : listing->entries_cap * 2;
+            size_t *tmp = mem_realloc(MEM_COMPLETION, listing->offsets, cap * sizeof(size_t));
+            if (tmp == NULL) {
+                return -1;
+            }
+            listing->offsets = tmp;
+            listing->entries_cap = cap;
+        }
+        memcpy(listing->names + listing->names_len, d->d_name, name_sz);
+        listing->offsets[listing->count++] = listing->names_len;
+        listing->names_len += name_sz;
+    }
+    return 0;
+}
+
+/**
+ * Reads the directory opened as building_fd into the building listing one
+ * getdents64 batch at a time, stopping early if the listing is cancelled
+ * @param arg unused
+ *
+ * @return NULL
+ */
+static void *listing_worker(void *arg)
+{
+    char *buf = mem_malloc(MEM_COMPLETION, COMPLETE_BUF_SZ);
+    long nread = -1;
+    while (buf != NULL && atomic_load(&cancelled) == false) {
+        nread = syscall(SYS_getdents64, building_fd, buf, COMPLETE_BUF_SZ);
+        if (nread <= 0) {
+            break;
+        }
+        pthread_mutex_lock(&lock);
+        int rc = listing_append(building, buf, nread);
+        pthread_cond_broadcast(&progress);
+        pthread_mutex_unlock(&lock);
+        if (rc == -1) {
+            nread = -1;
+            break;
+        }
+    }
+    mem_free(MEM_COMPLETION, buf);
+
+    pthread_mutex_lock(&lock);
+    if (nread == 0 && atomic_load(&cancelled) == false) {
+        building->complete = true;
+        LOG("Listed %zu entries for completion\n", building->count);
+    }
+    pthread_cond_broadcast(&progress);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * Waits for the worker thread to finish and drops its listing unless it was
+ * read completely
+ */
+static void worker_join(void)
+{
+    if (worker_running == false) {
+        return;
+    }
+    pthread_join(worker, NULL);
+    worker_running = false;
+    close(building_fd);
+    building_fd = -1;
+    if (building->complete == false) {
+        listing_free(building);
+    }
+    building = NULL;
+}
+
+/**
+ * Cancels the directory listing in progress, if any
+ */
+void complete_cancel(void)
+{
+    if (worker_running == false) {
+        return;
+    }
+    atomic_store(&cancelled, true);
+    worker_join();
+    LOGP("Cancelled completion listing\n");
+}
+
+/**
+ * Finds the listing for a directory: a complete cached copy that is newer than
+ * the directory's modification time, the listing still being read, or a new
+ * listing started on the worker thread. Called without lock held.
+ * @param dir the directory to list
+ *
+ * @return the listing or NULL if the directory could not be read
+ */
+static struct dir_listing *listing_get(const char *dir)
+{
+    struct stat st;
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool finished = worker_running && building->complete;
+    pthread_mutex_unlock(&lock);
+    if (finished) {
+        worker_join();
+    }
+
+    time_t now = time(NULL);
+    struct dir_listing *slot = NULL;
+    for (int i = 0; i < COMPLETE_CACHE_SLOTS; i++) {
+        struct dir_listing *l = &cache[i];
+        if (l->used && l->dev == st.st_dev && l->ino == st.st_ino
+                && l->mtime.tv_sec == st.st_mtim.tv_sec
+                && l->mtime.tv_nsec == st.st_mtim.tv_nsec
+                && (l == building || l->loaded > st.st_mtim.tv_sec)) {
+            l->last_used = now;
+            return l;
+        }
+    }
+
+    complete_cancel();
+    for (int i = 0; i < COMPLETE_CACHE_SLOTS; i++) {
+        if (slot == NULL || cache[i].used == false
+                || (slot->used && cache[i].last_used < slot->last_used)) {
+            slot = &cache[i];
+        }
+    }
+    listing_free(slot);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    slot->used = true;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->loaded = now;
+    slot->last_used = now;
+
+    building = slot;
+    building_fd = fd;
+    atomic_store(&cancelled, false);
+    if (pthread_create(&worker, NULL, listing_worker, NULL) != 0) {
+        perror("pthread_create");
+        close(fd);
+        building = NULL;
+        building_fd = -1;
+        listing_free(slot);
+        return NULL;
+    }
+    worker_running = true;
+    return slot;
+}
+
+/**
+ * Waits until a listing is complete, the deadline passes, or the user types.
+ * Called with lock held.
+ * @param listing the listing to wait for
+ *
+ * @return false if the user typed while waiting, true otherwise
+ */
+static bool listing_wait(struct dir_listing *listing)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long end_ns = deadline.tv_nsec + COMPLETE_DEADLINE_MS * 1000000L;
+    deadline.tv_sec += end_ns / 1000000000L;
+    deadline.tv_nsec = end_ns % 1000000000L;
+
+    while (listing->complete == false && worker_running) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec > deadline.tv_sec
+                || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+            break;
+        }
+        long slice_ns = now.tv_nsec + COMPLETE_POLL_MS * 1000000L;
+        struct timespec slice = {
+            .tv_sec = now.tv_sec + slice_ns / 1000000000L,
+            .tv_nsec = slice_ns % 1000000000L,
+        };
+        pthread_cond_timedwait(&progress, &lock, &slice);
+
+        struct pollfd pfd = { .fd = fileno(*le.instream ? *le.instream : stdin), .events = POLLIN };
+        if (poll(&pfd, 1, 0) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Frees the matches collected for readline
+ */
+static void found_free(void)
+{
+    for (size_t i = found_next; i < found_len; i++) {
+        mem_free(MEM_COMPLETION, found[i]);
+    }
+    mem_free(MEM_COMPLETION, found);
+    found = NULL;
+    found_len = 0;
+    found_next = 0;
+}
+
+/**
+ * Hands the collected matches to readline one per call
+ * @param text unused; the matches were already filtered
+ * @param state 0 on the first call for a completion
+ *
+ * @return the next match, which readline frees, or NULL when done
+ */
+static char *complete_generator(const char *text, int state)
+{
+    if (found_next < found_len) {
+        /* readline frees the match, so it stops being charged here */
+        mem_release(MEM_COMPLETION, found[found_next]);
+        return found[found_next++];
+    }
+    return NULL;
+}
+
+/**
+ * Compares two matches for display
+ * @param a pointer to the first match
+ * @param b pointer to the second match
+ *
+ * @return negative, zero, or positive integer like strcmp
+ */
+static int match_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Shows the matches found so far while a listing is still being read,
+ * followed by a "more…" marker, and redraws the prompt
+ */
+static void show_partial(void)
+{
+    size_t shown = found_len;
+    if (*le.completion_query_items > 0 && shown > (size_t) *le.completion_query_items) {
+        shown = *le.completion_query_items;
+    }
+    char **list = malloc((shown + 2) * sizeof(char *));
+    if (list == NULL) {
+        perror("malloc");
+        return;
+    }
+    int max = 0;
+    list[0] = "";
+    for (size_t i = 0; i < shown; i++) {
+        list[i + 1] = found[i];
+        char *base = strrchr(found[i], '/');
+        int len = strlen((base != NULL) ? base + 1 : found[i]);
+        if (len > max) {
+            max = len;
+        }
+    }
+    list[shown + 1] = NULL;
+    qsort(list + 1, shown, sizeof(char *), match_cmp);
+    le.display_match_list(list, shown, max);
+    fprintf(*le.outstream, "more…\n");
+    le.forced_update_display();
+    free(list);
+}
+
+/**
+ * Completes a file name. The directory part of text is listed on the worker
+ * thread (or taken from the cache) and its entries starting with the last
+ * path component of text are matched.
+ * @param text the word being completed
+ *
+ * @return array of matches in readline's format, or NULL if there are none,
+ * the listing is still incomplete, or the user typed while waiting
+ */
+char **complete_path(const char *text)
+{
+    const char *slash = strrchr(text, '/');
+    char dir[PATH_MAX];
+    size_t dir_len = 0;
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        dir_len = slash - text + 1;
+        if (dir_len >= PATH_MAX) {
+            return NULL;
+        }
+        memcpy(dir, text, dir_len);
+        dir[dir_len] = '\0';
+    }
+    const char *prefix = text + dir_len;
+    size_t prefix_len = strlen(prefix);
+
+    /* listing_get() may join the worker, which takes lock itself, so it is
+     * called without holding it. */
+    struct dir_listing *listing = listing_get(dir);
+    if (listing == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (listing_wait(listing) == false) {
+        pthread_mutex_unlock(&lock);
+        complete_cancel();
+        return NULL;
+    }
+
+    found_free();
+    size_t cap = 0;
+    for (size_t i = 0; i < listing->count; i++) {
+        const char *name = listing->names + listing->offsets[i];
+        if (strncmp(name, prefix, prefix_len) != 0 || (name[0] == '.' && prefix[0] != '.')) {
+            continue;
+        }
+        if (found_len == cap) {
+            cap = (cap == 0) ? 16 : cap * 2;
+            char **tmp = mem_realloc(MEM_COMPLETION, found, cap * sizeof(char *));
+            if (tmp == NULL) {
+                perror("realloc");
+                break;
+            }
+            found = tmp;
+        }
+        char *match = mem_malloc(MEM_COMPLETION, dir_len + strlen(name) + 1);
+        if (match == NULL) {
+            perror("malloc");
+            break;
+        }
+        memcpy(match, text, dir_len);
+        strcpy(match + dir_len, name);
+        found[found_len++] = match;
+    }
+    bool complete = listing->complete;
+    pthread_mutex_unlock(&lock);
+
+    *le.filename_completion_desired = 1;
+    if (complete == false) {
+        if (found_len > 0) {
+            show_partial();
+        }
+        found_free();
+        return NULL;
+    }
+    char **matches = le.completion_matches(text, complete_generator);
+    found_free();
+    return matches;
+}
+
+/**
+ * Stops the worker thread and frees every cached listing
+ */
+void complete_destroy(void)
+{
+    complete_cancel();
+    found_free();
+    for (int i = 0; i < COMPLETE_CACHE_SLOTS; i++) {
+        listing_free(&cache[i]);
+    }
+}
@@ -0,0 +1,14 @@
+/**
+ * @file
+ *
+ * Contains function headers for asynchronous filename completion.
+ */
+
+#ifndef _COMPLETE_H_
+#define _COMPLETE_H_
+
+char **complete_path(const char *text);
+void complete_cancel(void);
+void complete_destroy(void);
+
+#endif
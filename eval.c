@@ -0,0 +1,915 @@
+/**
+ * @file
+ *
+ * Contains the evaluator for parsed commands. Simple commands go through the
+ * builtin dispatch or are forked and exec'd; compound commands are run from
+ * their parsed form, so loop bodies are never re-read or re-tokenized.
+ */
+
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "alias.h"
+#include "batch.h"
+#include "eval.h"
+#include "frecency.h"
+#include "func.h"
+#include "guard.h"
+#include "heredoc.h"
+#include "history.h"
+#include "latency.h"
+#include "logger.h"
+#include "memo.h"
+#include "memstat.h"
+#include "parser.h"
+#include "pipesize.h"
+#include "place.h"
+#include "procsub.h"
+#include "pstat.h"
+#include "read.h"
+#include "ui.h"
+#include "util.h"
+#include "vars.h"
+#include "watch.h"
+#include "wildcard.h"
+
+static bool exit_requested = false;
+static int exit_status = 0;
+static int loop_depth = 0;
+static int breaking = 0;
+static bool continuing = false;
+static bool exec_in_place = false;
+static int func_depth = 0;
+static bool returning = false;
+
+/* Deepest nesting of function calls, to stop runaway recursion */
+#define FUNC_MAX_DEPTH 1000
+
+/**
+ * Handler of a builtin, returning its exit status
+ */
+typedef int (*builtin_fn)(char *args[]);
+
+/**
+ * Checks if the "exit" builtin has run
+ *
+ * @return true if the shell should exit
+ */
+bool eval_exit_requested(void)
+{
+    return exit_requested;
+}
+
+/**
+ * Retrieves the status passed to the "exit" builtin
+ *
+ * @return the status the shell should exit with
+ */
+int eval_exit_status(void)
+{
+    return exit_status;
+}
+
+/**
+ * Converts a status from waitpid into a shell exit status
+ * @param status the status reported by waitpid
+ *
+ * @return the exit code, or 128 plus the signal number if the child was killed
+ */
+static int wait_status_code(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/**
+ * Copies a node's tokens into an array the command may modify. The array has
+ * room for at least ARGS_INIT_SZ entries so that history expansion can
+ * replace its contents.
+ * @param cmd the command node
+ *
+ * @return newly-allocated NULL-terminated array or NULL on failure
+ */
+static char **copy_args(struct node *cmd)
+{
+    int size = (cmd->tokens + 1 > ARGS_INIT_SZ) ? cmd->tokens + 1 : ARGS_INIT_SZ;
+    char **args = mem_malloc(MEM_PARSER, size * sizeof(char *));
+    if (args == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(args, cmd->args, (cmd->tokens + 1) * sizeof(char *));
+    return args;
+}
+
+/**
+ * Handles the loop control builtins "break" and "continue"
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 outside of a loop
+ */
+static int loop_control(char *args[])
+{
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", args[0]);
+        return 1;
+    }
+    if (strcmp(args[0], "continue") == 0) {
+        continuing = true;
+        breaking = 0;
+        return 0;
+    }
+    int levels = (args[1] != NULL) ? atoi(args[1]) : 1;
+    if (levels < 1) {
+        levels = 1;
+    }
+    breaking = (levels < loop_depth) ? levels : loop_depth;
+    return 0;
+}
+
+/**
+ * Handles the "return" builtin, which ends the function being run
+ * @param args command arguments
+ *
+ * @return the status given, or the status of the last command
+ */
+static int return_builtin(char *args[])
+{
+    if (func_depth == 0) {
+        fprintf(stderr, "return: only meaningful in a function\n");
+        return 1;
+    }
+    returning = true;
+    return (args[1] != NULL) ? atoi(args[1]) : vars_get_status();
+}
+
+/**
+ * Handles the "exit" builtin, which ends the shell once the current command
+ * list returns
+ * @param args command arguments
+ *
+ * @return 0
+ */
+static int exit_builtin(char *args[])
+{
+    exit_requested = true;
+    exit_status = (args[1] != NULL) ? atoi(args[1]) : vars_get_status();
+    return 0;
+}
+
+/**
+ * Handles the "history" builtin
+ * @param args command arguments
+ *
+ * @return 0
+ */
+static int history_builtin(char *args[])
+{
+    history_handler(args);
+    return 0;
+}
+
+/**
+ * Handles the "pipesize" builtin
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+static int pipesize_builtin(char *args[])
+{
+    return pipesize_handler(args);
+}
+
+/**
+ * Handles the "jobs" builtin, which lists the background jobs
+ * @param args command arguments
+ *
+ * @return 0
+ */
+static int jobs_builtin(char *args[])
+{
+    jobs_reap();
+    for (int i = get_job_num(); i >= 0; i--) {
+        if (get_jobs_list()[i].command != NULL) {
+            printf("%s\n", get_jobs_list()[i].command);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Handles the "true" and ":" builtins
+ * @param args command arguments
+ *
+ * @return 0
+ */
+static int true_builtin(char *args[])
+{
+    return 0;
+}
+
+/**
+ * Handles the "false" builtin
+ * @param args command arguments
+ *
+ * @return 1
+ */
+static int false_builtin(char *args[])
+{
+    return 1;
+}
+
+/**
+ * Handles the "unset" builtin: "unset -f NAME..." removes functions and
+ * "unset NAME..." removes variables
+ * @param args command arguments
+ *
+ * @return the status of the handler that ran
+ */
+static int unset_builtin(char *args[])
+{
+    if (args[1] != NULL && strcmp(args[1], "-f") == 0) {
+        return func_unset_handler(args);
+    }
+    return unset_handler(args);
+}
+
+/**
+ * Finds the builtin with a given name
+ * @param name the command name
+ *
+ * @return the builtin's handler, or NULL if name is not a builtin
+ */
+static builtin_fn find_builtin(const char *name)
+{
+    if (strcmp(name, "exit") == 0) {
+        return exit_builtin;
+    } else if (strcmp(name, "history") == 0) {
+        return history_builtin;
+    } else if (strcmp(name, "cd") == 0 || strcmp(name, "z") == 0) {
+        return cd_handler;
+    } else if (strcmp(name, "pipesize") == 0) {
+        return pipesize_builtin;
+    } else if (strcmp(name, "place") == 0) {
+        return place_handler;
+    } else if (strcmp(name, "pstat") == 0) {
+        return pstat_handler;
+    } else if (strcmp(name, "jobs") == 0) {
+        return jobs_builtin;
+    } else if (strcmp(name, "true") == 0 || strcmp(name, ":") == 0) {
+        return true_builtin;
+    } else if (strcmp(name, "false") == 0) {
+        return false_builtin;
+    } else if (strcmp(name, "test") == 0 || strcmp(name, "[") == 0) {
+        return test_handler;
+    } else if (strcmp(name, "export") == 0) {
+        return export_handler;
+    } else if (strcmp(name, "timeout") == 0) {
+        return timeout_handler;
+    } else if (strcmp(name, "limit") == 0) {
+        return limit_handler;
+    } else if (strcmp(name, "batch") == 0) {
+        return batch_handler;
+    } else if (strcmp(name, "memo") == 0) {
+        return memo_handler;
+    } else if (strcmp(name, "stats") == 0) {
+        return stats_handler;
+    } else if (strcmp(name, "unset") == 0) {
+        return unset_builtin;
+    } else if (strcmp(name, "break") == 0 || strcmp(name, "continue") == 0) {
+        return loop_control;
+    } else if (strcmp(name, "return") == 0) {
+        return return_builtin;
+    } else if (strcmp(name, "shift") == 0) {
+        return shift_handler;
+    } else if (strcmp(name, "alias") == 0) {
+        return alias_handler;
+    } else if (strcmp(name, "unalias") == 0) {
+        return unalias_handler;
+    } else if (strcmp(name, "functions") == 0) {
+        return functions_handler;
+    } else if (strcmp(name, "read") == 0) {
+        return read_handler;
+    } else if (strcmp(name, "watch") == 0) {
+        return watch_handler;
+    } else if (strcmp(name, "latency") == 0) {
+        return latency_handler;
+    }
+    return NULL;
+}
+
+/**
+ * Checks if any argument is a redirection operator
+ * @param args command arguments
+ *
+ * @return true if the command redirects a file descriptor
+ */
+static bool has_redirection(char *args[])
+{
+    for (int i = 1; args[i] != NULL; i++) {
+        if (is_redirection(args[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Runs the builtin named by args[0], if there is one. Its redirections are
+ * applied to the shell for as long as it runs, and removed from its
+ * arguments.
+ * @param args command arguments after expansion
+ * @param status receives the exit status of the builtin
+ *
+ * @return true if args named a builtin
+ */
+static bool run_builtin(char *args[], int *status)
+{
+    builtin_fn builtin = find_builtin(args[0]);
+    if (builtin == NULL) {
+        return false;
+    }
+    struct redir_save save;
+    bool redirected = has_redirection(args);
+    if (redirected && redirect_push(args, &save) == -1) {
+        *status = 1;
+        return true;
+    }
+    *status = builtin(args);
+    if (redirected) {
+        redirect_pop(&save);
+    }
+    return true;
+}
+
+/**
+ * Runs a shell function in the current process, with the arguments after the
+ * name as its positional parameters. Loop control and "return" inside the
+ * function do not reach past it.
+ * @param args command arguments, starting with the function name
+ *
+ * @return the exit status of the function
+ */
+int eval_function(char *args[])
+{
+    if (func_depth == FUNC_MAX_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", args[0]);
+        return 1;
+    }
+    struct function *fn = func_acquire(args[0]);
+    if (fn == NULL) {
+        return 127;
+    }
+    int count = 0;
+    while (args[count] != NULL) {
+        count++;
+    }
+    char **params = calloc(count, sizeof(char *));
+    if (params == NULL) {
+        perror("calloc");
+        func_release(fn);
+        return 1;
+    }
+    for (int i = 1; i < count; i++) {
+        if ((params[i - 1] = strdup(args[i])) == NULL) {
+            perror("strdup");
+            break;
+        }
+    }
+
+    char **saved_params = vars_swap_params(params);
+    int saved_loops = loop_depth;
+    loop_depth = 0;
+    func_depth++;
+    int status = eval_list(fn->body);
+    func_depth--;
+    loop_depth = saved_loops;
+    returning = false;
+    vars_swap_params(saved_params);
+
+    for (int i = 0; params[i] != NULL; i++) {
+        free(params[i]);
+    }
+    free(params);
+    func_release(fn);
+    return status;
+}
+
+/**
+ * Checks if the last command of "mash -c" may replace the shell. It may not
+ * when the shell still has work to do while or after it runs: enforcing a
+ * timeout, storing memo output, reporting pstat's per-stage summary,
+ * writing directory visits to the frecency database, or writing the latency
+ * histograms at exit.
+ * Features with work of that kind add their check here.
+ * @param cmd the command node
+ *
+ * @return true if the command can be exec'd without forking
+ */
+static bool may_exec_in_place(const struct node *cmd)
+{
+    return exec_in_place && cmd->background == false && guard_has_timeout() == false
+        && memo_capturing() == false && pstat_enabled() == false
+        && frecency_pending() == false && latency_dump_pending() == false;
+}
+
+/**
+ * Runs a simple command: history expansion, variable and wildcard expansion,
+ * then either a builtin in this process or a forked child
+ * @param cmd the command node
+ *
+ * @return the exit status of the command
+ */
+int execute_command(struct node *cmd)
+{
+    char **args = copy_args(cmd);
+    if (args == NULL) {
+        return 1;
+    }
+    int tokens = cmd->tokens;
+    bool pipes = cmd->pipes;
+    int status = 0;
+
+    if (args[0] == (char *) 0) {
+        mem_free(MEM_PARSER, args);
+        return 0;
+    }
+
+    if (strcmp(args[0], "!!") == 0 || args[0][0] == '!') {
+        if (strcmp(args[0], "!!") == 0) {
+            double_bang_handler(args);
+        } else {
+            bang_handler(args, cmd->text);
+        }
+        pipes = false;
+        for (tokens = 0; args[tokens] != (char *) 0; tokens++) {
+            if (args[tokens][0] == '|') {
+                pipes = true;
+            }
+        }
+    }
+
+    char **split = vars_split_params(args);
+    if (split != args) {
+        mem_free(MEM_PARSER, args);
+        args = split;
+        mem_adopt(MEM_PARSER, args);
+        for (tokens = 0; args[tokens] != (char *) 0; tokens++);
+        if (tokens == 0) {
+            goto done;
+        }
+    }
+    if (vars_expand(args) == -1) {
+        status = 1;
+        goto done;
+    }
+    char **expanded = wildcard_expand(args);
+    if (expanded != args) {
+        mem_free(MEM_PARSER, args);
+        args = expanded;
+        mem_adopt(MEM_PARSER, args);
+        for (tokens = 0; args[tokens] != (char *) 0; tokens++);
+    }
+
+    int assignments = 0;
+    while (assignments < tokens && var_assignment(args[assignments])) {
+        assignments++;
+    }
+    if (assignments > 0 && assignments == tokens) {
+        for (int i = 0; i < tokens; i++) {
+            char *eq = strchr(args[i], '=');
+            *eq = '\0';
+            var_set(args[i], eq + 1);
+            *eq = '=';
+        }
+        goto done;
+    }
+
+    if (cmd->heredocs != NULL && heredoc_open(args, cmd->heredocs) == -1) {
+        status = 1;
+        goto done;
+    }
+    if (cmd->procsubs != NULL && procsub_open(args, cmd->procsubs) == -1) {
+        status = 1;
+        goto done;
+    }
+
+    if (strcmp(args[0], "memo") == 0 && args[1] != NULL && args[1][0] != '-'
+            && is_redirection(args[1]) == false) {
+        /* "memo command..." replays the output of an identical earlier run */
+        memmove(args, args + 1, tokens * sizeof(char *));
+        tokens--;
+        if (cmd->background == false) {
+            int memo = memo_begin(args, &status);
+            if (memo != 0) {
+                status = (memo == -1) ? 1 : status;
+                goto done;
+            }
+            for (tokens = 0; args[tokens] != (char *) 0; tokens++);
+        }
+    }
+
+    int unprefixed = tokens;
+    int guarded;
+    while ((guarded = guard_prefix(args)) != 0 || (guarded = place_prefix(args)) != 0) {
+        /* "timeout ...", "limit ..." and "place ..." in front of a command apply to it only */
+        if (guarded == -1) {
+            status = 1;
+            goto done;
+        }
+        memmove(args, args + guarded, (tokens - guarded + 1) * sizeof(char *));
+        tokens -= guarded;
+    }
+
+    if (strcmp(args[0], "pstat") == 0 && args[1] != NULL && is_redirection(args[1]) == false
+            && (args[2] != NULL || (strcmp(args[1], "on") != 0 && strcmp(args[1], "off") != 0))) {
+        /* "pstat pipeline..." meters this pipeline only */
+        if (pstat_override() == -1) {
+            status = 1;
+            goto done;
+        }
+        memmove(args, args + 1, tokens * sizeof(char *));
+        tokens--;
+    }
+
+    if (strcmp(args[0], "pipesize") == 0 && args[1] != NULL && args[2] != NULL
+            && strcmp(args[1], "-d") != 0 && is_redirection(args[1]) == false
+            && is_redirection(args[2]) == false) {
+        /* "pipesize SPEC pipeline..." sizes the pipes of this pipeline only */
+        if (pipesize_override(args[1]) == -1) {
+            status = 1;
+            goto done;
+        }
+        memmove(args, args + 2, (tokens - 1) * sizeof(char *));
+        tokens -= 2;
+    }
+
+    if (run_builtin(args, &status)) {
+        goto done;
+    }
+
+    /* A plain function call runs in this process; one that needs a process of
+     * its own (pipes, "&", redirections, prefixes) runs in the forked child */
+    if (func_defined(args[0]) && pipes == false && cmd->background == false
+            && tokens == unprefixed && cmd->heredocs == NULL && cmd->procsubs == NULL
+            && has_redirection(args) == false) {
+        status = eval_function(args);
+        goto done;
+    }
+
+    struct command_line *cmds = NULL;
+    if ((cmds = build_pipes(args, pipes)) == NULL) {
+        status = 1;
+        goto done;
+    }
+
+    place_begin(cmds, cmd->background);
+
+    /* The last command of "mash -c" replaces the shell instead of forking */
+    pid_t child = 0;
+    if (may_exec_in_place(cmd)) {
+        fflush(NULL);
+    } else {
+        latency_fork_begin();
+        child = fork();
+        if (child > 0) {
+            latency_forked();
+        }
+    }
+    if (child == -1) {
+        perror("fork");
+        status = 1;
+    } else if (child == 0) {
+        memo_redirect();
+        if (pipes == true) {
+            execute_pipeline(cmds);
+        } else {
+            place_apply(0, false);
+            exec_command(args);
+        }
+    } else {
+        if (cmd->background) {
+            if (get_job_num() == 10) {
+                set_job_num(0);
+            }
+            char *jobs_cmd = mem_malloc(MEM_JOBS, strlen(cmd->text) + 3);
+            if (jobs_cmd != NULL) {
+                sprintf(jobs_cmd, "%s &", cmd->text);
+            }
+            jobs_reap();
+            mem_free(MEM_JOBS, get_jobs_list()[get_job_num()].command);
+            get_jobs_list()[get_job_num()].done = 0;
+            get_jobs_list()[get_job_num()].command = jobs_cmd;
+            get_jobs_list()[get_job_num()].pid = child;
+            set_job_num(get_job_num()+1);
+        } else {
+            int wstatus;
+            bool timed_out;
+            if (guard_wait(child, &wstatus, &timed_out) == -1) {
+                perror("waitpid");
+                status = 1;
+            } else {
+                latency_reaped(child);
+                status = timed_out ? 124 : wait_status_code(wstatus);
+            }
+            if (pipes && pstat_enabled()) {
+                pstat_report();
+            }
+            memo_finish(status, timed_out == false);
+        }
+    }
+    mem_free(MEM_PARSER, cmds);
+
+done:
+    mem_free(MEM_PARSER, args);
+    wildcard_release();
+    heredoc_release();
+    procsub_release();
+    vars_release();
+    pipesize_clear_override();
+    pstat_clear_override();
+    guard_clear_override();
+    place_clear_override();
+    memo_cancel();
+    vars_set_status(status);
+    return status;
+}
+
+/**
+ * Runs a for loop: the word list is expanded once, then the body runs once
+ * per word with the loop variable set
+ * @param node the for node
+ *
+ * @return the exit status of the last command run
+ */
+static int eval_for(struct node *node)
+{
+    int count = 0;
+    while (node->words[count] != NULL) {
+        count++;
+    }
+    char **words = malloc((count + 1) * sizeof(char *));
+    if (words == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(words, node->words, (count + 1) * sizeof(char *));
+    char **split = vars_split_params(words);
+    if (split != words) {
+        free(words);
+        words = split;
+    }
+    vars_expand(words);
+    char **expanded = wildcard_expand(words);
+
+    char **items = NULL;
+    for (count = 0; expanded[count] != NULL; count++);
+    if ((items = calloc(count + 1, sizeof(char *))) != NULL) {
+        for (int i = 0; i < count; i++) {
+            items[i] = strdup(expanded[i]);
+        }
+    }
+    if (expanded != words) {
+        free(expanded);
+    }
+    free(words);
+    wildcard_release();
+    vars_release();
+    if (items == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    int status = 0;
+    loop_depth++;
+    for (int i = 0; i < count && exit_requested == false && returning == false; i++) {
+        var_set(node->var, (items[i] != NULL) ? items[i] : "");
+        status = eval_list(node->body);
+        continuing = false;
+        if (breaking > 0) {
+            breaking--;
+            break;
+        }
+    }
+    loop_depth--;
+
+    for (int i = 0; i < count; i++) {
+        free(items[i]);
+    }
+    free(items);
+    return status;
+}
+
+/**
+ * Runs a while or until loop
+ * @param node the loop node
+ *
+ * @return the exit status of the last body command run
+ */
+static int eval_while(struct node *node)
+{
+    int status = 0;
+    loop_depth++;
+    while (exit_requested == false && returning == false) {
+        int cond = eval_list(node->cond);
+        if (breaking > 0) {
+            breaking--;
+            break;
+        }
+        if (returning) {
+            status = cond;
+            break;
+        }
+        if ((cond == 0) != (node->type == NODE_WHILE)) {
+            break;
+        }
+        status = eval_list(node->body);
+        continuing = false;
+        if (breaking > 0) {
+            breaking--;
+            break;
+        }
+    }
+    loop_depth--;
+    return status;
+}
+
+/**
+ * Runs a case command: the first arm with a pattern matching the word runs
+ * @param node the case node
+ *
+ * @return the exit status of the arm that ran, or 0 if none matched
+ */
+static int eval_case(struct node *node)
+{
+    char *word_args[] = { node->word, NULL };
+    vars_expand(word_args);
+    char *word = strdup(word_args[0]);
+    vars_release();
+    if (word == NULL) {
+        perror("strdup");
+        return 1;
+    }
+
+    struct case_item *match = NULL;
+    for (struct case_item *item = node->items; item != NULL && match == NULL; item = item->next) {
+        for (int i = 0; item->patterns[i] != NULL; i++) {
+            char *pattern_args[] = { item->patterns[i], NULL };
+            vars_expand(pattern_args);
+            bool matched = fnmatch(pattern_args[0], word, 0) == 0;
+            vars_release();
+            if (matched) {
+                match = item;
+                break;
+            }
+        }
+    }
+    free(word);
+    return (match != NULL) ? eval_list(match->body) : 0;
+}
+
+/**
+ * Runs a compound command or function definition
+ * @param node the node to run
+ *
+ * @return the exit status of the node
+ */
+static int eval_compound(struct node *node)
+{
+    int status = 0;
+    switch (node->type) {
+        case NODE_COMMAND:
+            break;
+        case NODE_IF:
+            if (eval_list(node->cond) == 0) {
+                status = eval_list(node->body);
+            } else if (node->else_body != NULL) {
+                status = eval_list(node->else_body);
+            }
+            break;
+        case NODE_WHILE:
+        case NODE_UNTIL:
+            status = eval_while(node);
+            break;
+        case NODE_FOR:
+            status = eval_for(node);
+            break;
+        case NODE_CASE:
+            status = eval_case(node);
+            break;
+        case NODE_FUNCTION:
+            status = (func_define(node->var, node->body) == 0) ? 0 : 1;
+            break;
+    }
+    return status;
+}
+
+/**
+ * Runs a compound command with its redirections applied to the shell for as
+ * long as it runs, so builtins inside it (such as "read" in "while read
+ * line; do ...; done < file") see them too
+ * @param node the compound command
+ *
+ * @return the exit status of the command, or 1 if a redirection failed
+ */
+static int eval_redirected(struct node *node)
+{
+    char **args = malloc((node->tokens + 1) * sizeof(char *));
+    if (args == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(args, node->args, (node->tokens + 1) * sizeof(char *));
+
+    /* The files are open once the redirections are applied, so the expanded
+     * names can go before the body reuses the expansion pools */
+    struct redir_save save;
+    bool redirected = vars_expand(args) == 0
+        && (node->heredocs == NULL || heredoc_open(args, node->heredocs) == 0)
+        && redirect_push(args, &save) == 0;
+    heredoc_release();
+    vars_release();
+    free(args);
+    if (redirected == false) {
+        return 1;
+    }
+    int status = eval_compound(node);
+    redirect_pop(&save);
+    return status;
+}
+
+/**
+ * Runs a single syntax tree node
+ * @param node the node to run
+ *
+ * @return the exit status of the node
+ */
+int eval_node(struct node *node)
+{
+    if (node->type == NODE_COMMAND) {
+        return execute_command(node);
+    }
+    int status = (node->args != NULL) ? eval_redirected(node) : eval_compound(node);
+    vars_set_status(status);
+    return status;
+}
+
+/**
+ * Runs a list of nodes in order, skipping nodes cut short by "&&" or "||" and
+ * stopping early for exit, break, or continue
+ * @param list the first node of the list
+ * @param exec_last true to exec the last node in place if it is a simple
+ * command
+ *
+ * @return the exit status of the last node run
+ */
+static int run_list(struct node *list, bool exec_last)
+{
+    int status = vars_get_status();
+    bool skip = false;
+    for (struct node *node = list; node != NULL && returning == false; node = node->next) {
+        if (skip == false) {
+            exec_in_place = exec_last && node->next == NULL && node->type == NODE_COMMAND;
+            status = eval_node(node);
+            exec_in_place = false;
+            if (exit_requested || breaking > 0 || continuing || returning) {
+                break;
+            }
+        }
+        skip = (node->op == LIST_AND && status != 0) || (node->op == LIST_OR && status == 0);
+    }
+    return status;
+}
+
+/**
+ * Runs a list of nodes in order
+ * @param list the first node of the list
+ *
+ * @return the exit status of the last node run
+ */
+int eval_list(struct node *list)
+{
+    return run_list(list, false);
+}
+
+/**
+ * Runs a list of nodes as the last thing the shell does. If the final node is
+ * an external command it replaces the shell rather than running in a child,
+ * so this only returns if it is not.
+ * @param list the first node of the list
+ *
+ * @return the exit status of the last node run
+ */
+int eval_final(struct node *list)
+{
+    return run_list(list, true);
+}
@@ -0,0 +1,22 @@
+/**
+ * @file
+ *
+ * Contains function headers for running parsed commands.
+ */
+
+#ifndef _EVAL_H_
+#define _EVAL_H_
+
+#include <stdbool.h>
+
+#include "parser.h"
+
+int eval_list(struct node *list);
+int eval_final(struct node *list);
+int eval_node(struct node *node);
+int execute_command(struct node *cmd);
+int eval_function(char *args[]);
+bool eval_exit_requested(void);
+int eval_exit_status(void);
+
+#endif
@@ -0,0 +1,349 @@
+/**
+ * @file
+ *
+ * Contains the fan-out copy behind the tee builtin and commands with several
+ * output redirections ("cmd > a > b"). When the input is a pipe the data
+ * never passes through user space: tee(2) duplicates it into a scratch pipe
+ * that is spliced into each output in turn, and the original is finally
+ * spliced into the last output, which consumes it. Outputs that cannot be
+ * spliced into (terminals, for instance) and inputs that are not pipes fall
+ * back to a buffered copy.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fanout.h"
+#include "logger.h"
+
+/* Most bytes moved per round when the input is a pipe */
+#define FANOUT_CHUNK (1 << 20)
+
+/* Buffer size of the fallback copy */
+#define FANOUT_BUF 65536
+
+/**
+ * Writes a whole buffer, resuming after short writes
+ * @param fd where to write
+ * @param buf the data
+ * @param len the number of bytes
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Moves exactly len bytes from a pipe to an output, with splice where the
+ * output allows it and read/write otherwise
+ * @param pipe_fd the pipe to take the data from
+ * @param out the output
+ * @param len the number of bytes, all of which are already in the pipe
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int drain(int pipe_fd, int out, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = splice(pipe_fd, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINVAL) {
+            char buf[FANOUT_BUF];
+            n = read(pipe_fd, buf, (len < sizeof(buf)) ? len : sizeof(buf));
+            if (n > 0 && write_all(out, buf, n) == -1) {
+                n = -1;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Copies a pipe to several outputs inside the kernel
+ * @param in the pipe
+ * @param outs the outputs
+ * @param count the number of outputs
+ *
+ * @return 0 on success, -1 on failure, or -2 if the only output does not
+ * accept splice and nothing was copied yet
+ */
+static int copy_pipe(int in, const int *outs, int count)
+{
+    int scratch[2] = { -1, -1 };
+    if (count > 1) {
+        if (pipe2(scratch, O_CLOEXEC) == -1) {
+            perror("pipe");
+            return -1;
+        }
+        /* Every tee must fit in the scratch pipe, or the copies would differ */
+        int size = fcntl(in, F_GETPIPE_SZ);
+        if (size > 0) {
+            fcntl(scratch[1], F_SETPIPE_SZ, size);
+        }
+    }
+    size_t chunk = FANOUT_CHUNK;
+    if (count > 1) {
+        int size = fcntl(scratch[1], F_GETPIPE_SZ);
+        chunk = (size > 0 && (size_t) size < chunk) ? (size_t) size : chunk;
+    }
+
+    int result = 0;
+    while (result == 0) {
+        ssize_t n;
+        if (count > 1) {
+            n = tee(in, scratch[1], chunk, 0);
+        } else {
+            n = splice(in, NULL, outs[0], NULL, chunk, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINVAL) {
+                /* The output refuses splice; copy through a buffer instead */
+                return -2;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("tee");
+                result = -1;
+            }
+            break;
+        }
+        if (count == 1) {
+            continue;
+        }
+        for (int i = 0; i < count - 1 && result == 0; i++) {
+            ssize_t copied = n;
+            if (i > 0) {
+                while ((copied = tee(in, scratch[1], n, 0)) == -1 && errno == EINTR);
+            }
+            if (copied != n || drain(scratch[0], outs[i], n) == -1) {
+                perror("tee");
+                result = -1;
+            }
+        }
+        if (result == 0 && drain(in, outs[count - 1], n) == -1) {
+            perror("tee");
+            result = -1;
+        }
+    }
+    if (count > 1) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    return result;
+}
+
+/**
+ * Copies an input to several outputs through a buffer
+ * @param in the input
+ * @param outs the outputs
+ * @param count the number of outputs
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int copy_buffered(int in, const int *outs, int count)
+{
+    char buf[FANOUT_BUF];
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("read");
+                return -1;
+            }
+            return 0;
+        }
+        for (int i = 0; i < count; i++) {
+            if (write_all(outs[i], buf, n) == -1) {
+                perror("write");
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * Copies an input to several outputs until the end of the input
+ * @param in the input
+ * @param outs the outputs
+ * @param count the number of outputs
+ *
+ * @return 0 on success or -1 on failure
+ */
+int fanout_copy(int in, const int *outs, int count)
+{
+    struct stat st;
+    if (fstat(in, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        int result = copy_pipe(in, outs, count);
+        if (result != -2) {
+            return result;
+        }
+    }
+    LOGP("Input is not a pipe; copying through a buffer\n");
+    return copy_buffered(in, outs, count);
+}
+
+/**
+ * Sends a descriptor's output to several files. The calling process forks:
+ * the child returns the write end of a new pipe to put on the descriptor and
+ * goes on to run the command, while the parent stays behind copying the pipe
+ * to the files, then exits with the command's status. Called in the child
+ * the shell forked for a command, so the shell's wait covers both.
+ * @param outs the open files
+ * @param count the number of files
+ *
+ * @return the pipe's write end (in the child), or -1 on failure
+ */
+int fanout_redirect(const int *outs, int count)
+{
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(fd[0]);
+        for (int i = 0; i < count; i++) {
+            close(outs[i]);
+        }
+        return fd[1];
+    }
+
+    close(fd[1]);
+    /* The command decides how to react to closed outputs, not the copier */
+    signal(SIGPIPE, SIG_IGN);
+    fanout_copy(fd[0], outs, count);
+    close(fd[0]);
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    _exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+}
+
+/**
+ * Sends a descriptor's output to several files from the shell itself, for
+ * builtins and compound commands. Unlike fanout_redirect() the shell stays
+ * the caller: a new child copies the pipe to the files and exits once every
+ * write end is closed, and the shell waits for it when the redirection is
+ * taken down.
+ * @param outs the open files, closed in the shell
+ * @param count the number of files
+ * @param copier receives the process ID of the copying child
+ *
+ * @return the pipe's write end, or -1 on failure
+ */
+int fanout_spawn(const int *outs, int count, pid_t *copier)
+{
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    } else if (pid == 0) {
+        close(fd[1]);
+        /* ^C stops the writer; the copier still passes on what it wrote */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        int result = fanout_copy(fd[0], outs, count);
+        _exit((result == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fd[0]);
+    for (int i = 0; i < count; i++) {
+        close(outs[i]);
+    }
+    *copier = pid;
+    return fd[1];
+}
+
+/**
+ * Runs the builtin tee: "tee [-a] [FILE...]" copies stdin to stdout and to
+ * every FILE, appending with -a. Called in the child that would otherwise
+ * exec tee.
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 if a file could not be opened or written
+ */
+int tee_main(char *args[])
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        i++;
+    }
+    int count = 1;
+    for (int j = i; args[j] != NULL; j++) {
+        count++;
+    }
+    int *outs = malloc(count * sizeof(int));
+    if (outs == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int status = 0;
+    int opened = 0;
+    outs[opened++] = STDOUT_FILENO;
+    for (; args[i] != NULL; i++) {
+        int fd = open(args[i], flags, 0666);
+        if (fd == -1) {
+            perror(args[i]);
+            status = 1;
+            continue;
+        }
+        outs[opened++] = fd;
+    }
+    if (fanout_copy(STDIN_FILENO, outs, opened) == -1) {
+        status = 1;
+    }
+    for (int j = 1; j < opened; j++) {
+        close(outs[j]);
+    }
+    free(outs);
+    return status;
+}
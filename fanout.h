@@ -0,0 +1,18 @@
+/**
+ * @file
+ *
+ * Contains function headers for copying one stream to several outputs: the
+ * builtin tee and commands with more than one output redirection.
+ */
+
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <sys/types.h>
+
+int fanout_copy(int in, const int *outs, int count);
+int fanout_redirect(const int *outs, int count);
+int fanout_spawn(const int *outs, int count, pid_t *copier);
+int tee_main(char *args[]);
+
+#endif
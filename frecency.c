@@ -0,0 +1,710 @@
+/**
+ * @file
+ *
+ * Contains the frecency database behind "z" and "cd -j". Every directory cd
+ * visits gains rank, and a directory's score is its rank weighted by how
+ * recently it was visited. The database is a file mapped and copied into
+ * memory the first time it is needed. Visits are applied in memory right
+ * away but written out in batches: the file is re-read under a lock, the
+ * pending visits are merged in (so concurrent shells do not lose each
+ * other's visits), ranks are aged once their total grows too large, and the
+ * result is renamed into place.
+ *
+ * Lookups walk an index kept sorted by rank. Since recency can at most
+ * multiply a rank by FRECENCY_MAX_WEIGHT, the walk stops as soon as no
+ * remaining entry could beat the best match, which keeps lookups short even
+ * with tens of thousands of directories.
+ *
+ * File layout: header, records, then the path strings.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frecency.h"
+#include "logger.h"
+#include "memstat.h"
+#include "util.h"
+
+/* Identifies a database file and its format version */
+#define FRECENCY_MAGIC "MASHFR\x01"
+
+/* Number of visits collected before they are written out */
+#define FRECENCY_BATCH 16
+
+/* Total rank above which every rank is aged */
+#define FRECENCY_MAX_TOTAL 50000.0
+
+/* Factor applied to every rank when aging; entries that fall below 1 go */
+#define FRECENCY_AGING 0.9
+
+/* Largest recency weight, given to directories visited within the hour */
+#define FRECENCY_MAX_WEIGHT 4.0
+
+/* Most patterns a lookup uses; any further patterns are ignored */
+#define FRECENCY_MAX_PATTERNS 8
+
+/**
+ * Header at the start of the database file
+ */
+struct frecency_header
+{
+    char magic[8];
+    uint32_t count;
+    uint32_t strings_len;
+};
+
+/**
+ * Describes one directory in the database file
+ */
+struct frecency_record
+{
+    double rank;
+    int64_t last;
+    uint32_t path;
+    uint32_t path_len;
+};
+
+/**
+ * Stores one directory in memory. lower is a lowercase copy of the path
+ * (sharing its allocation) for matching, tail the offset of its final
+ * component, and pos its place in the rank index.
+ */
+struct frecency_entry
+{
+    char *path;
+    char *lower;
+    size_t tail;
+    double rank;
+    time_t last;
+    int pos;
+};
+
+/**
+ * Stores the lowercased patterns of a lookup
+ */
+struct frecency_patterns
+{
+    int count;
+    const char *text[FRECENCY_MAX_PATTERNS];
+    size_t len[FRECENCY_MAX_PATTERNS];
+    char buf[PATH_MAX];
+};
+
+/**
+ * Stores a visit that has not been written to the database file yet
+ */
+struct frecency_visit
+{
+    char *path;
+    int hits;
+    time_t last;
+};
+
+static char db_path[PATH_MAX];
+static bool loaded = false;
+
+static struct frecency_entry *entries = NULL;
+static int entry_count = 0;
+static int entry_cap = 0;
+
+/* Entry indices sorted by rank, highest first */
+static int *order = NULL;
+static int order_cap = 0;
+
+/* Open-addressing hash table of entry indices by path; -1 marks a free slot */
+static int *slots = NULL;
+static size_t slot_count = 0;
+
+static struct frecency_visit pending[FRECENCY_BATCH];
+static int pending_count = 0;
+static int pending_hits = 0;
+
+/**
+ * Computes the 64-bit FNV-1a hash of a path
+ * @param path the path to hash
+ *
+ * @return the hash value
+ */
+static uint64_t path_hash(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Finds the hash table slot of a path
+ * @param path the path to look for
+ *
+ * @return the slot holding the path's entry, or the free slot where it would go
+ */
+static size_t find_slot(const char *path)
+{
+    size_t mask = slot_count - 1;
+    size_t i = path_hash(path) & mask;
+    while (slots[i] != -1 && strcmp(entries[slots[i]].path, path) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * Orders entry indices by rank, highest first
+ * @param a first entry index
+ * @param b second entry index
+ *
+ * @return comparison result for qsort
+ */
+static int rank_cmp(const void *a, const void *b)
+{
+    double x = entries[*(const int *) a].rank;
+    double y = entries[*(const int *) b].rank;
+    return (x < y) - (x > y);
+}
+
+/**
+ * Rebuilds the hash table and the rank index from the entry array
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int rebuild_index(void)
+{
+    size_t want = 64;
+    while (want < (size_t) entry_count * 2) {
+        want *= 2;
+    }
+    int *new_slots = mem_malloc(MEM_DIRS, want * sizeof(int));
+    int cap = (entry_cap > 0) ? entry_cap : 1;
+    int *new_order = mem_malloc(MEM_DIRS, cap * sizeof(int));
+    if (new_slots == NULL || new_order == NULL) {
+        perror("malloc");
+        mem_free(MEM_DIRS, new_slots);
+        mem_free(MEM_DIRS, new_order);
+        return -1;
+    }
+    mem_free(MEM_DIRS, slots);
+    mem_free(MEM_DIRS, order);
+    slots = new_slots;
+    order = new_order;
+    order_cap = cap;
+    slot_count = want;
+    memset(slots, -1, slot_count * sizeof(int));
+
+    for (int i = 0; i < entry_count; i++) {
+        slots[find_slot(entries[i].path)] = i;
+        order[i] = i;
+    }
+    qsort(order, entry_count, sizeof(int), rank_cmp);
+    for (int i = 0; i < entry_count; i++) {
+        entries[order[i]].pos = i;
+    }
+    return 0;
+}
+
+/**
+ * Moves an entry to its place in the rank index after its rank changed
+ * @param idx the entry
+ */
+static void reposition(int idx)
+{
+    int pos = entries[idx].pos;
+    while (pos > 0 && entries[order[pos - 1]].rank < entries[idx].rank) {
+        order[pos] = order[pos - 1];
+        entries[order[pos]].pos = pos;
+        pos--;
+    }
+    while (pos < entry_count - 1 && entries[order[pos + 1]].rank > entries[idx].rank) {
+        order[pos] = order[pos + 1];
+        entries[order[pos]].pos = pos;
+        pos++;
+    }
+    order[pos] = idx;
+    entries[idx].pos = pos;
+}
+
+/**
+ * Frees every in-memory entry
+ */
+static void clear_entries(void)
+{
+    for (int i = 0; i < entry_count; i++) {
+        mem_free(MEM_DIRS, entries[i].path);
+    }
+    entry_count = 0;
+}
+
+/**
+ * Appends an entry without updating the indexes
+ * @param path the directory
+ * @param rank its rank
+ * @param last when it was last visited
+ *
+ * @return index of the new entry or -1 on failure
+ */
+static int append_entry(const char *path, double rank, time_t last)
+{
+    if (entry_count == entry_cap) {
+        int cap = (entry_cap == 0) ? 256 : entry_cap * 2;
+        struct frecency_entry *tmp = mem_realloc(MEM_DIRS, entries, cap * sizeof(struct frecency_entry));
+        if (tmp == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        entries = tmp;
+        entry_cap = cap;
+    }
+    size_t len = strlen(path);
+    char *copy = mem_malloc(MEM_DIRS, 2 * (len + 1));
+    if (copy == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(copy, path, len + 1);
+    char *lower = copy + len + 1;
+    for (size_t i = 0; i <= len; i++) {
+        lower[i] = tolower((unsigned char) path[i]);
+    }
+    const char *slash = strrchr(path, '/');
+    size_t tail = (slash != NULL) ? (size_t) (slash - path) + 1 : 0;
+    entries[entry_count] = (struct frecency_entry) { copy, lower, tail, rank, last, entry_count };
+    return entry_count++;
+}
+
+/**
+ * Replaces the in-memory entries with the contents of the database file
+ */
+static void read_file(void)
+{
+    clear_entries();
+    int fd = open(db_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct frecency_header)) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+
+    const struct frecency_header *header = (const struct frecency_header *) map;
+    const struct frecency_record *records = (const struct frecency_record *) (header + 1);
+    const char *strings = (const char *) (records + header->count);
+    size_t records_end = sizeof(*header) + (size_t) header->count * sizeof(*records);
+    if (memcmp(header->magic, FRECENCY_MAGIC, sizeof(header->magic)) != 0
+            || records_end + header->strings_len != (size_t) st.st_size) {
+        LOG("Ignoring invalid frecency database '%s'\n", db_path);
+        munmap(map, st.st_size);
+        return;
+    }
+    for (uint32_t i = 0; i < header->count; i++) {
+        const struct frecency_record *r = &records[i];
+        if ((size_t) r->path + r->path_len >= header->strings_len
+                || strings[r->path + r->path_len] != '\0') {
+            continue;
+        }
+        append_entry(strings + r->path, r->rank, r->last);
+    }
+    munmap(map, st.st_size);
+    LOG("Loaded %d directories from '%s'\n", entry_count, db_path);
+}
+
+/**
+ * Loads the database on first use
+ *
+ * @return 0 if the database is usable or -1 otherwise
+ */
+static int ensure_loaded(void)
+{
+    if (loaded) {
+        return 0;
+    }
+    const char *data = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX - 16];
+    if (data != NULL && data[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/mash", data);
+    } else {
+        snprintf(dir, sizeof(dir), "%s/.local/share/mash", (home != NULL) ? home : ".");
+    }
+    if (make_dirs(dir) == -1) {
+        return -1;
+    }
+    snprintf(db_path, PATH_MAX, "%s/dirs", dir);
+    read_file();
+    if (rebuild_index() == -1) {
+        return -1;
+    }
+    loaded = true;
+    return 0;
+}
+
+/**
+ * Adds visits to a directory's entry, creating it if needed
+ * @param path the directory
+ * @param hits the number of visits
+ * @param last when it was last visited
+ */
+static void add_visit(const char *path, int hits, time_t last)
+{
+    size_t slot = find_slot(path);
+    int idx = slots[slot];
+    if (idx == -1) {
+        if ((idx = append_entry(path, 0, last)) == -1) {
+            return;
+        }
+        if ((size_t) entry_count * 2 > slot_count || entry_count > order_cap) {
+            entries[idx].rank = hits;
+            rebuild_index();
+            return;
+        }
+        slots[slot] = idx;
+        order[idx] = idx;
+    }
+    entries[idx].rank += hits;
+    if (last > entries[idx].last) {
+        entries[idx].last = last;
+    }
+    reposition(idx);
+}
+
+/**
+ * Scales every rank down once their total is too large, dropping entries
+ * that fall below 1
+ */
+static void age_entries(void)
+{
+    double total = 0;
+    for (int i = 0; i < entry_count; i++) {
+        total += entries[i].rank;
+    }
+    if (total <= FRECENCY_MAX_TOTAL) {
+        return;
+    }
+    int kept = 0;
+    for (int i = 0; i < entry_count; i++) {
+        entries[i].rank *= FRECENCY_AGING;
+        if (entries[i].rank < 1) {
+            mem_free(MEM_DIRS, entries[i].path);
+        } else {
+            entries[kept++] = entries[i];
+        }
+    }
+    LOG("Aged frecency database: %d of %d directories kept\n", kept, entry_count);
+    entry_count = kept;
+}
+
+/**
+ * Writes the in-memory entries to the database file through a temporary
+ * file, so readers never see a partial database
+ */
+static void write_file(void)
+{
+    uint32_t strings_len = 0;
+    for (int i = 0; i < entry_count; i++) {
+        strings_len += strlen(entries[i].path) + 1;
+    }
+    struct frecency_header header = { FRECENCY_MAGIC, entry_count, strings_len };
+    size_t size = sizeof(header) + entry_count * sizeof(struct frecency_record) + strings_len;
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        perror("malloc");
+        return;
+    }
+    memcpy(buf, &header, sizeof(header));
+    struct frecency_record *records = (struct frecency_record *) (buf + sizeof(header));
+    char *strings = (char *) (records + entry_count);
+    uint32_t off = 0;
+    for (int i = 0; i < entry_count; i++) {
+        /* Written in rank order so the next load sorts almost nothing */
+        struct frecency_entry *e = &entries[order[i]];
+        uint32_t len = strlen(e->path);
+        records[i] = (struct frecency_record) { e->rank, e->last, off, len };
+        memcpy(strings + off, e->path, len + 1);
+        off += len + 1;
+    }
+
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", db_path, getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror(tmp_path);
+        free(buf);
+        return;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, buf + written, size - written);
+        if (n == -1) {
+            perror("write");
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+    free(buf);
+    if (written < size || rename(tmp_path, db_path) == -1) {
+        if (written == size) {
+            perror("rename");
+        }
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Writes the pending visits out: the database file is re-read under a lock,
+ * the visits merged in, the ranks aged, and the result written back
+ */
+static void flush(void)
+{
+    if (pending_count == 0 || loaded == false) {
+        return;
+    }
+    char lock_path[PATH_MAX + 8];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", db_path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd != -1 && flock(lock_fd, LOCK_EX) == -1) {
+        perror("flock");
+    }
+
+    read_file();
+    rebuild_index();
+    for (int i = 0; i < pending_count; i++) {
+        add_visit(pending[i].path, pending[i].hits, pending[i].last);
+        mem_free(MEM_DIRS, pending[i].path);
+    }
+    pending_count = 0;
+    pending_hits = 0;
+    age_entries();
+    rebuild_index();
+    write_file();
+
+    if (lock_fd != -1) {
+        close(lock_fd);
+    }
+}
+
+/**
+ * Records a visit to a directory. The visit counts immediately and is
+ * written to the database with the next batch.
+ * @param path absolute path of the directory
+ */
+void frecency_visit(const char *path)
+{
+    if (ensure_loaded() == -1) {
+        return;
+    }
+    time_t now = time(NULL);
+    add_visit(path, 1, now);
+
+    int i = 0;
+    while (i < pending_count && strcmp(pending[i].path, path) != 0) {
+        i++;
+    }
+    if (i < pending_count) {
+        pending[i].hits++;
+        pending[i].last = now;
+    } else {
+        char *copy = mem_strdup(MEM_DIRS, path);
+        if (copy == NULL) {
+            perror("strdup");
+            return;
+        }
+        pending[pending_count++] = (struct frecency_visit) { copy, 1, now };
+    }
+    if (++pending_hits == FRECENCY_BATCH) {
+        flush();
+    }
+}
+
+/**
+ * Checks if visits are waiting to be written to the database
+ *
+ * @return true if frecency_close() still has visits to write
+ */
+bool frecency_pending(void)
+{
+    return pending_count > 0;
+}
+
+/**
+ * Weights a rank by how recently the directory was visited
+ * @param entry the directory
+ * @param now the current time
+ *
+ * @return the directory's frecency score
+ */
+static double score(const struct frecency_entry *entry, time_t now)
+{
+    time_t age = now - entry->last;
+    if (age < 3600) {
+        return entry->rank * FRECENCY_MAX_WEIGHT;
+    } else if (age < 86400) {
+        return entry->rank * 2;
+    } else if (age < 604800) {
+        return entry->rank / 2;
+    }
+    return entry->rank / 4;
+}
+
+/**
+ * Prepares the patterns of a lookup for matching
+ * @param patterns NULL-terminated patterns
+ * @param set receives the lowercased patterns
+ */
+static void lower_patterns(char *patterns[], struct frecency_patterns *set)
+{
+    size_t used = 0;
+    set->count = 0;
+    for (int i = 0; patterns[i] != NULL && i < FRECENCY_MAX_PATTERNS; i++) {
+        size_t len = strlen(patterns[i]);
+        if (used + len + 1 > sizeof(set->buf)) {
+            break;
+        }
+        for (size_t j = 0; j <= len; j++) {
+            set->buf[used + j] = tolower((unsigned char) patterns[i][j]);
+        }
+        set->text[set->count] = set->buf + used;
+        set->len[set->count++] = len;
+        used += len + 1;
+    }
+}
+
+/**
+ * Checks if a directory contains every pattern, in order and ignoring case.
+ * The last pattern must match within the final path component unless it
+ * contains a slash itself.
+ * @param entry the directory to check
+ * @param set the lowercased patterns
+ *
+ * @return true if the directory matches
+ */
+static bool matches(const struct frecency_entry *entry, const struct frecency_patterns *set)
+{
+    const char *tail = entry->lower + entry->tail;
+    const char *from = entry->lower;
+    for (int i = 0; i < set->count; i++) {
+        if (i == set->count - 1 && from < tail && strchr(set->text[i], '/') == NULL) {
+            from = tail;
+        }
+        const char *found = strstr(from, set->text[i]);
+        if (found == NULL) {
+            return false;
+        }
+        from = found + set->len[i];
+    }
+    return true;
+}
+
+/**
+ * Finds the highest scoring directory matching all patterns
+ * @param patterns NULL-terminated patterns
+ *
+ * @return the directory, valid until the next call into this module, or NULL
+ * if none matched
+ */
+const char *frecency_best(char *patterns[])
+{
+    if (ensure_loaded() == -1) {
+        return NULL;
+    }
+    struct frecency_patterns set;
+    lower_patterns(patterns, &set);
+    time_t now = time(NULL);
+    const struct frecency_entry *best = NULL;
+    double best_score = 0;
+    for (int i = 0; i < entry_count; i++) {
+        const struct frecency_entry *e = &entries[order[i]];
+        if (e->rank * FRECENCY_MAX_WEIGHT <= best_score) {
+            break;
+        }
+        double s = score(e, now);
+        if (s > best_score && matches(e, &set)) {
+            best = e;
+            best_score = s;
+        }
+    }
+    return (best != NULL) ? best->path : NULL;
+}
+
+/**
+ * Removes a directory that no longer exists from the in-memory index, so the
+ * next lookup picks the runner-up. The file drops it when it ages out.
+ * @param path the directory
+ */
+void frecency_forget(const char *path)
+{
+    if (loaded == false) {
+        return;
+    }
+    size_t slot = find_slot(path);
+    if (slots[slot] != -1) {
+        entries[slots[slot]].rank = 0;
+        entries[slots[slot]].last = 0;
+        reposition(slots[slot]);
+    }
+}
+
+/**
+ * Prints the highest scoring directories matching all patterns
+ * @param patterns NULL-terminated patterns, or an empty list for all
+ */
+void frecency_list(char *patterns[])
+{
+    if (ensure_loaded() == -1) {
+        return;
+    }
+    struct frecency_patterns set;
+    lower_patterns(patterns, &set);
+    time_t now = time(NULL);
+    int shown = 0;
+    for (int i = 0; i < entry_count && shown < 20; i++) {
+        const struct frecency_entry *e = &entries[order[i]];
+        if (e->rank > 0 && matches(e, &set)) {
+            printf("%10.1f  %s\n", score(e, now), e->path);
+            shown++;
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * Writes any pending visits and frees the in-memory database
+ */
+void frecency_close(void)
+{
+    flush();
+    clear_entries();
+    mem_free(MEM_DIRS, entries);
+    mem_free(MEM_DIRS, slots);
+    mem_free(MEM_DIRS, order);
+    entries = NULL;
+    slots = NULL;
+    order = NULL;
+    entry_cap = 0;
+    slot_count = 0;
+    loaded = false;
+}
@@ -0,0 +1,19 @@
+/**
+ * @file
+ *
+ * Contains function headers for the frecency database of visited directories.
+ */
+
+#ifndef _FRECENCY_H_
+#define _FRECENCY_H_
+
+#include <stdbool.h>
+
+void frecency_visit(const char *path);
+const char *frecency_best(char *patterns[]);
+void frecency_forget(const char *path);
+void frecency_list(char *patterns[]);
+bool frecency_pending(void);
+void frecency_close(void);
+
+#endif
@@ -0,0 +1,214 @@
+/**
+ * @file
+ *
+ * Contains shell functions. A definition stores a copy of the parsed body in
+ * a hash table keyed by name; calling the function runs that tree in the
+ * shell's own process (see eval_function()), so only the external commands
+ * inside it fork.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "func.h"
+#include "logger.h"
+#include "parser.h"
+
+/* Number of hash table buckets */
+#define FUNC_BUCKETS 64
+
+/**
+ * Stores a single function definition
+ */
+struct func_entry
+{
+    char *name;
+    struct function *fn;
+    struct func_entry *next;
+};
+
+static struct func_entry *table[FUNC_BUCKETS] = { 0 };
+
+/**
+ * Hashes a function name
+ * @param name the name to hash
+ *
+ * @return bucket index for the name
+ */
+static unsigned int func_hash(const char *name)
+{
+    unsigned int hash = 5381;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    return hash % FUNC_BUCKETS;
+}
+
+/**
+ * Finds a function definition by name
+ * @param name the name to find
+ *
+ * @return pointer to the entry or NULL if no such function is defined
+ */
+static struct func_entry *func_find(const char *name)
+{
+    for (struct func_entry *e = table[func_hash(name)]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Defines a function, replacing any previous definition
+ * @param name the function name
+ * @param body the parsed body, which is copied
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+int func_define(const char *name, const struct node *body)
+{
+    struct function *fn = malloc(sizeof(struct function));
+    if (fn == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    fn->refs = 1;
+    if ((fn->body = node_copy(body)) == NULL && body != NULL) {
+        free(fn);
+        return -1;
+    }
+
+    struct func_entry *e = func_find(name);
+    if (e != NULL) {
+        func_release(e->fn);
+        e->fn = fn;
+        return 0;
+    }
+    if ((e = malloc(sizeof(struct func_entry))) == NULL || (e->name = strdup(name)) == NULL) {
+        perror("malloc");
+        free(e);
+        func_release(fn);
+        return -1;
+    }
+    e->fn = fn;
+    unsigned int bucket = func_hash(name);
+    e->next = table[bucket];
+    table[bucket] = e;
+    LOG("Defined function %s\n", name);
+    return 0;
+}
+
+/**
+ * Checks if a function is defined
+ * @param name the function name
+ *
+ * @return true if the name is a function
+ */
+bool func_defined(const char *name)
+{
+    return func_find(name) != NULL;
+}
+
+/**
+ * Takes a reference to a function's body for the length of a call
+ * @param name the function name
+ *
+ * @return the function, to be passed to func_release() when the call
+ * returns, or NULL if no such function is defined
+ */
+struct function *func_acquire(const char *name)
+{
+    struct func_entry *e = func_find(name);
+    if (e == NULL) {
+        return NULL;
+    }
+    e->fn->refs++;
+    return e->fn;
+}
+
+/**
+ * Drops a reference to a function's body, freeing it with the last one
+ * @param fn the function
+ */
+void func_release(struct function *fn)
+{
+    if (--fn->refs > 0) {
+        return;
+    }
+    node_free(fn->body);
+    free(fn);
+}
+
+/**
+ * Removes a function definition
+ * @param name the function name
+ *
+ * @return true if the function was defined
+ */
+static bool func_unset(const char *name)
+{
+    struct func_entry **link = &table[func_hash(name)];
+    while (*link != NULL) {
+        struct func_entry *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            func_release(e->fn);
+            free(e->name);
+            free(e);
+            return true;
+        }
+        link = &e->next;
+    }
+    return false;
+}
+
+/**
+ * Handles "unset -f NAME...", which removes functions
+ * @param args command arguments
+ *
+ * @return 0 on completion
+ */
+int func_unset_handler(char *args[])
+{
+    for (int i = 2; args[i] != NULL; i++) {
+        func_unset(args[i]);
+    }
+    return 0;
+}
+
+/**
+ * Handles the "functions" builtin, which lists the defined functions
+ * @param args command arguments
+ *
+ * @return 0 on completion
+ */
+int functions_handler(char *args[])
+{
+    for (int i = 0; i < FUNC_BUCKETS; i++) {
+        for (struct func_entry *e = table[i]; e != NULL; e = e->next) {
+            printf("%s()\n", e->name);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Frees every function definition
+ */
+void func_destroy(void)
+{
+    for (int i = 0; i < FUNC_BUCKETS; i++) {
+        while (table[i] != NULL) {
+            struct func_entry *e = table[i];
+            table[i] = e->next;
+            func_release(e->fn);
+            free(e->name);
+            free(e);
+        }
+    }
+}
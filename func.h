@@ -0,0 +1,32 @@
+/**
+ * @file
+ *
+ * Contains function headers for shell functions.
+ */
+
+#ifndef _FUNC_H_
+#define _FUNC_H_
+
+#include <stdbool.h>
+
+#include "parser.h"
+
+/**
+ * Stores a function's body. Calls hold a reference, so a function that is
+ * redefined or unset while it runs keeps its old body until it returns.
+ */
+struct function
+{
+    struct node *body;
+    int refs;
+};
+
+int func_define(const char *name, const struct node *body);
+bool func_defined(const char *name);
+struct function *func_acquire(const char *name);
+void func_release(struct function *fn);
+int func_unset_handler(char *args[]);
+int functions_handler(char *args[]);
+void func_destroy(void);
+
+#endif
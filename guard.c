@@ -0,0 +1,527 @@
+/**
+ * @file
+ *
+ * Contains command containment: timeouts and resource limits. A timed command
+ * is waited for through a pidfd with poll, so the shell never blocks in
+ * waitpid past the deadline. At the deadline the command and everything it
+ * started are sent the configured signal, then SIGKILL if they are still
+ * running after a grace period. Resource limits are applied with setrlimit in
+ * the child just before exec. Both can be set as session defaults or as a
+ * prefix for a single command, like the pipesize policy.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "guard.h"
+#include "logger.h"
+#include "util.h"
+
+/* Default delay between the timeout signal and SIGKILL */
+#define GUARD_KILL_AFTER_MS 5000
+
+/* Largest number of processes signalled when a command times out */
+#define GUARD_MAX_TREE 256
+
+/**
+ * Maps signal names accepted by "timeout -s" to their numbers
+ */
+static const struct
+{
+    const char *name;
+    int signo;
+} signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+};
+
+static struct guard_policy global_policy = {
+    0, SIGTERM, GUARD_KILL_AFTER_MS, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY
+};
+static struct guard_policy override_policy;
+static bool override_set = false;
+
+/**
+ * Retrieves the policy that applies to the command being started
+ *
+ * @return pointer to the per-command override if set, otherwise the global policy
+ */
+static struct guard_policy *current_policy(void)
+{
+    return override_set ? &override_policy : &global_policy;
+}
+
+/**
+ * Parses a duration: a number of seconds, optionally fractional, with an
+ * optional "ms", "s", "m", or "h" suffix
+ * @param spec the duration to parse
+ * @param ms receives the duration in milliseconds
+ *
+ * @return 0 on success or -1 if the duration is invalid
+ */
+static int parse_duration(const char *spec, long *ms)
+{
+    char *end;
+    double value = strtod(spec, &end);
+    if (end == spec || value <= 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        value /= 1000;
+    } else if (strcmp(end, "m") == 0) {
+        value *= 60;
+    } else if (strcmp(end, "h") == 0) {
+        value *= 3600;
+    } else if (strcmp(end, "s") != 0 && *end != '\0') {
+        return -1;
+    }
+    *ms = (long) (value * 1000);
+    return (*ms > 0) ? 0 : -1;
+}
+
+/**
+ * Parses a signal given by number or by name, with or without "SIG"
+ * @param spec the signal to parse
+ * @param signo receives the signal number
+ *
+ * @return 0 on success or -1 if the signal is unknown
+ */
+static int parse_signal(const char *spec, int *signo)
+{
+    char *end;
+    long value = strtol(spec, &end, 10);
+    if (end != spec && *end == '\0' && value > 0 && value < NSIG) {
+        *signo = value;
+        return 0;
+    }
+    if (strncasecmp(spec, "SIG", 3) == 0) {
+        spec += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcasecmp(spec, signal_names[i].name) == 0) {
+            *signo = signal_names[i].signo;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parses a resource limit: "unlimited" or a count with an optional K, M, or G
+ * suffix
+ * @param spec the limit to parse
+ * @param value receives the limit
+ *
+ * @return 0 on success or -1 if the limit is invalid
+ */
+static int parse_limit(const char *spec, rlim_t *value)
+{
+    if (strcmp(spec, "unlimited") == 0) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    unsigned long long count = strtoull(spec, &end, 10);
+    if (end == spec || spec[0] == '-') {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        count <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        count <<= 20;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        count <<= 30;
+        end++;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *value = count;
+    return 0;
+}
+
+/**
+ * Parses the options of "timeout": [-s SIGNAL] [-k DURATION] DURATION|off
+ * @param args command arguments, starting with "timeout"
+ * @param policy receives the parsed settings
+ *
+ * @return index of the first argument after the options, or -1 if they are
+ * invalid
+ */
+static int parse_timeout_args(char *args[], struct guard_policy *policy)
+{
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+        if (strcmp(args[i], "-s") == 0) {
+            if (parse_signal(args[i + 1], &policy->signal) == -1) {
+                fprintf(stderr, "timeout: unknown signal '%s'\n", args[i + 1]);
+                return -1;
+            }
+        } else if (strcmp(args[i], "-k") == 0) {
+            if (parse_duration(args[i + 1], &policy->kill_after_ms) == -1) {
+                fprintf(stderr, "timeout: invalid duration '%s'\n", args[i + 1]);
+                return -1;
+            }
+        } else {
+            break;
+        }
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "usage: timeout [-s SIGNAL] [-k DURATION] DURATION|off [COMMAND...]\n");
+        return -1;
+    }
+    if (strcmp(args[i], "off") == 0) {
+        policy->timeout_ms = 0;
+    } else if (parse_duration(args[i], &policy->timeout_ms) == -1) {
+        fprintf(stderr, "timeout: invalid duration '%s'\n", args[i]);
+        return -1;
+    }
+    return i + 1;
+}
+
+/**
+ * Parses the options of "limit": [-t CPU_SECONDS] [-v ADDRESS_SPACE]
+ * [-n OPEN_FILES], or "off" to remove every limit
+ * @param args command arguments, starting with "limit"
+ * @param policy receives the parsed settings
+ *
+ * @return index of the first argument after the options, or -1 if they are
+ * invalid
+ */
+static int parse_limit_args(char *args[], struct guard_policy *policy)
+{
+    if (args[1] != NULL && strcmp(args[1], "off") == 0) {
+        policy->cpu = RLIM_INFINITY;
+        policy->as = RLIM_INFINITY;
+        policy->nofile = RLIM_INFINITY;
+        return 2;
+    }
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i += 2) {
+        rlim_t *target = NULL;
+        if (strcmp(args[i], "-t") == 0) {
+            target = &policy->cpu;
+        } else if (strcmp(args[i], "-v") == 0) {
+            target = &policy->as;
+        } else if (strcmp(args[i], "-n") == 0) {
+            target = &policy->nofile;
+        }
+        if (target == NULL || args[i + 1] == NULL || parse_limit(args[i + 1], target) == -1) {
+            fprintf(stderr, "usage: limit [-t CPU_SECONDS] [-v BYTES] [-n FILES] [COMMAND...]\n"
+                    "       limit off\n");
+            return -1;
+        }
+    }
+    if (i == 1) {
+        fprintf(stderr, "usage: limit [-t CPU_SECONDS] [-v BYTES] [-n FILES] [COMMAND...]\n"
+                "       limit off\n");
+        return -1;
+    }
+    return i;
+}
+
+/**
+ * Handles a "timeout ..." or "limit ..." prefix in front of a command. The
+ * settings apply to that command only.
+ * @param args command arguments
+ *
+ * @return the number of arguments making up the prefix, 0 if args does not
+ * start with a prefix (including "timeout" or "limit" without a command,
+ * which the builtins handle), or -1 if the prefix is invalid
+ */
+int guard_prefix(char *args[])
+{
+    bool timeout = strcmp(args[0], "timeout") == 0;
+    if (timeout == false && strcmp(args[0], "limit") != 0) {
+        return 0;
+    }
+    if (args[1] == NULL || is_redirection(args[1])) {
+        return 0;
+    }
+    struct guard_policy policy = *current_policy();
+    int used = timeout ? parse_timeout_args(args, &policy) : parse_limit_args(args, &policy);
+    if (used == -1) {
+        return -1;
+    }
+    if (args[used] == NULL || is_redirection(args[used])) {
+        /* Only settings and redirections: the builtin changes the defaults */
+        return 0;
+    }
+    override_policy = policy;
+    override_set = true;
+    return used;
+}
+
+/**
+ * Removes the per-command settings so the session defaults apply again
+ */
+void guard_clear_override(void)
+{
+    override_set = false;
+}
+
+/**
+ * Checks if the command being started has a timeout, which requires the
+ * shell to stay behind and watch it
+ *
+ * @return true if a timeout applies
+ */
+bool guard_has_timeout(void)
+{
+    return current_policy()->timeout_ms != 0;
+}
+
+/**
+ * Applies one resource limit to the calling process
+ * @param resource the RLIMIT_ constant
+ * @param value the limit, or RLIM_INFINITY to leave it unchanged
+ * @param name name used in error messages
+ */
+static void apply_limit(int resource, rlim_t value, const char *name)
+{
+    if (value == RLIM_INFINITY) {
+        return;
+    }
+    struct rlimit limit;
+    if (getrlimit(resource, &limit) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    limit.rlim_cur = value;
+    if (limit.rlim_max == RLIM_INFINITY || value < limit.rlim_max) {
+        limit.rlim_max = value;
+    } else {
+        limit.rlim_cur = limit.rlim_max;
+    }
+    if (setrlimit(resource, &limit) == -1) {
+        perror(name);
+    }
+}
+
+/**
+ * Applies the resource limits of the current policy. Called in the child just
+ * before exec.
+ */
+void guard_apply_limits(void)
+{
+    struct guard_policy *policy = current_policy();
+    apply_limit(RLIMIT_CPU, policy->cpu, "limit: cpu");
+    apply_limit(RLIMIT_AS, policy->as, "limit: address space");
+    apply_limit(RLIMIT_NOFILE, policy->nofile, "limit: open files");
+}
+
+/**
+ * Collects a process and its descendants from /proc
+ * @param pid the process at the root of the tree
+ * @param tree receives the process IDs
+ * @param count number of entries already in tree, updated as pids are added
+ */
+static void collect_tree(pid_t pid, pid_t *tree, int *count)
+{
+    if (*count == GUARD_MAX_TREE) {
+        return;
+    }
+    tree[(*count)++] = pid;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        return;
+    }
+    int child;
+    while (fscanf(file, "%d", &child) == 1) {
+        collect_tree(child, tree, count);
+    }
+    fclose(file);
+}
+
+/**
+ * Sends a signal to a command and every process it started
+ * @param pidfd pidfd of the command
+ * @param child process ID of the command
+ * @param signo the signal to send
+ */
+static void signal_tree(int pidfd, pid_t child, int signo)
+{
+    pid_t tree[GUARD_MAX_TREE];
+    int count = 0;
+    collect_tree(child, tree, &count);
+    for (int i = 1; i < count; i++) {
+        kill(tree[i], signo);
+    }
+    if (syscall(SYS_pidfd_send_signal, pidfd, signo, NULL, 0) == -1 && errno != ESRCH) {
+        perror("pidfd_send_signal");
+    }
+}
+
+/**
+ * Waits until a pidfd becomes readable (the process exited) or a timeout
+ * passes, resuming after signal interruptions
+ * @param pidfd the pidfd to wait on
+ * @param timeout_ms how long to wait
+ *
+ * @return true if the process exited, false if the timeout passed
+ */
+static bool wait_exit(int pidfd, long timeout_ms)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long remaining = timeout_ms;
+    while (remaining > 0) {
+        struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+        int rc = poll(&pfd, 1, (remaining > 1000000) ? 1000000 : (int) remaining);
+        if (rc > 0) {
+            return true;
+        }
+        if (rc == -1 && errno != EINTR) {
+            perror("poll");
+            return true;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000
+                + (now.tv_nsec - start.tv_nsec) / 1000000);
+    }
+    return false;
+}
+
+/**
+ * Waits for a foreground command. Without a timeout this is a plain waitpid;
+ * with one, the command is watched through a pidfd and signalled at the
+ * deadline, then killed if it outlives the grace period.
+ * @param child the process to wait for
+ * @param status receives the status reported by waitpid
+ * @param timed_out set to true if the deadline passed
+ *
+ * @return the process ID on success or -1 on failure, like waitpid
+ */
+pid_t guard_wait(pid_t child, int *status, bool *timed_out)
+{
+    struct guard_policy *policy = current_policy();
+    *timed_out = false;
+    if (policy->timeout_ms == 0) {
+        return waitpid(child, status, 0);
+    }
+    int pidfd = syscall(SYS_pidfd_open, child, 0);
+    if (pidfd == -1) {
+        perror("pidfd_open");
+        return waitpid(child, status, 0);
+    }
+    if (wait_exit(pidfd, policy->timeout_ms) == false) {
+        *timed_out = true;
+        LOG("Command timed out; sending signal %d\n", policy->signal);
+        signal_tree(pidfd, child, policy->signal);
+        if (policy->signal != SIGKILL && wait_exit(pidfd, policy->kill_after_ms) == false) {
+            LOGP("Command outlived its grace period; sending SIGKILL\n");
+            signal_tree(pidfd, child, SIGKILL);
+        }
+    }
+    close(pidfd);
+    return waitpid(child, status, 0);
+}
+
+/**
+ * Formats a duration for display
+ * @param ms the duration in milliseconds
+ * @param buf receives the text
+ * @param len size of buf
+ */
+static void format_duration(long ms, char *buf, size_t len)
+{
+    if (ms % 1000 == 0) {
+        snprintf(buf, len, "%lds", ms / 1000);
+    } else {
+        snprintf(buf, len, "%ldms", ms);
+    }
+}
+
+/**
+ * Handles the "timeout" builtin. With no arguments it prints the session
+ * default; "timeout [-s SIGNAL] [-k DURATION] DURATION|off" sets it. A
+ * command after the options runs with that timeout instead (handled by
+ * guard_prefix()).
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int timeout_handler(char *args[])
+{
+    if (args[1] == NULL) {
+        if (global_policy.timeout_ms == 0) {
+            printf("timeout: off\n");
+        } else {
+            char timeout[32], kill_after[32];
+            format_duration(global_policy.timeout_ms, timeout, sizeof(timeout));
+            format_duration(global_policy.kill_after_ms, kill_after, sizeof(kill_after));
+            printf("timeout: %s\nsignal: %s\nkill after: %s\n", timeout,
+                    strsignal(global_policy.signal), kill_after);
+        }
+        fflush(stdout);
+        return 0;
+    }
+    struct guard_policy policy = global_policy;
+    if (parse_timeout_args(args, &policy) == -1) {
+        return 1;
+    }
+    global_policy.timeout_ms = policy.timeout_ms;
+    global_policy.signal = policy.signal;
+    global_policy.kill_after_ms = policy.kill_after_ms;
+    return 0;
+}
+
+/**
+ * Prints one resource limit
+ * @param name the limit's name
+ * @param value the limit
+ */
+static void print_limit(const char *name, rlim_t value)
+{
+    if (value == RLIM_INFINITY) {
+        printf("%s: unlimited\n", name);
+    } else {
+        printf("%s: %llu\n", name, (unsigned long long) value);
+    }
+}
+
+/**
+ * Handles the "limit" builtin. With no arguments it prints the session
+ * defaults; "limit [-t CPU_SECONDS] [-v BYTES] [-n FILES]" sets them and
+ * "limit off" removes them. A command after the options runs with those
+ * limits instead (handled by guard_prefix()).
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int limit_handler(char *args[])
+{
+    if (args[1] == NULL) {
+        print_limit("cpu seconds", global_policy.cpu);
+        print_limit("address space", global_policy.as);
+        print_limit("open files", global_policy.nofile);
+        fflush(stdout);
+        return 0;
+    }
+    struct guard_policy policy = global_policy;
+    if (parse_limit_args(args, &policy) == -1) {
+        return 1;
+    }
+    global_policy.cpu = policy.cpu;
+    global_policy.as = policy.as;
+    global_policy.nofile = policy.nofile;
+    return 0;
+}
@@ -0,0 +1,37 @@
+/**
+ * @file
+ *
+ * Contains function headers for command timeouts and resource limits.
+ */
+
+#ifndef _GUARD_H_
+#define _GUARD_H_
+
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/**
+ * Stores how commands are contained: a timeout (0 for none) with the signal
+ * sent at the deadline and the delay before escalating to SIGKILL, and the
+ * resource limits applied before exec (RLIM_INFINITY for none)
+ */
+struct guard_policy
+{
+    long timeout_ms;
+    int signal;
+    long kill_after_ms;
+    rlim_t cpu;
+    rlim_t as;
+    rlim_t nofile;
+};
+
+int guard_prefix(char *args[]);
+void guard_clear_override(void);
+bool guard_has_timeout(void);
+void guard_apply_limits(void);
+pid_t guard_wait(pid_t child, int *status, bool *timed_out);
+int timeout_handler(char *args[]);
+int limit_handler(char *args[]);
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * @file
+ *
+ * Contains here-document and here-string input. The parser keeps each body
+ * in the command's node and leaves a "[N]<<" operator in its arguments. Right
+ * before the command runs, every body is written to an anonymous memfd that
+ * is then sealed against changes, and its operator is rewritten to
+ * "[N]<&FD", so execute_redirection() puts the memfd on the descriptor the
+ * same way it handles any other input redirection. Bodies never reach the
+ * file system, however large they are.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "heredoc.h"
+#include "logger.h"
+#include "vars.h"
+
+/* Most here-documents and here-strings a single command may have */
+#define HEREDOC_MAX 16
+
+static int open_fds[HEREDOC_MAX];
+static char operators[HEREDOC_MAX][32];
+static int open_count = 0;
+
+/**
+ * Writes a body to a new memfd and seals it
+ * @param body the body
+ *
+ * @return the memfd, positioned at the start, or -1 on failure
+ */
+static int seal_body(const char *body)
+{
+    int fd = memfd_create("mash-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+    size_t len = strlen(body);
+    while (len > 0) {
+        ssize_t n = write(fd, body, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        body += n;
+        len -= n;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        LOG("Could not seal here-document: %s\n", strerror(errno));
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/**
+ * Opens the here-documents and here-strings of a command and points its
+ * "[N]<<" operators at them. The memfds stay open until heredoc_release().
+ * @param args expanded command arguments, rewritten in place
+ * @param docs the command's bodies, in the order of their operators
+ *
+ * @return 0 on success or -1 on failure
+ */
+int heredoc_open(char *args[], const struct heredoc *docs)
+{
+    for (int i = 0; args[i] != (char *) 0 && docs != NULL; i++) {
+        int digits = strspn(args[i], "0123456789");
+        if (strcmp(args[i] + digits, "<<") != 0) {
+            continue;
+        }
+        if (open_count == HEREDOC_MAX || digits > 9) {
+            fprintf(stderr, "mash: too many here-documents\n");
+            return -1;
+        }
+        char *doc[] = { docs->body, (char *) 0 };
+        if (docs->expand) {
+            vars_expand(doc);
+        }
+        int fd = seal_body(doc[0]);
+        if (fd == -1) {
+            return -1;
+        }
+        open_fds[open_count] = fd;
+        snprintf(operators[open_count], sizeof(operators[0]), "%.*s<&%d", digits, args[i], fd);
+        args[i] = operators[open_count++];
+        docs = docs->next;
+    }
+    return 0;
+}
+
+/**
+ * Closes the memfds opened for the current command. Its children keep their
+ * own copies.
+ */
+void heredoc_release(void)
+{
+    for (int i = 0; i < open_count; i++) {
+        close(open_fds[i]);
+    }
+    open_count = 0;
+}
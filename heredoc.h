@@ -0,0 +1,16 @@
+/**
+ * @file
+ *
+ * Contains function headers for feeding here-documents and here-strings to
+ * commands through sealed memfds.
+ */
+
+#ifndef _HEREDOC_H_
+#define _HEREDOC_H_
+
+#include "parser.h"
+
+int heredoc_open(char *args[], const struct heredoc *docs);
+void heredoc_release(void);
+
+#endif
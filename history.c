@@ -20,6 +20,8 @@
 #include <unistd.h>
 
 #include "history.h"
+#include "memstat.h"
+#include "sharehist.h"
 #include "util.h"
 
 static char** strings;
@@ -66,8 +68,8 @@ void hist_init(unsigned int limit)
     end = -1;
     history_num = 0;
     size = limit;
-    strings = malloc(sizeof(char*)*limit);
-    integers = malloc(sizeof(int*)*limit);
+    strings = mem_calloc(MEM_HISTORY, limit, sizeof(char*));
+    integers = mem_calloc(MEM_HISTORY, limit, sizeof(int*));
 }
 
 /**
@@ -76,10 +78,10 @@ void hist_init(unsigned int limit)
 void hist_destroy(void)
 {
     for (int i = 0; i < size; i++) {
-        free(strings[i]);
+        mem_free(MEM_HISTORY, strings[i]);
     }
-    free(strings);
-    free(integers);
+    mem_free(MEM_HISTORY, strings);
+    mem_free(MEM_HISTORY, integers);
 }
 
 /**
@@ -94,7 +96,7 @@ void hist_remove(void)
             front = -1;
             end = -1;
         } else {
-            free(strings[front]);
+            mem_free(MEM_HISTORY, strings[front]);
             front = (front + 1) % size;
         }
     }
@@ -114,8 +116,11 @@ void hist_add(const char *cmd)
         front = 0;
     }
     end = (end + 1) % size;
-    strings[end] = strdup(cmd);
+    strings[end] = mem_strdup(MEM_HISTORY, cmd);
     integers[end] = (int*) history_num;
+    if (sharehist_active()) {
+        sharehist_add(cmd);
+    }
 }
 
 /**
@@ -187,12 +192,16 @@ void hist_print(void)
 
 /**
  * Searches through the history array to find the most recent command starting with the prefix parameter
+ * When the shared history is in use, commands from other sessions are searched too.
  * @param prefix prefix of a string in the history array
  * 
  * @return the most recent command in the history array that has the same prefix or NULL if not found
  */
 const char *hist_search_prefix(char *prefix)
 {
+    if (sharehist_active()) {
+        return sharehist_search_prefix(prefix);
+    }
     if (strings_list_empty()) {
         return NULL;
     }
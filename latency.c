@@ -0,0 +1,345 @@
+/**
+ * @file
+ *
+ * Contains session-wide latency histograms for the phases of running a
+ * command: waiting for an input line, parsing it, forking, getting from the
+ * fork to the exec in the child, and getting from the child's exit back to the
+ * next prompt. Each phase has a log-linear histogram in the style of
+ * HdrHistogram: values below 2^LAT_SUB_BITS nanoseconds have a bucket each,
+ * and every power of two above that is split into 2^LAT_SUB_BITS buckets, so
+ * any recorded value is known to within about 3% in constant memory. The
+ * child reports when it reached exec through a small shared mapping.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "logger.h"
+
+/* Buckets per power of two, as a power of two */
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+
+/* Buckets needed to cover every 64-bit value */
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/**
+ * Stores the distribution of one phase, in nanoseconds
+ */
+struct histogram
+{
+    uint64_t counts[LAT_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+/**
+ * Stores when a forked child reached exec, written by the child
+ */
+struct exec_slot
+{
+    _Atomic pid_t pid;
+    uint64_t ns;
+};
+
+static const char *phase_names[LAT_PHASES] = {
+    "input", "parse", "fork", "exec", "prompt"
+};
+
+static struct histogram phases[LAT_PHASES];
+static struct exec_slot *slot = NULL;
+static bool slot_failed = false;
+static uint64_t fork_start = 0;
+static uint64_t exit_mark = 0;
+static const char *dump_path = NULL;
+
+/**
+ * Reads the monotonic clock
+ *
+ * @return the current time in nanoseconds
+ */
+uint64_t latency_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Finds the bucket a value falls in
+ * @param ns the value
+ *
+ * @return index of the bucket
+ */
+static int bucket_of(uint64_t ns)
+{
+    if (ns < LAT_SUB) {
+        return (int) ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + (int) ((ns >> shift) - LAT_SUB);
+}
+
+/**
+ * Finds the largest value that falls in a bucket
+ * @param bucket index of the bucket
+ *
+ * @return the value
+ */
+static uint64_t bucket_top(int bucket)
+{
+    if (bucket < LAT_SUB) {
+        return bucket;
+    }
+    int shift = bucket / LAT_SUB - 1;
+    uint64_t low = (uint64_t) (LAT_SUB + bucket % LAT_SUB) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+/**
+ * Records one sample of a phase
+ * @param phase the phase
+ * @param ns the time it took
+ */
+void latency_add(enum latency_phase phase, uint64_t ns)
+{
+    struct histogram *h = &phases[phase];
+    h->counts[bucket_of(ns)]++;
+    h->total++;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+/**
+ * Records one sample of a phase that started at a given time and ends now
+ * @param phase the phase
+ * @param start when the phase started, from latency_clock()
+ */
+void latency_since(enum latency_phase phase, uint64_t start)
+{
+    uint64_t now = latency_clock();
+    latency_add(phase, (now > start) ? now - start : 0);
+}
+
+/**
+ * Finds a percentile of a phase
+ * @param h the phase's histogram
+ * @param percent the percentile, from 0 to 100
+ *
+ * @return the value at or below which percent of the samples fall, or 0 if
+ * there are none
+ */
+static uint64_t percentile(const struct histogram *h, double percent)
+{
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percent / 100 * h->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return (top < h->max) ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Marks the start of a fork. Creates the mapping the child reports its exec
+ * through the first time.
+ */
+void latency_fork_begin(void)
+{
+    if (slot == NULL && slot_failed == false) {
+        void *mem = mmap(NULL, sizeof(struct exec_slot), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOG("Latency mapping failed: %s\n", strerror(errno));
+            slot_failed = true;
+        } else {
+            slot = mem;
+        }
+    }
+    if (slot != NULL) {
+        atomic_store(&slot->pid, 0);
+    }
+    fork_start = latency_clock();
+}
+
+/**
+ * Records the fork phase in the parent once fork() has returned
+ */
+void latency_forked(void)
+{
+    latency_since(LAT_FORK, fork_start);
+}
+
+/**
+ * Notes, in a forked child, that it is about to exec
+ */
+void latency_exec(void)
+{
+    if (slot != NULL) {
+        slot->ns = latency_clock();
+        atomic_store(&slot->pid, getpid());
+    }
+}
+
+/**
+ * Records the exec phase of a child that was waited for, and marks the time
+ * its exit was seen for the prompt phase
+ * @param child the child's process ID
+ */
+void latency_reaped(pid_t child)
+{
+    exit_mark = latency_clock();
+    if (slot != NULL && atomic_load(&slot->pid) == child && slot->ns > fork_start) {
+        latency_add(LAT_EXEC, slot->ns - fork_start);
+    }
+}
+
+/**
+ * Records the prompt phase when a child exited since the last prompt. Called
+ * just before the next input line is read.
+ */
+void latency_prompt(void)
+{
+    if (exit_mark != 0) {
+        latency_since(LAT_PROMPT, exit_mark);
+        exit_mark = 0;
+    }
+}
+
+/**
+ * Prints every phase as one line of JSON
+ * @param out the stream to print to
+ */
+static void print_json(FILE *out)
+{
+    fprintf(out, "{");
+    for (int i = 0; i < LAT_PHASES; i++) {
+        const struct histogram *h = &phases[i];
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"p50_ns\":%lu,\"p90_ns\":%lu,"
+                "\"p99_ns\":%lu,\"max_ns\":%lu}", (i > 0) ? "," : "", phase_names[i],
+                h->total, percentile(h, 50), percentile(h, 90), percentile(h, 99), h->max);
+    }
+    fprintf(out, "}\n");
+}
+
+/**
+ * Asks for every phase to be written as JSON to a file when the shell exits
+ * @param path the file
+ */
+void latency_dump_at_exit(const char *path)
+{
+    dump_path = path;
+}
+
+/**
+ * Checks if the histograms are to be written when the shell exits, which
+ * keeps the last command from replacing the shell
+ *
+ * @return true if latency_dump_at_exit() was called
+ */
+bool latency_dump_pending(void)
+{
+    return dump_path != NULL;
+}
+
+/**
+ * Writes every phase as JSON to the file given to latency_dump_at_exit(),
+ * replacing it
+ *
+ * @return 0 on success or if no file was given, -1 on failure
+ */
+int latency_dump(void)
+{
+    if (dump_path == NULL) {
+        return 0;
+    }
+    FILE *out = fopen(dump_path, "w");
+    if (out == NULL) {
+        perror(dump_path);
+        return -1;
+    }
+    print_json(out);
+    if (fclose(out) == EOF) {
+        perror(dump_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Formats a duration with a unit that suits its size
+ * @param ns the duration in nanoseconds
+ * @param buf receives the text
+ * @param size size of buf
+ */
+static void format_ns(uint64_t ns, char *buf, size_t size)
+{
+    if (ns < 1000) {
+        snprintf(buf, size, "%luns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+}
+
+/**
+ * Handles the "latency" builtin. With no arguments it prints the sample count,
+ * p50, p90, p99, and maximum of each phase; "latency -j" prints the same data
+ * in nanoseconds as one line of JSON, and "latency reset" clears it.
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int latency_handler(char *args[])
+{
+    bool json = false;
+    if (args[1] != NULL && strcmp(args[1], "reset") == 0 && args[2] == NULL) {
+        memset(phases, 0, sizeof(phases));
+        exit_mark = 0;
+        return 0;
+    } else if (args[1] != NULL && strcmp(args[1], "-j") == 0 && args[2] == NULL) {
+        json = true;
+    } else if (args[1] != NULL) {
+        fprintf(stderr, "usage: latency [-j | reset]\n");
+        return 1;
+    }
+
+    if (json) {
+        print_json(stdout);
+    } else {
+        printf("%-8s %10s %10s %10s %10s %10s\n", "phase", "count", "p50", "p90", "p99", "max");
+        for (int i = 0; i < LAT_PHASES; i++) {
+            const struct histogram *h = &phases[i];
+            char p50[32], p90[32], p99[32], max[32];
+            format_ns(percentile(h, 50), p50, sizeof(p50));
+            format_ns(percentile(h, 90), p90, sizeof(p90));
+            format_ns(percentile(h, 99), p99, sizeof(p99));
+            format_ns(h->max, max, sizeof(max));
+            printf("%-8s %10lu %10s %10s %10s %10s\n", phase_names[i], h->total,
+                    p50, p90, p99, max);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file
+ *
+ * Contains function headers for the session-wide command latency histograms.
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Phases of running a command that are timed
+ */
+enum latency_phase
+{
+    LAT_INPUT,
+    LAT_PARSE,
+    LAT_FORK,
+    LAT_EXEC,
+    LAT_PROMPT,
+    LAT_PHASES,
+};
+
+uint64_t latency_clock(void);
+void latency_add(enum latency_phase phase, uint64_t ns);
+void latency_since(enum latency_phase phase, uint64_t start);
+void latency_fork_begin(void);
+void latency_forked(void);
+void latency_exec(void);
+void latency_reaped(pid_t child);
+void latency_prompt(void);
+void latency_dump_at_exit(const char *path);
+bool latency_dump_pending(void);
+int latency_dump(void);
+int latency_handler(char *args[]);
+
+#endif
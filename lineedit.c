@@ -0,0 +1,78 @@
+/**
+ * @file
+ *
+ * Contains the lazy loader for readline.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+
+#include "lineedit.h"
+#include "logger.h"
+
+struct lineedit le = { 0 };
+
+static void *handle = NULL;
+
+/**
+ * Looks up one readline symbol
+ * @param name the symbol name
+ * @param dest receives the address of the symbol
+ *
+ * @return 0 on success or -1 if the symbol is missing
+ */
+static int load_symbol(const char *name, void *dest)
+{
+    void *sym = dlsym(handle, name);
+    if (sym == NULL) {
+        fprintf(stderr, "mash: %s\n", dlerror());
+        return -1;
+    }
+    *(void **) dest = sym;
+    return 0;
+}
+
+/**
+ * Loads readline and fills in the le table. Only the first call does any work.
+ *
+ * @return 0 on success or -1 if readline could not be loaded
+ */
+int lineedit_load(void)
+{
+    if (handle != NULL) {
+        return 0;
+    }
+    if ((handle = dlopen("libreadline.so.8", RTLD_NOW)) == NULL
+            && (handle = dlopen("libreadline.so", RTLD_NOW)) == NULL) {
+        fprintf(stderr, "mash: %s\n", dlerror());
+        return -1;
+    }
+
+    int rc = 0;
+    rc |= load_symbol("readline", &le.readline);
+    rc |= load_symbol("rl_bind_keyseq", &le.bind_keyseq);
+    rc |= load_symbol("rl_variable_bind", &le.variable_bind);
+    rc |= load_symbol("rl_replace_line", &le.replace_line);
+    rc |= load_symbol("rl_getc", &le.getc);
+    rc |= load_symbol("rl_completion_matches", &le.completion_matches);
+    rc |= load_symbol("rl_display_match_list", &le.display_match_list);
+    rc |= load_symbol("rl_forced_update_display", &le.forced_update_display);
+    rc |= load_symbol("rl_line_buffer", &le.line_buffer);
+    rc |= load_symbol("rl_point", &le.point);
+    rc |= load_symbol("rl_end", &le.end);
+    rc |= load_symbol("rl_attempted_completion_over", &le.attempted_completion_over);
+    rc |= load_symbol("rl_filename_completion_desired", &le.filename_completion_desired);
+    rc |= load_symbol("rl_completion_query_items", &le.completion_query_items);
+    rc |= load_symbol("rl_instream", &le.instream);
+    rc |= load_symbol("rl_outstream", &le.outstream);
+    rc |= load_symbol("rl_attempted_completion_function", &le.attempted_completion_function);
+    rc |= load_symbol("rl_getc_function", &le.getc_function);
+    rc |= load_symbol("rl_startup_hook", &le.startup_hook);
+    if (rc != 0) {
+        dlclose(handle);
+        handle = NULL;
+        return -1;
+    }
+    LOGP("Loaded readline\n");
+    return 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file
+ *
+ * Contains the readline entry points used by the shell. readline is loaded
+ * with dlopen only when the session is interactive, so scripts never pay for
+ * loading or relocating it; its functions and variables are reached through
+ * the le table once lineedit_load() has succeeded.
+ */
+
+#ifndef _LINEEDIT_H_
+#define _LINEEDIT_H_
+
+#include <stdio.h>
+#include <readline/readline.h>
+
+/**
+ * Stores pointers to the readline functions and variables the shell uses
+ */
+struct lineedit
+{
+    char *(*readline)(const char *prompt);
+    int (*bind_keyseq)(const char *keyseq, rl_command_func_t *function);
+    int (*variable_bind)(const char *variable, const char *value);
+    void (*replace_line)(const char *text, int clear_undo);
+    int (*getc)(FILE *stream);
+    char **(*completion_matches)(const char *text, rl_compentry_func_t *entry_func);
+    void (*display_match_list)(char **matches, int len, int max);
+    int (*forced_update_display)(void);
+
+    char **line_buffer;
+    int *point;
+    int *end;
+    int *attempted_completion_over;
+    int *filename_completion_desired;
+    int *completion_query_items;
+    FILE **instream;
+    FILE **outstream;
+    rl_completion_func_t **attempted_completion_function;
+    rl_getc_func_t **getc_function;
+    rl_hook_func_t **startup_hook;
+};
+
+extern struct lineedit le;
+
+int lineedit_load(void);
+
+#endif
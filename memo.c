@@ -0,0 +1,696 @@
+/**
+ * @file
+ *
+ * Contains the memoized command output cache used by "memo command...". The
+ * cache key is a hash of the expanded arguments, the working directory, the
+ * environment variables named in $MEMO_ENV (PATH, LANG, and LC_ALL when it is
+ * unset), and the path, size, modification time, and content of every
+ * regular file named as an argument or input redirection (or read through a
+ * duplicated descriptor, as here-documents are), plus where each output
+ * redirection points. A hit replays the stored output with sendfile and
+ * skips the command; a miss runs the command with its stdout captured into a
+ * new entry, then replays that. The command's own output redirections (those
+ * of the last stage of a pipeline) are applied in the shell around both, so
+ * the replay goes where the command's output would have gone.
+ *
+ * Entries live in $XDG_CACHE_HOME/mash/memo (or ~/.cache/mash/memo), one file
+ * per key: a header, the command text, then the output. An entry's
+ * modification time is its last use, which eviction by age and size relies on.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "memo.h"
+#include "util.h"
+#include "vars.h"
+
+/* Identifies a cache entry and its format version */
+#define MEMO_MAGIC "MASHMO\x02"
+
+/* Environment variables in the key when $MEMO_ENV is unset */
+#define MEMO_DEFAULT_ENV "PATH LANG LC_ALL"
+
+/**
+ * Header at the start of every cache entry
+ */
+struct memo_header
+{
+    char magic[8];
+    int32_t status;
+    uint32_t command_len;
+    uint64_t output_len;
+};
+
+/**
+ * Running state of the 128-bit cache key: two 64-bit FNV-1a style lanes with
+ * different starting points and multipliers
+ */
+struct memo_key
+{
+    uint64_t a;
+    uint64_t b;
+};
+
+/**
+ * Describes a cache entry for listing and eviction
+ */
+struct memo_entry
+{
+    char name[40];
+    off_t size;
+    time_t used;
+    int status;
+    char command[64];
+};
+
+static char memo_dir[PATH_MAX];
+static char entry_path[PATH_MAX + 48];
+static char tmp_path[PATH_MAX + 64];
+static int pending_fd = -1;
+static off_t pending_start = 0;
+static struct redir_save saved_fds;
+static bool redirected = false;
+
+/**
+ * Adds bytes to a cache key
+ * @param key the key being built
+ * @param data the bytes to add
+ * @param len the number of bytes
+ */
+static void key_add(struct memo_key *key, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        key->a = (key->a ^ bytes[i]) * 0x100000001b3ULL;
+        key->b = (key->b ^ bytes[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+/**
+ * Adds a string and its terminator to a cache key, so adjacent strings
+ * cannot run together
+ * @param key the key being built
+ * @param str the string to add
+ */
+static void key_add_string(struct memo_key *key, const char *str)
+{
+    key_add(key, str, strlen(str) + 1);
+}
+
+/**
+ * Adds the content of an open regular file to a cache key
+ * @param key the key being built
+ * @param fd the file
+ * @param size the size of the file
+ */
+static void key_add_content(struct memo_key *key, int fd, off_t size)
+{
+    if (size > 0) {
+        void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            key_add(key, data, size);
+            munmap(data, size);
+        }
+    }
+}
+
+/**
+ * Adds a regular file's identity and content to a cache key. Anything that
+ * is not a readable regular file is left out.
+ * @param key the key being built
+ * @param path the file
+ */
+static void key_add_file(struct memo_key *key, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+    key_add_string(key, path);
+    int64_t meta[3] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+    key_add(key, meta, sizeof(meta));
+    key_add_content(key, fd, st.st_size);
+    close(fd);
+    LOG("Memo key includes file '%s'\n", path);
+}
+
+/**
+ * Adds where an output redirection points to a cache key: its operator and
+ * the target's path with the directory resolved, which stays the same
+ * whether or not the target exists yet
+ * @param key the key being built
+ * @param op the redirection operator
+ * @param path the target
+ */
+static void key_add_target(struct memo_key *key, const char *op, const char *path)
+{
+    char *copy = strdup(path);
+    char *dir_copy = strdup(path);
+    if (copy == NULL || dir_copy == NULL) {
+        free(copy);
+        free(dir_copy);
+        return;
+    }
+    char *dir = realpath(dirname(dir_copy), NULL);
+    key_add_string(key, op);
+    key_add_string(key, (dir != NULL) ? dir : "");
+    key_add_string(key, basename(copy));
+    free(dir);
+    free(copy);
+    free(dir_copy);
+}
+
+/**
+ * Adds the content of a regular file the command reads through "[N]<&FD",
+ * such as a here-document, to a cache key
+ * @param key the key being built
+ * @param tok the redirection token
+ */
+static void key_add_dup(struct memo_key *key, const char *tok)
+{
+    const char *dup = strstr(tok, "<&");
+    if (dup == NULL || dup[2] < '0' || dup[2] > '9') {
+        return;
+    }
+    int fd = atoi(dup + 2);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        int64_t size = st.st_size;
+        key_add(key, &size, sizeof(size));
+        key_add_content(key, fd, st.st_size);
+    }
+}
+
+/**
+ * Computes the cache key of a command
+ * @param args expanded command arguments
+ * @param hex receives the key as 32 hex digits
+ */
+static void compute_key(char *args[], char hex[33])
+{
+    struct memo_key key = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+    for (int i = 0; args[i] != NULL; i++) {
+        key_add_string(&key, args[i]);
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, PATH_MAX) != NULL) {
+        key_add_string(&key, cwd);
+    }
+
+    const char *names = var_get("MEMO_ENV");
+    char *copy = strdup((names != NULL) ? names : MEMO_DEFAULT_ENV);
+    char *state = NULL;
+    for (char *name = (copy != NULL) ? strtok_r(copy, " :", &state) : NULL; name != NULL;
+            name = strtok_r(NULL, " :", &state)) {
+        const char *value = getenv(name);
+        key_add_string(&key, name);
+        key_add_string(&key, (value != NULL) ? value : "");
+    }
+    free(copy);
+
+    /* Output redirection targets are written by the command, not read */
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t prev_len = strlen(args[i - 1]);
+        if (prev_len > 0 && args[i - 1][prev_len - 1] == '>' && is_redirection(args[i - 1])) {
+            key_add_target(&key, args[i - 1], args[i]);
+            continue;
+        }
+        key_add_file(&key, args[i]);
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        key_add_dup(&key, args[i]);
+    }
+    snprintf(hex, 33, "%016llx%016llx", (unsigned long long) key.a, (unsigned long long) key.b);
+}
+
+/**
+ * Works out (and creates, if needed) the cache directory
+ *
+ * @return 0 on success or -1 if there is no usable cache directory
+ */
+static int open_dir(void)
+{
+    if (memo_dir[0] != '\0') {
+        return 0;
+    }
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache != NULL && cache[0] == '/') {
+        snprintf(memo_dir, PATH_MAX, "%s/mash/memo", cache);
+    } else {
+        snprintf(memo_dir, PATH_MAX, "%s/.cache/mash/memo", (home != NULL) ? home : ".");
+    }
+    if (make_dirs(memo_dir) == -1) {
+        memo_dir[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copies part of a file to stdout, with sendfile where the kernel allows it
+ * @param fd the file to copy from
+ * @param offset where the data starts
+ * @param len the number of bytes to copy
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int copy_out(int fd, off_t offset, size_t len)
+{
+    fflush(stdout);
+    while (len > 0) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, len);
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            char buf[65536];
+            n = pread(fd, buf, (len < sizeof(buf)) ? len : sizeof(buf), offset);
+            if (n > 0 && write(STDOUT_FILENO, buf, n) != n) {
+                n = -1;
+            }
+            offset += (n > 0) ? n : 0;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("memo");
+            }
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Reads and checks the header of a cache entry
+ * @param fd the entry
+ * @param header receives the header
+ * @param size size of the entry file
+ *
+ * @return true if the entry is complete and in the current format
+ */
+static bool read_header(int fd, struct memo_header *header, off_t size)
+{
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header)) {
+        return false;
+    }
+    return memcmp(header->magic, MEMO_MAGIC, sizeof(header->magic)) == 0
+        && (off_t) (sizeof(*header) + header->command_len + header->output_len) == size;
+}
+
+/**
+ * Discards the entry being captured, if any
+ */
+static void discard_entry(void)
+{
+    if (pending_fd == -1) {
+        return;
+    }
+    close(pending_fd);
+    unlink(tmp_path);
+    pending_fd = -1;
+}
+
+/**
+ * Applies the redirections of the command's last stage to the shell, and
+ * removes them from its arguments, so its captured or replayed output goes
+ * where the command would have sent it
+ * @param args expanded command arguments
+ *
+ * @return 0 on success or -1 if a redirection failed
+ */
+static int redirect_output(char *args[])
+{
+    int last = 0;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (args[i][0] == '|') {
+            last = i + 1;
+        }
+    }
+    for (int i = last; args[i] != NULL; i++) {
+        if (is_redirection(args[i])) {
+            if (redirect_push(args + last, &saved_fds) == -1) {
+                return -1;
+            }
+            redirected = true;
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Looks a command up in the cache. On a hit the stored output is written to
+ * stdout; on a miss a new entry is opened to capture the command's output.
+ * Either way the redirections of the command's last stage are applied to the
+ * shell and removed from args until memo_finish() or memo_cancel().
+ * @param args expanded command arguments, without "memo"
+ * @param status receives the stored exit status on a hit
+ *
+ * @return 1 if the command was answered from the cache, 0 if it should run,
+ * or -1 if one of its redirections failed
+ */
+int memo_begin(char *args[], int *status)
+{
+    memo_cancel();
+    char key[33];
+    char command[4096] = "";
+    size_t command_len = 0;
+    bool usable = open_dir() == 0;
+    if (usable) {
+        compute_key(args, key);
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", memo_dir, key);
+        for (int i = 0; args[i] != NULL && command_len < sizeof(command) - 1; i++) {
+            command_len += snprintf(command + command_len, sizeof(command) - command_len,
+                    (i > 0) ? " %s" : "%s", args[i]);
+        }
+        command_len = strlen(command);
+    }
+    if (redirect_output(args) == -1) {
+        return -1;
+    }
+    if (usable == false) {
+        return 0;
+    }
+
+    int fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        struct memo_header header;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && read_header(fd, &header, st.st_size)) {
+            LOG("Memo hit: %s\n", key);
+            /* Touching the entry marks it used for eviction */
+            futimens(fd, NULL);
+            copy_out(fd, sizeof(header) + header.command_len, header.output_len);
+            close(fd);
+            *status = header.status;
+            return 1;
+        }
+        close(fd);
+    }
+
+    LOG("Memo miss: %s\n", key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.%d", memo_dir, key, getpid());
+    pending_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (pending_fd == -1) {
+        perror(tmp_path);
+        return 0;
+    }
+
+    struct memo_header header = { MEMO_MAGIC, 0, command_len, 0 };
+    if (write(pending_fd, &header, sizeof(header)) != sizeof(header)
+            || write(pending_fd, command, command_len) != (ssize_t) command_len) {
+        perror("memo");
+        discard_entry();
+        return 0;
+    }
+    pending_start = sizeof(header) + command_len;
+    return 0;
+}
+
+/**
+ * Checks if a command's output is being captured for the cache
+ *
+ * @return true if memo_begin() opened a new entry
+ */
+bool memo_capturing(void)
+{
+    return pending_fd != -1;
+}
+
+/**
+ * Points stdout at the entry being captured. Called in the child; any
+ * redirection of the last stage's stdout was already applied by the shell.
+ */
+void memo_redirect(void)
+{
+    if (pending_fd != -1 && dup2(pending_fd, STDOUT_FILENO) == -1) {
+        perror("dup2");
+    }
+}
+
+/**
+ * Completes the entry being captured: its output is written to stdout and,
+ * unless the command failed to start or was killed, the entry is kept. The
+ * redirections memo_begin() applied stay until memo_cancel().
+ * @param status exit status of the command
+ * @param keep false to discard the entry regardless of the status
+ */
+void memo_finish(int status, bool keep)
+{
+    if (pending_fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(pending_fd, &st) == -1) {
+        perror("fstat");
+        discard_entry();
+        return;
+    }
+    size_t output_len = st.st_size - pending_start;
+    copy_out(pending_fd, pending_start, output_len);
+
+    if (keep && status < 126) {
+        struct memo_header header = { MEMO_MAGIC, status, pending_start - sizeof(header), output_len };
+        if (pwrite(pending_fd, &header, sizeof(header), 0) == sizeof(header)
+                && rename(tmp_path, entry_path) == 0) {
+            close(pending_fd);
+            pending_fd = -1;
+            return;
+        }
+        perror("memo");
+    }
+    discard_entry();
+}
+
+/**
+ * Discards the entry being captured, if any, and puts back the descriptors
+ * memo_begin() redirected
+ */
+void memo_cancel(void)
+{
+    discard_entry();
+    if (redirected) {
+        redirect_pop(&saved_fds);
+        redirected = false;
+    }
+}
+
+/**
+ * Orders cache entries from most to least recently used
+ * @param a first entry
+ * @param b second entry
+ *
+ * @return comparison result for qsort
+ */
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct memo_entry *x = a;
+    const struct memo_entry *y = b;
+    return (x->used < y->used) - (x->used > y->used);
+}
+
+/**
+ * Reads every entry in the cache directory
+ * @param count receives the number of entries
+ *
+ * @return newly-allocated array of entries, most recently used first, or NULL
+ * if the cache is empty or cannot be read
+ */
+static struct memo_entry *list_entries(int *count)
+{
+    *count = 0;
+    if (open_dir() == -1) {
+        return NULL;
+    }
+    DIR *dir = opendir(memo_dir);
+    if (dir == NULL) {
+        perror(memo_dir);
+        return NULL;
+    }
+    struct memo_entry *entries = NULL;
+    int cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof(entries->name)) {
+            continue;
+        }
+        int fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        struct memo_header header;
+        if (fd == -1 || fstat(fd, &st) == -1 || read_header(fd, &header, st.st_size) == false) {
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+        if (*count == cap) {
+            cap = (cap == 0) ? 32 : cap * 2;
+            struct memo_entry *tmp = realloc(entries, cap * sizeof(struct memo_entry));
+            if (tmp == NULL) {
+                perror("realloc");
+                close(fd);
+                break;
+            }
+            entries = tmp;
+        }
+        struct memo_entry *entry = &entries[(*count)++];
+        strcpy(entry->name, ent->d_name);
+        entry->size = st.st_size;
+        entry->used = st.st_mtim.tv_sec;
+        entry->status = header.status;
+        size_t len = (header.command_len < sizeof(entry->command) - 1)
+            ? header.command_len : sizeof(entry->command) - 1;
+        ssize_t n = pread(fd, entry->command, len, sizeof(header));
+        entry->command[(n > 0) ? n : 0] = '\0';
+        close(fd);
+    }
+    closedir(dir);
+    if (*count > 0) {
+        qsort(entries, *count, sizeof(struct memo_entry), entry_cmp);
+    }
+    return entries;
+}
+
+/**
+ * Parses a size with an optional K, M, or G suffix
+ * @param spec the size to parse
+ * @param size receives the size in bytes
+ *
+ * @return 0 on success or -1 if the size is invalid
+ */
+static int parse_size(const char *spec, long long *size)
+{
+    char *end;
+    long long value = strtoll(spec, &end, 10);
+    if (end == spec || value < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    *size = value;
+    return (*end == '\0') ? 0 : -1;
+}
+
+/**
+ * Parses an age in seconds with an optional s, m, h, or d suffix
+ * @param spec the age to parse
+ * @param age receives the age in seconds
+ *
+ * @return 0 on success or -1 if the age is invalid
+ */
+static int parse_age(const char *spec, long long *age)
+{
+    char *end;
+    long long value = strtoll(spec, &end, 10);
+    if (end == spec || value < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 's': end++; break;
+        case 'm': value *= 60; end++; break;
+        case 'h': value *= 3600; end++; break;
+        case 'd': value *= 86400; end++; break;
+    }
+    *age = value;
+    return (*end == '\0') ? 0 : -1;
+}
+
+/**
+ * Removes one cache entry
+ * @param entry the entry to remove
+ */
+static void remove_entry(const struct memo_entry *entry)
+{
+    char path[PATH_MAX + 48];
+    snprintf(path, sizeof(path), "%s/%s", memo_dir, entry->name);
+    if (unlink(path) == -1 && errno != ENOENT) {
+        perror(path);
+    }
+}
+
+/**
+ * Handles the "memo" builtin options. "memo command..." itself is handled by
+ * the evaluator through memo_begin().
+ *
+ *   memo [-l]      lists entries, most recently used first
+ *   memo -s SIZE   evicts least recently used entries until the cache fits
+ *   memo -a AGE    evicts entries not used within AGE
+ *   memo -c        removes every entry
+ *
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int memo_handler(char *args[])
+{
+    long long limit = 0;
+    bool list = args[1] == NULL || strcmp(args[1], "-l") == 0;
+    bool clear = args[1] != NULL && strcmp(args[1], "-c") == 0;
+    bool by_size = args[1] != NULL && strcmp(args[1], "-s") == 0 && args[2] != NULL
+        && parse_size(args[2], &limit) == 0;
+    bool by_age = args[1] != NULL && strcmp(args[1], "-a") == 0 && args[2] != NULL
+        && parse_age(args[2], &limit) == 0;
+    if (list == false && clear == false && by_size == false && by_age == false) {
+        fprintf(stderr, "usage: memo COMMAND...\n"
+                "       memo [-l] | -s SIZE | -a AGE | -c\n");
+        return 1;
+    }
+
+    int count;
+    struct memo_entry *entries = list_entries(&count);
+    time_t now = time(NULL);
+    long long total = 0;
+    int removed = 0;
+    bool evicting = false;
+    for (int i = 0; i < count; i++) {
+        struct memo_entry *entry = &entries[i];
+        if (list) {
+            printf("%.16s %10lld %8llds %4d  %s\n", entry->name, (long long) entry->size,
+                    (long long) (now - entry->used), entry->status, entry->command);
+        } else if (clear || (by_age && now - entry->used > limit)
+                || (by_size && (evicting || total + entry->size > limit))) {
+            evicting = by_size;
+            remove_entry(entry);
+            removed++;
+            continue;
+        }
+        total += entry->size;
+    }
+    if (list) {
+        printf("%d entries, %lld bytes in %s\n", count, total, memo_dir);
+    } else {
+        printf("removed %d entries, %lld bytes kept\n", removed, total);
+    }
+    fflush(stdout);
+    free(entries);
+    return 0;
+}
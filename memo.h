@@ -0,0 +1,19 @@
+/**
+ * @file
+ *
+ * Contains function headers for the memoized command output cache.
+ */
+
+#ifndef _MEMO_H_
+#define _MEMO_H_
+
+#include <stdbool.h>
+
+int memo_begin(char *args[], int *status);
+bool memo_capturing(void);
+void memo_redirect(void);
+void memo_finish(int status, bool keep);
+void memo_cancel(void);
+int memo_handler(char *args[]);
+
+#endif
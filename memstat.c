@@ -0,0 +1,201 @@
+/**
+ * @file
+ *
+ * Contains allocation accounting by subsystem. Each tracked allocation is
+ * charged to a tag using the allocator's own record of the block size
+ * (malloc_usable_size), so no header is added to the allocation. Counters are
+ * atomic because the completion worker thread allocates too.
+ */
+
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "memstat.h"
+
+/**
+ * Stores the counters for one subsystem
+ */
+struct mem_counter
+{
+    _Atomic size_t live;
+    _Atomic size_t peak;
+    _Atomic size_t allocs;
+    _Atomic size_t frees;
+};
+
+static struct mem_counter counters[MEM_TAGS];
+
+static const char *tag_names[MEM_TAGS] = {
+    [MEM_HISTORY] = "history",
+    [MEM_PARSER] = "parser",
+    [MEM_JOBS] = "jobs",
+    [MEM_UI] = "ui",
+    [MEM_COMPLETION] = "completion",
+    [MEM_DIRS] = "dirs",
+};
+
+/**
+ * Adds a block to a subsystem's live bytes and raises its peak if needed
+ * @param tag the subsystem
+ * @param bytes usable size of the block
+ */
+static void charge(enum mem_tag tag, size_t bytes)
+{
+    struct mem_counter *c = &counters[tag];
+    size_t live = atomic_fetch_add(&c->live, bytes) + bytes;
+    size_t peak = atomic_load(&c->peak);
+    while (live > peak && atomic_compare_exchange_weak(&c->peak, &peak, live) == false);
+}
+
+/**
+ * Charges an existing block to a subsystem, for memory allocated by code that
+ * does not use these functions (getline, readline, other modules)
+ * @param tag the subsystem that now owns the block
+ * @param ptr the block, or NULL
+ */
+void mem_adopt(enum mem_tag tag, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    charge(tag, malloc_usable_size(ptr));
+    atomic_fetch_add(&counters[tag].allocs, 1);
+}
+
+/**
+ * Stops charging a block to a subsystem without freeing it, for memory handed
+ * to code that frees it with plain free()
+ * @param tag the subsystem that owned the block
+ * @param ptr the block, or NULL
+ */
+void mem_release(enum mem_tag tag, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    atomic_fetch_sub(&counters[tag].live, malloc_usable_size(ptr));
+    atomic_fetch_add(&counters[tag].frees, 1);
+}
+
+/**
+ * Allocates memory charged to a subsystem
+ * @param tag the subsystem
+ * @param size number of bytes
+ *
+ * @return the block or NULL on failure
+ */
+void *mem_malloc(enum mem_tag tag, size_t size)
+{
+    void *ptr = malloc(size);
+    mem_adopt(tag, ptr);
+    return ptr;
+}
+
+/**
+ * Allocates zeroed memory charged to a subsystem
+ * @param tag the subsystem
+ * @param count number of elements
+ * @param size size of each element
+ *
+ * @return the block or NULL on failure
+ */
+void *mem_calloc(enum mem_tag tag, size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+    mem_adopt(tag, ptr);
+    return ptr;
+}
+
+/**
+ * Resizes memory charged to a subsystem
+ * @param tag the subsystem
+ * @param ptr the block to resize, or NULL
+ * @param size new number of bytes
+ *
+ * @return the resized block, or NULL on failure (ptr is then left unchanged)
+ */
+void *mem_realloc(enum mem_tag tag, void *ptr, size_t size)
+{
+    size_t old = (ptr != NULL) ? malloc_usable_size(ptr) : 0;
+    void *tmp = realloc(ptr, size);
+    if (tmp == NULL) {
+        return NULL;
+    }
+    if (ptr == NULL) {
+        atomic_fetch_add(&counters[tag].allocs, 1);
+    }
+    atomic_fetch_sub(&counters[tag].live, old);
+    charge(tag, malloc_usable_size(tmp));
+    return tmp;
+}
+
+/**
+ * Duplicates a string into memory charged to a subsystem
+ * @param tag the subsystem
+ * @param str the string to copy
+ *
+ * @return the copy or NULL on failure
+ */
+char *mem_strdup(enum mem_tag tag, const char *str)
+{
+    char *copy = strdup(str);
+    mem_adopt(tag, copy);
+    return copy;
+}
+
+/**
+ * Frees memory charged to a subsystem
+ * @param tag the subsystem
+ * @param ptr the block, or NULL
+ */
+void mem_free(enum mem_tag tag, void *ptr)
+{
+    mem_release(tag, ptr);
+    free(ptr);
+}
+
+/**
+ * Handles the "stats" builtin. With no arguments it prints a table of live
+ * bytes, peak bytes, and allocation counts per subsystem, plus the allocator's
+ * total in-use heap. "stats -j" prints the same data as one line of JSON.
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int stats_handler(char *args[])
+{
+    bool json = false;
+    if (args[1] != NULL && strcmp(args[1], "-j") == 0 && args[2] == NULL) {
+        json = true;
+    } else if (args[1] != NULL) {
+        fprintf(stderr, "usage: stats [-j]\n");
+        return 1;
+    }
+
+    struct mallinfo2 info = mallinfo2();
+    if (json) {
+        printf("{");
+        for (int i = 0; i < MEM_TAGS; i++) {
+            printf("\"%s\":{\"live\":%zu,\"peak\":%zu,\"allocs\":%zu,\"frees\":%zu},",
+                    tag_names[i], atomic_load(&counters[i].live),
+                    atomic_load(&counters[i].peak), atomic_load(&counters[i].allocs),
+                    atomic_load(&counters[i].frees));
+        }
+        printf("\"heap\":{\"in_use\":%zu,\"mapped\":%zu}}\n", info.uordblks, info.hblkhd);
+    } else {
+        printf("%-12s %12s %12s %10s %10s\n", "subsystem", "live", "peak", "allocs", "frees");
+        for (int i = 0; i < MEM_TAGS; i++) {
+            printf("%-12s %12zu %12zu %10zu %10zu\n", tag_names[i],
+                    atomic_load(&counters[i].live), atomic_load(&counters[i].peak),
+                    atomic_load(&counters[i].allocs), atomic_load(&counters[i].frees));
+        }
+        printf("%-12s %12zu\n", "heap", info.uordblks + info.hblkhd);
+    }
+    fflush(stdout);
+    return 0;
+}
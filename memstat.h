@@ -0,0 +1,35 @@
+/**
+ * @file
+ *
+ * Contains the allocation accounting used to track memory by subsystem.
+ */
+
+#ifndef _MEMSTAT_H_
+#define _MEMSTAT_H_
+
+#include <stddef.h>
+
+/**
+ * Subsystems that allocations are charged to
+ */
+enum mem_tag
+{
+    MEM_HISTORY,
+    MEM_PARSER,
+    MEM_JOBS,
+    MEM_UI,
+    MEM_COMPLETION,
+    MEM_DIRS,
+    MEM_TAGS,
+};
+
+void *mem_malloc(enum mem_tag tag, size_t size);
+void *mem_calloc(enum mem_tag tag, size_t count, size_t size);
+void *mem_realloc(enum mem_tag tag, void *ptr, size_t size);
+char *mem_strdup(enum mem_tag tag, const char *str);
+void mem_free(enum mem_tag tag, void *ptr);
+void mem_adopt(enum mem_tag tag, void *ptr);
+void mem_release(enum mem_tag tag, void *ptr);
+int stats_handler(char *args[]);
+
+#endif
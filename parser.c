@@ -0,0 +1,1290 @@
+/**
+ * @file
+ *
+ * Contains a recursive descent parser that turns tokenized command lines into
+ * a syntax tree. Simple commands end at ";", "&", ";;", "&&", "||", or the
+ * end of a line. Function definitions are parsed like compound commands.
+ * Compound commands may span lines; the parser pulls more lines from its
+ * reader until the construct is closed. Here-document bodies are read from
+ * the lines that follow the command. Every string in the tree is a copy, so
+ * a parsed tree can be run many times after its input lines are freed.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arith.h"
+#include "logger.h"
+#include "memstat.h"
+#include "parser.h"
+#include "util.h"
+#include "vars.h"
+
+/* Returned by peek() at the end of an input line */
+static char newline_tok[] = "\n";
+
+/**
+ * Stores an input line read by the parser so it can be freed afterwards
+ */
+struct held_line
+{
+    char *command;
+    char **args;
+    struct held_line *next;
+};
+
+/**
+ * Stores the state of a parse in progress
+ */
+struct parser
+{
+    char **args;
+    int pos;
+    int count;
+    int depth;
+    bool eof;
+    bool error;
+    bool unclosed;
+    line_reader reader;
+    struct held_line *held;
+};
+
+static struct node *parse_command(struct parser *p);
+
+/**
+ * Notes if a line opens an arithmetic expansion without closing it. The line
+ * is still parsed to its end so an open compound command is read in full,
+ * then rejected.
+ * @param p the parser
+ * @param args the line's tokens
+ * @param count the number of tokens
+ */
+static void check_arith(struct parser *p, char *args[], int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (arith_unclosed(args[i]) != NULL) {
+            p->unclosed = true;
+        }
+    }
+}
+
+/**
+ * Retrieves the current token without consuming it
+ * @param p the parser
+ *
+ * @return the current token, newline_tok at the end of a line, or NULL at the
+ * end of input
+ */
+static char *peek(struct parser *p)
+{
+    if (p->eof) {
+        return NULL;
+    }
+    if (p->pos < p->count) {
+        return p->args[p->pos];
+    }
+    return newline_tok;
+}
+
+/**
+ * Consumes the current token. Moving past the end of a line reads the next
+ * line, which only happens inside an unfinished compound command.
+ * @param p the parser
+ */
+static void advance(struct parser *p)
+{
+    if (p->pos < p->count) {
+        p->pos++;
+        return;
+    }
+    if (p->depth == 0 || p->reader == NULL) {
+        p->eof = true;
+        return;
+    }
+
+    char **args = NULL;
+    int tokens = 0;
+    char *command = p->reader(&args, &tokens);
+    struct held_line *line = mem_malloc(MEM_PARSER, sizeof(struct held_line));
+    if (command == NULL || line == NULL) {
+        mem_free(MEM_UI, command);
+        mem_free(MEM_PARSER, args);
+        mem_free(MEM_PARSER, line);
+        p->eof = true;
+        return;
+    }
+    line->command = command;
+    line->args = args;
+    line->next = p->held;
+    p->held = line;
+    p->args = args;
+    p->pos = 0;
+    p->count = tokens;
+    check_arith(p, args, tokens);
+}
+
+/**
+ * Reports a syntax error at the current token
+ * @param p the parser
+ */
+static void syntax_error(struct parser *p)
+{
+    if (p->error == false) {
+        char *tok = peek(p);
+        if (tok == NULL) {
+            fprintf(stderr, "mash: syntax error: unexpected end of file\n");
+        } else if (tok == newline_tok) {
+            fprintf(stderr, "mash: syntax error near unexpected newline\n");
+        } else {
+            fprintf(stderr, "mash: syntax error near unexpected token '%s'\n", tok);
+        }
+    }
+    p->error = true;
+}
+
+/**
+ * Checks if the current token equals a string
+ * @param p the parser
+ * @param word the string to compare against
+ *
+ * @return true if the current token is word
+ */
+static bool at(struct parser *p, const char *word)
+{
+    char *tok = peek(p);
+    return tok != NULL && tok != newline_tok && strcmp(tok, word) == 0;
+}
+
+/**
+ * Consumes a required keyword
+ * @param p the parser
+ * @param word the keyword that must come next
+ *
+ * @return true if the keyword was found, false after reporting an error
+ */
+static bool expect(struct parser *p, const char *word)
+{
+    if (at(p, word) == false) {
+        syntax_error(p);
+        return false;
+    }
+    advance(p);
+    return true;
+}
+
+/**
+ * Checks if a token is a reserved word that cannot start a command
+ * @param tok the token to check
+ *
+ * @return true if the token closes or continues a compound command
+ */
+static bool is_reserved(const char *tok)
+{
+    const char *reserved[] = { "then", "elif", "else", "fi", "do", "done", "esac", ";;", "}" };
+    for (size_t i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++) {
+        if (strcmp(tok, reserved[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks if a token is one of the words that end the current list
+ * @param tok the token to check
+ * @param stops NULL-terminated list of words, or NULL for none
+ *
+ * @return true if tok is in stops
+ */
+static bool is_stop(const char *tok, const char *const *stops)
+{
+    for (int i = 0; stops != NULL && stops[i] != NULL; i++) {
+        if (strcmp(tok, stops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Copies a NULL-terminated array of strings
+ * @param src the strings to copy
+ * @param count the number of strings
+ *
+ * @return newly-allocated copy or NULL on failure
+ */
+static char **copy_strings(char **src, int count)
+{
+    char **dst = mem_calloc(MEM_PARSER, count + 1, sizeof(char *));
+    if (dst == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        if ((dst[i] = mem_strdup(MEM_PARSER, src[i])) == NULL) {
+            perror("strdup");
+            for (int j = 0; j < i; j++) {
+                mem_free(MEM_PARSER, dst[j]);
+            }
+            mem_free(MEM_PARSER, dst);
+            return NULL;
+        }
+    }
+    return dst;
+}
+
+/**
+ * Frees a NULL-terminated array of strings and the strings themselves
+ * @param strings the array to free
+ */
+static void free_strings(char **strings)
+{
+    if (strings == NULL) {
+        return;
+    }
+    for (int i = 0; strings[i] != NULL; i++) {
+        mem_free(MEM_PARSER, strings[i]);
+    }
+    mem_free(MEM_PARSER, strings);
+}
+
+/**
+ * Allocates an empty syntax tree node
+ * @param type the kind of node
+ *
+ * @return the new node or NULL on failure
+ */
+static struct node *node_new(enum node_type type)
+{
+    struct node *node = mem_calloc(MEM_PARSER, 1, sizeof(struct node));
+    if (node == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    node->type = type;
+    return node;
+}
+
+/**
+ * Consumes an "&&" or "||" after a command and records it on the command.
+ * The command that follows may be on the next line.
+ * @param p the parser
+ * @param node the command before the operator
+ *
+ * @return true if an operator was consumed
+ */
+static bool parse_and_or(struct parser *p, struct node *node)
+{
+    if (at(p, "&&")) {
+        node->op = LIST_AND;
+    } else if (at(p, "||")) {
+        node->op = LIST_OR;
+    } else {
+        return false;
+    }
+    p->depth++;
+    advance(p);
+    while (peek(p) == newline_tok) {
+        advance(p);
+    }
+    p->depth--;
+
+    char *tok = peek(p);
+    if (tok == NULL || strcmp(tok, ";") == 0) {
+        syntax_error(p);
+    }
+    return true;
+}
+
+/**
+ * Parses commands separated by ";", "&", "&&", "||", or newlines until one of
+ * the stop words (or, at the top level, the end of the line) is reached
+ * @param p the parser
+ * @param stops NULL-terminated list of words that end the list, or NULL
+ *
+ * @return the first node of the list (NULL if it is empty or on error)
+ */
+static struct node *parse_list(struct parser *p, const char *const *stops)
+{
+    struct node *head = NULL;
+    struct node **tail = &head;
+    while (p->error == false) {
+        char *tok = peek(p);
+        if (tok == NULL) {
+            break;
+        }
+        if (tok == newline_tok) {
+            if (p->depth == 0) {
+                break;
+            }
+            advance(p);
+            continue;
+        }
+        if (strcmp(tok, ";") == 0) {
+            advance(p);
+            continue;
+        }
+        if (is_stop(tok, stops)) {
+            break;
+        }
+
+        struct node *node = parse_command(p);
+        if (node == NULL) {
+            break;
+        }
+        *tail = node;
+        tail = &node->next;
+
+        if (parse_and_or(p, node)) {
+            continue;
+        } else if (at(p, "&")) {
+            node->background = true;
+            advance(p);
+        } else if (at(p, ";")) {
+            advance(p);
+        }
+    }
+    if (p->error) {
+        node_free(head);
+        return NULL;
+    }
+    return head;
+}
+
+/**
+ * Checks if a token opens a process substitution
+ * @param tok the token to check
+ *
+ * @return true if the token starts with "<(" or ">("
+ */
+static bool is_procsub(const char *tok)
+{
+    return (tok[0] == '<' || tok[0] == '>') && tok[1] == '(';
+}
+
+/**
+ * Counts the parentheses a token opens minus those it closes
+ * @param tok the token
+ *
+ * @return the change in nesting depth
+ */
+static int paren_change(const char *tok)
+{
+    int change = 0;
+    for (const char *c = tok; *c != '\0'; c++) {
+        change += (*c == '(') - (*c == ')');
+    }
+    return change;
+}
+
+/**
+ * Collects the process substitutions of a simple command. The tokens from
+ * "<(" or ">(" up to the matching ")" are parsed as a list of their own and
+ * replaced in the arguments by a bare "<(" or ">(".
+ * @param p the parser
+ * @param node the command, with its arguments copied
+ *
+ * @return true on success, false on error
+ */
+static bool parse_procsubs(struct parser *p, struct node *node)
+{
+    struct procsub **tail = &node->procsubs;
+    for (int i = 0; i < node->tokens; i++) {
+        if (is_procsub(node->args[i]) == false) {
+            continue;
+        }
+        int depth = 0;
+        int end = i;
+        while (end < node->tokens && (depth += paren_change(node->args[end])) > 0) {
+            end++;
+        }
+        size_t last_len = (end < node->tokens) ? strlen(node->args[end]) : 0;
+        if (depth != 0 || node->args[end][last_len - 1] != ')') {
+            fprintf(stderr, "mash: syntax error: unterminated process substitution\n");
+            return false;
+        }
+
+        /* The inner tokens, without the "<(" and the closing ")" */
+        node->args[end][last_len - 1] = '\0';
+        char *inner[end - i + 2];
+        int count = 0;
+        for (int j = i; j <= end; j++) {
+            char *tok = (j == i) ? node->args[j] + 2 : node->args[j];
+            if (*tok != '\0') {
+                inner[count++] = tok;
+            }
+        }
+        inner[count] = NULL;
+
+        struct parser sub = { 0 };
+        sub.args = inner;
+        sub.count = count;
+        struct node *list = parse_list(&sub, NULL);
+        if (sub.error == false && (list == NULL || sub.pos < sub.count)) {
+            syntax_error(&sub);
+        }
+        struct procsub *ps = (sub.error) ? NULL : mem_calloc(MEM_PARSER, 1, sizeof(struct procsub));
+        if (ps == NULL) {
+            node_free(list);
+            return false;
+        }
+        ps->list = list;
+        ps->output = (node->args[i][0] == '>');
+        *tail = ps;
+        tail = &ps->next;
+
+        node->args[i][2] = '\0';
+        for (int j = i + 1; j <= end; j++) {
+            mem_free(MEM_PARSER, node->args[j]);
+        }
+        memmove(node->args + i + 1, node->args + end + 1, (node->tokens - end) * sizeof(char *));
+        node->tokens -= end - i;
+    }
+    return true;
+}
+
+/**
+ * Kinds of here-document operators
+ */
+enum heredoc_kind
+{
+    HEREDOC_NONE,
+    HEREDOC_DOC,
+    HEREDOC_STRIP_TABS,
+    HEREDOC_STRING,
+};
+
+/**
+ * Recognizes a here-document ("[N]<<WORD" or "[N]<<-WORD") or here-string
+ * ("[N]<<<WORD") operator. The word may also be the next token.
+ * @param tok the token to check
+ * @param op_len receives the length of the operator, including any
+ * descriptor number
+ *
+ * @return the kind of operator, or HEREDOC_NONE if tok is not one
+ */
+static enum heredoc_kind heredoc_operator(const char *tok, size_t *op_len)
+{
+    size_t digits = strspn(tok, "0123456789");
+    if (strncmp(tok + digits, "<<", 2) != 0) {
+        return HEREDOC_NONE;
+    }
+    *op_len = digits + 3;
+    if (tok[digits + 2] == '<') {
+        return HEREDOC_STRING;
+    } else if (tok[digits + 2] == '-') {
+        return HEREDOC_STRIP_TABS;
+    }
+    *op_len = digits + 2;
+    return HEREDOC_DOC;
+}
+
+/**
+ * Reads a here-document body from the lines after the current one, up to a
+ * line that is exactly the delimiter
+ * @param p the parser
+ * @param delim the delimiter
+ * @param strip_tabs whether leading tabs are removed from every line
+ *
+ * @return the newly-allocated body, one newline after each line, or NULL on
+ * failure
+ */
+static char *read_heredoc(struct parser *p, const char *delim, bool strip_tabs)
+{
+    size_t len = 0;
+    size_t cap = 64;
+    char *body = mem_malloc(MEM_PARSER, cap);
+    if (body == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    body[0] = '\0';
+    for (;;) {
+        char *line = (p->reader != NULL) ? p->reader(NULL, NULL) : NULL;
+        if (line == NULL) {
+            fprintf(stderr, "mash: here-document ended by end of file (wanted '%s')\n", delim);
+            break;
+        }
+        char *text = line;
+        while (strip_tabs && *text == '\t') {
+            text++;
+        }
+        if (strcmp(text, delim) == 0) {
+            mem_free(MEM_UI, line);
+            break;
+        }
+        size_t text_len = strlen(text);
+        if (len + text_len + 2 > cap) {
+            while (len + text_len + 2 > cap) {
+                cap *= 2;
+            }
+            char *tmp = mem_realloc(MEM_PARSER, body, cap);
+            if (tmp == NULL) {
+                perror("realloc");
+                mem_free(MEM_UI, line);
+                mem_free(MEM_PARSER, body);
+                return NULL;
+            }
+            body = tmp;
+        }
+        memcpy(body + len, text, text_len);
+        len += text_len;
+        body[len++] = '\n';
+        body[len] = '\0';
+        mem_free(MEM_UI, line);
+    }
+    LOG("Read %zu byte here-document\n", len);
+    return body;
+}
+
+/**
+ * Collects the here-documents and here-strings of a simple command. Each
+ * operator is cut down to "[N]<<" and its word removed from the arguments;
+ * the body is kept in the node instead. Variables are expanded in
+ * here-strings and in here-documents whose delimiter has no quotes.
+ * @param p the parser
+ * @param node the command, with its arguments copied
+ *
+ * @return true on success, false on error
+ */
+static bool parse_heredocs(struct parser *p, struct node *node)
+{
+    struct heredoc **tail = &node->heredocs;
+    for (int i = 0; i < node->tokens; i++) {
+        size_t op_len;
+        enum heredoc_kind kind = heredoc_operator(node->args[i], &op_len);
+        if (kind == HEREDOC_NONE) {
+            continue;
+        }
+        char *word = node->args[i] + op_len;
+        bool separate = (*word == '\0');
+        if (separate && i + 1 == node->tokens) {
+            syntax_error(p);
+            return false;
+        }
+        if (separate) {
+            word = node->args[i + 1];
+        }
+
+        struct heredoc *doc = mem_calloc(MEM_PARSER, 1, sizeof(struct heredoc));
+        if (doc == NULL) {
+            perror("calloc");
+            return false;
+        }
+        *tail = doc;
+        tail = &doc->next;
+        if (kind == HEREDOC_STRING) {
+            doc->expand = true;
+            if ((doc->body = mem_malloc(MEM_PARSER, strlen(word) + 2)) != NULL) {
+                sprintf(doc->body, "%s\n", word);
+            }
+        } else {
+            /* Quoting any part of the delimiter turns off expansion */
+            char delim[strlen(word) + 1];
+            size_t len = 0;
+            for (char *c = word; *c != '\0'; c++) {
+                if (*c != '\'' && *c != '"' && *c != '\\') {
+                    delim[len++] = *c;
+                }
+            }
+            delim[len] = '\0';
+            doc->expand = (len == strlen(word));
+            doc->body = read_heredoc(p, delim, kind == HEREDOC_STRIP_TABS);
+        }
+        if (doc->body == NULL) {
+            return false;
+        }
+
+        node->args[i][strspn(node->args[i], "0123456789") + 2] = '\0';
+        if (separate) {
+            mem_free(MEM_PARSER, node->args[i + 1]);
+            memmove(node->args + i + 1, node->args + i + 2, (node->tokens - i - 1) * sizeof(char *));
+            node->tokens--;
+        }
+    }
+    return true;
+}
+
+/**
+ * Checks if a token ends a command
+ * @param tok the token to check
+ *
+ * @return true for ";", "&", ";;", "&&", and "||"
+ */
+static bool is_separator(const char *tok)
+{
+    return strcmp(tok, ";") == 0 || strcmp(tok, "&") == 0 || strcmp(tok, ";;") == 0
+        || strcmp(tok, "&&") == 0 || strcmp(tok, "||") == 0;
+}
+
+/**
+ * Parses a simple command: every token up to the next separator
+ * @param p the parser
+ *
+ * @return the command node or NULL on error
+ */
+static struct node *parse_simple(struct parser *p)
+{
+    int start = p->pos;
+    int depth = 0;
+    while (p->pos < p->count) {
+        char *tok = p->args[p->pos];
+        /* Separators inside a process substitution belong to it */
+        if (depth == 0 && is_separator(tok)) {
+            break;
+        }
+        if (depth > 0 || is_procsub(tok)) {
+            depth += paren_change(tok);
+            depth = (depth < 0) ? 0 : depth;
+        }
+        p->pos++;
+    }
+
+    struct node *node = node_new(NODE_COMMAND);
+    if (node == NULL) {
+        p->error = true;
+        return NULL;
+    }
+    node->tokens = p->pos - start;
+    if ((node->args = copy_strings(p->args + start, node->tokens)) == NULL) {
+        p->error = true;
+        mem_free(MEM_PARSER, node);
+        return NULL;
+    }
+    if (parse_procsubs(p, node) == false || parse_heredocs(p, node) == false) {
+        p->error = true;
+        node_free(node);
+        return NULL;
+    }
+
+    size_t text_sz = 1;
+    for (int i = 0; i < node->tokens; i++) {
+        text_sz += strlen(node->args[i]) + 1;
+        if (node->args[i][0] == '|') {
+            node->pipes = true;
+        }
+    }
+    if ((node->text = mem_malloc(MEM_PARSER, text_sz)) == NULL) {
+        perror("malloc");
+        p->error = true;
+        node_free(node);
+        return NULL;
+    }
+    node->text[0] = '\0';
+    for (int i = 0; i < node->tokens; i++) {
+        if (i > 0) {
+            strcat(node->text, " ");
+        }
+        strcat(node->text, node->args[i]);
+    }
+    return node;
+}
+
+/**
+ * Parses "if LIST then LIST [elif LIST then LIST]... [else LIST] fi". An elif
+ * is parsed as a nested if in the else branch that shares the closing fi.
+ * @param p the parser (positioned at "if" or "elif")
+ *
+ * @return the if node or NULL on error
+ */
+static struct node *parse_if(struct parser *p)
+{
+    const char *const cond_stops[] = { "then", NULL };
+    const char *const body_stops[] = { "elif", "else", "fi", NULL };
+    const char *const else_stops[] = { "fi", NULL };
+
+    struct node *node = node_new(NODE_IF);
+    if (node == NULL) {
+        p->error = true;
+        return NULL;
+    }
+    p->depth++;
+    advance(p);
+    node->cond = parse_list(p, cond_stops);
+    if (expect(p, "then")) {
+        node->body = parse_list(p, body_stops);
+    }
+    if (p->error == false) {
+        if (at(p, "elif")) {
+            node->else_body = parse_if(p);
+            p->depth--;
+            if (p->error) {
+                node_free(node);
+                return NULL;
+            }
+            return node;
+        }
+        if (at(p, "else")) {
+            advance(p);
+            node->else_body = parse_list(p, else_stops);
+        }
+    }
+    if (p->error == false) {
+        expect(p, "fi");
+    }
+    p->depth--;
+    if (p->error) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parses "while LIST do LIST done" or "until LIST do LIST done"
+ * @param p the parser (positioned at "while" or "until")
+ *
+ * @return the loop node or NULL on error
+ */
+static struct node *parse_while(struct parser *p)
+{
+    const char *const cond_stops[] = { "do", NULL };
+    const char *const body_stops[] = { "done", NULL };
+
+    struct node *node = node_new(at(p, "while") ? NODE_WHILE : NODE_UNTIL);
+    if (node == NULL) {
+        p->error = true;
+        return NULL;
+    }
+    p->depth++;
+    advance(p);
+    node->cond = parse_list(p, cond_stops);
+    if (expect(p, "do")) {
+        node->body = parse_list(p, body_stops);
+    }
+    if (p->error == false) {
+        expect(p, "done");
+    }
+    p->depth--;
+    if (p->error) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parses "for NAME in WORD... ; do LIST done"
+ * @param p the parser (positioned at "for")
+ *
+ * @return the loop node or NULL on error
+ */
+static struct node *parse_for(struct parser *p)
+{
+    const char *const body_stops[] = { "done", NULL };
+
+    struct node *node = node_new(NODE_FOR);
+    if (node == NULL) {
+        p->error = true;
+        return NULL;
+    }
+    p->depth++;
+    advance(p);
+
+    char *name = peek(p);
+    if (name == NULL || name == newline_tok || is_reserved(name)
+            || (node->var = mem_strdup(MEM_PARSER, name)) == NULL) {
+        syntax_error(p);
+    } else {
+        advance(p);
+    }
+
+    if (p->error == false && expect(p, "in")) {
+        int start = p->pos;
+        while (p->pos < p->count && strcmp(p->args[p->pos], ";") != 0) {
+            p->pos++;
+        }
+        if ((node->words = copy_strings(p->args + start, p->pos - start)) == NULL) {
+            p->error = true;
+        }
+    }
+    while (p->error == false && (at(p, ";") || peek(p) == newline_tok)) {
+        advance(p);
+    }
+    if (p->error == false && expect(p, "do")) {
+        node->body = parse_list(p, body_stops);
+    }
+    if (p->error == false) {
+        expect(p, "done");
+    }
+    p->depth--;
+    if (p->error) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parses "case WORD in PATTERN[|PATTERN]...) LIST ;; ... esac". Each pattern
+ * group must be a single token ending in ")", optionally starting with "(".
+ * @param p the parser (positioned at "case")
+ *
+ * @return the case node or NULL on error
+ */
+static struct node *parse_case(struct parser *p)
+{
+    const char *const body_stops[] = { ";;", "esac", NULL };
+
+    struct node *node = node_new(NODE_CASE);
+    if (node == NULL) {
+        p->error = true;
+        return NULL;
+    }
+    p->depth++;
+    advance(p);
+
+    char *word = peek(p);
+    if (word == NULL || word == newline_tok || (node->word = mem_strdup(MEM_PARSER, word)) == NULL) {
+        syntax_error(p);
+    } else {
+        advance(p);
+        expect(p, "in");
+    }
+
+    struct case_item **tail = &node->items;
+    while (p->error == false) {
+        char *tok = peek(p);
+        if (tok == newline_tok || (tok != NULL && strcmp(tok, ";") == 0)) {
+            advance(p);
+            continue;
+        }
+        if (at(p, "esac")) {
+            advance(p);
+            break;
+        }
+        size_t len = (tok != NULL) ? strlen(tok) : 0;
+        if (len < 2 || tok[len - 1] != ')') {
+            syntax_error(p);
+            break;
+        }
+
+        struct case_item *item = mem_calloc(MEM_PARSER, 1, sizeof(struct case_item));
+        char *group = strndup(tok + (tok[0] == '(' ? 1 : 0), len - 1 - (tok[0] == '(' ? 1 : 0));
+        if (item == NULL || group == NULL) {
+            perror("calloc");
+            mem_free(MEM_PARSER, item);
+            free(group);
+            p->error = true;
+            break;
+        }
+        *tail = item;
+        tail = &item->next;
+
+        int count = 1;
+        for (char *c = group; *c != '\0'; c++) {
+            count += (*c == '|');
+        }
+        if ((item->patterns = mem_calloc(MEM_PARSER, count + 1, sizeof(char *))) == NULL) {
+            perror("calloc");
+            free(group);
+            p->error = true;
+            break;
+        }
+        char *next = group;
+        for (int i = 0; i < count; i++) {
+            char *bar = strchr(next, '|');
+            if (bar != NULL) {
+                *bar = '\0';
+            }
+            if ((item->patterns[i] = mem_strdup(MEM_PARSER, next)) == NULL) {
+                perror("strdup");
+                p->error = true;
+                break;
+            }
+            next = (bar != NULL) ? bar + 1 : next + strlen(next);
+        }
+        free(group);
+        if (p->error) {
+            break;
+        }
+        advance(p);
+
+        item->body = parse_list(p, body_stops);
+        if (at(p, ";;")) {
+            advance(p);
+        }
+    }
+    p->depth--;
+    if (p->error) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Checks if the current token starts a function definition: "function NAME",
+ * "NAME()", or "NAME ()"
+ * @param p the parser
+ *
+ * @return true if a function definition follows
+ */
+static bool at_function(struct parser *p)
+{
+    char *tok = peek(p);
+    size_t len = strlen(tok);
+    if (strcmp(tok, "function") == 0) {
+        return true;
+    }
+    if (len > 2 && strcmp(tok + len - 2, "()") == 0) {
+        return var_valid_name(tok, len - 2);
+    }
+    return p->pos + 1 < p->count && strcmp(p->args[p->pos + 1], "()") == 0
+        && var_valid_name(tok, len);
+}
+
+/**
+ * Parses "NAME() { LIST }" or "function NAME [()] { LIST }". The "{" may be
+ * on a later line, and "}" must come where a command could start.
+ * @param p the parser (positioned at "function" or the name)
+ *
+ * @return the function node or NULL on error
+ */
+static struct node *parse_function(struct parser *p)
+{
+    const char *const body_stops[] = { "}", NULL };
+
+    struct node *node = node_new(NODE_FUNCTION);
+    if (node == NULL) {
+        p->error = true;
+        return NULL;
+    }
+    p->depth++;
+    bool keyword = at(p, "function");
+    if (keyword) {
+        advance(p);
+    }
+
+    char *name = peek(p);
+    size_t len = (name != NULL && name != newline_tok) ? strlen(name) : 0;
+    if (len > 2 && strcmp(name + len - 2, "()") == 0) {
+        len -= 2;
+    }
+    if (len == 0 || var_valid_name(name, len) == false) {
+        syntax_error(p);
+    } else if ((node->var = mem_malloc(MEM_PARSER, len + 1)) == NULL) {
+        perror("malloc");
+        p->error = true;
+    } else {
+        memcpy(node->var, name, len);
+        node->var[len] = '\0';
+        advance(p);
+        if (at(p, "()")) {
+            advance(p);
+        }
+    }
+    while (p->error == false && peek(p) == newline_tok) {
+        advance(p);
+    }
+    if (p->error == false && expect(p, "{")) {
+        node->body = parse_list(p, body_stops);
+    }
+    if (p->error == false) {
+        expect(p, "}");
+    }
+    p->depth--;
+    if (p->error) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Collects the redirections after a compound command ("done < file"), up to
+ * the next separator. Here-documents are read as for a simple command.
+ * @param p the parser (positioned after the command's closing keyword)
+ * @param node the compound command
+ *
+ * @return the node, or NULL on error (the node is then freed)
+ */
+static struct node *parse_redirections(struct parser *p, struct node *node)
+{
+    if (node == NULL) {
+        return NULL;
+    }
+    int start = p->pos;
+    while (p->pos < p->count) {
+        char *tok = p->args[p->pos];
+        size_t op_len;
+        enum heredoc_kind kind = heredoc_operator(tok, &op_len);
+        if (kind != HEREDOC_NONE) {
+            p->pos += (tok[op_len] == '\0') ? 2 : 1;
+        } else if (is_redirection(tok)) {
+            /* "[N]>&M" and "[N]<&-" have no file operand */
+            bool dup = strchr(tok, '&') != NULL && tok[0] != '&';
+            p->pos += dup ? 1 : 2;
+        } else {
+            break;
+        }
+    }
+    if (p->pos > p->count) {
+        p->pos = p->count;
+        syntax_error(p);
+    } else if (p->pos < p->count && is_separator(p->args[p->pos]) == false
+            && is_reserved(p->args[p->pos]) == false) {
+        syntax_error(p);
+    }
+    if (p->error == false && p->pos > start) {
+        node->tokens = p->pos - start;
+        if ((node->args = copy_strings(p->args + start, node->tokens)) == NULL) {
+            p->error = true;
+        } else if (parse_heredocs(p, node) == false) {
+            p->error = true;
+        }
+    }
+    if (p->error) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+/**
+ * Parses a single simple or compound command
+ * @param p the parser
+ *
+ * @return the command node or NULL on error
+ */
+static struct node *parse_command(struct parser *p)
+{
+    char *tok = peek(p);
+    if (strcmp(tok, "if") == 0) {
+        return parse_redirections(p, parse_if(p));
+    } else if (strcmp(tok, "while") == 0 || strcmp(tok, "until") == 0) {
+        return parse_redirections(p, parse_while(p));
+    } else if (strcmp(tok, "for") == 0) {
+        return parse_redirections(p, parse_for(p));
+    } else if (strcmp(tok, "case") == 0) {
+        return parse_redirections(p, parse_case(p));
+    } else if (at_function(p)) {
+        return parse_function(p);
+    } else if (is_reserved(tok) || strcmp(tok, "&") == 0 || strcmp(tok, "&&") == 0
+            || strcmp(tok, "||") == 0) {
+        syntax_error(p);
+        return NULL;
+    }
+    return parse_simple(p);
+}
+
+/**
+ * Parses a tokenized input line into a syntax tree, reading further lines
+ * from the reader while a compound command is left open
+ * @param args NULL-terminated tokens of the first line (still owned by the caller)
+ * @param tokens the number of tokens
+ * @param reader supplies continuation lines, or NULL if there are none
+ * @param error set to true if the input could not be parsed
+ *
+ * @return the first node of the parsed list, or NULL if the line was empty or
+ * invalid
+ */
+struct node *parse_line(char *args[], int tokens, line_reader reader, bool *error)
+{
+    struct parser p = { 0 };
+    p.args = args;
+    p.count = tokens;
+    p.reader = reader;
+    check_arith(&p, args, tokens);
+
+    struct node *list = parse_list(&p, NULL);
+    if (p.error == false && p.pos < p.count) {
+        /* A stray closing keyword stopped the list early */
+        syntax_error(&p);
+        node_free(list);
+        list = NULL;
+    }
+    if (p.error == false && p.unclosed) {
+        fprintf(stderr, "mash: syntax error: unterminated $((\n");
+        p.error = true;
+        node_free(list);
+        list = NULL;
+    }
+
+    while (p.held != NULL) {
+        struct held_line *line = p.held;
+        p.held = line->next;
+        mem_free(MEM_UI, line->command);
+        mem_free(MEM_PARSER, line->args);
+        mem_free(MEM_PARSER, line);
+    }
+    *error = p.error;
+    return list;
+}
+
+/**
+ * Copies a string that may be NULL
+ * @param dst receives the copy
+ * @param src the string, or NULL
+ *
+ * @return true on success, false if memory could not be allocated
+ */
+static bool copy_string(char **dst, const char *src)
+{
+    if (src == NULL) {
+        *dst = NULL;
+        return true;
+    }
+    if ((*dst = mem_strdup(MEM_PARSER, src)) == NULL) {
+        perror("strdup");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Copies a NULL-terminated array of strings that may itself be NULL
+ * @param dst receives the copy
+ * @param src the strings, or NULL
+ *
+ * @return true on success, false if memory could not be allocated
+ */
+static bool copy_array(char ***dst, char **src)
+{
+    if (src == NULL) {
+        *dst = NULL;
+        return true;
+    }
+    int count = 0;
+    while (src[count] != NULL) {
+        count++;
+    }
+    return (*dst = copy_strings(src, count)) != NULL;
+}
+
+/**
+ * Copies a list that may be empty
+ * @param dst receives the copy
+ * @param src the first node of the list, or NULL
+ *
+ * @return true on success, false if memory could not be allocated
+ */
+static bool copy_list(struct node **dst, const struct node *src)
+{
+    *dst = node_copy(src);
+    return src == NULL || *dst != NULL;
+}
+
+/**
+ * Copies a list of syntax tree nodes and everything they own, so the copy
+ * outlives the tree it was taken from (function bodies, for instance)
+ * @param src the first node of the list
+ *
+ * @return the copy, or NULL if src is NULL or memory could not be allocated
+ */
+struct node *node_copy(const struct node *src)
+{
+    struct node *head = NULL;
+    struct node **tail = &head;
+    for (; src != NULL; src = src->next) {
+        struct node *node = node_new(src->type);
+        if (node == NULL) {
+            goto fail;
+        }
+        *tail = node;
+        tail = &node->next;
+        node->op = src->op;
+        node->tokens = src->tokens;
+        node->pipes = src->pipes;
+        node->background = src->background;
+        if (copy_array(&node->args, src->args) == false || copy_string(&node->text, src->text) == false
+                || copy_list(&node->cond, src->cond) == false
+                || copy_list(&node->body, src->body) == false
+                || copy_list(&node->else_body, src->else_body) == false
+                || copy_string(&node->var, src->var) == false
+                || copy_array(&node->words, src->words) == false
+                || copy_string(&node->word, src->word) == false) {
+            goto fail;
+        }
+
+        struct heredoc **doc_tail = &node->heredocs;
+        for (struct heredoc *doc = src->heredocs; doc != NULL; doc = doc->next) {
+            struct heredoc *copy = mem_calloc(MEM_PARSER, 1, sizeof(struct heredoc));
+            if (copy == NULL) {
+                perror("calloc");
+                goto fail;
+            }
+            *doc_tail = copy;
+            doc_tail = &copy->next;
+            copy->expand = doc->expand;
+            if (copy_string(&copy->body, doc->body) == false) {
+                goto fail;
+            }
+        }
+        struct procsub **sub_tail = &node->procsubs;
+        for (struct procsub *sub = src->procsubs; sub != NULL; sub = sub->next) {
+            struct procsub *copy = mem_calloc(MEM_PARSER, 1, sizeof(struct procsub));
+            if (copy == NULL) {
+                perror("calloc");
+                goto fail;
+            }
+            *sub_tail = copy;
+            sub_tail = &copy->next;
+            copy->output = sub->output;
+            if (copy_list(&copy->list, sub->list) == false) {
+                goto fail;
+            }
+        }
+        struct case_item **item_tail = &node->items;
+        for (struct case_item *item = src->items; item != NULL; item = item->next) {
+            struct case_item *copy = mem_calloc(MEM_PARSER, 1, sizeof(struct case_item));
+            if (copy == NULL) {
+                perror("calloc");
+                goto fail;
+            }
+            *item_tail = copy;
+            item_tail = &copy->next;
+            if (copy_array(&copy->patterns, item->patterns) == false
+                    || copy_list(&copy->body, item->body) == false) {
+                goto fail;
+            }
+        }
+    }
+    return head;
+
+fail:
+    node_free(head);
+    return NULL;
+}
+
+/**
+ * Frees a list of syntax tree nodes and everything they own
+ * @param node the first node of the list
+ */
+void node_free(struct node *node)
+{
+    while (node != NULL) {
+        struct node *next = node->next;
+        free_strings(node->args);
+        mem_free(MEM_PARSER, node->text);
+        while (node->heredocs != NULL) {
+            struct heredoc *doc = node->heredocs;
+            node->heredocs = doc->next;
+            mem_free(MEM_PARSER, doc->body);
+            mem_free(MEM_PARSER, doc);
+        }
+        while (node->procsubs != NULL) {
+            struct procsub *ps = node->procsubs;
+            node->procsubs = ps->next;
+            node_free(ps->list);
+            mem_free(MEM_PARSER, ps);
+        }
+        node_free(node->cond);
+        node_free(node->body);
+        node_free(node->else_body);
+        mem_free(MEM_PARSER, node->var);
+        free_strings(node->words);
+        mem_free(MEM_PARSER, node->word);
+        while (node->items != NULL) {
+            struct case_item *item = node->items;
+            node->items = item->next;
+            free_strings(item->patterns);
+            node_free(item->body);
+            mem_free(MEM_PARSER, item);
+        }
+        mem_free(MEM_PARSER, node);
+        node = next;
+    }
+}
@@ -0,0 +1,123 @@
+/**
+ * @file
+ *
+ * Contains the syntax tree and function headers for parsing command lines,
+ * including the if, while, until, for, and case compound commands and
+ * function definitions.
+ */
+
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <stdbool.h>
+
+/**
+ * Kinds of syntax tree nodes
+ */
+enum node_type
+{
+    NODE_COMMAND,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_UNTIL,
+    NODE_FOR,
+    NODE_CASE,
+    NODE_FUNCTION,
+};
+
+/**
+ * How a node in a list is joined to the node after it: ";" (or "&", or a
+ * newline) always runs the next node, "&&" runs it only if this one
+ * succeeded, and "||" only if this one failed
+ */
+enum list_op
+{
+    LIST_SEQ,
+    LIST_AND,
+    LIST_OR,
+};
+
+/**
+ * Stores one arm of a case command: its patterns and the list it runs
+ */
+struct case_item
+{
+    char **patterns;
+    struct node *body;
+    struct case_item *next;
+};
+
+/**
+ * Stores the body of a here-document or here-string. A command's bodies are
+ * kept in the order their "[N]<<" operators appear in its arguments.
+ */
+struct heredoc
+{
+    char *body;
+    bool expand;
+    struct heredoc *next;
+};
+
+/**
+ * Stores a process substitution: the list it runs and whether the command
+ * reads its output ("<(list)") or writes to its input (">(list)"). A
+ * command's substitutions are kept in the order their "<(" and ">(" tokens
+ * appear in its arguments.
+ */
+struct procsub
+{
+    struct node *list;
+    bool output;
+    struct procsub *next;
+};
+
+/**
+ * Stores a parsed command. Nodes in a list are chained through next, and op
+ * tells how each one is joined to the next.
+ *
+ * NODE_COMMAND uses args, tokens, pipes, background, text, heredocs, and
+ * procsubs.
+ * NODE_IF uses cond, body, and else_body; NODE_WHILE and NODE_UNTIL use cond
+ * and body. NODE_FOR uses var, words, and body. NODE_CASE uses word and items.
+ * NODE_FUNCTION, a function definition, uses var for the name and body.
+ * The other compound commands keep the redirections that follow them, which
+ * apply to the whole command, in args, tokens, and heredocs.
+ */
+struct node
+{
+    enum node_type type;
+    struct node *next;
+    enum list_op op;
+
+    char **args;
+    int tokens;
+    bool pipes;
+    bool background;
+    char *text;
+    struct heredoc *heredocs;
+    struct procsub *procsubs;
+
+    struct node *cond;
+    struct node *body;
+    struct node *else_body;
+
+    char *var;
+    char **words;
+    char *word;
+    struct case_item *items;
+};
+
+/**
+ * Supplies the next input line to the parser when a compound command spans
+ * several lines. Returns the raw line (freed by the parser) and sets args to
+ * its NULL-terminated tokens (also freed by the parser), or returns NULL at
+ * the end of input. When args is NULL the line is returned as typed, without
+ * tokenizing, for here-document bodies.
+ */
+typedef char *(*line_reader)(char ***args, int *tokens);
+
+struct node *parse_line(char *args[], int tokens, line_reader reader, bool *error);
+struct node *node_copy(const struct node *src);
+void node_free(struct node *node);
+
+#endif
@@ -0,0 +1,285 @@
+/**
+ * @file
+ *
+ * Contains the pipe sizing policy for pipelines. Pipes can keep the kernel
+ * default, use a fixed capacity, use the largest capacity allowed by
+ * /proc/sys/fs/pipe-max-size, or grow adaptively when a stage keeps finding
+ * its pipe full.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "pipesize.h"
+
+/* Used when /proc/sys/fs/pipe-max-size cannot be read */
+#define PIPE_MAX_FALLBACK (1024 * 1024)
+
+/* Time between samples of the pipe fill levels in adaptive mode */
+#define ADAPT_INTERVAL_MS 10
+
+/* Consecutive full samples before a pipe edge is enlarged */
+#define ADAPT_STALL_SAMPLES 5
+
+static struct pipe_size_policy global_policy = { PIPE_SIZE_DEFAULT, 0 };
+static struct pipe_size_policy override_policy = { PIPE_SIZE_DEFAULT, 0 };
+static bool override_set = false;
+static bool debug = false;
+static long max_size = 0;
+
+/**
+ * Retrieves the policy that applies to the pipeline being started
+ *
+ * @return pointer to the per-pipeline override if set, otherwise the global policy
+ */
+static struct pipe_size_policy *current_policy(void)
+{
+    return override_set ? &override_policy : &global_policy;
+}
+
+/**
+ * Reads the largest pipe capacity an unprivileged process may request
+ *
+ * @return the maximum pipe size in bytes
+ */
+long pipesize_max(void)
+{
+    if (max_size > 0) {
+        return max_size;
+    }
+    max_size = PIPE_MAX_FALLBACK;
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (file != NULL) {
+        long value;
+        if (fscanf(file, "%ld", &value) == 1 && value > 0) {
+            max_size = value;
+        }
+        fclose(file);
+    }
+    return max_size;
+}
+
+/**
+ * Parses a pipe size specification: "default", "max", "adaptive", or a byte
+ * count with an optional K or M suffix
+ * @param spec the specification to parse
+ * @param policy receives the parsed policy
+ *
+ * @return 0 on success or -1 if the specification is invalid
+ */
+int pipesize_parse(const char *spec, struct pipe_size_policy *policy)
+{
+    if (strcmp(spec, "default") == 0) {
+        policy->mode = PIPE_SIZE_DEFAULT;
+    } else if (strcmp(spec, "max") == 0) {
+        policy->mode = PIPE_SIZE_MAX;
+    } else if (strcmp(spec, "adaptive") == 0) {
+        policy->mode = PIPE_SIZE_ADAPTIVE;
+    } else {
+        char *end;
+        long bytes = strtol(spec, &end, 10);
+        if (end == spec || bytes <= 0) {
+            return -1;
+        }
+        if (*end == 'k' || *end == 'K') {
+            bytes *= 1024;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            bytes *= 1024 * 1024;
+            end++;
+        }
+        if (*end != '\0') {
+            return -1;
+        }
+        policy->mode = PIPE_SIZE_FIXED;
+        policy->bytes = bytes;
+    }
+    return 0;
+}
+
+/**
+ * Sets a policy that only applies to the next pipeline started
+ * @param spec pipe size specification (see pipesize_parse())
+ *
+ * @return 0 on success or -1 if the specification is invalid
+ */
+int pipesize_override(const char *spec)
+{
+    if (pipesize_parse(spec, &override_policy) == -1) {
+        fprintf(stderr, "pipesize: invalid size '%s'\n", spec);
+        return -1;
+    }
+    override_set = true;
+    return 0;
+}
+
+/**
+ * Removes the per-pipeline policy so the global policy applies again
+ */
+void pipesize_clear_override(void)
+{
+    override_set = false;
+}
+
+/**
+ * Checks if pipelines should be monitored and grown adaptively
+ *
+ * @return true if the current policy is adaptive
+ */
+bool pipesize_adaptive(void)
+{
+    return current_policy()->mode == PIPE_SIZE_ADAPTIVE;
+}
+
+/**
+ * Sets the capacity of a newly created pipe according to the current policy
+ * and reports it when the debug listing is enabled
+ * @param fd either end of the pipe
+ * @param edge index of the pipe within the pipeline
+ * @param producer name of the command writing to the pipe
+ * @param consumer name of the command reading from the pipe
+ */
+void pipesize_apply(int fd, int edge, char *producer, char *consumer)
+{
+    struct pipe_size_policy *policy = current_policy();
+    long bytes = 0;
+    if (policy->mode == PIPE_SIZE_FIXED) {
+        bytes = (policy->bytes < pipesize_max()) ? policy->bytes : pipesize_max();
+    } else if (policy->mode == PIPE_SIZE_MAX) {
+        bytes = pipesize_max();
+    }
+    if (bytes > 0 && fcntl(fd, F_SETPIPE_SZ, (int) bytes) == -1) {
+        perror("F_SETPIPE_SZ");
+    }
+    if (debug) {
+        fprintf(stderr, "pipesize: edge %d (%s | %s): %d bytes\n",
+                edge, producer, consumer, fcntl(fd, F_GETPIPE_SZ));
+    }
+}
+
+/**
+ * Supervises a running pipeline in adaptive mode. The fill level of every
+ * edge is sampled periodically, and an edge found full for several samples
+ * in a row has its capacity doubled, up to the system maximum. An edge is
+ * released as soon as its consumer exits so that writers see EPIPE. Exits
+ * with the status of the last stage once every stage has finished.
+ * @param edges read ends of each pipe edge (stages - 1 of them)
+ * @param pids process IDs of every stage in order
+ * @param stages the number of stages in the pipeline
+ */
+void pipesize_monitor(int *edges, pid_t *pids, int stages)
+{
+    int *stalls = calloc(stages, sizeof(int));
+    int running = stages;
+    int last_status = 0;
+    struct timespec interval = { 0, ADAPT_INTERVAL_MS * 1000000L };
+
+    while (running > 0) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < stages; i++) {
+                if (pids[i] != pid) {
+                    continue;
+                }
+                pids[i] = -1;
+                running--;
+                if (i == stages - 1) {
+                    last_status = status;
+                }
+                if (i > 0 && edges[i - 1] != -1) {
+                    close(edges[i - 1]);
+                    edges[i - 1] = -1;
+                }
+            }
+        }
+        if (running == 0) {
+            break;
+        }
+
+        for (int i = 0; i < stages - 1; i++) {
+            if (edges[i] == -1) {
+                continue;
+            }
+            int avail = 0;
+            int size = fcntl(edges[i], F_GETPIPE_SZ);
+            if (size <= 0 || ioctl(edges[i], FIONREAD, &avail) == -1) {
+                continue;
+            }
+            /* Partially filled pages mean a full pipe can hold slightly
+             * less than its capacity, so anything past 7/8 counts. */
+            if (avail < size - size / 8) {
+                stalls[i] = 0;
+                continue;
+            }
+            if (++stalls[i] < ADAPT_STALL_SAMPLES || size >= pipesize_max()) {
+                continue;
+            }
+            long grown = (long) size * 2;
+            if (grown > pipesize_max()) {
+                grown = pipesize_max();
+            }
+            if (fcntl(edges[i], F_SETPIPE_SZ, (int) grown) != -1 && debug) {
+                fprintf(stderr, "pipesize: edge %d grown to %d bytes\n",
+                        i, fcntl(edges[i], F_GETPIPE_SZ));
+            }
+            stalls[i] = 0;
+        }
+        nanosleep(&interval, NULL);
+    }
+
+    free(stalls);
+    if (WIFSIGNALED(last_status)) {
+        _exit(128 + WTERMSIG(last_status));
+    }
+    _exit(WEXITSTATUS(last_status));
+}
+
+/**
+ * Shows or changes the pipe sizing policy. Usage:
+ *   pipesize                  show the global policy and system limit
+ *   pipesize SPEC             set the global policy
+ *   pipesize -d on|off        toggle the listing of chosen sizes on stderr
+ * A pipeline prefixed with "pipesize SPEC" is handled in main() and only uses
+ * SPEC for that pipeline.
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int pipesize_handler(char *args[])
+{
+    if (args[1] == NULL) {
+        const char *names[] = { "default", "fixed", "max", "adaptive" };
+        printf("policy: %s", names[global_policy.mode]);
+        if (global_policy.mode == PIPE_SIZE_FIXED) {
+            printf(" (%ld bytes)", global_policy.bytes);
+        }
+        printf("\nmaximum: %ld bytes\ndebug: %s\n", pipesize_max(), debug ? "on" : "off");
+        fflush(stdout);
+    } else if (strcmp(args[1], "-d") == 0) {
+        if (args[2] != NULL && strcmp(args[2], "on") == 0) {
+            debug = true;
+        } else if (args[2] != NULL && strcmp(args[2], "off") == 0) {
+            debug = false;
+        } else {
+            fprintf(stderr, "usage: pipesize -d on|off\n");
+            return 1;
+        }
+    } else if (pipesize_parse(args[1], &global_policy) == -1) {
+        fprintf(stderr, "pipesize: invalid size '%s'\n", args[1]);
+        return 1;
+    }
+    return 0;
+}
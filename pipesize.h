@@ -0,0 +1,42 @@
+/**
+ * @file
+ *
+ * Contains function headers for choosing the capacity of pipeline pipes.
+ */
+
+#ifndef _PIPESIZE_H_
+#define _PIPESIZE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Ways of sizing the pipes that connect pipeline stages
+ */
+enum pipe_size_mode
+{
+    PIPE_SIZE_DEFAULT,
+    PIPE_SIZE_FIXED,
+    PIPE_SIZE_MAX,
+    PIPE_SIZE_ADAPTIVE,
+};
+
+/**
+ * Stores a pipe sizing policy; bytes is only used by PIPE_SIZE_FIXED
+ */
+struct pipe_size_policy
+{
+    enum pipe_size_mode mode;
+    long bytes;
+};
+
+long pipesize_max(void);
+int pipesize_parse(const char *spec, struct pipe_size_policy *policy);
+int pipesize_override(const char *spec);
+void pipesize_clear_override(void);
+bool pipesize_adaptive(void);
+void pipesize_apply(int fd, int edge, char *producer, char *consumer);
+void pipesize_monitor(int *edges, pid_t *pids, int stages);
+int pipesize_handler(char *args[]);
+
+#endif
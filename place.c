@@ -0,0 +1,407 @@
+/**
+ * @file
+ *
+ * Contains CPU placement and priorities for commands. A policy chooses the
+ * CPUs each stage of a pipeline may run on: an explicit list, "spread" (one
+ * CPU per stage, rotating through the allowed CPUs so concurrent pipelines
+ * land on different cores), or "pack" (every stage on the socket the shell is
+ * running on, so they share a cache). It can also lower the CPU priority with
+ * a nice increment and set the I/O scheduling class. The settings are applied
+ * in each child with sched_setaffinity, nice and ioprio_set, either for one
+ * command given as a prefix or as the session default for background jobs.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "place.h"
+#include "util.h"
+
+/* ioprio_set() encoding, from linux/ioprio.h */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/* I/O priority level used when a class is given without one */
+#define PLACE_IO_LEVEL 4
+
+/**
+ * Ways of choosing the CPUs a command's stages may run on
+ */
+enum place_mode
+{
+    PLACE_INHERIT,
+    PLACE_LIST,
+    PLACE_SPREAD,
+    PLACE_PACK,
+};
+
+/**
+ * Stores a placement policy: the CPU mode and the CPUs it chooses from
+ * (empty for the shell's own affinity), the nice increment, the I/O priority
+ * in ioprio_set() encoding (-1 to leave it unchanged), and the options as
+ * given, for display
+ */
+struct place_policy
+{
+    enum place_mode mode;
+    cpu_set_t cpus;
+    int nice;
+    int ioprio;
+    char cpus_spec[64];
+    char io_spec[16];
+};
+
+static const struct place_policy empty_policy = { PLACE_INHERIT, { { 0 } }, 0, -1, "", "" };
+static struct place_policy background_policy = { PLACE_INHERIT, { { 0 } }, 0, -1, "", "" };
+static struct place_policy override_policy;
+static bool override_set = false;
+
+/* Policy of the command being started and the CPUs resolved for it; children inherit both */
+static const struct place_policy *active = NULL;
+static cpu_set_t active_cpus;
+static int first_cpu = 0;
+
+/* Where the next spread pipeline starts, so concurrent ones use different CPUs */
+static unsigned int rotation = 0;
+
+/**
+ * Parses a CPU list such as "0-3,8"
+ * @param spec the list
+ * @param set receives the CPUs
+ *
+ * @return 0 on success or -1 if the list is invalid
+ */
+static int parse_cpu_list(const char *spec, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = spec;
+    do {
+        char *end;
+        long from = strtol(p, &end, 10);
+        long to = from;
+        if (end == p || from < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if (end == p || to < from) {
+                return -1;
+            }
+        }
+        if (to >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = from; cpu <= to; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        p = end;
+    } while (*p++ == ',');
+    return (p[-1] == '\0') ? 0 : -1;
+}
+
+/**
+ * Parses the value of -c: "spread", "pack" or a CPU list, where the first
+ * two may be followed by ":LIST" to choose from those CPUs only
+ * @param spec the value
+ * @param policy receives the mode and CPUs
+ *
+ * @return 0 on success or -1 if the value is invalid
+ */
+static int parse_cpus(const char *spec, struct place_policy *policy)
+{
+    const char *list = spec;
+    CPU_ZERO(&policy->cpus);
+    if (strncmp(spec, "spread", 6) == 0 && (spec[6] == '\0' || spec[6] == ':')) {
+        policy->mode = PLACE_SPREAD;
+        list = (spec[6] == ':') ? spec + 7 : NULL;
+    } else if (strncmp(spec, "pack", 4) == 0 && (spec[4] == '\0' || spec[4] == ':')) {
+        policy->mode = PLACE_PACK;
+        list = (spec[4] == ':') ? spec + 5 : NULL;
+    } else {
+        policy->mode = PLACE_LIST;
+    }
+    if (list != NULL && parse_cpu_list(list, &policy->cpus) == -1) {
+        return -1;
+    }
+    snprintf(policy->cpus_spec, sizeof(policy->cpus_spec), "%s", spec);
+    return 0;
+}
+
+/**
+ * Parses the value of -i: "idle", "be" or "rt", optionally followed by
+ * ":LEVEL" from 0 (highest) to 7
+ * @param spec the value
+ * @param policy receives the I/O priority
+ *
+ * @return 0 on success or -1 if the value is invalid
+ */
+static int parse_ioprio(const char *spec, struct place_policy *policy)
+{
+    const char *names[] = { "rt", "be", "idle" };
+    for (int class = 1; class <= 3; class++) {
+        size_t len = strlen(names[class - 1]);
+        if (strncmp(spec, names[class - 1], len) != 0) {
+            continue;
+        }
+        long level = PLACE_IO_LEVEL;
+        if (spec[len] == ':') {
+            char *end;
+            level = strtol(spec + len + 1, &end, 10);
+            if (end == spec + len + 1 || *end != '\0' || level < 0 || level > 7) {
+                return -1;
+            }
+        } else if (spec[len] != '\0') {
+            return -1;
+        }
+        policy->ioprio = (class << IOPRIO_CLASS_SHIFT) | (int) level;
+        snprintf(policy->io_spec, sizeof(policy->io_spec), "%s", spec);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Parses placement options: [-c spread|pack|CPUS] [-n NICE] [-i CLASS[:LEVEL]]
+ * @param args command arguments
+ * @param start index of the first option
+ * @param policy receives the settings
+ *
+ * @return index of the first argument after the options, or -1 if they are
+ * invalid
+ */
+static int parse_options(char *args[], int start, struct place_policy *policy)
+{
+    int i = start;
+    for (; args[i] != NULL && args[i][0] == '-'; i += 2) {
+        const char *value = args[i + 1];
+        int result = -1;
+        if (value == NULL) {
+            result = -1;
+        } else if (strcmp(args[i], "-c") == 0) {
+            result = parse_cpus(value, policy);
+        } else if (strcmp(args[i], "-n") == 0) {
+            char *end;
+            long nice = strtol(value, &end, 10);
+            if (end != value && *end == '\0' && nice >= -39 && nice <= 39) {
+                policy->nice = (int) nice;
+                result = 0;
+            }
+        } else if (strcmp(args[i], "-i") == 0) {
+            result = parse_ioprio(value, policy);
+        }
+        if (result == -1) {
+            fprintf(stderr, "place: invalid option '%s%s%s'\n", args[i],
+                    (value != NULL) ? " " : "", (value != NULL) ? value : "");
+            return -1;
+        }
+    }
+    if (i == start) {
+        fprintf(stderr, "usage: place [-c spread|pack|CPUS] [-n NICE] [-i CLASS[:LEVEL]] COMMAND...\n"
+                "       place -b [OPTIONS]|off\n");
+        return -1;
+    }
+    return i;
+}
+
+/**
+ * Handles a "place ..." prefix in front of a command. The settings apply to
+ * that command only.
+ * @param args command arguments
+ *
+ * @return the number of arguments making up the prefix, 0 if args does not
+ * start with a prefix (including "place" without a command, which the
+ * builtin handles), or -1 if the prefix is invalid
+ */
+int place_prefix(char *args[])
+{
+    if (strcmp(args[0], "place") != 0 || args[1] == NULL || strcmp(args[1], "-b") == 0
+            || is_redirection(args[1])) {
+        return 0;
+    }
+    struct place_policy policy = empty_policy;
+    int used = parse_options(args, 1, &policy);
+    if (used == -1) {
+        return -1;
+    }
+    if (args[used] == NULL || is_redirection(args[used])) {
+        return 0;
+    }
+    override_policy = policy;
+    override_set = true;
+    return used;
+}
+
+/**
+ * Removes the per-command settings so the session default applies again
+ */
+void place_clear_override(void)
+{
+    override_set = false;
+}
+
+/**
+ * Reads which socket a CPU belongs to
+ * @param cpu the CPU number
+ *
+ * @return the physical package ID, or -1 if it is unknown
+ */
+static int cpu_socket(int cpu)
+{
+    char path[80];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int socket = -1;
+    if (fscanf(file, "%d", &socket) != 1) {
+        socket = -1;
+    }
+    fclose(file);
+    return socket;
+}
+
+/**
+ * Chooses the policy for the command about to be started and resolves the
+ * CPUs it may use. Called in the shell before forking, so the rotation of
+ * spread pipelines advances.
+ * @param cmds the command's pipeline stages
+ * @param background true if the command runs in the background
+ */
+void place_begin(struct command_line *cmds, bool background)
+{
+    active = override_set ? &override_policy : (background ? &background_policy : NULL);
+    if (active == NULL || active->mode == PLACE_INHERIT) {
+        return;
+    }
+    active_cpus = active->cpus;
+    if (CPU_COUNT(&active_cpus) == 0
+            && sched_getaffinity(0, sizeof(active_cpus), &active_cpus) == -1) {
+        perror("place: sched_getaffinity");
+        active = NULL;
+        return;
+    }
+
+    if (active->mode == PLACE_PACK) {
+        /* Keep the socket the shell is on if it is allowed, else the first allowed one */
+        int home = sched_getcpu();
+        if (home == -1 || CPU_ISSET(home, &active_cpus) == 0) {
+            for (home = 0; home < CPU_SETSIZE && CPU_ISSET(home, &active_cpus) == 0; home++);
+        }
+        int socket = cpu_socket(home);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &active_cpus) && cpu_socket(cpu) != socket) {
+                CPU_CLR(cpu, &active_cpus);
+            }
+        }
+        LOG("Packing on socket %d, %d CPUs\n", socket, CPU_COUNT(&active_cpus));
+    } else if (active->mode == PLACE_SPREAD) {
+        int stages = 1;
+        while (cmds[stages - 1].stdout_pipe) {
+            stages++;
+        }
+        first_cpu = rotation % CPU_COUNT(&active_cpus);
+        rotation += stages;
+    }
+}
+
+/**
+ * Applies the placement and priorities of the current command to the calling
+ * process. Called in each stage's process before it runs.
+ * @param stage index of the stage within its pipeline
+ * @param several true if the stage runs several processes ("|N>"), which
+ * share the whole set instead of getting one CPU each when spread
+ */
+void place_apply(int stage, bool several)
+{
+    if (active == NULL) {
+        return;
+    }
+    if (active->mode != PLACE_INHERIT) {
+        cpu_set_t set = active_cpus;
+        if (active->mode == PLACE_SPREAD && several == false) {
+            /* Lower numbers are usually distinct cores, with SMT siblings after them */
+            int pick = (first_cpu + stage) % CPU_COUNT(&active_cpus);
+            int cpu = 0;
+            for (; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &active_cpus) && pick-- == 0) {
+                    break;
+                }
+            }
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            perror("place: sched_setaffinity");
+        }
+    }
+    errno = 0;
+    if (active->nice != 0 && nice(active->nice) == -1 && errno != 0) {
+        perror("place: nice");
+    }
+    if (active->ioprio != -1
+            && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, active->ioprio) == -1) {
+        perror("place: ioprio_set");
+    }
+}
+
+/**
+ * Handles the "place" builtin. With no arguments it prints the default for
+ * background jobs; "place -b OPTIONS" sets it and "place -b off" removes it.
+ * Options in front of a command apply to that command instead (handled by
+ * place_prefix()).
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on invalid usage
+ */
+int place_handler(char *args[])
+{
+    if (args[1] == NULL) {
+        struct place_policy *policy = &background_policy;
+        if (policy->mode == PLACE_INHERIT && policy->nice == 0 && policy->ioprio == -1) {
+            printf("background: off\n");
+        } else {
+            printf("background:");
+            if (policy->mode != PLACE_INHERIT) {
+                printf(" -c %s", policy->cpus_spec);
+            }
+            if (policy->nice != 0) {
+                printf(" -n %d", policy->nice);
+            }
+            if (policy->ioprio != -1) {
+                printf(" -i %s", policy->io_spec);
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if (strcmp(args[1], "-b") == 0 && args[2] != NULL && strcmp(args[2], "off") == 0
+            && args[3] == NULL) {
+        background_policy = empty_policy;
+        return 0;
+    }
+    struct place_policy policy = empty_policy;
+    int start = (strcmp(args[1], "-b") == 0) ? 2 : 1;
+    int used = parse_options(args, start, &policy);
+    if (used == -1) {
+        return 1;
+    }
+    if (start == 1 || args[used] != NULL) {
+        fprintf(stderr, "usage: place [-c spread|pack|CPUS] [-n NICE] [-i CLASS[:LEVEL]] COMMAND...\n"
+                "       place -b [OPTIONS]|off\n");
+        return 1;
+    }
+    background_policy = policy;
+    return 0;
+}
@@ -0,0 +1,21 @@
+/**
+ * @file
+ *
+ * Contains function headers for placing commands on CPUs and setting their
+ * CPU and I/O priority.
+ */
+
+#ifndef _PLACE_H_
+#define _PLACE_H_
+
+#include <stdbool.h>
+
+#include "util.h"
+
+int place_prefix(char *args[]);
+void place_clear_override(void);
+void place_begin(struct command_line *cmds, bool background);
+void place_apply(int stage, bool several);
+int place_handler(char *args[]);
+
+#endif
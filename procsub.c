@@ -0,0 +1,182 @@
+/**
+ * @file
+ *
+ * Contains process substitution. Right before a command runs, each "<(" or
+ * ">(" left in its arguments by the parser starts the substituted list in a
+ * child of its own, connected to the shell through a pipe, and the argument
+ * becomes "/dev/fd/N" for the shell's end of that pipe. All the lists run at
+ * the same time as each other and the command. The shell's ends are
+ * close-on-exec, so only a process that names one in its own arguments (see
+ * procsub_keep()) keeps it across exec. The helpers are not waited for; the
+ * SIGCHLD handler reaps them as they finish.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "logger.h"
+#include "procsub.h"
+
+/* Most substitutions a single command may have */
+#define PROCSUB_MAX 16
+
+/* Most helpers that may be running at once */
+#define PROCSUB_HELPERS 64
+
+static int open_fds[PROCSUB_MAX];
+static char paths[PROCSUB_MAX][32];
+static int open_count = 0;
+
+/* Running helpers; a slot is free when 0. Written by the SIGCHLD handler. */
+static volatile pid_t helpers[PROCSUB_HELPERS];
+
+/**
+ * Remembers a running helper so that it gets reaped
+ * @param pid the helper
+ *
+ * @return 0 on success or -1 if every slot is taken
+ */
+static int track_helper(pid_t pid)
+{
+    for (int i = 0; i < PROCSUB_HELPERS; i++) {
+        if (helpers[i] == 0) {
+            helpers[i] = pid;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Starts one substituted list
+ * @param sub the substitution
+ * @param shell_end receives the shell's end of the pipe
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int start_helper(const struct procsub *sub, int *shell_end)
+{
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    /* The list writes what the command reads, or reads what it writes */
+    int child_end = sub->output ? fd[0] : fd[1];
+    *shell_end = sub->output ? fd[1] : fd[0];
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    } else if (pid == 0) {
+        /* The command's other substitutions are not this helper's business */
+        for (int i = 0; i < open_count; i++) {
+            close(open_fds[i]);
+        }
+        open_count = 0;
+        memset((void *) helpers, 0, sizeof(helpers));
+        close(*shell_end);
+        int target = sub->output ? STDIN_FILENO : STDOUT_FILENO;
+        if (dup2(child_end, target) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        close(child_end);
+        _exit(eval_final(sub->list));
+    }
+    close(child_end);
+    if (track_helper(pid) == -1) {
+        LOG("No slot to track helper %d; it is reaped when the shell exits\n", (int) pid);
+    }
+    return 0;
+}
+
+/**
+ * Starts the substituted lists of a command and replaces their "<(" and ">("
+ * arguments with the paths of the pipes. The shell's ends stay open until
+ * procsub_release().
+ * @param args expanded command arguments, rewritten in place
+ * @param subs the command's substitutions, in the order of their arguments
+ *
+ * @return 0 on success or -1 on failure
+ */
+int procsub_open(char *args[], const struct procsub *subs)
+{
+    procsub_reap();
+    for (int i = 0; args[i] != (char *) 0 && subs != NULL; i++) {
+        if (strcmp(args[i], "<(") != 0 && strcmp(args[i], ">(") != 0) {
+            continue;
+        }
+        if (open_count == PROCSUB_MAX) {
+            fprintf(stderr, "mash: too many process substitutions\n");
+            return -1;
+        }
+        int fd;
+        if (start_helper(subs, &fd) == -1) {
+            return -1;
+        }
+        open_fds[open_count] = fd;
+        snprintf(paths[open_count], sizeof(paths[0]), "/dev/fd/%d", fd);
+        args[i] = paths[open_count++];
+        subs = subs->next;
+    }
+    return 0;
+}
+
+/**
+ * Keeps the pipes a command names in its arguments open across exec. Called
+ * in the command's child after close_inherited_fds().
+ * @param args the command's arguments
+ */
+void procsub_keep(char *args[])
+{
+    for (int i = 0; args[i] != (char *) 0; i++) {
+        for (int j = 0; j < open_count; j++) {
+            if (args[i] == paths[j] || strcmp(args[i], paths[j]) == 0) {
+                fcntl(open_fds[j], F_SETFD, 0);
+            }
+        }
+    }
+}
+
+/**
+ * Closes the shell's ends of the current command's pipes. The helpers see
+ * end of file or a broken pipe once the command's copies are closed too.
+ */
+void procsub_release(void)
+{
+    for (int i = 0; i < open_count; i++) {
+        close(open_fds[i]);
+    }
+    open_count = 0;
+}
+
+/**
+ * Reaps the helpers that have finished. Async-signal-safe, so it is called
+ * from the SIGCHLD handler.
+ */
+void procsub_reap(void)
+{
+    int saved_errno = errno;
+    for (int i = 0; i < PROCSUB_HELPERS; i++) {
+        pid_t pid = helpers[i];
+        if (pid != 0 && waitpid(pid, NULL, WNOHANG) != 0) {
+            helpers[i] = 0;
+        }
+    }
+    errno = saved_errno;
+}
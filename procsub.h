@@ -0,0 +1,18 @@
+/**
+ * @file
+ *
+ * Contains function headers for process substitution: "<(list)" and
+ * ">(list)" arguments that name a pipe to or from a concurrent list.
+ */
+
+#ifndef _PROCSUB_H_
+#define _PROCSUB_H_
+
+#include "parser.h"
+
+int procsub_open(char *args[], const struct procsub *subs);
+void procsub_keep(char *args[]);
+void procsub_release(void);
+void procsub_reap(void);
+
+#endif
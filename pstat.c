@@ -0,0 +1,405 @@
+/**
+ * @file
+ *
+ * Contains the throughput meter for pipelines. In metered mode each pipe
+ * edge is split in two, with a relay process in between that moves the data
+ * with splice(2), so it never enters user space. The relay counts the bytes
+ * and the time it spent waiting on either side: waiting for data means the
+ * producer is the slower stage, waiting for room means the consumer is. The
+ * counters live in a shared mapping created by the shell, so "pstat" can show
+ * them while a background pipeline is still running.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "pstat.h"
+
+/* Most bytes a relay moves per splice; a pipe holds less, so this means "all" */
+#define PSTAT_CHUNK (1 << 20)
+
+/* Share of the elapsed time a side must wait before it is called the bottleneck */
+#define PSTAT_BOUND_PERCENT 10
+
+/**
+ * Stores the counters of one metered edge. Each edge has a single writer,
+ * its relay, so readers at worst see counters that are a moment old.
+ */
+struct pstat_edge
+{
+    char producer[32];
+    char consumer[32];
+    uint64_t bytes;
+    uint64_t starved_ns;
+    uint64_t blocked_ns;
+    struct timespec start;
+    struct timespec end;
+    struct timespec wait_start;
+    int waiting;
+    bool done;
+};
+
+/* Values of pstat_edge.waiting: which side the relay is waiting on right now */
+enum { WAIT_NONE, WAIT_PRODUCER, WAIT_CONSUMER };
+
+/**
+ * Stores the counters of the most recent metered pipeline
+ */
+struct pstat_table
+{
+    unsigned int generation;
+    int edges;
+    struct pstat_edge edge[PSTAT_EDGES];
+};
+
+static struct pstat_table *table = NULL;
+static unsigned int reported = 0;
+static bool global_enabled = false;
+static bool override_set = false;
+
+/**
+ * Creates the mapping shared with metered pipelines, once
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int map_table(void)
+{
+    if (table != NULL) {
+        return 0;
+    }
+    void *mem = mmap(NULL, sizeof(struct pstat_table), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("pstat: mmap");
+        return -1;
+    }
+    table = mem;
+    return 0;
+}
+
+/**
+ * Computes the time between two instants
+ * @param from the earlier instant
+ * @param to the later instant
+ *
+ * @return the difference in nanoseconds
+ */
+static uint64_t elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+    return (uint64_t) (to->tv_sec - from->tv_sec) * 1000000000ULL
+        + to->tv_nsec - from->tv_nsec;
+}
+
+/**
+ * Checks if the pipeline being started should be metered
+ *
+ * @return true if metering is on globally or for this pipeline
+ */
+bool pstat_enabled(void)
+{
+    return (global_enabled || override_set) && table != NULL;
+}
+
+/**
+ * Meters the next pipeline only, for "pstat pipeline..."
+ *
+ * @return 0 on success or -1 if the shared counters could not be created
+ */
+int pstat_override(void)
+{
+    if (map_table() == -1) {
+        return -1;
+    }
+    override_set = true;
+    return 0;
+}
+
+/**
+ * Removes the per-pipeline request so the global setting applies again
+ */
+void pstat_clear_override(void)
+{
+    override_set = false;
+}
+
+/**
+ * Resets the counters for a new metered pipeline. Called in the pipeline's
+ * process before any stage starts.
+ * @param edges number of pipe edges in the pipeline
+ */
+void pstat_begin(int edges)
+{
+    unsigned int generation = table->generation + 1;
+    memset(table, 0, sizeof(*table));
+    table->edges = (edges < PSTAT_EDGES) ? edges : PSTAT_EDGES;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < table->edges; i++) {
+        table->edge[i].start = now;
+    }
+    table->generation = generation;
+}
+
+/**
+ * Moves data from stdin to stdout until either side closes, counting bytes
+ * and the time spent waiting on each side
+ * @param e the edge's counters
+ */
+static void relay(struct pstat_edge *e)
+{
+    for (;;) {
+        ssize_t n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, PSTAT_CHUNK,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            e->bytes += n;
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            /* End of input, or EPIPE once the consumer is gone */
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        /* Data waiting in the input means the output is the one that is full */
+        int avail = 0;
+        ioctl(STDIN_FILENO, FIONREAD, &avail);
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if (avail > 0) {
+            pfd = (struct pollfd) { STDOUT_FILENO, POLLOUT, 0 };
+        }
+        struct timespec after;
+        clock_gettime(CLOCK_MONOTONIC, &e->wait_start);
+        e->waiting = (avail > 0) ? WAIT_CONSUMER : WAIT_PRODUCER;
+        poll(&pfd, 1, -1);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        if (avail > 0) {
+            e->blocked_ns += elapsed_ns(&e->wait_start, &after);
+        } else {
+            e->starved_ns += elapsed_ns(&e->wait_start, &after);
+        }
+        e->waiting = WAIT_NONE;
+    }
+    /* Recorded before the output closes, so the consumer's EOF implies final counters */
+    clock_gettime(CLOCK_MONOTONIC, &e->end);
+    e->done = true;
+}
+
+/**
+ * Starts a relay on a pipeline edge. The caller keeps the read end of the
+ * producer's pipe until this returns, then closes it.
+ * @param edge index of the edge within the pipeline
+ * @param in read end of the pipe the producer writes to
+ * @param producer name of the command writing to the edge
+ * @param consumer name of the command reading from the edge
+ *
+ * @return read end of the pipe the consumer should read from, or -1 if the
+ * edge is not metered and the consumer should read from in directly
+ */
+int pstat_relay(int edge, int in, char *producer, char *consumer)
+{
+    if (table == NULL || edge >= table->edges) {
+        return -1;
+    }
+    struct pstat_edge *e = &table->edge[edge];
+    snprintf(e->producer, sizeof(e->producer), "%s", producer);
+    snprintf(e->consumer, sizeof(e->consumer), "%s", consumer);
+
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pstat: pipe2");
+        return -1;
+    }
+    /* Both halves of the edge hold as much as the original pipe */
+    int size = fcntl(in, F_GETPIPE_SZ);
+    if (size > 0) {
+        fcntl(fd[1], F_SETPIPE_SZ, size);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("pstat: fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    } else if (pid == 0) {
+        if (dup2(in, STDIN_FILENO) == -1 || dup2(fd[1], STDOUT_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        /* Any other pipe end held here would hide EOF or EPIPE from a stage */
+        if (close_range(3, ~0U, 0) == -1) {
+            long max_fd = sysconf(_SC_OPEN_MAX);
+            for (int i = 3; i < max_fd && i < 65536; i++) {
+                close(i);
+            }
+        }
+        signal(SIGPIPE, SIG_IGN);
+        relay(e);
+        _exit(EXIT_SUCCESS);
+    }
+    LOG("Metering edge %d (%s | %s) through relay %d\n", edge, producer, consumer, pid);
+    close(fd[1]);
+    return fd[0];
+}
+
+/**
+ * Waits for every stage and relay of a metered pipeline, then exits with the
+ * last stage's status. Called in the pipeline's process, which stays behind
+ * so the relays have a parent until they finish.
+ * @param last process ID of the last stage
+ */
+void pstat_supervise(pid_t last)
+{
+    int last_status = 0;
+    for (;;) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pid == last) {
+            last_status = status;
+        }
+    }
+    if (WIFSIGNALED(last_status)) {
+        _exit(128 + WTERMSIG(last_status));
+    }
+    _exit(WEXITSTATUS(last_status));
+}
+
+/**
+ * Formats a byte count with a binary unit
+ * @param bytes the count
+ * @param buf receives the text
+ * @param size size of buf
+ */
+static void format_bytes(double bytes, char *buf, size_t size)
+{
+    const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, size, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+}
+
+/**
+ * Prints the counters of the most recent metered pipeline, one line per edge
+ * @param out where to print
+ */
+static void print_table(FILE *out)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(out, "%-4s %-24s %10s %12s %8s %8s  %s\n",
+            "edge", "stages", "bytes", "rate", "in-wait", "out-wait", "bound");
+    for (int i = 0; i < table->edges; i++) {
+        struct pstat_edge *e = &table->edge[i];
+        bool done = e->done;
+        uint64_t total = elapsed_ns(&e->start, done ? &e->end : &now);
+        double seconds = (total > 0) ? total / 1e9 : 1e-9;
+        uint64_t starved_ns = e->starved_ns;
+        uint64_t blocked_ns = e->blocked_ns;
+        /* A wait still in progress counts up to now */
+        int waiting = e->waiting;
+        if (done == false && waiting != WAIT_NONE) {
+            struct timespec since = e->wait_start;
+            uint64_t ongoing = elapsed_ns(&since, &now);
+            ongoing = (ongoing < total) ? ongoing : 0;
+            if (waiting == WAIT_PRODUCER) {
+                starved_ns += ongoing;
+            } else {
+                blocked_ns += ongoing;
+            }
+        }
+        int starved = (total > 0) ? (int) (starved_ns * 100 / total) : 0;
+        int blocked = (total > 0) ? (int) (blocked_ns * 100 / total) : 0;
+
+        char stages[72];
+        char bytes[16];
+        char rate[24];
+        snprintf(stages, sizeof(stages), "%s | %s", e->producer, e->consumer);
+        format_bytes(e->bytes, bytes, sizeof(bytes));
+        format_bytes(e->bytes / seconds, rate, sizeof(rate) - 2);
+        strcat(rate, "/s");
+
+        const char *bound = "balanced";
+        if (starved < PSTAT_BOUND_PERCENT && blocked < PSTAT_BOUND_PERCENT) {
+            /* Neither side made the relay wait noticeably */
+        } else if (starved >= blocked) {
+            bound = "producer";
+        } else {
+            bound = "consumer";
+        }
+        fprintf(out, "%-4d %-24s %10s %12s %7d%% %7d%%  %s%s\n", i, stages, bytes, rate,
+                starved, blocked, bound, done ? "" : " (running)");
+    }
+    fflush(out);
+}
+
+/**
+ * Prints the summary of a metered pipeline that just finished in the
+ * foreground, unless it was already reported
+ */
+void pstat_report(void)
+{
+    if (table == NULL || table->generation == reported || table->edges == 0) {
+        return;
+    }
+    reported = table->generation;
+    print_table(stderr);
+}
+
+/**
+ * Handles the "pstat" builtin: "pstat on|off" meters every pipeline or none,
+ * and "pstat" alone shows the edges of the most recent metered pipeline,
+ * which may still be running. Metering a single pipeline with
+ * "pstat pipeline..." is handled before the builtin runs.
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 on failure
+ */
+int pstat_handler(char *args[])
+{
+    if (args[1] == NULL) {
+        if (table == NULL || table->generation == 0) {
+            fprintf(stderr, "pstat: no pipeline has been metered\n");
+            return 1;
+        }
+        print_table(stdout);
+        return 0;
+    }
+    if (args[2] == NULL && strcmp(args[1], "on") == 0) {
+        if (map_table() == -1) {
+            return 1;
+        }
+        global_enabled = true;
+        return 0;
+    }
+    if (args[2] == NULL && strcmp(args[1], "off") == 0) {
+        global_enabled = false;
+        return 0;
+    }
+    fprintf(stderr, "usage: pstat [on|off]\n");
+    return 1;
+}
@@ -0,0 +1,25 @@
+/**
+ * @file
+ *
+ * Contains function headers for metering the throughput of pipeline edges.
+ */
+
+#ifndef _PSTAT_H_
+#define _PSTAT_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Most edges of one pipeline that are metered; later edges are plain pipes */
+#define PSTAT_EDGES 32
+
+bool pstat_enabled(void);
+int pstat_override(void);
+void pstat_clear_override(void);
+void pstat_begin(int edges);
+int pstat_relay(int edge, int in, char *producer, char *consumer);
+void pstat_supervise(pid_t last);
+void pstat_report(void);
+int pstat_handler(char *args[]);
+
+#endif
@@ -0,0 +1,419 @@
+/**
+ * @file
+ *
+ * Contains the "read" builtin. Input that can seek (regular files, and the
+ * memfds here-documents arrive in) is read a block at a time into a
+ * lookahead buffer kept per descriptor; after each record the descriptor's
+ * offset is moved back to just past it, so commands run from the loop body
+ * still find the rest of the input where they expect it. Pipes, terminals,
+ * and sockets cannot be put back, and may be shared with the commands the
+ * loop runs, so they are read a byte at a time and never past the record.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "read.h"
+#include "vars.h"
+
+/* Descriptors below this get a lookahead buffer */
+#define READ_FDS 10
+
+/* Bytes read ahead at a time from seekable input */
+#define READ_BLOCK 65536
+
+/**
+ * Stores the lookahead for one descriptor: a block of the file starting at
+ * offset base, and the file it came from, to notice when the descriptor is
+ * redirected elsewhere or the file changes
+ */
+struct lookahead
+{
+    char *data;
+    size_t len;
+    off_t base;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+/**
+ * Stores a record as it is read
+ */
+struct record
+{
+    char *text;
+    size_t len;
+    size_t cap;
+};
+
+static struct lookahead buffers[READ_FDS] = { 0 };
+
+/**
+ * Appends bytes to a record
+ * @param rec the record
+ * @param text the bytes
+ * @param len the number of bytes
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int append(struct record *rec, const char *text, size_t len)
+{
+    if (rec->len + len + 1 > rec->cap) {
+        size_t cap = (rec->cap == 0) ? 128 : rec->cap;
+        while (rec->len + len + 1 > cap) {
+            cap *= 2;
+        }
+        char *tmp = realloc(rec->text, cap);
+        if (tmp == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        rec->text = tmp;
+        rec->cap = cap;
+    }
+    memcpy(rec->text + rec->len, text, len);
+    rec->len += len;
+    rec->text[rec->len] = '\0';
+    return 0;
+}
+
+/**
+ * Reads a record one byte at a time, so nothing after it is consumed
+ * @param fd the descriptor
+ * @param delim the byte that ends the record
+ * @param limit the most bytes to read
+ * @param rec receives the record, without the delimiter
+ *
+ * @return 1 if the record ended at the delimiter or the limit, 0 at the end
+ * of input, or -1 on error
+ */
+static int read_bytes(int fd, char delim, size_t limit, struct record *rec)
+{
+    for (size_t count = 0; count < limit; ) {
+        char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (c == delim) {
+            return 1;
+        }
+        if (append(rec, &c, 1) == -1) {
+            return -1;
+        }
+        count++;
+    }
+    return 1;
+}
+
+/**
+ * Reads a record through the descriptor's lookahead buffer. The buffer is
+ * kept as long as the descriptor still refers to the same, unchanged file and
+ * its offset lies inside the buffer, which also covers other processes
+ * having read part of it.
+ * @param fd the descriptor, which must be seekable
+ * @param st the descriptor's file status
+ * @param offset the descriptor's current offset
+ * @param delim the byte that ends the record
+ * @param limit the most bytes to read
+ * @param rec receives the record, without the delimiter
+ *
+ * @return 1 if the record ended at the delimiter or the limit, 0 at the end
+ * of input, or -1 on error
+ */
+static int read_buffered(int fd, const struct stat *st, off_t offset, char delim,
+        size_t limit, struct record *rec)
+{
+    struct lookahead *b = &buffers[fd];
+    if (b->data == NULL && (b->data = malloc(READ_BLOCK)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (b->dev != st->st_dev || b->ino != st->st_ino || b->size != st->st_size
+            || b->mtime.tv_sec != st->st_mtim.tv_sec || b->mtime.tv_nsec != st->st_mtim.tv_nsec
+            || offset < b->base || offset > b->base + (off_t) b->len) {
+        b->dev = st->st_dev;
+        b->ino = st->st_ino;
+        b->size = st->st_size;
+        b->mtime = st->st_mtim;
+        b->base = offset;
+        b->len = 0;
+    }
+
+    size_t pos = offset - b->base;
+    int result = 1;
+    for (size_t count = 0; ; ) {
+        if (pos == b->len) {
+            ssize_t n = pread(fd, b->data, READ_BLOCK, b->base + b->len);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n == -1) {
+                    perror("read");
+                }
+                result = (n == 0) ? 0 : -1;
+                break;
+            }
+            b->base += b->len;
+            b->len = n;
+            pos = 0;
+        }
+        size_t chunk = b->len - pos;
+        if (chunk > limit - count) {
+            chunk = limit - count;
+        }
+        char *end = memchr(b->data + pos, delim, chunk);
+        size_t take = (end != NULL) ? (size_t) (end - (b->data + pos)) : chunk;
+        if (append(rec, b->data + pos, take) == -1) {
+            result = -1;
+            break;
+        }
+        pos += take;
+        count += take;
+        if (end != NULL) {
+            pos++;
+            break;
+        }
+        if (count == limit) {
+            break;
+        }
+    }
+    if (lseek(fd, b->base + pos, SEEK_SET) == -1) {
+        perror("lseek");
+        return -1;
+    }
+    return result;
+}
+
+/**
+ * Reads a record, through the lookahead buffer if the descriptor allows it
+ * @param fd the descriptor
+ * @param delim the byte that ends the record
+ * @param limit the most bytes to read
+ * @param rec receives the record, without the delimiter
+ *
+ * @return 1 if the record ended at the delimiter or the limit, 0 at the end
+ * of input, or -1 on error
+ */
+static int read_record(int fd, char delim, size_t limit, struct record *rec)
+{
+    struct stat st;
+    if (fd < READ_FDS && fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset != -1) {
+            return read_buffered(fd, &st, offset, delim, limit, rec);
+        }
+    }
+    return read_bytes(fd, delim, limit, rec);
+}
+
+/**
+ * Removes backslash escapes from a record in place
+ * @param rec the record
+ */
+static void unescape(struct record *rec)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < rec->len; i++) {
+        if (rec->text[i] == '\\' && i + 1 < rec->len) {
+            i++;
+        }
+        rec->text[j++] = rec->text[i];
+    }
+    rec->len = j;
+    rec->text[j] = '\0';
+}
+
+/**
+ * Checks if a record ends in an unescaped backslash, which joins it with the
+ * next one
+ * @param rec the record
+ *
+ * @return true if the record continues
+ */
+static bool continues(const struct record *rec)
+{
+    size_t slashes = 0;
+    while (slashes < rec->len && rec->text[rec->len - 1 - slashes] == '\\') {
+        slashes++;
+    }
+    return slashes % 2 == 1;
+}
+
+/**
+ * Splits a record into fields separated by the characters of IFS (blanks by
+ * default) and assigns them to variables. Runs of blanks count as one
+ * separator, and the last variable gets the rest of the record without its
+ * surrounding blanks. Unless raw, a backslash makes the next character part
+ * of the field, even a separator.
+ * @param text the record, which is modified
+ * @param names NULL-terminated variable names
+ * @param raw true if backslashes are ordinary characters
+ */
+static void assign_fields(char *text, char *names[], bool raw)
+{
+    const char *ifs = var_get("IFS");
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    char blanks[4] = { 0 };
+    for (size_t i = 0, n = 0; ifs[i] != '\0' && n < sizeof(blanks) - 1; i++) {
+        if (strchr(" \t\n", ifs[i]) != NULL && strchr(blanks, ifs[i]) == NULL) {
+            blanks[n++] = ifs[i];
+        }
+    }
+
+    char *c = text + strspn(text, blanks);
+    for (int i = 0; names[i] != NULL; i++) {
+        bool last = (names[i + 1] == NULL);
+        /* Fields are unescaped in place, so out never passes c */
+        char *field = c;
+        char *out = c;
+        char *kept = c;
+        while (*c != '\0') {
+            bool escaped = (raw == false && c[0] == '\\' && c[1] != '\0');
+            if (escaped) {
+                c++;
+            } else if (strchr(ifs, *c) != NULL && (last == false || strchr(blanks, *c) != NULL)) {
+                if (last == false) {
+                    break;
+                }
+                /* Blanks inside the last field stay unless they end it */
+                *out++ = *c++;
+                continue;
+            }
+            *out++ = *c++;
+            kept = out;
+        }
+        char sep = *c;
+        *(last ? kept : out) = '\0';
+        var_set(names[i], field);
+        if (sep == '\0') {
+            c = out;
+            *c = '\0';
+            continue;
+        }
+        c++;
+        if (strchr(blanks, sep) != NULL) {
+            c += strspn(c, blanks);
+            if (*c != '\0' && strchr(ifs, *c) != NULL) {
+                c++;
+            }
+        }
+        c += strspn(c, blanks);
+    }
+}
+
+/**
+ * Handles the "read" builtin. Usage:
+ *   read [-r] [-d DELIM] [-n COUNT] [-u FD] [NAME...]
+ * Reads a line, or a record ending in DELIM ("" for a NUL byte), of at most
+ * COUNT bytes, and splits it among the NAMEs (REPLY if none are given).
+ * Backslashes escape the next character, and one at the end of a line joins
+ * it to the next line, unless -r is given.
+ * @param args command arguments
+ *
+ * @return 0 if a record was read, 1 at the end of input or on error, or 2 on
+ * a usage error
+ */
+int read_handler(char *args[])
+{
+    bool raw = false;
+    char delim = '\n';
+    size_t limit = (size_t) -1;
+    int fd = STDIN_FILENO;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-r") == 0) {
+            raw = true;
+            continue;
+        }
+        const char *value = args[i + 1];
+        char *end = NULL;
+        long number = 0;
+        if (value != NULL && strcmp(args[i], "-d") == 0) {
+            delim = value[0];
+        } else if (value != NULL && (strcmp(args[i], "-n") == 0 || strcmp(args[i], "-u") == 0)) {
+            number = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || number < 0) {
+                value = NULL;
+            } else if (args[i][1] == 'n') {
+                limit = number;
+            } else {
+                fd = number;
+            }
+        } else {
+            value = NULL;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "read: usage: read [-r] [-d DELIM] [-n COUNT] [-u FD] [NAME...]\n");
+            return 2;
+        }
+        i++;
+    }
+    char *reply[] = { "REPLY", NULL };
+    char **names = (args[i] != NULL) ? args + i : reply;
+    for (int j = 0; names[j] != NULL; j++) {
+        if (var_valid_name(names[j], strlen(names[j])) == false) {
+            fprintf(stderr, "read: '%s': not a valid name\n", names[j]);
+            return 2;
+        }
+    }
+
+    struct record rec = { NULL, 0, 0 };
+    int result = 0;
+    if (append(&rec, "", 0) == 0) {
+        while ((result = read_record(fd, delim, limit - rec.len, &rec)) == 1
+                && raw == false && rec.len < limit && continues(&rec)) {
+            /* A backslash before the delimiter continues the record */
+            rec.text[--rec.len] = '\0';
+        }
+    } else {
+        result = -1;
+    }
+    if (result != -1 && names == reply) {
+        /* REPLY gets the record as it is, blanks and all */
+        if (raw == false) {
+            unescape(&rec);
+        }
+        var_set("REPLY", rec.text);
+    } else if (result != -1) {
+        assign_fields(rec.text, names, raw);
+    }
+    LOG("read %zu bytes from fd %d\n", rec.len, fd);
+    free(rec.text);
+    /* A final record without its delimiter is still assigned */
+    return (result == 1) ? 0 : 1;
+}
+
+/**
+ * Frees the lookahead buffers
+ */
+void read_destroy(void)
+{
+    for (int i = 0; i < READ_FDS; i++) {
+        free(buffers[i].data);
+        buffers[i].data = NULL;
+        buffers[i].len = 0;
+    }
+}
@@ -0,0 +1,13 @@
+/**
+ * @file
+ *
+ * Contains function headers for the "read" builtin.
+ */
+
+#ifndef _READ_H_
+#define _READ_H_
+
+int read_handler(char *args[]);
+void read_destroy(void);
+
+#endif
@@ -0,0 +1,484 @@
+/**
+ * @file
+ *
+ * Contains the compiled script cache. A script read on stdin is tokenized
+ * once into a compact image (the raw lines and their token arrays) and saved
+ * either next to the script or in a cache directory. Later runs validate the
+ * image against the script's size, modification time, and content hash, then
+ * map it and hand out the stored tokens instead of re-reading and
+ * re-tokenizing the script. Only tokens are cached: each line is still
+ * parsed, and its pipes and redirections are still set up, every time it
+ * runs.
+ *
+ * Image layout: header, line records, token offsets, string table.
+ */
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "memstat.h"
+#include "scriptcache.h"
+#include "util.h"
+
+/* Identifies a cache image and its format version */
+#define CACHE_MAGIC "MASHSC\x03"
+
+/**
+ * Header at the start of every cache image
+ */
+struct cache_header
+{
+    char magic[8];
+    uint64_t script_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    uint32_t line_count;
+    uint32_t token_count;
+    uint64_t strings_len;
+};
+
+/**
+ * Describes one script line inside a cache image
+ */
+struct cache_line
+{
+    uint32_t text;
+    uint32_t first_token;
+    uint32_t tokens;
+};
+
+/**
+ * Growable byte buffer used while compiling a script
+ */
+struct buffer
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static char *image = NULL;
+static size_t image_sz = 0;
+static bool image_mapped = false;
+static const struct cache_line *lines = NULL;
+static const uint32_t *token_offsets = NULL;
+static char *strings = NULL;
+static uint32_t line_count = 0;
+static uint32_t next_line = 0;
+
+/**
+ * Appends bytes to a buffer, growing it as needed
+ * @param buf the buffer to append to
+ * @param data the bytes to append
+ * @param len the number of bytes
+ *
+ * @return offset of the appended bytes or -1 if memory could not be allocated
+ */
+static long buffer_add(struct buffer *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->cap) {
+        size_t cap = (buf->cap == 0) ? 4096 : buf->cap;
+        while (buf->len + len > cap) {
+            cap *= 2;
+        }
+        char *tmp = realloc(buf->data, cap);
+        if (tmp == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        buf->data = tmp;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return buf->len - len;
+}
+
+/**
+ * Computes the 64-bit FNV-1a hash of a block of memory
+ * @param data the bytes to hash
+ * @param len the number of bytes
+ *
+ * @return the hash value
+ */
+static uint64_t fnv1a(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Points the line, token, and string tables at a cache image after checking
+ * that it belongs to the script and that every offset stays in bounds
+ * @param header expected header values for the script
+ *
+ * @return 0 if the image is usable or -1 if it is stale or corrupt
+ */
+static int image_attach(const struct cache_header *header)
+{
+    if (image_sz < sizeof(struct cache_header)) {
+        return -1;
+    }
+    const struct cache_header *h = (const struct cache_header *) image;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0
+            || h->script_size != header->script_size
+            || h->mtime_sec != header->mtime_sec
+            || h->mtime_nsec != header->mtime_nsec
+            || h->hash != header->hash) {
+        return -1;
+    }
+
+    size_t lines_sz = (size_t) h->line_count * sizeof(struct cache_line);
+    size_t tokens_sz = (size_t) h->token_count * sizeof(uint32_t);
+    if (sizeof(struct cache_header) + lines_sz + tokens_sz + h->strings_len != image_sz
+            || h->strings_len == 0) {
+        return -1;
+    }
+    lines = (const struct cache_line *) (image + sizeof(struct cache_header));
+    token_offsets = (const uint32_t *) ((const char *) lines + lines_sz);
+    strings = (char *) token_offsets + tokens_sz;
+    if (strings[h->strings_len - 1] != '\0') {
+        return -1;
+    }
+    for (uint32_t i = 0; i < h->line_count; i++) {
+        if (lines[i].text >= h->strings_len
+                || lines[i].first_token > h->token_count
+                || lines[i].tokens > h->token_count - lines[i].first_token) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < h->token_count; i++) {
+        if (token_offsets[i] >= h->strings_len) {
+            return -1;
+        }
+    }
+    line_count = h->line_count;
+    next_line = 0;
+    return 0;
+}
+
+/**
+ * Maps an existing cache image and attaches it if it matches the script
+ * @param cache_path location of the cache image
+ * @param header expected header values for the script
+ *
+ * @return 0 on success or -1 if there is no usable image
+ */
+static int image_load(const char *cache_path, const struct cache_header *header)
+{
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    /* Mapped writable but private so the shell may modify tokens freely */
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    image = map;
+    image_sz = st.st_size;
+    image_mapped = true;
+    if (image_attach(header) == -1) {
+        LOG("Discarding stale cache image '%s'\n", cache_path);
+        script_cache_close();
+        return -1;
+    }
+    LOG("Loaded %u cached lines from '%s'\n", line_count, cache_path);
+    return 0;
+}
+
+/**
+ * Tokenizes a script into a new cache image held in memory
+ * @param script the script contents
+ * @param script_sz the size of the script
+ * @param header header values describing the script
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int image_compile(const char *script, size_t script_sz, const struct cache_header *header)
+{
+    struct buffer line_buf = { 0 };
+    struct buffer token_buf = { 0 };
+    struct buffer string_buf = { 0 };
+    struct cache_header h = *header;
+    const char *pos = script;
+    const char *end = script + script_sz;
+    int result = -1;
+
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        size_t len = (newline != NULL) ? (size_t) (newline - pos) : (size_t) (end - pos);
+        char *copy = strndup(pos, len);
+        if (copy == NULL) {
+            perror("strndup");
+            goto done;
+        }
+        pos += len + 1;
+
+        struct cache_line line = { 0 };
+        long text = buffer_add(&string_buf, copy, len + 1);
+        int tokens;
+        bool pipes;
+        char **args = tokenize_command(copy, &tokens, &pipes);
+        if (text == -1 || args == NULL) {
+            free(copy);
+            goto done;
+        }
+        line.text = text;
+        line.first_token = h.token_count;
+        line.tokens = tokens;
+        for (int i = 0; i < tokens; i++) {
+            long off = buffer_add(&string_buf, args[i], strlen(args[i]) + 1);
+            uint32_t off32 = off;
+            if (off == -1 || buffer_add(&token_buf, &off32, sizeof(off32)) == -1) {
+                mem_free(MEM_PARSER, args);
+                free(copy);
+                goto done;
+            }
+            h.token_count++;
+        }
+        mem_free(MEM_PARSER, args);
+        free(copy);
+        if (buffer_add(&line_buf, &line, sizeof(line)) == -1) {
+            goto done;
+        }
+        h.line_count++;
+        if (string_buf.len > UINT32_MAX) {
+            LOGP("Script too large to cache\n");
+            goto done;
+        }
+    }
+    if (string_buf.len == 0 && buffer_add(&string_buf, "", 1) == -1) {
+        goto done;
+    }
+    h.strings_len = string_buf.len;
+
+    image_sz = sizeof(h) + line_buf.len + token_buf.len + string_buf.len;
+    if ((image = malloc(image_sz)) == NULL) {
+        perror("malloc");
+        goto done;
+    }
+    image_mapped = false;
+    char *p = image;
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+    if (line_buf.len > 0) {
+        memcpy(p, line_buf.data, line_buf.len);
+    }
+    p += line_buf.len;
+    if (token_buf.len > 0) {
+        memcpy(p, token_buf.data, token_buf.len);
+    }
+    p += token_buf.len;
+    memcpy(p, string_buf.data, string_buf.len);
+    result = image_attach(header);
+
+done:
+    free(line_buf.data);
+    free(token_buf.data);
+    free(string_buf.data);
+    return result;
+}
+
+/**
+ * Writes the in-memory cache image to disk. The image is written to a
+ * temporary file first and renamed into place so concurrent runs never see a
+ * partial image.
+ * @param cache_path location of the cache image
+ */
+static void image_save(const char *cache_path)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, PATH_MAX, "%s.%d", cache_path, getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        LOG("Cannot write cache image '%s'\n", tmp_path);
+        return;
+    }
+    size_t written = 0;
+    while (written < image_sz) {
+        ssize_t n = write(fd, image + written, image_sz - written);
+        if (n == -1) {
+            perror("write");
+            close(fd);
+            unlink(tmp_path);
+            return;
+        }
+        written += n;
+    }
+    close(fd);
+    if (rename(tmp_path, cache_path) == -1) {
+        perror("rename");
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Works out where the cache image for a script lives
+ * @param script_path absolute path of the script
+ * @param cache_dir directory for cache images, or NULL to store the image
+ * next to the script as ".<name>.mashc"
+ * @param cache_path receives the location (PATH_MAX bytes)
+ */
+static void cache_location(const char *script_path, const char *cache_dir, char *cache_path)
+{
+    if (cache_dir != NULL) {
+        snprintf(cache_path, PATH_MAX, "%s/%016llx.mashc", cache_dir,
+                (unsigned long long) fnv1a(script_path, strlen(script_path)));
+        return;
+    }
+    char dir_copy[PATH_MAX];
+    char base_copy[PATH_MAX];
+    strncpy(dir_copy, script_path, PATH_MAX - 1);
+    dir_copy[PATH_MAX - 1] = '\0';
+    strncpy(base_copy, script_path, PATH_MAX - 1);
+    base_copy[PATH_MAX - 1] = '\0';
+    snprintf(cache_path, PATH_MAX, "%s/.%s.mashc", dirname(dir_copy), basename(base_copy));
+}
+
+/**
+ * Activates the script cache for the script on stdin. The cached image is
+ * used if it matches the script; otherwise the script is compiled and the
+ * image saved for the next run. Does nothing unless stdin is a regular file.
+ * @param cache_dir directory for cache images, or NULL to store them next to
+ * the script
+ *
+ * @return 0 if commands will come from the cache or -1 otherwise
+ */
+int script_cache_open(const char *cache_dir)
+{
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        LOGP("stdin is not a script file; not caching\n");
+        return -1;
+    }
+
+    char script_path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/fd/0", script_path, PATH_MAX - 1);
+    if (len == -1) {
+        perror("readlink");
+        return -1;
+    }
+    script_path[len] = '\0';
+
+    void *script = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (script == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    struct cache_header header = { 0 };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.script_size = st.st_size;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.hash = fnv1a(script, st.st_size);
+
+    char cache_path[PATH_MAX];
+    cache_location(script_path, cache_dir, cache_path);
+
+    int result = 0;
+    if (image_load(cache_path, &header) == -1) {
+        if (image_compile(script, st.st_size, &header) == 0) {
+            image_save(cache_path);
+        } else {
+            script_cache_close();
+            result = -1;
+        }
+    }
+    munmap(script, st.st_size);
+
+    if (result == 0) {
+        /* The script has been consumed; commands should not read it */
+        lseek(STDIN_FILENO, 0, SEEK_END);
+    }
+    return result;
+}
+
+/**
+ * Checks if commands are being read from the script cache
+ *
+ * @return true if the cache is active
+ */
+bool script_cache_active(void)
+{
+    return image != NULL;
+}
+
+/**
+ * Retrieves the next script line from the cache
+ * @param args receives a NULL-terminated token array that the caller frees;
+ * the tokens themselves belong to the cache
+ * @param tokens receives the number of tokens
+ *
+ * @return copy of the raw line that the caller frees, or NULL at the end of
+ * the script
+ */
+char *script_cache_next(char ***args, int *tokens)
+{
+    if (image == NULL || next_line == line_count) {
+        return NULL;
+    }
+    const struct cache_line *line = &lines[next_line++];
+
+    int size = (line->tokens + 1 > ARGS_INIT_SZ) ? line->tokens + 1 : ARGS_INIT_SZ;
+    char **tok = mem_malloc(MEM_PARSER, size * sizeof(char *));
+    char *command = mem_strdup(MEM_UI, strings + line->text);
+    if (tok == NULL || command == NULL) {
+        perror("malloc");
+        mem_free(MEM_PARSER, tok);
+        mem_free(MEM_UI, command);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < line->tokens; i++) {
+        tok[i] = strings + token_offsets[line->first_token + i];
+    }
+    tok[line->tokens] = (char *) 0;
+
+    *args = tok;
+    *tokens = line->tokens;
+    return command;
+}
+
+/**
+ * Releases the cache image
+ */
+void script_cache_close(void)
+{
+    if (image != NULL) {
+        if (image_mapped) {
+            munmap(image, image_sz);
+        } else {
+            free(image);
+        }
+    }
+    image = NULL;
+    image_sz = 0;
+    lines = NULL;
+    token_offsets = NULL;
+    strings = NULL;
+    line_count = 0;
+    next_line = 0;
+}
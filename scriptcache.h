@@ -0,0 +1,17 @@
+/**
+ * @file
+ *
+ * Contains function headers for the compiled script cache.
+ */
+
+#ifndef _SCRIPTCACHE_H_
+#define _SCRIPTCACHE_H_
+
+#include <stdbool.h>
+
+int script_cache_open(const char *cache_dir);
+bool script_cache_active(void);
+char *script_cache_next(char ***args, int *tokens);
+void script_cache_close(void);
+
+#endif
@@ -0,0 +1,705 @@
+/**
+ * @file
+ *
+ * Contains sharded pipeline stages. "cmd1 |N> cmd2" runs N copies of cmd2 in
+ * place of one. The stage's own process stays behind as a supervisor: it
+ * reads cmd1's output, deals whole records (lines, or NUL-terminated records
+ * with the z flag) to the copies, and merges what the copies write into the
+ * stage's stdout, again one whole record at a time, so records from
+ * different copies never interleave.
+ *
+ * The operator is "|N[FLAGS]>". N of 0 (or none) means one copy per CPU.
+ * The flags are "o" to keep the original order, "h" or "hK" to send every
+ * record with the same hash of its Kth whitespace-separated field (or the
+ * whole record) to the same copy, and "z" to split records on NUL instead of
+ * newline.
+ *
+ * Without "o" the copies run for the whole stream and are fed blocks of
+ * records round-robin, or single records by hash. With "o" every block goes
+ * to a fresh copy, as with GNU parallel --pipe --keep-order. The output of
+ * the oldest block streams straight through, and that of later blocks is
+ * held back until every block before it is finished.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "procsub.h"
+#include "shard.h"
+#include "util.h"
+
+/* Most bytes read from a pipe at a time */
+#define SHARD_READ 65536
+
+/* Size of the block of records each copy gets in ordered mode */
+#define SHARD_BLOCK (1 << 20)
+
+/* Input held for a copy beyond which reading pauses */
+#define SHARD_PENDING (1 << 20)
+
+/* Most copies of a stage */
+#define SHARD_MAX 256
+
+/**
+ * Stores a growable byte buffer
+ */
+struct buffer
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Stores one running copy: its pipes, the input not yet written to it, and
+ * the output not yet passed on
+ */
+struct worker
+{
+    pid_t pid;
+    int in_fd;
+    int out_fd;
+    struct buffer in;
+    size_t in_off;
+    struct buffer out;
+    bool closing;
+};
+
+/**
+ * Stores the state of a sharded stage. In ordered mode the workers form a
+ * ring in input order, count of them starting at head.
+ */
+struct shard
+{
+    struct shard_spec spec;
+    char **args;
+    struct worker *workers;
+    int count;
+    int head;
+    int next;
+    struct buffer carry;
+    bool in_eof;
+    int status;
+};
+
+/**
+ * Makes room in a buffer
+ * @param buf the buffer
+ * @param extra bytes needed past its current length
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int buf_reserve(struct buffer *buf, size_t extra)
+{
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+    size_t cap = (buf->cap == 0) ? SHARD_READ : buf->cap;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    char *tmp = realloc(buf->data, cap);
+    if (tmp == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    buf->data = tmp;
+    buf->cap = cap;
+    return 0;
+}
+
+/**
+ * Appends data to a buffer, exiting if memory runs out
+ * @param buf the buffer
+ * @param data the data
+ * @param len the number of bytes
+ */
+static void buf_append(struct buffer *buf, const char *data, size_t len)
+{
+    if (buf_reserve(buf, len) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+/**
+ * Drops bytes from the front of a buffer
+ * @param buf the buffer
+ * @param len the number of bytes
+ */
+static void buf_consume(struct buffer *buf, size_t len)
+{
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+}
+
+/**
+ * Writes to the stage's stdout. A reader that went away ends the stage
+ * quietly, as SIGPIPE would.
+ * @param data the data
+ * @param len the number of bytes
+ */
+static void write_out(const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            if (errno != EPIPE) {
+                perror("write");
+            }
+            _exit((errno == EPIPE) ? 128 + SIGPIPE : EXIT_FAILURE);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Computes the length of the whole records at the start of some data
+ * @param data the data
+ * @param len its length
+ * @param separator the record separator
+ *
+ * @return the number of bytes up to and including the last separator
+ */
+static size_t whole_records(const char *data, size_t len, char separator)
+{
+    const char *last = (len > 0) ? memrchr(data, separator, len) : NULL;
+    return (last != NULL) ? (size_t) (last - data + 1) : 0;
+}
+
+/**
+ * Hashes the key of a record: its Kth whitespace-separated field, or the
+ * whole record
+ * @param spec the sharding spec
+ * @param rec the record, without its separator
+ * @param len its length
+ *
+ * @return FNV-1a hash of the key
+ */
+static uint64_t record_hash(const struct shard_spec *spec, const char *rec, size_t len)
+{
+    const char *start = rec;
+    const char *end = rec + len;
+    for (int field = 1; field <= spec->key; field++) {
+        while (start < end && (*start == ' ' || *start == '\t')) {
+            start++;
+        }
+        const char *stop = start;
+        while (stop < end && *stop != ' ' && *stop != '\t') {
+            stop++;
+        }
+        if (field == spec->key) {
+            end = stop;
+        } else {
+            start = stop;
+        }
+    }
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = start; c < end; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Computes how much input is waiting to be written to a copy
+ * @param w the copy
+ *
+ * @return the number of bytes
+ */
+static size_t pending(const struct worker *w)
+{
+    return w->in.len - w->in_off;
+}
+
+/**
+ * Starts a copy of the stage's command
+ * @param sh the stage
+ * @param w the slot to start it in
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int worker_start(struct shard *sh, struct worker *w)
+{
+    int in[2];
+    int out[2];
+    if (pipe2(in, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    } else if (pid == 0) {
+        /* A copy must not hold the others' pipes, or they never see end of file */
+        for (int i = 0; i < sh->spec.copies; i++) {
+            if (sh->workers[i].in_fd != -1) {
+                close(sh->workers[i].in_fd);
+            }
+            if (sh->workers[i].out_fd != -1) {
+                close(sh->workers[i].out_fd);
+            }
+        }
+        signal(SIGPIPE, SIG_DFL);
+        if (dup2(in[0], STDIN_FILENO) == -1 || dup2(out[1], STDOUT_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        exec_command(sh->args);
+    }
+    close(in[0]);
+    close(out[1]);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    w->pid = pid;
+    w->in_fd = in[1];
+    w->out_fd = out[0];
+    w->in.len = 0;
+    w->in_off = 0;
+    w->out.len = 0;
+    w->closing = false;
+    return 0;
+}
+
+/**
+ * Waits for a copy whose output has ended and folds its status into the
+ * stage's, which is the highest status of any copy
+ * @param sh the stage
+ * @param w the copy
+ */
+static void worker_reap(struct shard *sh, struct worker *w)
+{
+    int status;
+    while (waitpid(w->pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return;
+        }
+    }
+    int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    if (code > sh->status) {
+        sh->status = code;
+    }
+    w->pid = 0;
+}
+
+/**
+ * Gives the whole records read so far to the running copies, round-robin or
+ * by hash. At the end of the input the partial record left over goes too.
+ * @param sh the stage
+ */
+static void deal_unordered(struct shard *sh)
+{
+    size_t len = sh->in_eof ? sh->carry.len
+        : whole_records(sh->carry.data, sh->carry.len, sh->spec.separator);
+    if (len == 0) {
+        return;
+    }
+    if (sh->spec.key < 0) {
+        /* The whole run goes to the next copy with room */
+        struct worker *w = NULL;
+        for (int tries = 0; tries < sh->spec.copies && w == NULL; tries++) {
+            struct worker *candidate = &sh->workers[sh->next];
+            sh->next = (sh->next + 1) % sh->spec.copies;
+            if (candidate->in_fd != -1 && (pending(candidate) < SHARD_PENDING || sh->in_eof)) {
+                w = candidate;
+            }
+        }
+        if (w == NULL && sh->in_eof == false) {
+            return;
+        }
+        if (w != NULL) {
+            buf_append(&w->in, sh->carry.data, len);
+        }
+    } else {
+        const char *rec = sh->carry.data;
+        const char *end = rec + len;
+        while (rec < end) {
+            const char *sep = memchr(rec, sh->spec.separator, end - rec);
+            size_t rec_len = (sep != NULL) ? (size_t) (sep - rec + 1) : (size_t) (end - rec);
+            size_t key_len = (sep != NULL) ? rec_len - 1 : rec_len;
+            struct worker *w = &sh->workers[record_hash(&sh->spec, rec, key_len) % sh->spec.copies];
+            if (w->in_fd != -1) {
+                buf_append(&w->in, rec, rec_len);
+            }
+            rec += rec_len;
+        }
+    }
+    buf_consume(&sh->carry, len);
+}
+
+/**
+ * Starts a fresh copy for every complete block of input, as long as fewer
+ * than the allowed number of copies are running or waiting to be emitted
+ * @param sh the stage
+ *
+ * @return 0 on success or -1 if a copy could not be started
+ */
+static int deal_ordered(struct shard *sh)
+{
+    while (sh->count < sh->spec.copies && sh->carry.len > 0) {
+        size_t len = sh->carry.len;
+        if (len >= SHARD_BLOCK) {
+            size_t whole = whole_records(sh->carry.data, len, sh->spec.separator);
+            if (whole > 0) {
+                len = whole;
+            } else if (sh->in_eof == false) {
+                return 0;
+            }
+        } else if (sh->in_eof == false) {
+            return 0;
+        }
+        struct worker *w = &sh->workers[(sh->head + sh->count) % sh->spec.copies];
+        if (worker_start(sh, w) == -1) {
+            return -1;
+        }
+        buf_append(&w->in, sh->carry.data, len);
+        w->closing = true;
+        buf_consume(&sh->carry, len);
+        sh->count++;
+    }
+    return 0;
+}
+
+/**
+ * Checks if the stage should read more input
+ * @param sh the stage
+ *
+ * @return true if there is room for more input
+ */
+static bool want_input(const struct shard *sh)
+{
+    if (sh->in_eof) {
+        return false;
+    }
+    if (sh->spec.ordered) {
+        return sh->count < sh->spec.copies || sh->carry.len < SHARD_BLOCK;
+    }
+    bool any = false;
+    bool all = true;
+    for (int i = 0; i < sh->spec.copies; i++) {
+        const struct worker *w = &sh->workers[i];
+        if (w->in_fd != -1) {
+            any = any || pending(w) < SHARD_PENDING;
+            all = all && pending(w) < SHARD_PENDING;
+        }
+    }
+    /* Round-robin needs one copy with room, hashing may need any of them */
+    return (sh->spec.key < 0) ? any : all;
+}
+
+/**
+ * Writes as much waiting input to a copy as its pipe takes. A copy that
+ * stopped reading loses the rest of its input.
+ * @param w the copy
+ */
+static void feed_worker(struct worker *w)
+{
+    ssize_t n = write(w->in_fd, w->in.data + w->in_off, pending(w));
+    if (n > 0) {
+        w->in_off += n;
+    } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        LOG("Copy %d stopped reading: %s\n", (int) w->pid, strerror(errno));
+        w->in_off = w->in.len;
+        w->closing = true;
+    }
+    if (pending(w) == 0) {
+        w->in.len = 0;
+        w->in_off = 0;
+    }
+}
+
+/**
+ * Passes on a copy's output: whole records as they come in unordered mode,
+ * everything at the end of its output
+ * @param sh the stage
+ * @param w the copy
+ */
+static void emit_unordered(struct shard *sh, struct worker *w)
+{
+    size_t len = (w->out_fd == -1) ? w->out.len
+        : whole_records(w->out.data, w->out.len, sh->spec.separator);
+    if (len > 0) {
+        write_out(w->out.data, len);
+        buf_consume(&w->out, len);
+    }
+}
+
+/**
+ * Passes on the output of the oldest blocks in ordered mode: the oldest
+ * block's output as it comes, then, once it is finished, the output held
+ * back for the blocks after it
+ * @param sh the stage
+ */
+static void emit_ordered(struct shard *sh)
+{
+    while (sh->count > 0) {
+        struct worker *w = &sh->workers[sh->head];
+        if (w->out.len > 0) {
+            write_out(w->out.data, w->out.len);
+            w->out.len = 0;
+        }
+        if (w->out_fd != -1 || w->in_fd != -1) {
+            break;
+        }
+        worker_reap(sh, w);
+        sh->head = (sh->head + 1) % sh->spec.copies;
+        sh->count--;
+    }
+}
+
+/**
+ * Reads what a copy wrote
+ * @param sh the stage
+ * @param w the copy
+ */
+static void drain_worker(struct shard *sh, struct worker *w)
+{
+    if (buf_reserve(&w->out, SHARD_READ) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+    ssize_t n = read(w->out_fd, w->out.data + w->out.len, SHARD_READ);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        w->out.len += n;
+    } else {
+        close(w->out_fd);
+        w->out_fd = -1;
+    }
+    if (sh->spec.ordered == false) {
+        emit_unordered(sh, w);
+    }
+}
+
+/**
+ * Reads more of the stage's input
+ * @param sh the stage
+ */
+static void read_input(struct shard *sh)
+{
+    if (buf_reserve(&sh->carry, SHARD_READ) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+    ssize_t n = read(STDIN_FILENO, sh->carry.data + sh->carry.len, SHARD_READ);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        sh->carry.len += n;
+        return;
+    }
+    if (n == -1) {
+        perror("read");
+    }
+    sh->in_eof = true;
+}
+
+/**
+ * Checks if every copy has finished and all input has been dealt
+ * @param sh the stage
+ *
+ * @return true once the stage is done
+ */
+static bool finished(const struct shard *sh)
+{
+    if (sh->in_eof == false || sh->carry.len > 0) {
+        return false;
+    }
+    if (sh->spec.ordered) {
+        return sh->count == 0;
+    }
+    for (int i = 0; i < sh->spec.copies; i++) {
+        if (sh->workers[i].out_fd != -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parses a sharding operator, "|N[FLAGS]>" (see the file comment)
+ * @param tok the token to parse
+ * @param spec receives the parsed spec (may be NULL)
+ *
+ * @return true if the token is a sharding operator, false otherwise
+ */
+bool shard_parse(const char *tok, struct shard_spec *spec)
+{
+    size_t len = strlen(tok);
+    if (len < 2 || tok[0] != '|' || tok[len - 1] != '>') {
+        return false;
+    }
+    struct shard_spec s = { .copies = 0, .ordered = false, .key = -1, .separator = '\n' };
+    const char *c = tok + 1;
+    const char *end = tok + len - 1;
+    for (; c < end && isdigit((unsigned char) *c); c++) {
+        s.copies = s.copies * 10 + (*c - '0');
+        if (s.copies > SHARD_MAX) {
+            return false;
+        }
+    }
+    while (c < end) {
+        if (*c == 'o') {
+            s.ordered = true;
+        } else if (*c == 'z') {
+            s.separator = '\0';
+        } else if (*c == 'h') {
+            s.key = 0;
+            while (c + 1 < end && isdigit((unsigned char) c[1]) && s.key < 1000) {
+                s.key = s.key * 10 + (*++c - '0');
+            }
+        } else {
+            return false;
+        }
+        c++;
+    }
+    /* Records grouped by key cannot be put back in input order */
+    if (s.ordered && s.key >= 0) {
+        return false;
+    }
+    if (s.copies == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        s.copies = (cpus < 1) ? 1 : (cpus > SHARD_MAX) ? SHARD_MAX : cpus;
+    }
+    if (spec != NULL) {
+        *spec = s;
+    }
+    return true;
+}
+
+/**
+ * Runs a sharded stage. Called in the stage's process, with the pipeline's
+ * pipes already on stdin and stdout. The stage's redirections are applied
+ * here, once, and the copies inherit them.
+ * @param args the stage's command
+ * @param tok the sharding operator in front of it
+ *
+ * @return the highest exit status of any copy
+ */
+int shard_run(char *args[], const char *tok)
+{
+    struct shard sh = { .args = args };
+    if (shard_parse(tok, &sh.spec) == false) {
+        fprintf(stderr, "mash: bad parallel stage operator '%s'\n", tok);
+        return 2;
+    }
+    /* Redirections apply to the merged stream, not to every copy */
+    close_inherited_fds();
+    procsub_keep(args);
+    if (execute_redirection(args) == -1) {
+        return 1;
+    }
+    if (args[0] == (char *) 0) {
+        return 0;
+    }
+    sh.workers = calloc(sh.spec.copies, sizeof(struct worker));
+    struct pollfd *fds = calloc(1 + 2 * sh.spec.copies, sizeof(struct pollfd));
+    if (sh.workers == NULL || fds == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < sh.spec.copies; i++) {
+        sh.workers[i].in_fd = -1;
+        sh.workers[i].out_fd = -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    for (int i = 0; sh.spec.ordered == false && i < sh.spec.copies; i++) {
+        if (worker_start(&sh, &sh.workers[i]) == -1) {
+            return 1;
+        }
+    }
+    LOG("Running %d copies of '%s'\n", sh.spec.copies, args[0]);
+
+    while (finished(&sh) == false) {
+        fds[0].fd = want_input(&sh) ? STDIN_FILENO : -1;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < sh.spec.copies; i++) {
+            struct worker *w = &sh.workers[i];
+            fds[1 + 2 * i].fd = (w->in_fd != -1 && pending(w) > 0) ? w->in_fd : -1;
+            fds[1 + 2 * i].events = POLLOUT;
+            fds[2 + 2 * i].fd = w->out_fd;
+            fds[2 + 2 * i].events = POLLIN;
+        }
+        if (poll(fds, 1 + 2 * sh.spec.copies, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+
+        if (fds[0].revents != 0) {
+            read_input(&sh);
+        }
+        int dealt = 0;
+        if (sh.spec.ordered) {
+            dealt = deal_ordered(&sh);
+        } else {
+            deal_unordered(&sh);
+        }
+        if (dealt == -1) {
+            return 1;
+        }
+        for (int i = 0; i < sh.spec.copies; i++) {
+            struct worker *w = &sh.workers[i];
+            if (w->in_fd != -1 && fds[1 + 2 * i].fd != -1 && fds[1 + 2 * i].revents != 0) {
+                feed_worker(w);
+            }
+            if (w->in_fd != -1 && pending(w) == 0 && (w->closing || sh.in_eof)) {
+                close(w->in_fd);
+                w->in_fd = -1;
+            }
+            if (w->out_fd != -1 && fds[2 + 2 * i].fd != -1 && fds[2 + 2 * i].revents != 0) {
+                drain_worker(&sh, w);
+            }
+        }
+        if (sh.spec.ordered) {
+            emit_ordered(&sh);
+        }
+    }
+
+    for (int i = 0; i < sh.spec.copies; i++) {
+        if (sh.workers[i].pid != 0) {
+            worker_reap(&sh, &sh.workers[i]);
+        }
+        free(sh.workers[i].in.data);
+        free(sh.workers[i].out.data);
+    }
+    free(sh.carry.data);
+    free(sh.workers);
+    free(fds);
+    return sh.status;
+}
@@ -0,0 +1,29 @@
+/**
+ * @file
+ *
+ * Contains function headers for sharded pipeline stages: "cmd1 |N> cmd2"
+ * runs N copies of cmd2 and splits cmd1's output between them.
+ */
+
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#include <stdbool.h>
+
+/**
+ * Stores how a stage is sharded: the number of copies, whether the output
+ * keeps the input's order, the field whose hash picks the copy for a record
+ * (0 for the whole record, -1 for round-robin), and the record separator
+ */
+struct shard_spec
+{
+    int copies;
+    bool ordered;
+    int key;
+    char separator;
+};
+
+bool shard_parse(const char *tok, struct shard_spec *spec);
+int shard_run(char *args[], const char *tok);
+
+#endif
@@ -0,0 +1,348 @@
+/**
+ * @file
+ *
+ * Contains the shared history ring used by concurrent shell sessions. The
+ * ring lives in a POSIX shared memory object mapped MAP_SHARED by every
+ * session of the same user. Appends reserve a slot with an atomic fetch-add
+ * on the head counter and publish it with a per-slot sequence number, so
+ * neither writers nor readers take a lock. Each session holds a shared flock
+ * on the object while attached; the session that can upgrade it to an
+ * exclusive lock on exit is the last one, and it writes the ring to disk and
+ * removes the object, so the next first session loads the file again. The
+ * object is named after the user and the history file, so sessions with a
+ * different HOME keep separate rings.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "sharehist.h"
+
+#define SHAREHIST_MAGIC 0x4d534831u
+#define SHAREHIST_SLOTS 2048
+#define SHAREHIST_TEXT 1024
+
+/**
+ * Stores one history entry. seq is the entry's index plus one once the text
+ * is complete, and 0 while a writer is filling the slot.
+ */
+struct sharehist_slot
+{
+    _Atomic uint64_t seq;
+    uint32_t len;
+    char text[SHAREHIST_TEXT];
+};
+
+/**
+ * Stores the header of the shared ring, followed by its slots
+ */
+struct sharehist_ring
+{
+    _Atomic uint32_t magic;
+    uint32_t slots;
+    _Atomic uint64_t head;
+    struct sharehist_slot slot[SHAREHIST_SLOTS];
+};
+
+static struct sharehist_ring *ring = NULL;
+static int ring_fd = -1;
+static char disk_path[PATH_MAX];
+static char ring_name[NAME_MAX];
+static char result[SHAREHIST_TEXT];
+
+/**
+ * Copies the entry with the given index out of the ring. The sequence number
+ * is checked again after the copy so an entry overwritten mid-read is
+ * reported as missing rather than returned torn.
+ * @param index index of the entry
+ * @param buf receives the NUL-terminated entry
+ *
+ * @return true if the entry was still in the ring
+ */
+static bool ring_read(uint64_t index, char *buf)
+{
+    struct sharehist_slot *slot = &ring->slot[index % SHAREHIST_SLOTS];
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != index + 1) {
+        return false;
+    }
+    uint32_t len = slot->len;
+    if (len >= SHAREHIST_TEXT) {
+        return false;
+    }
+    memcpy(buf, slot->text, len);
+    buf[len] = '\0';
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+}
+
+/**
+ * Appends an entry to the ring without taking any lock
+ * @param cmd the entry text
+ * @param len length of the entry text
+ */
+static void ring_append(const char *cmd, size_t len)
+{
+    uint64_t index = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    struct sharehist_slot *slot = &ring->slot[index % SHAREHIST_SLOTS];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(slot->text, cmd, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+}
+
+/**
+ * Fills a freshly created ring from the history file on disk
+ */
+static void ring_load(void)
+{
+    FILE *file = fopen(disk_path, "re");
+    if (file == NULL) {
+        return;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, file)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len > 0 && len < SHAREHIST_TEXT) {
+            ring_append(line, len);
+        }
+    }
+    free(line);
+    fclose(file);
+    LOG("Loaded shared history from '%s'\n", disk_path);
+}
+
+/**
+ * Writes the ring to the history file on disk, oldest entry first. The file
+ * is written to a temporary name and renamed into place.
+ */
+static void ring_flush(void)
+{
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", disk_path, getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror(tmp_path);
+        return;
+    }
+    FILE *file = fdopen(fd, "w");
+    if (file == NULL) {
+        perror("fdopen");
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = (head > SHAREHIST_SLOTS) ? head - SHAREHIST_SLOTS : 0;
+    char buf[SHAREHIST_TEXT];
+    for (uint64_t i = first; i < head; i++) {
+        if (ring_read(i, buf)) {
+            fprintf(file, "%s\n", buf);
+        }
+    }
+    if (fclose(file) == EOF) {
+        perror("fclose");
+        unlink(tmp_path);
+        return;
+    }
+    if (rename(tmp_path, disk_path) == -1) {
+        perror("rename");
+        unlink(tmp_path);
+        return;
+    }
+    LOG("Flushed shared history to '%s'\n", disk_path);
+}
+
+/**
+ * Attaches this session to the shared history ring, creating it and loading
+ * the history file if no other session has done so yet
+ *
+ * @return 0 on success or -1 on failure, in which case only the private
+ * history is used
+ */
+int sharehist_open(void)
+{
+    const char *home = getenv("HOME");
+    snprintf(disk_path, PATH_MAX, "%s/.mash_history", (home != NULL) ? home : ".");
+
+    uint32_t hash = 2166136261u;
+    for (const char *c = disk_path; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    snprintf(ring_name, NAME_MAX, "/mash-history-%u-%08x", (unsigned int) getuid(), hash);
+
+    /* The exclusive lock keeps a new session from racing the first one's
+     * initialization or the last one's flush. An object the last session
+     * removed while this one waited for the lock is opened again. */
+    int fd;
+    struct stat st;
+    do {
+        fd = shm_open(ring_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            perror("shm_open");
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) == -1) {
+            perror("flock");
+            close(fd);
+            return -1;
+        }
+        if (fstat(fd, &st) == -1) {
+            perror("fstat");
+            close(fd);
+            return -1;
+        }
+        if (st.st_nlink == 0) {
+            close(fd);
+        }
+    } while (st.st_nlink == 0);
+    if ((size_t) st.st_size < sizeof(struct sharehist_ring)
+            && ftruncate(fd, sizeof(struct sharehist_ring)) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(struct sharehist_ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+    ring = map;
+    ring_fd = fd;
+    if (atomic_load(&ring->magic) != SHAREHIST_MAGIC || ring->slots != SHAREHIST_SLOTS) {
+        memset(ring, 0, sizeof(struct sharehist_ring));
+        ring->slots = SHAREHIST_SLOTS;
+        ring_load();
+        atomic_store(&ring->magic, SHAREHIST_MAGIC);
+    }
+    flock(fd, LOCK_SH);
+    LOG("Attached to shared history '%s'\n", ring_name);
+    return 0;
+}
+
+/**
+ * Checks if the shared history ring is in use
+ *
+ * @return true if this session is attached to the ring
+ */
+bool sharehist_active(void)
+{
+    return ring != NULL;
+}
+
+/**
+ * Appends a command to the shared history. Commands too long for a slot are
+ * kept in the private history only.
+ * @param cmd the command to add
+ */
+void sharehist_add(const char *cmd)
+{
+    size_t len = strlen(cmd);
+    if (ring == NULL || len == 0 || len >= SHAREHIST_TEXT) {
+        return;
+    }
+    ring_append(cmd, len);
+}
+
+/**
+ * Retrieves the index the next appended entry will get. Entries below it
+ * (and no more than the ring size below it) can be read with sharehist_get().
+ *
+ * @return the head index of the ring, or 0 if the ring is not in use
+ */
+uint64_t sharehist_head(void)
+{
+    if (ring == NULL) {
+        return 0;
+    }
+    return atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+/**
+ * Retrieves the index of the oldest entry that may still be in the ring
+ *
+ * @return the tail index of the ring, or 0 if the ring is not in use
+ */
+uint64_t sharehist_tail(void)
+{
+    uint64_t head = sharehist_head();
+    return (head > SHAREHIST_SLOTS) ? head - SHAREHIST_SLOTS : 0;
+}
+
+/**
+ * Retrieves an entry from the shared history
+ * @param index index of the entry
+ *
+ * @return the entry, valid until the next call into this module, or NULL if
+ * it has been overwritten or is still being written
+ */
+const char *sharehist_get(uint64_t index)
+{
+    if (ring == NULL || ring_read(index, result) == false) {
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Finds the most recent entry in the shared history starting with prefix
+ * @param prefix the prefix to search for
+ *
+ * @return the entry, valid until the next call into this module, or NULL if
+ * none matched
+ */
+const char *sharehist_search_prefix(const char *prefix)
+{
+    uint64_t head = sharehist_head();
+    uint64_t first = sharehist_tail();
+    size_t prefix_length = strlen(prefix);
+    for (uint64_t i = head; i > first; i--) {
+        const char *entry = sharehist_get(i - 1);
+        if (entry != NULL && strncmp(entry, prefix, prefix_length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Detaches this session from the shared history ring. If no other session
+ * is attached the ring is written to the history file and removed, and the
+ * next session to attach loads the file again.
+ */
+void sharehist_close(void)
+{
+    if (ring == NULL) {
+        return;
+    }
+    flock(ring_fd, LOCK_UN);
+    if (flock(ring_fd, LOCK_EX | LOCK_NB) == 0) {
+        ring_flush();
+        shm_unlink(ring_name);
+        flock(ring_fd, LOCK_UN);
+    }
+    munmap(ring, sizeof(struct sharehist_ring));
+    close(ring_fd);
+    ring = NULL;
+    ring_fd = -1;
+}
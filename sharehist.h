@@ -0,0 +1,22 @@
+/**
+ * @file
+ *
+ * Contains function headers for the history ring shared between sessions.
+ */
+
+#ifndef _SHAREHIST_H_
+#define _SHAREHIST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+int sharehist_open(void);
+bool sharehist_active(void);
+void sharehist_add(const char *cmd);
+uint64_t sharehist_head(void);
+uint64_t sharehist_tail(void);
+const char *sharehist_get(uint64_t index);
+const char *sharehist_search_prefix(const char *prefix);
+void sharehist_close(void);
+
+#endif
@@ -5,6 +5,7 @@
  */
 
 #include <fcntl.h>
+#include <locale.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,155 +14,265 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "alias.h"
+#include "arith.h"
+#include "complete.h"
+#include "eval.h"
+#include "frecency.h"
+#include "func.h"
 #include "history.h"
+#include "latency.h"
 #include "logger.h"
+#include "memstat.h"
+#include "parser.h"
+#include "pipesize.h"
+#include "read.h"
+#include "scriptcache.h"
+#include "sharehist.h"
 #include "ui.h"
 #include "util.h"
+#include "vars.h"
+#include "wildcard.h"
 
-int main(void)
+static bool startup_profile = false;
+static struct timespec profile_start;
+static struct timespec profile_last;
+static bool command_mode = false;
+static char *command_rest = NULL;
+static uint64_t line_ready = 0;
+static uint64_t input_wait = 0;
+
+/**
+ * Prints the time spent in a startup phase when --startup-profile was given
+ * @param phase name of the phase that just finished, or NULL to print the total
+ */
+static void profile_mark(const char *phase)
 {
-    init_ui();
+    if (startup_profile == false) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct timespec *since = (phase != NULL) ? &profile_last : &profile_start;
+    double ms = (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+    fprintf(stderr, "startup: %-14s %9.3f ms\n", (phase != NULL) ? phase : "total", ms);
+    profile_last = now;
+}
 
-    signal(SIGINT, sigint_handler);
-    signal(SIGCHLD, sigchld_handler);
+/**
+ * Prints the command line usage of the shell
+ * @param name the name the shell was invoked with
+ */
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--startup-profile] [--shared-history] [--script-cache] [--script-cache-dir=DIR] [--latency-json=FILE] [-c STRING [NAME [ARG...]] | SCRIPT [ARG...]]\n", name);
+}
 
-    hist_init(100);
+/**
+ * Takes the next line of the string given with -c
+ *
+ * @return newly-allocated line, or NULL when the string is used up
+ */
+static char *command_line(void)
+{
+    if (command_rest == NULL) {
+        return NULL;
+    }
+    char *end = strchr(command_rest, '\n');
+    size_t len = (end != NULL) ? (size_t) (end - command_rest) : strlen(command_rest);
+    char *line = mem_malloc(MEM_UI, len + 1);
+    if (line == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(line, command_rest, len);
+    line[len] = '\0';
+    command_rest = (end != NULL) ? end + 1 : NULL;
+    if (command_rest != NULL && command_rest[strspn(command_rest, " \t\r\n")] == '\0') {
+        command_rest = NULL;
+    }
+    return line;
+}
 
-    while (true) {
-        char* command = read_command();
-        if (command == NULL) {
-            free(command);
-            break;
-        }
-        if ((strcmp(command, "") != 0) && (*command != '!')) {
-            hist_add(command);
+/**
+ * Reads the next input line, from the -c string or the script cache when one
+ * is in use and from read_command() otherwise, adds it to the history,
+ * tokenizes it, and expands its aliases. Time spent waiting in read_command()
+ * is recorded as the input phase of the latency histograms.
+ * @param args receives the NULL-terminated tokens of the line, or NULL to
+ * get the line untokenized
+ * @param tokens receives the number of tokens
+ *
+ * @return the raw line, or NULL at the end of input
+ */
+static char *next_line(char ***args, int *tokens)
+{
+    bool pipes;
+    char *command;
+    char **cached = NULL;
+    int cached_tokens = 0;
+    latency_prompt();
+    if (command_mode) {
+        command = command_line();
+    } else if (script_cache_active()) {
+        command = script_cache_next(&cached, &cached_tokens);
+    } else {
+        uint64_t start = latency_clock();
+        command = read_command();
+        if (command != NULL) {
+            uint64_t waited = latency_clock() - start;
+            latency_add(LAT_INPUT, waited);
+            input_wait += waited;
         }
+    }
+    if (command == NULL) {
+        return NULL;
+    }
+    line_ready = latency_clock();
+    if (command_mode == false && (strcmp(command, "") != 0) && (*command != '!')) {
+        hist_add(command);
+    }
+    if (args == NULL) {
+        mem_free(MEM_PARSER, cached);
+        return command;
+    }
+    *args = cached;
+    *tokens = cached_tokens;
+    if (*args == NULL && (*args = tokenize_command(command, tokens, &pipes)) == NULL) {
+        mem_free(MEM_UI, command);
+        return NULL;
+    }
+    alias_expand(args, tokens);
+    return command;
+}
 
-        set_search_start();
+int main(int argc, char *argv[])
+{
+    clock_gettime(CLOCK_MONOTONIC, &profile_start);
+    profile_last = profile_start;
+    bool use_script_cache = false;
+    bool use_shared_history = false;
+    char *script_cache_dir = NULL;
+    char *script = NULL;
+    int params = argc;
 
-        char **args = calloc(100, sizeof(char*)*sizeof(char*));
-        int tokens = 0;
-        char *next_tok = command;
-        char *curr_tok;
-
-        char *jobs_cmd = strdup(command);
-        bool pipes = false;
-        bool io_redirection = false;
-        int size = 100;
-
-        while ((curr_tok = next_token(&next_tok, " \t\r\n")) != NULL) {
-            if (size == 0){
-                char **tmp = realloc(args, (tokens)*sizeof(char*)*sizeof(char*));
-                if (tmp == NULL) {
-                    perror("realloc");
-                    free(args);
-                    free(command);
-                    continue;
-                } else {
-                    args = tmp;
-                }
-                size = 100;
+    for (int i = 1; i < argc && params == argc; i++) {
+        if (strcmp(argv[i], "--startup-profile") == 0) {
+            startup_profile = true;
+        } else if (strcmp(argv[i], "--shared-history") == 0) {
+            use_shared_history = true;
+        } else if (strcmp(argv[i], "--script-cache") == 0) {
+            use_script_cache = true;
+        } else if (strncmp(argv[i], "--script-cache-dir=", 19) == 0) {
+            use_script_cache = true;
+            script_cache_dir = argv[i] + 19;
+        } else if (strncmp(argv[i], "--latency-json=", 15) == 0) {
+            latency_dump_at_exit(argv[i] + 15);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            /* Words after the string are "$0" and then "$1" onwards */
+            command_mode = true;
+            command_rest = argv[++i];
+            params = i + 1;
+            if (params < argc) {
+                vars_set_name(argv[params++]);
             }
-            if (*curr_tok == '#') {
-                break;
-            } else if (*curr_tok == '|') {
-                pipes = true;
-                args[tokens++] = curr_tok;
-            } else if (*curr_tok == '>') {
-                io_redirection = true;
-                args[tokens++] = curr_tok;
-            } else {
-                args[tokens++] = curr_tok;
-            }
-            size--;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            script = argv[i];
+            vars_set_name(script);
+            params = i + 1;
         }
+    }
+    vars_swap_params(argv + params);
+    profile_mark("arguments");
 
-        args[tokens] = (char *) 0;
-        
-        if (args[0] == (char *) 0) {
-            free(jobs_cmd);
-            free(args);
-            free(command);
-            continue;
+    if (script != NULL) {
+        int fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(script);
+            return 1;
         }
-
-        if (args[tokens - 1] != NULL && strcmp(args[tokens - 1], "&") != 0) {
-           free(jobs_cmd);
+        if (dup2(fd, STDIN_FILENO) == -1) {
+            perror("dup2");
+            return 1;
         }
+        close(fd);
+        profile_mark("script open");
+    }
 
-        if (strcmp(args[0], "!!") == 0) {
-            double_bang_handler(args);
-        } else if (args[0][0] == '!') {
-            bang_handler(args, command);
-        }
-        if (strcmp(args[0], "exit") == 0) {
+    if (command_mode == false) {
+        init_ui();
+        profile_mark("ui");
+    }
+    /* Glob results are sorted with strcoll(), so collate by the user's locale
+     * in scripts and -c strings too, not only in interactive sessions */
+    setlocale(LC_COLLATE, "");
+    profile_mark("locale");
+
+    signal(SIGINT, sigint_handler);
+    signal(SIGCHLD, sigchld_handler);
+    profile_mark("signals");
+
+    hist_init(100);
+    profile_mark("history");
+    if (use_shared_history) {
+        sharehist_open();
+        profile_mark("shared history");
+    }
+
+    if (use_script_cache) {
+        script_cache_open(script_cache_dir);
+        profile_mark("script cache");
+    }
+    profile_mark(NULL);
+
+    while (eval_exit_requested() == false) {
+        char **args = NULL;
+        int tokens = 0;
+        char *command = next_line(&args, &tokens);
+        if (command == NULL) {
             break;
-        } else if (strcmp(args[0], "history") == 0) {
-            history_handler(args);
-            free(args);
-            free(command);
-            continue;
-        } else if (strcmp(args[0], "cd") == 0) {
-            cd_handler(args);
-            free(args);
-            free(command);
-            continue;
-        } else if (strcmp(args[0], "jobs") == 0) {
-            for (int i = get_job_num(); i >= 0; i--) {
-                if (get_jobs_list()[i].command != NULL) {
-                    printf("%s\n", get_jobs_list()[i].command);
-                }
-            }
-            free(args);
-            free(command);
-            continue;
         }
+        set_search_start();
 
-        struct command_line *cmds = NULL; 
-        if ((cmds = build_pipes(args, pipes)) == NULL) {
-            free(args);
-            free(command);
-            free(cmds);
+        /* Continuation lines read while parsing count as input, not parsing */
+        uint64_t parse_start = line_ready;
+        uint64_t waited = input_wait;
+        bool error = false;
+        struct node *list = parse_line(args, tokens, next_line, &error);
+        latency_add(LAT_PARSE, latency_clock() - parse_start - (input_wait - waited));
+        mem_free(MEM_PARSER, args);
+        mem_free(MEM_UI, command);
+        if (error) {
+            vars_set_status(2);
+            set_status(2);
             continue;
         }
-        
-        pid_t child = fork();
-        if (child == -1) {
-            free(command);
-            perror("fork");
-        } else if (child == 0) {
-            if (args[0] != (char *) 0) {
-                if (pipes == true || io_redirection == true) {
-                    execute_pipeline(cmds);
-                } else {
-                    if (execvp(args[0], args) != 0) {
-                        perror("mash");
-                    }
-                }
-                free(command);
-            }
-        } else {
-            if (strcmp(args[tokens - 1], "&") == 0) {
-                if (get_job_num() == 10) {
-                    set_job_num(0);
-                }
-                get_jobs_list()[get_job_num()].command = jobs_cmd;
-                get_jobs_list()[get_job_num()].pid = child;
-                set_job_num(get_job_num()+1);
-            } else {
-                int status;
-                waitpid(child, &status, 0);
-                set_status(status);
-            }
+        if (list != NULL) {
+            /* The last line of a -c string may exec its final command in place */
+            bool last = command_mode && command_rest == NULL;
+            set_status(last ? eval_final(list) : eval_list(list));
+            node_free(list);
         }
-        free(args);
-        free(command);
-        free(cmds);
     }
+    latency_dump();
     hist_destroy();
+    sharehist_close();
     jobs_destroy();
+    wildcard_destroy();
+    complete_destroy();
+    frecency_close();
+    script_cache_close();
+    alias_destroy();
+    func_destroy();
+    arith_destroy();
+    read_destroy();
+    vars_destroy();
 
-    return 0;
+    return eval_exit_requested() ? eval_exit_status() : vars_get_status();
 }
\ No newline at end of file
@@ -6,14 +6,18 @@
 
 #include <stdio.h>
 #include <stdbool.h>
-#include <readline/readline.h>
 #include <locale.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <dirent.h>
+#include <stdint.h>
 
+#include "complete.h"
 #include "history.h"
+#include "lineedit.h"
 #include "logger.h"
+#include "memstat.h"
+#include "sharehist.h"
 #include "ui.h"
 #include "util.h"
 
@@ -45,8 +49,16 @@ static char *path = NULL;
 
 static char *curr_path = NULL;
 
+static bool shared_browsing = false;
+
+static uint64_t shared_cursor = 0;
+
+static char *shared_input = NULL;
+
 /**
- * Initializes the UI and allows script mode
+ * Initializes the UI and allows script mode. Script mode takes a fast path
+ * that never sets the locale or loads readline; readline is loaded only for
+ * interactive sessions.
  */
 void init_ui(void)
 {
@@ -57,14 +69,20 @@ void init_ui(void)
     curr_path = NULL;
 
     LOGP("Initializing UI...\n");
-    char *locale = setlocale(LC_ALL, "en_US.UTF-8");
-    LOG("Setting locale: %s\n", (locale != NULL) ? locale : "could not set locale!");
     if (isatty(STDIN_FILENO) == false) {
         LOGP("data piped in on stdin; entering script mode\n");
         scripting = true;
+        return;
+    }
+    char *locale = setlocale(LC_ALL, "en_US.UTF-8");
+    LOG("Setting locale: %s\n", (locale != NULL) ? locale : "could not set locale!");
+    if (lineedit_load() == -1) {
+        fprintf(stderr, "mash: line editing unavailable; reading plain lines\n");
+        scripting = true;
+        return;
     }
-    rl_startup_hook = readline_init;
-    //-- anything with "rl_" prefix is a readline function
+    *le.startup_hook = readline_init;
+    //-- anything with "rl_" prefix is a readline function, reached through le
 }
 
 /**
@@ -96,18 +114,21 @@ char *prompt_line(void)
         + strlen(status)
         + strlen(cmd_num)
         + strlen(user)
-        + strlen(host)
-        + strlen(cwd)
+        + ((host != NULL) ? strlen(host) : 0)
+        + ((cwd != NULL) ? strlen(cwd) : 0)
         + 1;
 
-    char *prompt_str = malloc(sizeof(char) * prompt_sz);
-
-    snprintf(prompt_str, prompt_sz, format_str,
-            status,
-            cmd_num,
-            user,
-            host,
-            cwd);
+    char *prompt_str = mem_malloc(MEM_UI, sizeof(char) * prompt_sz);
+    if (prompt_str != NULL) {
+        snprintf(prompt_str, prompt_sz, format_str,
+                status,
+                cmd_num,
+                user,
+                (host != NULL) ? host : "",
+                (cwd != NULL) ? cwd : "");
+    }
+    mem_free(MEM_UI, host);
+    mem_free(MEM_UI, cwd);
 
     return prompt_str;
 }
@@ -130,52 +151,45 @@ char *prompt_username(void)
 /**
  * Finds the hostname for the prompt
  * 
- * @return char pointer of hostname in terminal or "unknown_host" if it could not be found
+ * @return newly-allocated hostname, or "unknown_host" if it could not be found;
+ * the caller frees it
  */
 char *prompt_hostname(void)
 {
-    char *hostname = malloc(sizeof(char) * HOST_NAME_MAX);
-    if (gethostname(hostname, HOST_NAME_MAX) == 0) {
-        return hostname;
+    char hostname[HOST_NAME_MAX + 1];
+    if (gethostname(hostname, sizeof(hostname)) == 0) {
+        hostname[HOST_NAME_MAX] = '\0';
+        return mem_strdup(MEM_UI, hostname);
     } else {
-        free(hostname);
-        return "unknown_host";
+        return mem_strdup(MEM_UI, "unknown_host");
     }
 }
 
 /**
  * Finds the current working directory for the prompt
  * 
- * @return char pointer of username in terminal or "/unknown/path" if it could not be found
+ * @return newly-allocated working directory, with a home directory under /home
+ * shortened to "~", or "/unknown/path" if it could not be found; the caller
+ * frees it
  */
 char *prompt_cwd(void)
 {
     char *cwd;
     if ((cwd = getcwd(NULL, 0)) != NULL) {
-        char *ptr = strstr(cwd, "/home");
-        if (ptr != NULL) {
-            char *next_tok = strdup(cwd);
-            char *data = next_tok;
-            char *home = next_token(&next_tok, "/");
-            if (strcmp(home, "home") != 0) {
-                free(data);
-                return cwd;
-            }
-            next_token(&next_tok, "/");
-            char *temp = next_token(&next_tok, " ");
-            if (temp != NULL) {
-                char value[PATH_MAX] = "~/";
-                strcat(value, temp);
-                char *p = strdup(value);
-                free(data);
-                return p;
-            } else {
-                return "~"; 
+        char *display = cwd;
+        char value[PATH_MAX] = "~";
+        if (strncmp(cwd, "/home/", 6) == 0) {
+            char *rest = strchr(cwd + 6, '/');
+            if (rest != NULL && rest[1] != '\0') {
+                snprintf(value, PATH_MAX, "~%s", rest);
             }
+            display = value;
         }
-        return cwd;
+        char *p = mem_strdup(MEM_UI, display);
+        free(cwd);
+        return p;
     } else {
-        return "/unknown/path";
+        return mem_strdup(MEM_UI, "/unknown/path");
     }
 }
 
@@ -223,15 +237,13 @@ char *read_command(void)
             return NULL;
         }
         line[read_sz - 1] = '\0';
+        mem_adopt(MEM_UI, line);
         return line;
     } else {
         char *prompt = prompt_line();
-        char *command = readline(prompt);
-        if (command == NULL) {
-            free(prompt);
-            return NULL;
-        }
-        free(prompt);
+        char *command = le.readline(prompt);
+        mem_free(MEM_UI, prompt);
+        mem_adopt(MEM_UI, command);
         return command;
     }
 }
@@ -244,19 +256,108 @@ char *read_command(void)
  */
 int readline_init(void)
 {
-    rl_bind_keyseq("\\e[A", key_up);
-    rl_bind_keyseq("\\e[B", key_down);
-    rl_variable_bind("show-all-if-ambiguous", "on");
-    rl_variable_bind("colored-completion-prefix", "on");
-    rl_attempted_completion_function = command_completion;
+    le.bind_keyseq("\\e[A", key_up);
+    le.bind_keyseq("\\e[B", key_down);
+    le.variable_bind("show-all-if-ambiguous", "on");
+    le.variable_bind("colored-completion-prefix", "on");
+    *le.attempted_completion_function = command_completion;
+    *le.getc_function = ui_getc;
     return 0;
 }
 
+/**
+ * Reads the next key for readline, cancelling any file name completion still
+ * listing a directory unless the key is another Tab
+ * @param stream the input stream readline reads from
+ * 
+ * @return the key read, as returned by rl_getc
+ */
+int ui_getc(FILE *stream)
+{
+    int key = le.getc(stream);
+    if (key != '\t') {
+        complete_cancel();
+    }
+    return key;
+}
+
 /**
  * Sets search_start to -1 to start at the beginning
  */
 void set_search_start(void) {
     search_start = -1;
+    shared_browsing = false;
+}
+
+/**
+ * Moves this session's cursor in the shared history back to the previous entry
+ * starting with what the user typed, and displays it on the command line
+ * 
+ * @return 0 on completion
+ */
+static int shared_key_up(void)
+{
+    if (shared_browsing == false) {
+        mem_free(MEM_UI, shared_input);
+        if ((shared_input = mem_strdup(MEM_UI, *le.line_buffer)) == NULL) {
+            return 0;
+        }
+        shared_cursor = sharehist_head();
+        shared_browsing = true;
+    }
+    size_t prefix_length = strlen(shared_input);
+    uint64_t tail = sharehist_tail();
+    for (uint64_t i = shared_cursor; i > tail; i--) {
+        const char *entry = sharehist_get(i - 1);
+        if (entry != NULL && strncmp(entry, shared_input, prefix_length) == 0
+                && strcmp(entry, *le.line_buffer) != 0) {
+            shared_cursor = i - 1;
+            le.replace_line(entry, 1);
+            *le.point = *le.end;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Moves this session's cursor in the shared history forward to the next entry
+ * starting with what the user typed, restoring the typed text past the newest
+ * 
+ * @return 0 on completion
+ */
+static int shared_key_down(void)
+{
+    if (shared_browsing == false) {
+        return 0;
+    }
+    size_t prefix_length = strlen(shared_input);
+    uint64_t head = sharehist_head();
+    uint64_t i = (shared_cursor + 1 > sharehist_tail()) ? shared_cursor + 1 : sharehist_tail();
+    for (; i < head; i++) {
+        const char *entry = sharehist_get(i);
+        if (entry != NULL && strncmp(entry, shared_input, prefix_length) == 0
+                && strcmp(entry, *le.line_buffer) != 0) {
+            shared_cursor = i;
+            le.replace_line(entry, 1);
+            *le.point = *le.end;
+            return 0;
+        }
+    }
+    shared_browsing = false;
+    le.replace_line(shared_input, 1);
+    *le.point = *le.end;
+    return 0;
+}
+
+/**
+ * Saves the current line as the text history navigation searches for, freeing
+ * the previous one
+ */
+static void replace_user_input(void)
+{
+    mem_free(MEM_UI, user_input);
+    user_input = mem_strdup(MEM_UI, *le.line_buffer);
 }
 
 /**
@@ -278,8 +379,8 @@ char *hist_search_prefix_up(char *prefix, char **strings)
         search_start = get_size() - 1;
     }
     if (search_start == (get_end()+1)) {
-        if (strcmp(strings[get_end()+1], rl_line_buffer) != 0) {
-            user_input = strdup(rl_line_buffer);
+        if (strcmp(strings[get_end()+1], *le.line_buffer) != 0) {
+            replace_user_input();
             prefix = user_input;
             search_start = get_end();
         } else {
@@ -317,26 +418,29 @@ char *hist_search_prefix_up(char *prefix, char **strings)
  */
 int key_up(int count, int key)
 {
+    if (sharehist_active()) {
+        return shared_key_up();
+    }
     const char **strings = get_string_list();
     if (initialized == false) {
         initialized = true;
-        user_input = strdup(rl_line_buffer);
+        replace_user_input();
         search_start = get_end();
     }
-    if (strncmp(rl_line_buffer, user_input, strlen(user_input)) != 0) {
-        user_input = strdup(rl_line_buffer);
+    if (strncmp(*le.line_buffer, user_input, strlen(user_input)) != 0) {
+        replace_user_input();
     }
     const char *prefix_string = hist_search_prefix_up(user_input, (char**) strings);
     if (prefix_string != NULL) {
         if (strings[get_end()+2] != NULL) {
             if (strcmp(prefix_string, strings[get_end()+2]) == 0) {
-                rl_replace_line(strings[get_end()+1], 1);
-                rl_point = rl_end;
+                le.replace_line(strings[get_end()+1], 1);
+                *le.point = *le.end;
                 return 0;
             }
         }
-        rl_replace_line(prefix_string, 1);
-        rl_point = rl_end;
+        le.replace_line(prefix_string, 1);
+        *le.point = *le.end;
         return 0;
     }
     return 0;
@@ -391,16 +495,19 @@ char *hist_search_prefix_down(char *prefix, char **strings)
  */
 int key_down(int count, int key)
 {
+    if (sharehist_active()) {
+        return shared_key_down();
+    }
     const char **strings = get_string_list();
     const char *prefix_string = hist_search_prefix_down(user_input, (char**) strings);
     if (prefix_string != NULL) {
-        rl_replace_line(prefix_string, 1);
-        rl_point = rl_end;
+        le.replace_line(prefix_string, 1);
+        *le.point = *le.end;
         return 0;
     } else {
         initialized = false;
-        rl_replace_line("", 1); 
-        rl_point = rl_end;
+        le.replace_line("", 1); 
+        *le.point = *le.end;
     }
     return 0;
 }
@@ -415,10 +522,16 @@ int key_down(int count, int key)
  */
 char **command_completion(const char *text, int start, int end)
 {
+    /* Arguments and paths are completed by the asynchronous engine, which
+     * does not block on huge directories the way readline's own does. */
+    if ((start > 0 || strchr(text, '/') != NULL) && text[0] != '~') {
+        *le.attempted_completion_over = 1;
+        return complete_path(text);
+    }
     /* Tell readline that if we don't find a suitable completion, it should fall
      * back on its built-in filename completion. */
-    rl_attempted_completion_over = 0;
-    return rl_completion_matches(text, command_generator);
+    *le.attempted_completion_over = 0;
+    return le.completion_matches(text, command_generator);
 }
 
 /**
@@ -8,6 +8,8 @@
 #ifndef _UI_H_
 #define _UI_H_
 
+#include <stdio.h>
+
 void init_ui(void);
 char *prompt_line(void);
 char *prompt_username(void);
@@ -20,6 +22,7 @@ char *read_command(void);
 void set_search_start(void);
 int key_up(int count, int key);
 int key_down(int count, int key);
+int ui_getc(FILE *stream);
 char **command_completion(const char *text, int start, int end);
 char *command_generator(const char *text, int state);
 
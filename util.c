@@ -4,19 +4,37 @@
  * Contains retrieval, utility, signal, piping, redirection, jobs, and builtin functions.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "arith.h"
+#include "eval.h"
+#include "fanout.h"
+#include "frecency.h"
+#include "func.h"
+#include "guard.h"
 #include "history.h"
+#include "latency.h"
 #include "logger.h"
+#include "memstat.h"
+#include "pipesize.h"
+#include "place.h"
+#include "procsub.h"
+#include "pstat.h"
+#include "shard.h"
 #include "ui.h"
 #include "util.h"
 
@@ -76,6 +94,134 @@ char *next_token(char **str_ptr, const char *delim)
     return current_ptr;
 }
 
+/**
+ * Finds the first command separator (";", ";;", "&&", or "||") in a token
+ * @param tok the token to search
+ * @param sep receives the separator found
+ *
+ * @return pointer to the separator within tok, or NULL if there is none
+ */
+static char *find_separator(char *tok, char **sep)
+{
+    for (char *c = tok; *c != '\0'; c++) {
+        if (c[0] == '$' && c[1] == '(' && c[2] == '(' && arith_close(c + 3) != NULL) {
+            /* "&&" and "||" inside an arithmetic expansion are operators */
+            c = (char *) arith_close(c + 3) + 1;
+        } else if (c[0] == ';') {
+            *sep = (c[1] == ';') ? ";;" : ";";
+            return c;
+        } else if (c[0] == '&' && c[1] == '&') {
+            *sep = "&&";
+            return c;
+        } else if (c[0] == '|' && c[1] == '|') {
+            *sep = "||";
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Checks if a token ends inside an arithmetic expansion that the rest of the
+ * line closes, so the tokens after it belong to the expansion
+ * @param tok the token to check
+ * @param rest the text after the token, or NULL at the end of the line
+ *
+ * @return true if the token has a "$((" whose "))" comes later in the line
+ */
+static bool arith_continues(char *tok, char *rest)
+{
+    const char *open = arith_unclosed(tok);
+    if (open == NULL || rest == NULL) {
+        return false;
+    }
+    /* Look past the NUL that ends the token */
+    rest[-1] = ' ';
+    bool closed = arith_close(open + 3) != NULL;
+    rest[-1] = '\0';
+    return closed;
+}
+
+/**
+ * Splits a command line into tokens separated by whitespace, stopping at the
+ * first comment token. ";", ";;", "&&", and "||" always become tokens of
+ * their own, except inside "$(( ))", which stays one token even if it has
+ * blanks. A "$((" that the line never closes is left for the parser to
+ * reject. The tokens point into the command string, which is modified in
+ * place, or to string literals for separators.
+ * @param command the command line to split
+ * @param tokens receives the number of tokens found
+ * @param pipes receives whether the command contains a pipe
+ *
+ * @return NULL-terminated array of tokens that the caller must free, or NULL
+ * if memory could not be allocated
+ */
+char **tokenize_command(char *command, int *tokens, bool *pipes)
+{
+    int size = ARGS_INIT_SZ;
+    char **args = mem_malloc(MEM_PARSER, size * sizeof(char *));
+    if (args == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    int count = 0;
+    char *next_tok = command;
+    char *curr_tok;
+    *pipes = false;
+    while ((curr_tok = next_token(&next_tok, " \t\r\n")) != NULL) {
+        if (*curr_tok == '#') {
+            break;
+        }
+        /* An arithmetic expansion is one token, blanks and all */
+        while (arith_continues(curr_tok, next_tok)) {
+            char *end = next_tok - 1;
+            if (next_token(&next_tok, " \t\r\n") == NULL) {
+                break;
+            }
+            *end = ' ';
+        }
+        /* Separators split commands even without surrounding spaces */
+        while (curr_tok != NULL) {
+            char *tok = curr_tok;
+            char *sep = NULL;
+            char *at = find_separator(curr_tok, &sep);
+            if (at == NULL) {
+                curr_tok = NULL;
+            } else {
+                *at = '\0';
+                curr_tok = at + strlen(sep);
+                if (*curr_tok == '\0') {
+                    curr_tok = NULL;
+                }
+            }
+            for (int i = 0; i < 2; i++) {
+                char *add = (i == 0) ? tok : sep;
+                if (add == NULL || *add == '\0') {
+                    continue;
+                }
+                if (add == tok && *add == '|') {
+                    *pipes = true;
+                }
+                if (count + 1 == size) {
+                    char **tmp = mem_realloc(MEM_PARSER, args, size * 2 * sizeof(char *));
+                    if (tmp == NULL) {
+                        perror("realloc");
+                        mem_free(MEM_PARSER, args);
+                        return NULL;
+                    }
+                    args = tmp;
+                    size *= 2;
+                }
+                args[count++] = add;
+            }
+        }
+    }
+    args[count] = (char *) 0;
+    *tokens = count;
+    return args;
+}
+
 /**
  * Flushes the standard output when ^C is pressed
  * @param signo SIGINT integer
@@ -91,14 +237,17 @@ void sigint_handler(int signo)
  */
 void sigchld_handler(int signo)
 {
+    /* Only background jobs are reaped here; foreground commands are waited
+     * for by whoever started them, which needs their exit status. Freeing is
+     * left to jobs_reap() since free() is not async-signal-safe. */
     int status;
-    pid_t pid = waitpid(-1, &status, WNOHANG);
-    for (int i = 0; i <= job_num; i++) {
-        if (jobs[i].pid == pid) {
-            free(jobs[i].command);
-            jobs[i].command = NULL;
+    for (int i = 0; i < 10; i++) {
+        if (jobs[i].command != NULL && jobs[i].done == 0
+                && waitpid(jobs[i].pid, &status, WNOHANG) > 0) {
+            jobs[i].done = 1;
         }
     }
+    procsub_reap();
 }
 
 /**
@@ -110,7 +259,7 @@ void sigchld_handler(int signo)
  */
 struct command_line *build_pipes(char *args[], bool pipes) 
 {
-    cmds = calloc(100, sizeof(struct command_line));
+    cmds = mem_calloc(MEM_PARSER, 100, sizeof(struct command_line));
     if (pipes == true) {
         int i = 0;
         int j = 0;
@@ -119,7 +268,7 @@ struct command_line *build_pipes(char *args[], bool pipes)
         int size = 100;
         while (args[i] != (char *) 0) {
             if (size == 0){
-                struct command_line *tmp = realloc(cmds, i*sizeof(struct command_line));
+                struct command_line *tmp = mem_realloc(MEM_PARSER, cmds, i*sizeof(struct command_line));
                 if (tmp == NULL) {
                     perror("realloc");
                     return NULL;
@@ -128,8 +277,10 @@ struct command_line *build_pipes(char *args[], bool pipes)
                 }
                 size = 100;
             }
-            if (strcmp(args[i], "|") == 0) {
+            size_t len = strlen(args[i]);
+            if (strcmp(args[i], "|") == 0 || (args[i][0] == '|' && args[i][len - 1] == '>')) {
                 j++;
+                cmds[j].shard = (args[i][1] != '\0') ? args[i] : NULL;
                 args[i] = (char *) 0;
                 cmds[j].tokens = &args[i+1];
                 cmds[j].stdout_pipe = true;
@@ -146,122 +297,605 @@ struct command_line *build_pipes(char *args[], bool pipes)
 }
 
 /**
- * Executes redirection on the command if the symbols ">", ">>", or "<" are found
- * @param args command arguments
+ * Parses a redirection operator token. Recognized forms are "[N]>", "[N]>>",
+ * "[N]<", "&>", "&>>", "[N]>&M", "[N]<&M", "[N]>&-", and "[N]<&-".
+ * @param tok the token to parse
+ * @param redir receives the parsed redirection (may be NULL)
+ *
+ * @return true if the token is a redirection operator, false otherwise
  */
-void execute_redirection(char *args[])
+static bool parse_redirection(const char *tok, struct redirection *redir)
 {
-    struct command_line *redir = calloc(100, sizeof(struct command_line));
-    int i = 0;
-    int j = 0;
-    int size = 100;
-    while (args[i] != (char *) 0) {
-        if (size == 0){
-            struct command_line *tmp = realloc(redir, i*sizeof(struct command_line));
-            if (tmp == NULL) {
-                perror("realloc");
-                return;
-            } else {
-                redir = tmp;
-            }
-            size = 100;
+    struct redirection r = { .fd = -1, .target = -1 };
+    const char *c = tok;
+
+    if (c[0] == '&' && c[1] == '>') {
+        r.kind = (c[2] == '>') ? REDIR_BOTH_APPEND : REDIR_BOTH;
+        c += (c[2] == '>') ? 3 : 2;
+        if (*c != '\0') {
+            return false;
         }
-        redir[j].stdout_file = NULL; 
-        if (strcmp(args[i], ">") == 0) {
-            j++;
-            args[i] = (char *) 0;
-            redir[j].stdout_file = args[i+1];
-            int out_fd = open(redir[j].stdout_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            if (out_fd == -1) {
-                perror("fd");
-                free(redir);
-                return;
+        r.fd = STDOUT_FILENO;
+        if (redir != NULL) {
+            *redir = r;
+        }
+        return true;
+    }
+
+    if (*c >= '0' && *c <= '9') {
+        r.fd = 0;
+        while (*c >= '0' && *c <= '9') {
+            r.fd = r.fd * 10 + (*c - '0');
+            c++;
+        }
+    }
+
+    if (*c != '<' && *c != '>') {
+        return false;
+    }
+    bool input = (*c == '<');
+    if (r.fd == -1) {
+        r.fd = input ? STDIN_FILENO : STDOUT_FILENO;
+    }
+    c++;
+
+    if (*c == '&') {
+        c++;
+        if (*c == '-' && *(c + 1) == '\0') {
+            r.kind = REDIR_CLOSE;
+        } else if (*c >= '0' && *c <= '9') {
+            r.kind = REDIR_DUP;
+            r.target = 0;
+            while (*c >= '0' && *c <= '9') {
+                r.target = r.target * 10 + (*c - '0');
+                c++;
             }
-            if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                perror("dup2");
-                free(redir);
-                return;
+            if (*c != '\0') {
+                return false;
             }
-        } else if (strcmp(args[i], ">>") == 0) {
-            j++;
-            args[i] = (char *) 0;
-            redir[j].stdout_file = args[i+1];
-            int out_fd = open(redir[j].stdout_file, O_APPEND | O_CREAT | O_WRONLY, 0666);
-            if (out_fd == -1) {
-                perror("fd");
-                free(redir);
-                return;
+        } else {
+            return false;
+        }
+    } else if (input == false && *c == '>' && *(c + 1) == '\0') {
+        r.kind = REDIR_APPEND;
+    } else if (*c == '\0') {
+        r.kind = input ? REDIR_IN : REDIR_OUT;
+    } else {
+        return false;
+    }
+
+    if (redir != NULL) {
+        *redir = r;
+    }
+    return true;
+}
+
+/**
+ * Checks if a token is a redirection operator
+ * @param tok the token to check
+ *
+ * @return true if the token redirects a file descriptor, false otherwise
+ */
+bool is_redirection(const char *tok)
+{
+    return parse_redirection(tok, NULL);
+}
+
+/**
+ * Moves an open file descriptor onto a specific descriptor number. The
+ * original descriptor is closed, and the result is left inheritable.
+ * @param from the descriptor to move
+ * @param to the descriptor number it should end up at
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int move_fd(int from, int to)
+{
+    if (from == to) {
+        /* dup2 would leave FD_CLOEXEC set, so clear it by hand */
+        return fcntl(to, F_SETFD, 0);
+    }
+    if (dup2(from, to) == -1) {
+        perror("dup2");
+        close(from);
+        return -1;
+    }
+    close(from);
+    return 0;
+}
+
+/**
+ * Marks every descriptor above stderr close-on-exec so a child only keeps the
+ * descriptors it sets up itself. Descriptors created afterwards with dup2()
+ * are still inherited.
+ */
+void close_inherited_fds(void)
+{
+    if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) == 0) {
+        return;
+    }
+    /* Kernels older than 5.11 lack CLOSE_RANGE_CLOEXEC */
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd == -1 || max_fd > 65536) {
+        max_fd = 65536;
+    }
+    for (int fd = 3; fd < max_fd; fd++) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags != -1 && (flags & FD_CLOEXEC) == 0) {
+            fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+        }
+    }
+}
+
+/**
+ * Creates a directory and any missing parents
+ * @param path the directory to create
+ *
+ * @return 0 on success or -1 on failure
+ */
+int make_dirs(char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int rc = mkdir(path, 0700);
+        *slash = '/';
+        if (rc == -1 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+    }
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Opens the file operand of a redirection
+ * @param r the redirection
+ * @param file the file to open
+ *
+ * @return the new descriptor or -1 on failure
+ */
+static int open_target(struct redirection *r, const char *file)
+{
+    int flags = O_CLOEXEC;
+    if (r->kind == REDIR_OUT || r->kind == REDIR_BOTH) {
+        flags |= O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (r->kind == REDIR_APPEND || r->kind == REDIR_BOTH_APPEND) {
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        flags |= O_RDONLY;
+    }
+    int fd = open(file, flags, 0666);
+    if (fd == -1) {
+        perror(file);
+    }
+    return fd;
+}
+
+/**
+ * Applies a single redirection to the current process
+ * @param r the redirection to apply
+ * @param file the file operand for redirections that open a file
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int apply_redirection(struct redirection *r, const char *file)
+{
+    switch (r->kind) {
+        case REDIR_OUT:
+        case REDIR_BOTH:
+        case REDIR_APPEND:
+        case REDIR_BOTH_APPEND:
+        case REDIR_IN:
+            break;
+        case REDIR_DUP:
+            if (r->target == r->fd) {
+                return fcntl(r->fd, F_SETFD, 0);
             }
-            if (dup2(out_fd, STDOUT_FILENO) == -1) {
+            if (dup2(r->target, r->fd) == -1) {
                 perror("dup2");
-                free(redir);
-                return;
+                return -1;
             }
-        } else if (strcmp(args[i], "<") == 0) {
-            j++;
-            args[i] = (char *) 0;
-            redir[j].stdout_file = args[i+1];
-            int in_fd = open(redir[j].stdout_file, O_RDONLY);
-            if (in_fd == -1) {
-                perror("fd");
-                free(redir);
-                return;
+            return 0;
+        case REDIR_CLOSE:
+            close(r->fd);
+            return 0;
+    }
+
+    int fd = open_target(r, file);
+    if (fd == -1) {
+        return -1;
+    }
+    if (r->kind == REDIR_BOTH || r->kind == REDIR_BOTH_APPEND) {
+        if (dup2(fd, STDERR_FILENO) == -1) {
+            perror("dup2");
+            close(fd);
+            return -1;
+        }
+    }
+    return move_fd(fd, r->fd);
+}
+
+/**
+ * Checks if a redirection writes a single descriptor to a file, the kind
+ * that can be given several times to send output to several files
+ * @param r the redirection
+ *
+ * @return true for "[N]> file" and "[N]>> file" with N below REDIR_FANOUT_FDS
+ */
+static bool fans_out(const struct redirection *r)
+{
+    return (r->kind == REDIR_OUT || r->kind == REDIR_APPEND) && r->fd < REDIR_FANOUT_FDS;
+}
+
+/**
+ * Sends a descriptor to every file it is redirected to. The files are opened
+ * in order and a fan-out copier is put in front of them: the calling process
+ * in a command's child (see fanout_redirect()), or a child of its own when
+ * the redirection is applied to the shell (see fanout_spawn()).
+ * @param args the remaining command arguments, starting at the first
+ * redirection of the descriptor
+ * @param fd the descriptor
+ * @param count the number of files it is redirected to
+ * @param save the shell's saved descriptors, or NULL in a command's child
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int redirect_fanout(char *args[], int fd, int count, struct redir_save *save)
+{
+    int outs[count];
+    int opened = 0;
+    for (int i = 0; args[i] != (char *) 0 && opened < count; i++) {
+        struct redirection r;
+        if (parse_redirection(args[i], &r) == false) {
+            continue;
+        }
+        if (r.kind != REDIR_DUP && r.kind != REDIR_CLOSE) {
+            i++;
+        }
+        if (fans_out(&r) == false || r.fd != fd) {
+            continue;
+        }
+        if ((outs[opened] = open_target(&r, args[i])) == -1) {
+            break;
+        }
+        opened++;
+    }
+    int pipe_fd = -1;
+    if (opened == count && save == NULL) {
+        pipe_fd = fanout_redirect(outs, count);
+    } else if (opened == count && save->copiers < REDIR_SAVE_MAX) {
+        /* The shell itself must not become the copier */
+        pipe_fd = fanout_spawn(outs, count, &save->copier_pids[save->copiers]);
+        save->copiers += (pipe_fd != -1);
+    }
+    if (pipe_fd == -1) {
+        for (int i = 0; i < opened; i++) {
+            close(outs[i]);
+        }
+        return -1;
+    }
+    return move_fd(pipe_fd, fd);
+}
+
+/**
+ * Executes redirection on the command for every redirection operator found
+ * (see parse_redirection()). Redirections are applied left to right, and the
+ * operators and their file operands are removed from the arguments. A
+ * descriptor redirected to several files ("cmd > a > b") writes to all of
+ * them.
+ * @param args command arguments
+ * @param save the shell's saved descriptors when the redirections are applied
+ * to the shell itself, or NULL in a command's child
+ *
+ * @return 0 on success or -1 if a redirection failed
+ */
+static int apply_redirections(char *args[], struct redir_save *save)
+{
+    int targets[REDIR_FANOUT_FDS] = { 0 };
+    bool fanned[REDIR_FANOUT_FDS] = { false };
+    for (int i = 0; args[i] != (char *) 0; i++) {
+        struct redirection r;
+        if (parse_redirection(args[i], &r) && r.kind != REDIR_DUP && r.kind != REDIR_CLOSE
+                && args[i + 1] != (char *) 0) {
+            targets[r.fd < REDIR_FANOUT_FDS ? r.fd : 0] += fans_out(&r);
+            i++;
+        }
+    }
+
+    int i = 0;
+    int j = 0;
+    while (args[i] != (char *) 0) {
+        struct redirection r;
+        if (parse_redirection(args[i], &r) == false) {
+            args[j++] = args[i++];
+            continue;
+        }
+        if (fans_out(&r) && targets[r.fd] > 1) {
+            /* The first redirection of the descriptor sets up every file */
+            if (fanned[r.fd] == false && redirect_fanout(args + i, r.fd, targets[r.fd], save) == -1) {
+                return -1;
             }
-            if (dup2(in_fd, STDIN_FILENO) == -1) {
-                perror("dup2");
-                free(redir);
-                return;
+            fanned[r.fd] = true;
+            i += (args[i + 1] != (char *) 0) ? 2 : 1;
+            continue;
+        }
+        const char *file = NULL;
+        if (r.kind != REDIR_DUP && r.kind != REDIR_CLOSE) {
+            file = args[i + 1];
+            if (file == (char *) 0) {
+                fprintf(stderr, "mash: missing file after '%s'\n", args[i]);
+                return -1;
             }
+            i++;
+        }
+        if (apply_redirection(&r, file) == -1) {
+            return -1;
         }
         i++;
-        size--;
     }
-    free(redir);
+    args[j] = (char *) 0;
+    return 0;
+}
+
+/**
+ * Executes redirection on the command in a child that is about to run it
+ * (see apply_redirections())
+ * @param args command arguments
+ *
+ * @return 0 on success or -1 if a redirection failed
+ */
+int execute_redirection(char *args[])
+{
+    return apply_redirections(args, NULL);
+}
+
+/**
+ * Remembers a descriptor before a redirection replaces it
+ * @param save the saved descriptors
+ * @param fd the descriptor
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int save_fd(struct redir_save *save, int fd)
+{
+    for (int i = 0; i < save->count; i++) {
+        if (save->fds[i] == fd) {
+            return 0;
+        }
+    }
+    if (save->count == REDIR_SAVE_MAX) {
+        fprintf(stderr, "mash: too many redirections\n");
+        return -1;
+    }
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (copy == -1 && errno != EBADF) {
+        perror("fcntl");
+        return -1;
+    }
+    save->fds[save->count] = fd;
+    save->copies[save->count++] = copy;
+    return 0;
+}
+
+/**
+ * Applies redirections to the shell itself rather than to a child, for
+ * builtins and compound commands. The operators and their files are removed
+ * from the arguments, and the descriptors they replace are kept so
+ * redirect_pop() can restore them.
+ * @param args command arguments
+ * @param save receives the replaced descriptors
+ *
+ * @return 0 on success or -1 if a redirection failed, in which case nothing
+ * is left redirected
+ */
+int redirect_push(char *args[], struct redir_save *save)
+{
+    save->count = 0;
+    save->copiers = 0;
+    fflush(NULL);
+    for (int i = 0; args[i] != (char *) 0; i++) {
+        struct redirection r;
+        if (parse_redirection(args[i], &r) == false) {
+            continue;
+        }
+        if (save_fd(save, r.fd) == -1 || ((r.kind == REDIR_BOTH || r.kind == REDIR_BOTH_APPEND)
+                    && save_fd(save, STDERR_FILENO) == -1)) {
+            redirect_pop(save);
+            return -1;
+        }
+        if (r.kind != REDIR_DUP && r.kind != REDIR_CLOSE && args[i + 1] != (char *) 0) {
+            i++;
+        }
+    }
+    if (apply_redirections(args, save) == -1) {
+        redirect_pop(save);
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * Executes piping on the command if the symbol "|" is found
+ * Puts back the descriptors replaced by redirect_push(), then waits for the
+ * children copying output to several files to pass on the rest of it
+ * @param save the saved descriptors
+ */
+void redirect_pop(struct redir_save *save)
+{
+    fflush(NULL);
+    for (int i = save->count - 1; i >= 0; i--) {
+        if (save->copies[i] == -1) {
+            close(save->fds[i]);
+        } else {
+            dup2(save->copies[i], save->fds[i]);
+            close(save->copies[i]);
+        }
+    }
+    save->count = 0;
+    for (int i = 0; i < save->copiers; i++) {
+        while (waitpid(save->copier_pids[i], NULL, 0) == -1 && errno == EINTR);
+    }
+    save->copiers = 0;
+}
+
+/**
+ * Runs a single command in the current process after wiring up its
+ * redirections. Only returns if the command could not be executed.
+ * @param args command arguments
+ */
+void exec_command(char *args[])
+{
+    close_inherited_fds();
+    procsub_keep(args);
+    if (execute_redirection(args) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+    if (args[0] == (char *) 0) {
+        _exit(EXIT_SUCCESS);
+    }
+    if (strcmp(args[0], "tee") == 0) {
+        _exit(tee_main(args));
+    }
+    guard_apply_limits();
+    if (func_defined(args[0])) {
+        /* A function that needs a process of its own runs in this child */
+        int status = eval_function(args);
+        fflush(NULL);
+        _exit(eval_exit_requested() ? eval_exit_status() : status);
+    }
+    latency_exec();
+    execvp(args[0], args);
+    perror("mash");
+    _exit(127);
+}
+
+/**
+ * Runs one pipeline stage in the current process: the command itself, or
+ * for a stage behind "|N>", the supervisor of its copies
+ * @param cmds command_line struct containing data on each stage
+ * @param num index of the stage to run
+ */
+static void run_stage(struct command_line *cmds, int num)
+{
+    struct command_line *cmd = &cmds[num];
+    place_apply(num, cmd->shard != NULL);
+    if (cmd->shard != NULL) {
+        _exit(shard_run(cmd->tokens, cmd->shard));
+    }
+    exec_command(cmd->tokens);
+}
+
+/**
+ * Executes piping on the command if the symbol "|" is found. Each stage gets
+ * the pipe ends it needs followed by its own redirections; the last stage
+ * replaces the current process unless the pipe sizing policy is adaptive or
+ * the pipeline is metered, in which case this process stays behind to
+ * supervise the pipes.
  * @param cmds command_line struct containing data on each argument of the command
  */
 void execute_pipeline(struct command_line *cmds)
 {
+    int stages = 1;
+    while (cmds[stages - 1].stdout_pipe == true) {
+        stages++;
+    }
+
+    bool adaptive = pipesize_adaptive();
+    int *edges = NULL;
+    pid_t *pids = NULL;
+    if (adaptive) {
+        edges = calloc(stages, sizeof(int));
+        pids = calloc(stages, sizeof(pid_t));
+        if (edges == NULL || pids == NULL) {
+            perror("calloc");
+            _exit(EXIT_FAILURE);
+        }
+        signal(SIGCHLD, SIG_DFL);
+    }
+    bool metered = pstat_enabled();
+    if (metered) {
+        pstat_begin(stages - 1);
+        signal(SIGCHLD, SIG_DFL);
+    }
+
     int num = 0;
-    while (true) {
+    while (cmds[num].stdout_pipe == true) {
         int fd[2];
-        if (pipe(fd) == -1) {
-            perror("pipe");
-            return;
-        }
-        execute_redirection(cmds[num].tokens);
-        if (cmds[num].stdout_pipe == false) {
-            if (execvp(cmds[num].tokens[0], cmds[num].tokens) == -1) {
-                perror("execvp");
-                return;
-            }
-            break;
+        if (pipe2(fd, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            _exit(EXIT_FAILURE);
         }
+        pipesize_apply(fd[1], num, cmds[num].tokens[0], cmds[num + 1].tokens[0]);
         pid_t pid = fork();
-        if (pid == 0) {
+        if (pid == -1) {
+            perror("fork");
+            _exit(EXIT_FAILURE);
+        } else if (pid == 0) {
             /* Child */
             if (dup2(fd[1], STDOUT_FILENO) == -1) {
                 perror("dup2");
-                return;
+                _exit(EXIT_FAILURE);
             }
             close(fd[0]);
-            if (execvp(cmds[num].tokens[0], cmds[num].tokens) == -1) {
-                perror("execvp");
-                return;
-            }
+            close(fd[1]);
+            run_stage(cmds, num);
         } else {
             /* Parent */
+            close(fd[1]);
+            int relayed = -1;
+            if (metered) {
+                relayed = pstat_relay(num, fd[0], cmds[num].tokens[0], cmds[num + 1].tokens[0]);
+                if (relayed != -1) {
+                    close(fd[0]);
+                    fd[0] = relayed;
+                }
+            }
+            if (adaptive) {
+                pids[num] = pid;
+                edges[num] = fcntl(fd[0], F_DUPFD_CLOEXEC, 3);
+            }
             if (dup2(fd[0], STDIN_FILENO) == -1) {
                 perror("dup2");
-                return;
+                _exit(EXIT_FAILURE);
             }
-            close(fd[1]);
+            close(fd[0]);
         }
         num++;
     }
+
+    if (adaptive || metered) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            _exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            run_stage(cmds, num);
+        }
+        close(STDIN_FILENO);
+        if (adaptive) {
+            pids[num] = pid;
+            pipesize_monitor(edges, pids, stages);
+        }
+        pstat_supervise(pid);
+    }
+    run_stage(cmds, num);
+}
+
+/**
+ * Removes background jobs that the SIGCHLD handler found finished
+ */
+void jobs_reap(void)
+{
+    for (int i = 0; i < 10; i++) {
+        if (jobs[i].command != NULL && jobs[i].done) {
+            mem_free(MEM_JOBS, jobs[i].command);
+            jobs[i].command = NULL;
+            jobs[i].done = 0;
+        }
+    }
 }
 
 /**
@@ -271,7 +905,7 @@ void jobs_destroy(void)
 {
     for (int i = 0; i < 10; i++) 
     {
-        free(jobs[i].command);
+        mem_free(MEM_JOBS, jobs[i].command);
     }
 }
 
@@ -314,21 +948,207 @@ void history_handler(char *args[])
 }
 
 /**
- * Changes the process's working directory
+ * Retrieves the user's home directory: $HOME if set, otherwise the password
+ * database entry, looked up once
+ *
+ * @return the home directory, or "/" if it cannot be determined
+ */
+static const char *home_dir(void)
+{
+    static char *pw_home = NULL;
+    const char *home = getenv("HOME");
+    if (home != NULL && home[0] != '\0') {
+        return home;
+    }
+    if (pw_home == NULL) {
+        struct passwd *pwuid = getpwuid(getuid());
+        pw_home = strdup((pwuid != NULL) ? pwuid->pw_dir : "/");
+    }
+    return (pw_home != NULL) ? pw_home : "/";
+}
+
+/**
+ * Records the current working directory in the frecency database
+ */
+static void record_cwd(void)
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, PATH_MAX) != NULL) {
+        frecency_visit(cwd);
+    }
+}
+
+/**
+ * Jumps to the highest scoring visited directory matching the patterns, or
+ * lists the best matches when there are no patterns or the first is "-l"
+ * @param name name of the builtin, for messages
+ * @param patterns NULL-terminated patterns
+ *
+ * @return 0 on success or 1 if no directory matched
+ */
+static int jump_handler(const char *name, char *patterns[])
+{
+    if (patterns[0] == NULL || strcmp(patterns[0], "-l") == 0) {
+        frecency_list((patterns[0] != NULL) ? patterns + 1 : patterns);
+        return 0;
+    }
+    const char *best;
+    while ((best = frecency_best(patterns)) != NULL) {
+        if (chdir(best) == 0) {
+            record_cwd();
+            return 0;
+        }
+        if (errno != ENOENT && errno != ENOTDIR) {
+            perror(best);
+            return 1;
+        }
+        frecency_forget(best);
+    }
+    fprintf(stderr, "%s: no match\n", name);
+    return 1;
+}
+
+/**
+ * Changes the process's working directory. "cd -j PATTERN..." and
+ * "z PATTERN..." jump to the best matching directory visited before.
  * @param args command arguments
+ *
+ * @return 0 on success or 1 if the directory could not be changed
+ */
+int cd_handler(char *args[]) 
+{
+    if (strcmp(args[0], "z") == 0) {
+        return jump_handler(args[0], args + 1);
+    }
+    if (args[1] != NULL && strcmp(args[1], "-j") == 0) {
+        return jump_handler("cd -j", args + 2);
+    }
+    const char *target = (args[1] != NULL) ? args[1] : home_dir();
+    if (chdir(target) == -1) {
+        perror("chdir");
+        return 1;
+    }
+    record_cwd();
+    return 0;
+}
+
+/**
+ * Parses an integer operand for the test builtin
+ * @param str the operand
+ * @param value receives the parsed value
+ *
+ * @return true if the operand is a valid integer
+ */
+static bool test_integer(const char *str, long long *value)
+{
+    char *end;
+    *value = strtoll(str, &end, 10);
+    return end != str && *end == '\0';
+}
+
+/**
+ * Evaluates a test expression
+ * @param args the expression operands
+ * @param count the number of operands
+ *
+ * @return 0 if the expression is true, 1 if it is false, or 2 on error
  */
-void cd_handler(char *args[]) 
+static int test_eval(char *args[], int count)
 {
-    if (args[1] != NULL) {
-        if (chdir(args[1]) == -1) {
-            perror("chdir");
+    if (count == 0) {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0) {
+        int result = test_eval(args + 1, count - 1);
+        return (result == 2) ? 2 : !result;
+    }
+    if (count == 1) {
+        return (args[0][0] != '\0') ? 0 : 1;
+    }
+    if (count == 2) {
+        struct stat st;
+        const char *op = args[0];
+        const char *arg = args[1];
+        if (strcmp(op, "-n") == 0) {
+            return (arg[0] != '\0') ? 0 : 1;
+        } else if (strcmp(op, "-z") == 0) {
+            return (arg[0] == '\0') ? 0 : 1;
+        } else if (strcmp(op, "-e") == 0) {
+            return (stat(arg, &st) == 0) ? 0 : 1;
+        } else if (strcmp(op, "-f") == 0) {
+            return (stat(arg, &st) == 0 && S_ISREG(st.st_mode)) ? 0 : 1;
+        } else if (strcmp(op, "-d") == 0) {
+            return (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) ? 0 : 1;
+        } else if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) {
+            return (lstat(arg, &st) == 0 && S_ISLNK(st.st_mode)) ? 0 : 1;
+        } else if (strcmp(op, "-s") == 0) {
+            return (stat(arg, &st) == 0 && st.st_size > 0) ? 0 : 1;
+        } else if (strcmp(op, "-r") == 0) {
+            return (access(arg, R_OK) == 0) ? 0 : 1;
+        } else if (strcmp(op, "-w") == 0) {
+            return (access(arg, W_OK) == 0) ? 0 : 1;
+        } else if (strcmp(op, "-x") == 0) {
+            return (access(arg, X_OK) == 0) ? 0 : 1;
         }
-    } else {
-        struct passwd *pwuid = getpwuid(getuid());
-        if (chdir(pwuid->pw_dir) == -1) {
-            perror("chdir");
+        fprintf(stderr, "test: unknown operator '%s'\n", op);
+        return 2;
+    }
+    if (count == 3) {
+        const char *op = args[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+            return (strcmp(args[0], args[2]) == 0) ? 0 : 1;
+        } else if (strcmp(op, "!=") == 0) {
+            return (strcmp(args[0], args[2]) != 0) ? 0 : 1;
+        }
+        long long a;
+        long long b;
+        if (test_integer(args[0], &a) == false || test_integer(args[2], &b) == false) {
+            fprintf(stderr, "test: integer expression expected\n");
+            return 2;
+        }
+        if (strcmp(op, "-eq") == 0) {
+            return (a == b) ? 0 : 1;
+        } else if (strcmp(op, "-ne") == 0) {
+            return (a != b) ? 0 : 1;
+        } else if (strcmp(op, "-lt") == 0) {
+            return (a < b) ? 0 : 1;
+        } else if (strcmp(op, "-le") == 0) {
+            return (a <= b) ? 0 : 1;
+        } else if (strcmp(op, "-gt") == 0) {
+            return (a > b) ? 0 : 1;
+        } else if (strcmp(op, "-ge") == 0) {
+            return (a >= b) ? 0 : 1;
+        }
+        fprintf(stderr, "test: unknown operator '%s'\n", op);
+        return 2;
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+/**
+ * Evaluates a conditional expression for the "test" and "[" builtins without
+ * forking. Supports string tests (-n, -z, =, !=), integer comparisons (-eq,
+ * -ne, -lt, -le, -gt, -ge), file tests (-e, -f, -d, -L, -s, -r, -w, -x), and
+ * negation with "!".
+ * @param args command arguments
+ *
+ * @return 0 if the expression is true, 1 if it is false, or 2 on error
+ */
+int test_handler(char *args[])
+{
+    int count = 0;
+    while (args[count] != (char *) 0) {
+        count++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
         }
+        count--;
     }
+    return test_eval(args + 1, count - 1);
 }
 
 /**
@@ -340,7 +1160,7 @@ void double_bang_handler(char *args[])
     char *bang_str = NULL;
     int num = hist_last_cnum();
     char *temp = (char*) hist_search_cnum(num);
-    bang_str = strdup(temp);
+    bang_str = mem_strdup(MEM_HISTORY, temp);
     if (bang_str != NULL) {
         hist_add(bang_str);
         char *tmp = bang_str;
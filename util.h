@@ -9,6 +9,7 @@
 
 #include <fcntl.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,13 +20,65 @@
 #include <unistd.h>
 
 /**
- * Stores command information for piping and redirection
+ * Initial capacity of the argument arrays built from a command line
+ */
+#define ARGS_INIT_SZ 100
+
+/* Descriptors below this can be redirected to several files at once */
+#define REDIR_FANOUT_FDS 10
+
+/**
+ * Stores command information for piping and redirection. shard is the
+ * "|N>" operator in front of a stage that runs in several copies, or NULL.
  */
 struct command_line 
 {
     char **tokens;
     bool stdout_pipe;
     char *stdout_file;
+    char *shard;
+};
+
+/**
+ * Kinds of file descriptor redirection
+ */
+enum redir_kind
+{
+    REDIR_OUT,
+    REDIR_APPEND,
+    REDIR_IN,
+    REDIR_BOTH,
+    REDIR_BOTH_APPEND,
+    REDIR_DUP,
+    REDIR_CLOSE,
+};
+
+/**
+ * Stores a parsed redirection: the descriptor it applies to and, for
+ * duplication, the descriptor it copies
+ */
+struct redirection
+{
+    enum redir_kind kind;
+    int fd;
+    int target;
+};
+
+/* Most descriptors one redirect_push() can replace */
+#define REDIR_SAVE_MAX 16
+
+/**
+ * Stores the descriptors replaced by redirections applied to the shell
+ * itself, with a copy of each (-1 if it was closed) to put back afterwards,
+ * and the children copying output redirected to several files
+ */
+struct redir_save
+{
+    int count;
+    int fds[REDIR_SAVE_MAX];
+    int copies[REDIR_SAVE_MAX];
+    int copiers;
+    pid_t copier_pids[REDIR_SAVE_MAX];
 };
 
 /**
@@ -35,20 +88,30 @@ struct job_info
 {
     char *command;
     pid_t pid;
+    volatile sig_atomic_t done;
 };
 
 char *next_token(char **str_ptr, const char *delim);
+char **tokenize_command(char *command, int *tokens, bool *pipes);
 void sigint_handler(int signo);
 void sigchld_handler(int signo);
 struct command_line *build_pipes(char *args[], bool pipes);
-void execute_redirection(char *args[]);
+bool is_redirection(const char *tok);
+void close_inherited_fds(void);
+int make_dirs(char *path);
+int execute_redirection(char *args[]);
+int redirect_push(char *args[], struct redir_save *save);
+void redirect_pop(struct redir_save *save);
+void exec_command(char *args[]);
 void execute_pipeline(struct command_line *cmds);
+void jobs_reap(void);
 void jobs_destroy(void);
 struct job_info *get_jobs_list(void);
 int get_job_num(void);
 void set_job_num(int num);
 void history_handler(char *args[]);
-void cd_handler(char *args[]);
+int cd_handler(char *args[]);
+int test_handler(char *args[]);
 void double_bang_handler(char *args[]);
 void bang_handler(char *args[], char* bang_str);
 
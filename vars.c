@@ -0,0 +1,616 @@
+/**
+ * @file
+ *
+ * Contains shell variables and "$" expansion. Variables live in a hash table;
+ * names that are not shell variables fall back to the environment. The
+ * positional parameters ("$1", "$#", "$@") belong to the script, the -c
+ * string, or the function being run.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arith.h"
+#include "logger.h"
+#include "vars.h"
+
+/* Number of hash table buckets */
+#define VARS_BUCKETS 256
+
+/**
+ * Stores a single shell variable
+ */
+struct var
+{
+    char *name;
+    char *value;
+    struct var *next;
+};
+
+static struct var *table[VARS_BUCKETS] = { 0 };
+static int last_status = 0;
+static const char *shell_name = "mash";
+static char *no_params[] = { NULL };
+static char **params = no_params;
+static char **pool = NULL;
+static size_t pool_len = 0;
+static size_t pool_cap = 0;
+
+/**
+ * Hashes a variable name
+ * @param name the name to hash
+ * @param len the length of the name
+ *
+ * @return bucket index for the name
+ */
+static unsigned int var_hash(const char *name, size_t len)
+{
+    unsigned int hash = 5381;
+    for (size_t i = 0; i < len; i++) {
+        hash = hash * 33 + (unsigned char) name[i];
+    }
+    return hash % VARS_BUCKETS;
+}
+
+/**
+ * Finds a shell variable by name
+ * @param name the name to find (not necessarily NUL-terminated)
+ * @param len the length of the name
+ *
+ * @return pointer to the variable or NULL if it is not set
+ */
+static struct var *var_find(const char *name, size_t len)
+{
+    for (struct var *v = table[var_hash(name, len)]; v != NULL; v = v->next) {
+        if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0') {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Checks if a string is a valid variable name
+ * @param name the candidate name
+ * @param len the length of the name
+ *
+ * @return true if the name is made of letters, digits, and underscores and
+ * does not start with a digit
+ */
+bool var_valid_name(const char *name, size_t len)
+{
+    if (len == 0 || isdigit((unsigned char) name[0])) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Checks if a token is a variable assignment of the form NAME=VALUE
+ * @param tok the token to check
+ *
+ * @return true if the token is an assignment
+ */
+bool var_assignment(const char *tok)
+{
+    const char *eq = strchr(tok, '=');
+    return eq != NULL && var_valid_name(tok, eq - tok);
+}
+
+/**
+ * Sets a shell variable, replacing any previous value. Variables that are in
+ * the environment are updated there as well.
+ * @param name the variable name
+ * @param value the new value
+ */
+void var_set(const char *name, const char *value)
+{
+    size_t len = strlen(name);
+    struct var *v = var_find(name, len);
+    char *copy = strdup(value);
+    if (copy == NULL) {
+        perror("strdup");
+        return;
+    }
+    if (getenv(name) != NULL && setenv(name, value, 1) == -1) {
+        perror("setenv");
+    }
+    if (v != NULL) {
+        free(v->value);
+        v->value = copy;
+        return;
+    }
+    if ((v = malloc(sizeof(struct var))) == NULL || (v->name = strdup(name)) == NULL) {
+        perror("malloc");
+        free(v);
+        free(copy);
+        return;
+    }
+    v->value = copy;
+    unsigned int bucket = var_hash(name, len);
+    v->next = table[bucket];
+    table[bucket] = v;
+}
+
+/**
+ * Looks up a variable, checking shell variables before the environment
+ * @param name the variable name
+ *
+ * @return the value or NULL if the variable is not set
+ */
+const char *var_get(const char *name)
+{
+    struct var *v = var_find(name, strlen(name));
+    if (v != NULL) {
+        return v->value;
+    }
+    return getenv(name);
+}
+
+/**
+ * Removes a shell variable
+ * @param name the variable name
+ */
+void var_unset(const char *name)
+{
+    size_t len = strlen(name);
+    struct var **link = &table[var_hash(name, len)];
+    while (*link != NULL) {
+        struct var *v = *link;
+        if (strcmp(v->name, name) == 0) {
+            *link = v->next;
+            free(v->name);
+            free(v->value);
+            free(v);
+            return;
+        }
+        link = &v->next;
+    }
+}
+
+/**
+ * Records the exit status of the last command for "$?"
+ * @param status the exit status
+ */
+void vars_set_status(int status)
+{
+    last_status = status;
+}
+
+/**
+ * Retrieves the exit status of the last command
+ *
+ * @return the exit status
+ */
+int vars_get_status(void)
+{
+    return last_status;
+}
+
+/**
+ * Sets the name "$0" expands to
+ * @param name the script name, or the name given after a -c string
+ */
+void vars_set_name(const char *name)
+{
+    shell_name = name;
+}
+
+/**
+ * Replaces the positional parameters. The array is not copied and must stay
+ * valid until it is replaced again.
+ * @param args NULL-terminated parameters, "$1" first, or NULL for none
+ *
+ * @return the parameters that were in effect, for restoring them later
+ */
+char **vars_swap_params(char **args)
+{
+    char **old = params;
+    params = (args != NULL) ? args : no_params;
+    return old;
+}
+
+/**
+ * Counts the positional parameters
+ *
+ * @return the value of "$#"
+ */
+static int param_count(void)
+{
+    int count = 0;
+    while (params[count] != NULL) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Handles the "shift" builtin: "shift [N]" drops the first N positional
+ * parameters (one by default)
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 if there are fewer than N parameters
+ */
+int shift_handler(char *args[])
+{
+    int count = (args[1] != NULL) ? atoi(args[1]) : 1;
+    if (count < 0 || count > param_count()) {
+        fprintf(stderr, "shift: shift count out of range\n");
+        return 1;
+    }
+    params += count;
+    return 0;
+}
+
+/**
+ * Appends text to a growing string
+ * @param out the string being built
+ * @param len current length of the string
+ * @param cap current capacity of the string
+ * @param text the text to append
+ * @param text_len the length of the text
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int append(char **out, size_t *len, size_t *cap, const char *text, size_t text_len)
+{
+    if (*len + text_len + 1 > *cap) {
+        size_t new_cap = (*cap == 0) ? 64 : *cap;
+        while (*len + text_len + 1 > new_cap) {
+            new_cap *= 2;
+        }
+        char *tmp = realloc(*out, new_cap);
+        if (tmp == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        *out = tmp;
+        *cap = new_cap;
+    }
+    memcpy(*out + *len, text, text_len);
+    *len += text_len;
+    (*out)[*len] = '\0';
+    return 0;
+}
+
+static char *expand_token(const char *tok);
+
+/**
+ * Evaluates the expression of an arithmetic expansion. References with "$"
+ * inside it are expanded first; plain variable names are left to the
+ * evaluator, which lets it reuse the compiled expression.
+ * @param expr the text between "$((" and "))"
+ * @param len the length of the text
+ * @param number receives the value as a string
+ * @param size the size of the number buffer
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int expand_arith(const char *expr, size_t len, char *number, size_t size)
+{
+    long long result;
+    if (memchr(expr, '$', len) == NULL) {
+        if (arith_eval(expr, len, &result) == -1) {
+            return -1;
+        }
+    } else {
+        char *text = strndup(expr, len);
+        char *expanded = (text != NULL) ? expand_token(text) : NULL;
+        free(text);
+        if (expanded == NULL) {
+            return -1;
+        }
+        int status = arith_eval(expanded, strlen(expanded), &result);
+        free(expanded);
+        if (status == -1) {
+            return -1;
+        }
+    }
+    snprintf(number, size, "%lld", result);
+    return 0;
+}
+
+/**
+ * Expands the variable references in a single token
+ * @param tok the token to expand
+ *
+ * @return newly-allocated expansion or NULL on failure
+ */
+static char *expand_token(const char *tok)
+{
+    char *out = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    char number[32];
+
+    if (append(&out, &len, &cap, "", 0) == -1) {
+        return NULL;
+    }
+    const char *c = tok;
+    while (*c != '\0') {
+        const char *dollar = strchr(c, '$');
+        if (dollar == NULL) {
+            if (append(&out, &len, &cap, c, strlen(c)) == -1) {
+                goto fail;
+            }
+            break;
+        }
+        if (append(&out, &len, &cap, c, dollar - c) == -1) {
+            goto fail;
+        }
+        c = dollar + 1;
+
+        const char *value = NULL;
+        if (*c == '?') {
+            snprintf(number, sizeof(number), "%d", last_status);
+            value = number;
+            c++;
+        } else if (*c == '$') {
+            snprintf(number, sizeof(number), "%d", (int) getpid());
+            value = number;
+            c++;
+        } else if (*c == '#') {
+            snprintf(number, sizeof(number), "%d", param_count());
+            value = number;
+            c++;
+        } else if (*c == '0') {
+            value = shell_name;
+            c++;
+        } else if (isdigit((unsigned char) *c)) {
+            value = (*c - '0' <= param_count()) ? params[*c - '0' - 1] : NULL;
+            c++;
+        } else if (*c == '@' || *c == '*') {
+            for (int i = 0; params[i] != NULL; i++) {
+                if ((i > 0 && append(&out, &len, &cap, " ", 1) == -1)
+                        || append(&out, &len, &cap, params[i], strlen(params[i])) == -1) {
+                    goto fail;
+                }
+            }
+            c++;
+        } else if (c[0] == '(' && c[1] == '(' && arith_close(c + 2) != NULL) {
+            const char *close = arith_close(c + 2);
+            if (expand_arith(c + 2, close - c - 2, number, sizeof(number)) == -1) {
+                goto fail;
+            }
+            value = number;
+            c = close + 2;
+        } else if (*c == '{' && isdigit((unsigned char) c[1])) {
+            /* "${10}" and beyond need braces */
+            char *end;
+            long index = strtol(c + 1, &end, 10);
+            if (*end != '}') {
+                value = "$";
+            } else {
+                value = (index == 0) ? shell_name
+                    : (index <= param_count()) ? params[index - 1] : NULL;
+                c = end + 1;
+            }
+        } else if (*c == '{') {
+            const char *close = strchr(c, '}');
+            if (close == NULL || var_valid_name(c + 1, close - c - 1) == false) {
+                value = "$";
+            } else {
+                char name[256];
+                size_t name_len = close - c - 1;
+                if (name_len >= sizeof(name)) {
+                    name_len = sizeof(name) - 1;
+                }
+                memcpy(name, c + 1, name_len);
+                name[name_len] = '\0';
+                value = var_get(name);
+                c = close + 1;
+            }
+        } else if (isalpha((unsigned char) *c) || *c == '_') {
+            const char *start = c;
+            while (isalnum((unsigned char) *c) || *c == '_') {
+                c++;
+            }
+            char name[256];
+            size_t name_len = c - start;
+            if (name_len >= sizeof(name)) {
+                name_len = sizeof(name) - 1;
+            }
+            memcpy(name, start, name_len);
+            name[name_len] = '\0';
+            value = var_get(name);
+        } else {
+            value = "$";
+        }
+        if (value != NULL && append(&out, &len, &cap, value, strlen(value)) == -1) {
+            goto fail;
+        }
+    }
+    return out;
+
+fail:
+    free(out);
+    return NULL;
+}
+
+/**
+ * Checks if a token is exactly "$@" or "$*", which expands to one argument
+ * per positional parameter
+ * @param tok the token to check
+ *
+ * @return true if the token is a whole-list reference
+ */
+static bool param_list(const char *tok)
+{
+    return strcmp(tok, "$@") == 0 || strcmp(tok, "$*") == 0
+        || strcmp(tok, "${@}") == 0 || strcmp(tok, "${*}") == 0;
+}
+
+/**
+ * Replaces every token that is exactly "$@" or "$*" with the positional
+ * parameters, one argument each. Must run before vars_expand(), which would
+ * join them into one argument.
+ * @param args NULL-terminated command arguments
+ *
+ * @return args itself if no token refers to the whole list, otherwise a
+ * newly-allocated array the caller must free (its strings are borrowed from
+ * args and the parameters)
+ */
+char **vars_split_params(char *args[])
+{
+    int count = 0;
+    int lists = 0;
+    for (; args[count] != NULL; count++) {
+        lists += param_list(args[count]);
+    }
+    if (lists == 0) {
+        return args;
+    }
+    int total = count - lists + lists * param_count();
+    char **split = malloc((total + 1) * sizeof(char *));
+    if (split == NULL) {
+        perror("malloc");
+        return args;
+    }
+    int j = 0;
+    for (int i = 0; i < count; i++) {
+        if (param_list(args[i]) == false) {
+            split[j++] = args[i];
+            continue;
+        }
+        for (int k = 0; params[k] != NULL; k++) {
+            split[j++] = params[k];
+        }
+    }
+    split[j] = NULL;
+    return split;
+}
+
+/**
+ * Expands "$NAME", "${NAME}", "$?", "$$", and the positional parameters
+ * ("$0" to "$9", "${10}" and up, "$#", "$@", "$*"), and arithmetic
+ * expansions ("$(( EXPR ))") in every token. Tokens are replaced in place;
+ * expanded strings stay valid until vars_release() is called. Unset variables
+ * expand to an empty string.
+ * @param args NULL-terminated command arguments
+ *
+ * @return 0 on success or -1 if a token could not be expanded, which leaves
+ * that token as it was
+ */
+int vars_expand(char *args[])
+{
+    int status = 0;
+    for (int i = 0; args[i] != (char *) 0; i++) {
+        if (strchr(args[i], '$') == NULL) {
+            continue;
+        }
+        char *expanded = expand_token(args[i]);
+        if (expanded == NULL) {
+            status = -1;
+            continue;
+        }
+        if (pool_len == pool_cap) {
+            size_t cap = (pool_cap == 0) ? 16 : pool_cap * 2;
+            char **tmp = realloc(pool, cap * sizeof(char *));
+            if (tmp == NULL) {
+                perror("realloc");
+                free(expanded);
+                continue;
+            }
+            pool = tmp;
+            pool_cap = cap;
+        }
+        pool[pool_len++] = expanded;
+        args[i] = expanded;
+    }
+    return status;
+}
+
+/**
+ * Frees the strings produced by vars_expand() for the current command
+ */
+void vars_release(void)
+{
+    for (size_t i = 0; i < pool_len; i++) {
+        free(pool[i]);
+    }
+    pool_len = 0;
+}
+
+/**
+ * Frees every shell variable and the expansion pool
+ */
+void vars_destroy(void)
+{
+    vars_release();
+    free(pool);
+    pool = NULL;
+    pool_cap = 0;
+    for (int i = 0; i < VARS_BUCKETS; i++) {
+        while (table[i] != NULL) {
+            struct var *v = table[i];
+            table[i] = v->next;
+            free(v->name);
+            free(v->value);
+            free(v);
+        }
+    }
+}
+
+/**
+ * Exports variables to the environment of later commands. Usage:
+ *   export NAME[=VALUE]...
+ * @param args command arguments
+ *
+ * @return 0 on success or 1 if a name was invalid
+ */
+int export_handler(char *args[])
+{
+    int status = 0;
+    for (int i = 1; args[i] != (char *) 0; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = (eq != NULL) ? (size_t) (eq - args[i]) : strlen(args[i]);
+        if (var_valid_name(args[i], len) == false) {
+            fprintf(stderr, "export: invalid name '%s'\n", args[i]);
+            status = 1;
+            continue;
+        }
+        char name[256];
+        if (len >= sizeof(name)) {
+            len = sizeof(name) - 1;
+        }
+        memcpy(name, args[i], len);
+        name[len] = '\0';
+        const char *value = (eq != NULL) ? eq + 1 : var_get(name);
+        if (value == NULL) {
+            value = "";
+        }
+        if (eq != NULL) {
+            var_set(name, value);
+        }
+        if (setenv(name, value, 1) == -1) {
+            perror("setenv");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Removes variables from the shell and the environment. Usage:
+ *   unset NAME...
+ * @param args command arguments
+ *
+ * @return 0 on completion
+ */
+int unset_handler(char *args[])
+{
+    for (int i = 1; args[i] != (char *) 0; i++) {
+        var_unset(args[i]);
+        unsetenv(args[i]);
+    }
+    return 0;
+}
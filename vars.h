@@ -0,0 +1,30 @@
+/**
+ * @file
+ *
+ * Contains function headers for shell variables and their expansion.
+ */
+
+#ifndef _VARS_H_
+#define _VARS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void var_set(const char *name, const char *value);
+const char *var_get(const char *name);
+void var_unset(const char *name);
+bool var_valid_name(const char *name, size_t len);
+bool var_assignment(const char *tok);
+void vars_set_status(int status);
+int vars_get_status(void);
+void vars_set_name(const char *name);
+char **vars_swap_params(char **args);
+int shift_handler(char *args[]);
+char **vars_split_params(char *args[]);
+int vars_expand(char *args[]);
+void vars_release(void);
+void vars_destroy(void);
+int export_handler(char *args[]);
+int unset_handler(char *args[]);
+
+#endif
@@ -0,0 +1,428 @@
+/**
+ * @file
+ *
+ * Contains the "watch" builtin, which runs a command again whenever files
+ * change or a timer fires. Changes come from inotify, with every directory
+ * under the given paths watched; a burst of events (an editor saving, a
+ * checkout) is gathered into one run by waiting for a short quiet period.
+ * The timer is a timerfd. The shell sleeps in poll() on these descriptors and
+ * on a signalfd for ^C, so nothing is polled for while nothing happens. The
+ * command is parsed once and the same tree is run every time.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "logger.h"
+#include "parser.h"
+#include "watch.h"
+
+/* Quiet time that ends a burst of changes, in milliseconds */
+#define WATCH_DEBOUNCE_MS 100
+
+/* Seconds between runs when no paths are given */
+#define WATCH_INTERVAL 2.0
+
+/* Events that count as a change */
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * Stores a watched file or directory
+ */
+struct watched
+{
+    int wd;
+    char *path;
+};
+
+/**
+ * Stores the state of a watch: the descriptors waited on, the watched paths,
+ * and the first path that changed since the last run
+ */
+struct watcher
+{
+    int inotify;
+    int timer;
+    int signals;
+    char **roots;
+    int root_count;
+    struct watched *items;
+    int count;
+    int size;
+    char changed[PATH_MAX];
+};
+
+/**
+ * Records a watch descriptor and the path it watches
+ * @param w the watcher
+ * @param wd the watch descriptor
+ * @param path the path
+ */
+static void remember(struct watcher *w, int wd, const char *path)
+{
+    for (int i = 0; i < w->count; i++) {
+        if (w->items[i].wd == wd) {
+            return;
+        }
+    }
+    if (w->count == w->size) {
+        int size = (w->size == 0) ? 16 : w->size * 2;
+        struct watched *tmp = realloc(w->items, size * sizeof(struct watched));
+        if (tmp == NULL) {
+            perror("realloc");
+            return;
+        }
+        w->items = tmp;
+        w->size = size;
+    }
+    if ((w->items[w->count].path = strdup(path)) == NULL) {
+        perror("strdup");
+        return;
+    }
+    w->items[w->count++].wd = wd;
+}
+
+/**
+ * Finds the path a watch descriptor watches
+ * @param w the watcher
+ * @param wd the watch descriptor
+ *
+ * @return index of the path or -1 if the descriptor is unknown
+ */
+static int lookup(struct watcher *w, int wd)
+{
+    for (int i = 0; i < w->count; i++) {
+        if (w->items[i].wd == wd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Watches a path and, if it is a directory, every directory below it.
+ * Directories whose names start with "." (such as .git) are skipped below the
+ * top, since tools write to them constantly.
+ * @param w the watcher
+ * @param path the path
+ * @param report true to report paths that cannot be watched
+ */
+static void add_tree(struct watcher *w, const char *path, bool report)
+{
+    int wd = inotify_add_watch(w->inotify, path, WATCH_EVENTS);
+    if (wd == -1) {
+        if (report) {
+            perror(path);
+        }
+        return;
+    }
+    remember(w, wd, path);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int) sizeof(child)) {
+            continue;
+        }
+        struct stat st;
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN
+                    && lstat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            add_tree(w, child, false);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Watches the given paths again if their watches went away, as happens when
+ * an editor saves a watched file by replacing it
+ * @param w the watcher
+ */
+static void rewatch_roots(struct watcher *w)
+{
+    for (int i = 0; i < w->root_count; i++) {
+        bool watched = false;
+        for (int j = 0; j < w->count && watched == false; j++) {
+            watched = (strcmp(w->items[j].path, w->roots[i]) == 0);
+        }
+        if (watched == false) {
+            add_tree(w, w->roots[i], false);
+        }
+    }
+}
+
+/**
+ * Reads the pending inotify events, watching new directories and forgetting
+ * removed ones
+ * @param w the watcher
+ *
+ * @return the number of events that count as a change
+ */
+static int drain_events(struct watcher *w)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changes = 0;
+    ssize_t len = read(w->inotify, buf, sizeof(buf));
+    for (char *p = buf; len > 0 && p < buf + len; ) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        int at = lookup(w, ev->wd);
+        if (ev->mask & IN_IGNORED) {
+            if (at != -1) {
+                free(w->items[at].path);
+                w->items[at] = w->items[--w->count];
+            }
+            continue;
+        }
+        if (at == -1 || (ev->mask & WATCH_EVENTS) == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        if (ev->len > 0) {
+            snprintf(path, sizeof(path), "%s/%s", w->items[at].path, ev->name);
+        } else {
+            snprintf(path, sizeof(path), "%s", w->items[at].path);
+        }
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                && ev->name[0] != '.') {
+            add_tree(w, path, false);
+        }
+        if (changes++ == 0 && w->changed[0] == '\0') {
+            snprintf(w->changed, sizeof(w->changed), "%s", path);
+        }
+    }
+    return changes;
+}
+
+/**
+ * Waits until the watched paths change (and then stay quiet for the debounce
+ * time) or the timer fires
+ * @param w the watcher
+ * @param debounce_ms the quiet time that ends a burst of changes
+ *
+ * @return 0 when the command should run again or -1 if ^C was pressed or
+ * waiting failed
+ */
+static int wait_for_change(struct watcher *w, int debounce_ms)
+{
+    struct pollfd fds[] = {
+        { w->signals, POLLIN, 0 }, { w->inotify, POLLIN, 0 }, { w->timer, POLLIN, 0 },
+    };
+    bool changed = false;
+    for (;;) {
+        /* Once something changed, wait only for the burst to end */
+        int ready = poll(fds, 3, changed ? debounce_ms : -1);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready == -1) {
+            perror("poll");
+            return -1;
+        }
+        if (ready == 0) {
+            rewatch_roots(w);
+            return 0;
+        }
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(w->signals, &info, sizeof(info)) > 0) {
+                return -1;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            changed |= (drain_events(w) > 0);
+        }
+        if (fds[2].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(w->timer, &expirations, sizeof(expirations)) > 0 && changed == false) {
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * Starts the timer that runs the command every interval
+ * @param w the watcher
+ * @param interval the interval in seconds
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int start_timer(struct watcher *w, double interval)
+{
+    if ((w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct itimerspec spec = { 0 };
+    spec.it_interval.tv_sec = (time_t) interval;
+    spec.it_interval.tv_nsec = (long) ((interval - (time_t) interval) * 1e9);
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(w->timer, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs the command once and reports how it went
+ * @param cmd the parsed command
+ * @param run the number of this run, from 1
+ *
+ * @return the exit status of the command
+ */
+static int run_once(struct node *cmd, int run)
+{
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = eval_list(cmd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "watch: run %d exited with status %d after %.3fs\n", run, status, elapsed);
+    return status;
+}
+
+/**
+ * Handles the "watch" builtin. Usage:
+ *   watch [--paths PATH... --] [--interval SECONDS] [--debounce MS] command...
+ * Runs the command, then runs it again each time something under the paths
+ * changes, or every interval (2 seconds if no paths are given). ^C stops it.
+ * @param args command arguments
+ *
+ * @return the exit status of the last run, or 2 on a usage error
+ */
+int watch_handler(char *args[])
+{
+    struct watcher w = { -1, -1, -1, NULL, 0, NULL, 0, 0, { 0 } };
+    double interval = 0;
+    long debounce_ms = WATCH_DEBOUNCE_MS;
+    bool valid = true;
+    int i = 1;
+    while (valid && args[i] != NULL && strncmp(args[i], "--", 2) == 0) {
+        char *end = NULL;
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "--paths") == 0) {
+            w.roots = args + ++i;
+            while (args[i] != NULL && strncmp(args[i], "--", 2) != 0) {
+                w.root_count++;
+                i++;
+            }
+            valid = (w.root_count > 0);
+            continue;
+        } else if (strcmp(args[i], "--interval") == 0 && args[i + 1] != NULL) {
+            interval = strtod(args[i + 1], &end);
+            valid = (interval >= 0.001);
+        } else if (strcmp(args[i], "--debounce") == 0 && args[i + 1] != NULL) {
+            debounce_ms = strtol(args[i + 1], &end, 10);
+            valid = (debounce_ms >= 0);
+        } else {
+            valid = false;
+            break;
+        }
+        valid = valid && end != args[i + 1] && *end == '\0';
+        i += 2;
+    }
+    if (valid == false || args[i] == NULL) {
+        fprintf(stderr, "usage: watch [--paths PATH... --] [--interval SECONDS] "
+                "[--debounce MS] command...\n");
+        return 2;
+    }
+
+    int count = 0;
+    while (args[i + count] != NULL) {
+        count++;
+    }
+    bool error = false;
+    struct node *cmd = parse_line(args + i, count, NULL, &error);
+    if (cmd == NULL) {
+        return error ? 2 : 0;
+    }
+
+    int status = 1;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    if ((w.signals = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+        perror("signalfd");
+        goto out;
+    }
+    if (w.root_count > 0) {
+        if ((w.inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1) {
+            perror("inotify_init1");
+            goto out;
+        }
+        for (int j = 0; j < w.root_count; j++) {
+            add_tree(&w, w.roots[j], true);
+        }
+        LOG("Watching %d directories and files\n", w.count);
+    }
+    if ((w.root_count == 0 || interval > 0)
+            && start_timer(&w, (interval > 0) ? interval : WATCH_INTERVAL) == -1) {
+        goto out;
+    }
+
+    for (int run = 1; ; run++) {
+        if (w.changed[0] != '\0') {
+            fprintf(stderr, "watch: %s changed\n", w.changed);
+            w.changed[0] = '\0';
+        }
+        status = run_once(cmd, run);
+        /* A command killed by ^C ends the watch too */
+        if (eval_exit_requested() || status == 128 + SIGINT) {
+            break;
+        }
+        /* ^C is taken from the signalfd only while waiting, so the commands
+         * that run still get it */
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        int result = wait_for_change(&w, debounce_ms);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        if (result == -1) {
+            break;
+        }
+    }
+
+out:
+    for (int j = 0; j < w.count; j++) {
+        free(w.items[j].path);
+    }
+    free(w.items);
+    int fds[] = { w.signals, w.inotify, w.timer };
+    for (size_t j = 0; j < sizeof(fds) / sizeof(fds[0]); j++) {
+        if (fds[j] != -1) {
+            close(fds[j]);
+        }
+    }
+    node_free(cmd);
+    return status;
+}
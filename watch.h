@@ -0,0 +1,13 @@
+/**
+ * @file
+ *
+ * Contains function headers for running a command again when files change
+ * or a timer fires.
+ */
+
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+int watch_handler(char *args[]);
+
+#endif
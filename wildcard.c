@@ -0,0 +1,479 @@
+/**
+ * @file
+ *
+ * Contains wildcard (glob) expansion for command tokens. Directories are read
+ * with large getdents64 batches and kept in a small listing cache keyed by
+ * path and modification time, so repeated globs over the same directory do
+ * not re-read it.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "wildcard.h"
+
+/* Size of the buffer handed to getdents64 */
+#define WILDCARD_BUF_SZ (1024 * 1024)
+
+/* Number of directory listings kept in the cache */
+#define WILDCARD_CACHE_SLOTS 8
+
+/* Seconds an unused listing may stay in the cache */
+#define WILDCARD_CACHE_TTL 30
+
+/**
+ * Record layout returned by the getdents64 system call
+ */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * Stores the entries of a single directory for the listing cache
+ */
+struct dir_listing
+{
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t loaded;
+    time_t last_used;
+    char *names;
+    size_t *offsets;
+    unsigned char *types;
+    size_t count;
+};
+
+/**
+ * Growable list of strings used while collecting matches
+ */
+struct str_list
+{
+    char **items;
+    size_t len;
+    size_t cap;
+};
+
+static struct dir_listing cache[WILDCARD_CACHE_SLOTS] = { 0 };
+static char *dirent_buf = NULL;
+static struct str_list pool = { 0 };
+
+/**
+ * Appends a string to a string list, growing it as needed
+ * @param list the list to append to
+ * @param str the string to append
+ *
+ * @return 0 on success or -1 if memory could not be allocated
+ */
+static int str_list_add(struct str_list *list, char *str)
+{
+    if (list->len == list->cap) {
+        size_t cap = (list->cap == 0) ? 16 : list->cap * 2;
+        char **tmp = realloc(list->items, cap * sizeof(char *));
+        if (tmp == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->items = tmp;
+        list->cap = cap;
+    }
+    list->items[list->len++] = str;
+    return 0;
+}
+
+/**
+ * Frees the strings held by a string list along with the list itself
+ * @param list the list to free
+ */
+static void str_list_free(struct str_list *list)
+{
+    for (size_t i = 0; i < list->len; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
+
+/**
+ * Compares two strings using the collation order of the current locale
+ * @param a pointer to the first string
+ * @param b pointer to the second string
+ *
+ * @return negative, zero, or positive integer like strcoll
+ */
+static int collate_cmp(const void *a, const void *b)
+{
+    return strcoll(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Frees the memory held by a cached directory listing
+ * @param listing the listing to free
+ */
+static void listing_free(struct dir_listing *listing)
+{
+    free(listing->path);
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->types);
+    memset(listing, 0, sizeof(struct dir_listing));
+}
+
+/**
+ * Reads every entry of a directory into a listing with getdents64
+ * @param path the directory to read
+ * @param listing the listing to fill
+ *
+ * @return 0 on success or -1 on failure
+ */
+static int listing_read(const char *path, struct dir_listing *listing)
+{
+    if (dirent_buf == NULL && (dirent_buf = malloc(WILDCARD_BUF_SZ)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    size_t names_cap = 4096;
+    size_t names_len = 0;
+    size_t entries_cap = 64;
+    size_t count = 0;
+    char *names = malloc(names_cap);
+    size_t *offsets = malloc(entries_cap * sizeof(size_t));
+    unsigned char *types = malloc(entries_cap);
+    if (names == NULL || offsets == NULL || types == NULL) {
+        perror("malloc");
+        goto fail;
+    }
+
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, dirent_buf, WILDCARD_BUF_SZ)) > 0) {
+        for (long pos = 0; pos < nread; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (dirent_buf + pos);
+            pos += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                continue;
+            }
+            size_t name_sz = strlen(d->d_name) + 1;
+            if (names_len + name_sz > names_cap) {
+                while (names_len + name_sz > names_cap) {
+                    names_cap *= 2;
+                }
+                char *tmp = realloc(names, names_cap);
+                if (tmp == NULL) {
+                    perror("realloc");
+                    goto fail;
+                }
+                names = tmp;
+            }
+            if (count == entries_cap) {
+                entries_cap *= 2;
+                size_t *tmp_off = realloc(offsets, entries_cap * sizeof(size_t));
+                if (tmp_off == NULL) {
+                    perror("realloc");
+                    goto fail;
+                }
+                offsets = tmp_off;
+                unsigned char *tmp_types = realloc(types, entries_cap);
+                if (tmp_types == NULL) {
+                    perror("realloc");
+                    goto fail;
+                }
+                types = tmp_types;
+            }
+            memcpy(names + names_len, d->d_name, name_sz);
+            offsets[count] = names_len;
+            types[count] = d->d_type;
+            names_len += name_sz;
+            count++;
+        }
+    }
+    if (nread == -1) {
+        perror("getdents64");
+        goto fail;
+    }
+    close(fd);
+
+    listing->names = names;
+    listing->offsets = offsets;
+    listing->types = types;
+    listing->count = count;
+    LOG("Read %zu entries from '%s'\n", count, path);
+    return 0;
+
+fail:
+    close(fd);
+    free(names);
+    free(offsets);
+    free(types);
+    return -1;
+}
+
+/**
+ * Retrieves the listing of a directory, reading it only if the cached copy is
+ * missing, expired, or older than the directory's modification time
+ * @param path the directory to list
+ *
+ * @return pointer to the cached listing or NULL if it could not be read
+ */
+static struct dir_listing *listing_get(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    time_t now = time(NULL);
+    struct dir_listing *slot = NULL;
+    for (int i = 0; i < WILDCARD_CACHE_SLOTS; i++) {
+        if (cache[i].path != NULL && now - cache[i].last_used > WILDCARD_CACHE_TTL) {
+            listing_free(&cache[i]);
+        }
+        if (cache[i].path != NULL && strcmp(cache[i].path, path) == 0) {
+            /* A listing read during the same second as the last change may
+             * have missed part of it, so it is only trusted once it is newer. */
+            if (cache[i].dev == st.st_dev && cache[i].ino == st.st_ino
+                    && cache[i].mtime.tv_sec == st.st_mtim.tv_sec
+                    && cache[i].mtime.tv_nsec == st.st_mtim.tv_nsec
+                    && cache[i].loaded > st.st_mtim.tv_sec) {
+                cache[i].last_used = now;
+                return &cache[i];
+            }
+            slot = &cache[i];
+            break;
+        }
+        if (slot == NULL || cache[i].path == NULL
+                || (slot->path != NULL && cache[i].last_used < slot->last_used)) {
+            slot = &cache[i];
+        }
+    }
+
+    listing_free(slot);
+    if (listing_read(path, slot) == -1) {
+        return NULL;
+    }
+    if ((slot->path = strdup(path)) == NULL) {
+        perror("strdup");
+        listing_free(slot);
+        return NULL;
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->loaded = now;
+    slot->last_used = now;
+    return slot;
+}
+
+/**
+ * Checks if a token contains unescaped wildcard characters
+ * @param token the token to check
+ *
+ * @return true if the token is a pattern, false otherwise
+ */
+bool wildcard_has_magic(const char *token)
+{
+    bool bracket = false;
+    for (const char *c = token; *c != '\0'; c++) {
+        if (*c == '\\' && *(c + 1) != '\0') {
+            c++;
+        } else if (*c == '*' || *c == '?') {
+            return true;
+        } else if (*c == '[') {
+            bracket = true;
+        } else if (*c == ']' && bracket) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Matches the remaining path components of a pattern below a prefix
+ * @param prefix the path matched so far (empty for the working directory)
+ * @param pattern the remaining pattern components separated by '/'
+ * @param matches list that receives every matching path
+ */
+static void wildcard_walk(const char *prefix, const char *pattern, struct str_list *matches)
+{
+    const char *slash = strchr(pattern, '/');
+    size_t comp_len = (slash != NULL) ? (size_t) (slash - pattern) : strlen(pattern);
+    size_t prefix_len = strlen(prefix);
+    if (comp_len > NAME_MAX || prefix_len + comp_len + 2 > PATH_MAX) {
+        return;
+    }
+
+    char comp[NAME_MAX + 1];
+    memcpy(comp, pattern, comp_len);
+    comp[comp_len] = '\0';
+
+    char candidate[PATH_MAX];
+    if (wildcard_has_magic(comp) == false) {
+        snprintf(candidate, PATH_MAX, "%s%s%s", prefix, comp, (slash != NULL) ? "/" : "");
+        if (slash != NULL) {
+            wildcard_walk(candidate, slash + 1, matches);
+            return;
+        }
+        struct stat st;
+        if (lstat(candidate, &st) == 0) {
+            char *match = strdup(candidate);
+            if (match != NULL && str_list_add(matches, match) == -1) {
+                free(match);
+            }
+        }
+        return;
+    }
+
+    struct dir_listing *listing = listing_get((prefix_len == 0) ? "." : prefix);
+    if (listing == NULL) {
+        return;
+    }
+
+    /* Collect this level first: descending may evict the listing. */
+    struct str_list level = { 0 };
+    for (size_t i = 0; i < listing->count; i++) {
+        const char *name = listing->names + listing->offsets[i];
+        if (fnmatch(comp, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        if (prefix_len + strlen(name) + 2 > PATH_MAX) {
+            continue;
+        }
+        snprintf(candidate, PATH_MAX, "%s%s", prefix, name);
+        if (slash != NULL) {
+            unsigned char type = listing->types[i];
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat st;
+                if (stat(candidate, &st) == -1 || !S_ISDIR(st.st_mode)) {
+                    continue;
+                }
+            } else if (type != DT_DIR) {
+                continue;
+            }
+            strcat(candidate, "/");
+        }
+        char *match = strdup(candidate);
+        if (match == NULL || str_list_add(&level, match) == -1) {
+            free(match);
+            break;
+        }
+    }
+
+    if (slash == NULL) {
+        for (size_t i = 0; i < level.len; i++) {
+            if (str_list_add(matches, level.items[i]) == -1) {
+                free(level.items[i]);
+            }
+        }
+        free(level.items);
+        return;
+    }
+    for (size_t i = 0; i < level.len; i++) {
+        wildcard_walk(level.items[i], slash + 1, matches);
+    }
+    str_list_free(&level);
+}
+
+/**
+ * Expands every wildcard token in a command's arguments. Tokens that match no
+ * paths are passed through unchanged.
+ * @param args NULL-terminated command arguments
+ *
+ * @return args itself when nothing was expanded, otherwise a newly-allocated
+ * NULL-terminated array that the caller must free. Expanded strings stay valid
+ * until wildcard_release() is called.
+ */
+char **wildcard_expand(char *args[])
+{
+    int first = -1;
+    for (int i = 0; args[i] != (char *) 0; i++) {
+        if (wildcard_has_magic(args[i])) {
+            first = i;
+            break;
+        }
+    }
+    if (first == -1) {
+        return args;
+    }
+
+    struct str_list out = { 0 };
+    for (int i = 0; args[i] != (char *) 0; i++) {
+        struct str_list matches = { 0 };
+        if (i >= first && wildcard_has_magic(args[i])) {
+            wildcard_walk("", args[i], &matches);
+        }
+        if (matches.len == 0) {
+            if (str_list_add(&out, args[i]) == -1) {
+                free(out.items);
+                return args;
+            }
+            continue;
+        }
+        qsort(matches.items, matches.len, sizeof(char *), collate_cmp);
+        for (size_t j = 0; j < matches.len; j++) {
+            if (str_list_add(&pool, matches.items[j]) == -1) {
+                free(matches.items[j]);
+                matches.items[j] = NULL;
+            }
+        }
+        for (size_t j = 0; j < matches.len; j++) {
+            if (matches.items[j] != NULL && str_list_add(&out, matches.items[j]) == -1) {
+                free(matches.items);
+                free(out.items);
+                return args;
+            }
+        }
+        free(matches.items);
+    }
+    if (str_list_add(&out, (char *) 0) == -1) {
+        free(out.items);
+        return args;
+    }
+    return out.items;
+}
+
+/**
+ * Frees the strings produced by wildcard_expand() for the current command
+ */
+void wildcard_release(void)
+{
+    str_list_free(&pool);
+}
+
+/**
+ * Frees the directory listing cache and any outstanding expansion results
+ */
+void wildcard_destroy(void)
+{
+    wildcard_release();
+    for (int i = 0; i < WILDCARD_CACHE_SLOTS; i++) {
+        listing_free(&cache[i]);
+    }
+    free(dirent_buf);
+    dirent_buf = NULL;
+}
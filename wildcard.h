@@ -0,0 +1,17 @@
+/**
+ * @file
+ *
+ * Contains function headers for wildcard (glob) expansion of command tokens.
+ */
+
+#ifndef _WILDCARD_H_
+#define _WILDCARD_H_
+
+#include <stdbool.h>
+
+bool wildcard_has_magic(const char *token);
+char **wildcard_expand(char *args[]);
+void wildcard_release(void);
+void wildcard_destroy(void);
+
+#endif